@@ -40,6 +40,12 @@ void AtExitManager::RegisterCallback(ExitCallback callback)
     exit_manager->exit_callbacks_.push(std::move(callback));
 }
 
+// static
+bool AtExitManager::HasInstance() noexcept
+{
+    return exit_manager != nullptr;
+}
+
 // static
 void AtExitManager::ProcessExitCallback()
 {
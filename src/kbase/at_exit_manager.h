@@ -35,6 +35,9 @@ public:
 
     static void RegisterCallback(ExitCallback callback);
 
+    // Returns true if an instance is alive in the module.
+    static bool HasInstance() noexcept;
+
 private:
     static void ProcessExitCallback();
 
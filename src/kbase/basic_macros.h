@@ -52,6 +52,13 @@
 #define CONCATENATE(part1, part2) CONCATENATE_IMPL(part1, part2)
 #define ANONYMOUS_VAR(tag) CONCATENATE(tag, __LINE__)
 
+// Keeps rarely executed code out of its caller.
+#if defined(COMPILER_MSVC)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
 #define FORCE_AS_MEMBER_FUNCTION()                      \
     UNUSED_VAR(this)
 
@@ -0,0 +1,292 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#if defined(_MSC_VER)
+#pragma once
+#endif
+
+#ifndef KBASE_CONCURRENT_LRU_CACHE_H_
+#define KBASE_CONCURRENT_LRU_CACHE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "kbase/basic_macros.h"
+#include "kbase/lru_cache.h"
+
+namespace kbase {
+
+// A thread-safe LRU cache, which consists of independently locked shards, and each key is
+// always cached in the same shard by its hash.
+// Capacity is divided evenly among shards, and thus is approximate for the whole cache;
+// a shard evicts its least recently used entry when it becomes full, even if others have
+// free storage.
+// Since entries may be evicted by other threads at any time, they are returned by copy.
+// `Hash` selects the shard for a key, and must be given when keys have no std::hash, e.g.
+// when using TreeMap.
+// Each shard evicts entries by `EvictionPolicy`; if the policy refuses to cache an entry,
+// Put() has no effect, and GetOrCompute() still returns the entry computed.
+// Statistics are collected by each shard, if `Stats` is LRUCacheStats.
+template<typename Key, typename Entry, template<typename, typename> class Map = HashMap,
+         typename Hash = std::hash<Key>, typename EvictionPolicy = LRUEviction,
+         typename Stats = NoLRUCacheStats>
+class ConcurrentLRUCache {
+private:
+    using ShardCache = LRUCache<Key, Entry, Map, EvictionPolicy, Stats>;
+
+    // `token` tells apart computations of the same key, since a computation is dropped from
+    // the table once the key is put or erased.
+    struct PendingEntry {
+        std::shared_future<Entry> result;
+        uint64_t token;
+    };
+
+    using PendingTable = typename Map<Key, PendingEntry>::MapType;
+
+    struct Shard {
+        explicit Shard(size_t max_size)
+            : cache(max_size), next_token(0)
+        {}
+
+        std::mutex mutex;
+        ShardCache cache;
+        // Entries being computed by `GetOrCompute()`.
+        PendingTable pending;
+        uint64_t next_token;
+    };
+
+public:
+    using key_type = Key;
+    using size_type = size_t;
+
+    enum : size_type {
+        NoAutoEvict = 0
+    };
+
+    // If `shard_count` is 0, the cache has a shard count based on the number of processors.
+    // The shard count is always rounded up to a power of 2.
+    explicit ConcurrentLRUCache(size_type capacity, size_type shard_count = 0)
+        : capacity_(capacity),
+          shard_mask_(GetShardMask(shard_count))
+    {
+        size_type count = shard_mask_ + 1;
+        size_type shard_capacity = capacity == NoAutoEvict ? NoAutoEvict :
+                                                             (capacity + count - 1) / count;
+        shards_.reserve(count);
+        for (size_type i = 0; i < count; ++i) {
+            shards_.push_back(std::make_unique<Shard>(shard_capacity));
+        }
+    }
+
+    ~ConcurrentLRUCache() = default;
+
+    DISALLOW_COPY(ConcurrentLRUCache);
+
+    DISALLOW_MOVE(ConcurrentLRUCache);
+
+    // Adds a pair of <key, entry> into the cache. If the key already exists, updates the entry.
+
+    void Put(const Key& key, const Entry& entry)
+    {
+        auto& shard = GetShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.pending.erase(key);
+        shard.cache.Put(key, entry);
+    }
+
+    void Put(const Key& key, Entry&& entry)
+    {
+        auto& shard = GetShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.pending.erase(key);
+        shard.cache.Put(key, std::move(entry));
+    }
+
+    // Copies the entry associated with `key` into `entry`, and marks it recently used.
+    // Returns false if no such entry, and `entry` is untouched.
+    bool Get(const Key& key, Entry& entry)
+    {
+        auto& shard = GetShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.cache.Get(key);
+        if (it == shard.cache.end()) {
+            return false;
+        }
+
+        entry = it->second;
+        return true;
+    }
+
+    // Returns the entry associated with `key`; if there is no such entry, caches and
+    // returns the one created by `fn()`.
+    // When multiple threads miss the same key at the same time, only one of them invokes
+    // `fn`, and the others wait for and share its result. If `fn` throws, the exception is
+    // propagated to all of them, and nothing is cached.
+    // If the key is put or erased while `fn` is running, the result is still returned to
+    // the threads waiting for it, but is not cached; later calls don't wait for it either.
+    // `fn` is invoked without any lock held, but must not call `GetOrCompute()` with the
+    // same key.
+    template<typename Fn>
+    Entry GetOrCompute(const Key& key, Fn&& fn)
+    {
+        auto& shard = GetShard(key);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto it = shard.cache.Get(key);
+        if (it != shard.cache.end()) {
+            return it->second;
+        }
+
+        auto pending_it = shard.pending.find(key);
+        if (pending_it != shard.pending.end()) {
+            auto result = pending_it->second.result;
+            lock.unlock();
+            return result.get();
+        }
+
+        std::promise<Entry> promise;
+        auto result = promise.get_future().share();
+        auto token = shard.next_token++;
+        shard.pending.insert({key, PendingEntry{result, token}});
+        lock.unlock();
+
+        bool computed = false;
+        try {
+            promise.set_value(fn());
+            computed = true;
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+
+        // Waiters coming in before the entry is cached still find the finished result.
+        // The result is outdated if the computation was dropped.
+        lock.lock();
+        pending_it = shard.pending.find(key);
+        if (pending_it != shard.pending.end() && pending_it->second.token == token) {
+            shard.pending.erase(pending_it);
+            if (computed) {
+                shard.cache.Put(key, result.get());
+            }
+        }
+
+        lock.unlock();
+
+        return result.get();
+    }
+
+    // Returns true if the entry associated with `key` was erased.
+    bool erase(const Key& key)
+    {
+        auto& shard = GetShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.pending.erase(key);
+        auto it = shard.cache.find(key);
+        if (it == shard.cache.end()) {
+            return false;
+        }
+
+        shard.cache.erase(it);
+        return true;
+    }
+
+    void clear()
+    {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->pending.clear();
+            shard->cache.Evict(shard->cache.size());
+        }
+    }
+
+    // The value is a snapshot, as shards are being modified while others are counted.
+    size_type size() const
+    {
+        size_type total = 0;
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            total += shard->cache.size();
+        }
+
+        return total;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_type capacity() const noexcept
+    {
+        return capacity_;
+    }
+
+    bool auto_evict() const noexcept
+    {
+        return capacity_ != NoAutoEvict;
+    }
+
+    size_type shard_count() const noexcept
+    {
+        return shard_mask_ + 1;
+    }
+
+    // Returns statistics summed over shards, each of which samples access frequencies from
+    // at most `max_sample_count_per_shard` entries.
+    // Like size(), the value is a snapshot.
+    LRUCacheStatsSnapshot GetStats(size_type max_sample_count_per_shard = 256) const
+    {
+        LRUCacheStatsSnapshot snapshot;
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            snapshot += shard->cache.GetStats(max_sample_count_per_shard);
+        }
+
+        return snapshot;
+    }
+
+    void ResetStats()
+    {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->cache.ResetStats();
+        }
+    }
+
+private:
+    Shard& GetShard(const Key& key) const
+    {
+        // Hashes of integers are usually themselves, thus bits are mixed before masking.
+        auto hash = static_cast<uint64_t>(Hash()(key)) * UINT64_C(0x9E3779B97F4A7C15);
+        return *shards_[static_cast<size_type>(hash >> 32) & shard_mask_];
+    }
+
+    static size_type GetShardMask(size_type shard_count) noexcept
+    {
+        if (shard_count == 0) {
+            // Twice the number of processors keeps contention low, even if some keys are hot.
+            shard_count = std::max<size_type>(std::thread::hardware_concurrency(), 1) * 2;
+        }
+
+        size_type power = 1;
+        while (power < shard_count) {
+            power <<= 1;
+        }
+
+        return power - 1;
+    }
+
+private:
+    const size_type capacity_;
+    const size_type shard_mask_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}   // namespace kbase
+
+#endif  // KBASE_CONCURRENT_LRU_CACHE_H_
@@ -4,13 +4,29 @@
 
 #include "kbase/logging.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
-#include <iomanip>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <istream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <thread>
+#include <vector>
 
+#include "kbase/at_exit_manager.h"
 #include "kbase/basic_macros.h"
 #include "kbase/secure_c_runtime.h"
 #include "kbase/stack_walker.h"
+#include "kbase/string_format.h"
 
 #if defined(OS_WIN)
 #include <Windows.h>
@@ -18,6 +34,11 @@
 
 #if defined(OS_POSIX)
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
@@ -27,6 +48,10 @@ using kbase::LogSeverity;
 using kbase::LogItemOptions;
 using kbase::LoggingDestination;
 using kbase::OldFileDisposalOption;
+using kbase::TimestampClockSource;
+using kbase::LogFileFormat;
+using kbase::LogWritingMode;
+using kbase::AsyncOverflowPolicy;
 
 using kbase::PathChar;
 using kbase::PathString;
@@ -43,30 +68,179 @@ constexpr const char* kLogSeverityNames[] {"INFO", "WARNING", "ERROR", "FATAL"};
 
 constexpr LogSeverity kAlwaysPrintErrorMinLevel = LogSeverity::LogError;
 
+// Default settings for asynchronous mode.
+constexpr std::chrono::milliseconds kDefaultAsyncFlushInterval(1000);
+constexpr size_t kDefaultAsyncBufferSize = 256 * 1024U;
+constexpr size_t kDefaultAsyncMaxBufferCount = 16U;
+
+// At least one buffer for producers and another one for the flusher.
+constexpr size_t kMinAsyncBufferCount = 2U;
+
 LogSeverity g_min_severity_level = LogSeverity::LogInfo;
 LogItemOptions g_log_item_options = LogItemOptions::EnableTimestamp;
 LoggingDestination g_logging_dest = LoggingDestination::LogToFile;
 OldFileDisposalOption g_old_file_option = OldFileDisposalOption::AppendToOldFile;
+TimestampClockSource g_clock_source = TimestampClockSource::PreciseClock;
 
 PathString g_log_file_path;
 FileHandle g_log_file = kInvalidFileHandle;
 
+constexpr char kDigitPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes decimal digits of `value` backwards from `end`, and returns the position of
+// the first digit.
+char* FormatDecimalBackward(unsigned long long value, char* end) noexcept
+{
+    while (value >= 100) {
+        auto index = static_cast<size_t>(value % 100) * 2;
+        value /= 100;
+        *--end = kDigitPairs[index + 1];
+        *--end = kDigitPairs[index];
+    }
+
+    if (value >= 10) {
+        auto index = static_cast<size_t>(value) * 2;
+        *--end = kDigitPairs[index + 1];
+        *--end = kDigitPairs[index];
+    } else {
+        *--end = static_cast<char>('0' + value);
+    }
+
+    return end;
+}
+
+template<typename T>
+constexpr bool IsNegative(T value, std::true_type) noexcept
+{
+    return value < 0;
+}
+
+template<typename T>
+constexpr bool IsNegative(T, std::false_type) noexcept
+{
+    return false;
+}
+
+// Writes `value` in exactly `width` digits, with leading zeros if necessary.
+void FormatZeroPadded(unsigned int value, size_t width, char* dest) noexcept
+{
+    for (auto p = dest + width; p != dest; value /= 10) {
+        *--p = static_cast<char>('0' + value % 10);
+    }
+}
+
+// The length of timestamp in the form like "20160126 09:14:38,456".
+constexpr size_t kTimestampLength = 21;
+
+// The length of the part down to the second, i.e. "20160126 09:14:38,".
+constexpr size_t kTimestampPrefixLength = 18;
+
+// Converting to local time is slow, and contends a global lock in some C runtimes, therefore
+// we cache the formatted prefix and re-create it only when the second changes.
+struct TimestampCache {
+    int64_t seconds_since_epoch = -1;
+    char prefix[kTimestampPrefixLength];
+};
+
+thread_local TimestampCache tls_timestamp_cache;
+
+// The point from which `MonotonicClock` starts advancing.
+struct MonotonicClockAnchor {
+    std::chrono::system_clock::time_point system_time = std::chrono::system_clock::now();
+    std::chrono::steady_clock::time_point steady_time = std::chrono::steady_clock::now();
+};
+
+MonotonicClockAnchor g_monotonic_clock_anchor;
+
+std::chrono::system_clock::time_point GetCoarseSystemTime()
+{
+    namespace chrono = std::chrono;
+
+#if defined(OS_WIN)
+    // In 100-nanosecond intervals since January 1, 1601 (UTC).
+    constexpr int64_t kEpochDifferenceIn100ns = 116444736000000000LL;
+    FILETIME file_time;
+    GetSystemTimeAsFileTime(&file_time);
+    ULARGE_INTEGER ticks;
+    ticks.LowPart = file_time.dwLowDateTime;
+    ticks.HighPart = file_time.dwHighDateTime;
+    auto since_epoch = chrono::duration<int64_t, std::ratio<1, 10000000>>(
+        static_cast<int64_t>(ticks.QuadPart) - kEpochDifferenceIn100ns);
+#else
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    auto since_epoch = chrono::seconds(ts.tv_sec) + chrono::nanoseconds(ts.tv_nsec);
+#endif
+
+    return chrono::system_clock::time_point(
+        chrono::duration_cast<chrono::system_clock::duration>(since_epoch));
+}
+
+std::chrono::system_clock::time_point GetTimestampNow()
+{
+    namespace chrono = std::chrono;
+
+    switch (g_clock_source) {
+        case TimestampClockSource::CoarseClock:
+            return GetCoarseSystemTime();
+
+        case TimestampClockSource::MonotonicClock:
+            return g_monotonic_clock_anchor.system_time +
+                   chrono::duration_cast<chrono::system_clock::duration>(
+                       chrono::steady_clock::now() - g_monotonic_clock_anchor.steady_time);
+
+        default:
+            return chrono::system_clock::now();
+    }
+}
+
 // Ouputs timestamp in the form like "20160126 09:14:38,456".
-void OutputNowTimestamp(std::ostream& stream)
+void OutputTimestamp(kbase::LogStream& stream, std::chrono::system_clock::time_point timestamp)
 {
     namespace chrono = std::chrono;
 
     // Because c-style date & time don't support microsecond precison, we have to
     // handle it on our own.
-    auto time_now = chrono::system_clock::now();
-    auto duration_in_ms = chrono::duration_cast<chrono::milliseconds>(time_now.time_since_epoch());
-    auto ms_part = duration_in_ms - chrono::duration_cast<chrono::seconds>(duration_in_ms);
+    auto duration_in_ms = chrono::duration_cast<chrono::milliseconds>(timestamp.time_since_epoch());
+    auto duration_in_sec = chrono::duration_cast<chrono::seconds>(duration_in_ms);
+    auto ms_part = duration_in_ms - duration_in_sec;
 
-    tm local_time_now;
-    time_t raw_time = chrono::system_clock::to_time_t(time_now);
-    kbase::SecureLocalTime(&raw_time, &local_time_now);
-    stream << std::put_time(&local_time_now, "%Y%m%d %H:%M:%S,")
-           << std::setfill('0') << std::setw(3) << ms_part.count();
+    auto& cache = tls_timestamp_cache;
+    if (cache.seconds_since_epoch != duration_in_sec.count()) {
+        tm local_time_now;
+        auto raw_time = static_cast<time_t>(duration_in_sec.count());
+        kbase::SecureLocalTime(&raw_time, &local_time_now);
+
+        char* buf = cache.prefix;
+        FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_year + 1900), 4, buf);
+        FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_mon + 1), 2, buf + 4);
+        FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_mday), 2, buf + 6);
+        buf[8] = ' ';
+        FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_hour), 2, buf + 9);
+        buf[11] = ':';
+        FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_min), 2, buf + 12);
+        buf[14] = ':';
+        FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_sec), 2, buf + 15);
+        buf[17] = ',';
+
+        cache.seconds_since_epoch = duration_in_sec.count();
+    }
+
+    char buf[kTimestampLength];
+    memcpy(buf, cache.prefix, kTimestampPrefixLength);
+    FormatZeroPadded(static_cast<unsigned int>(ms_part.count()), 3, buf + kTimestampPrefixLength);
+
+    stream.Append(buf, kTimestampLength);
+}
+
+void OutputNowTimestamp(kbase::LogStream& stream)
+{
+    OutputTimestamp(stream, GetTimestampNow());
 }
 
 template<typename charT>
@@ -98,6 +272,22 @@ ProcessID GetCurrentProcessID()
 #endif
 }
 
+// The value is identical to what std::this_thread::get_id() outputs.
+#if defined(OS_WIN)
+using ThreadID = DWORD;
+#else
+using ThreadID = pthread_t;
+#endif
+
+ThreadID GetCurrentThreadID()
+{
+#if defined(OS_WIN)
+    return GetCurrentThreadId();
+#else
+    return pthread_self();
+#endif
+}
+
 bool IsFileHandleValid(FileHandle handle)
 {
 #if defined(OS_WIN)
@@ -161,165 +351,1994 @@ PathString GetFallbackLogFilePath()
 
 #endif
 
-void CloseLogFile()
+FileHandle OpenLogFile(const PathString& path)
 {
-    if (IsFileHandleValid(g_log_file)) {
 #if defined(OS_WIN)
-        CloseHandle(g_log_file);
+    // Surprisingly, we need neither a local nor a global lock here, on Windows.
+    // Because if we opened a file with `FILE_APPEND_DATA` flag only, the system
+    // will ensure that each appending is atomic.
+    // See https://msdn.microsoft.com/en-us/library/windows/hardware/ff548289(v=vs.85).aspx.
+    // `FILE_SHARE_DELETE` is required for renaming the file when it is being rotated.
+    return CreateFileW(path.c_str(),
+                       FILE_APPEND_DATA,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       nullptr,
+                       OPEN_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL,
+                       nullptr);
 #else
-        close(g_log_file);
+    // Similarly, we make atomic appending on POSIX systems, which saves us from using
+    // a global lock.
+    return open(path.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0666);
 #endif
-        g_log_file = kInvalidFileHandle;
-    }
 }
 
-// Once this function succeed, `g_log_file` refers to a valid and writable file.
-// Returns true, if we initialized the log file successfully, false otherwise.
-bool InitLogFile()
+void CloseFileHandle(FileHandle handle)
 {
-    if (IsFileHandleValid(g_log_file)) {
-        return true;
-    }
+#if defined(OS_WIN)
+    CloseHandle(handle);
+#else
+    close(handle);
+#endif
+}
 
-    if (g_log_file_path.empty()) {
-        g_log_file_path = GetDefaultLogFilePath();
-    }
+uint64_t GetFileSize(FileHandle handle)
+{
+#if defined(OS_WIN)
+    LARGE_INTEGER file_size;
+    return GetFileSizeEx(handle, &file_size) ? static_cast<uint64_t>(file_size.QuadPart) : 0;
+#else
+    struct stat file_info;
+    return fstat(handle, &file_info) == 0 ? static_cast<uint64_t>(file_info.st_size) : 0;
+#endif
+}
 
-    if (g_old_file_option == OldFileDisposalOption::DeleteOldFile) {
-        DeleteFilePath(g_log_file_path);
-    }
+bool PathExists(const PathString& path)
+{
+#if defined(OS_WIN)
+    return GetFileAttributesW(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    return access(path.c_str(), F_OK) == 0;
+#endif
+}
 
+bool RenameFilePath(const PathString& from, const PathString& to)
+{
 #if defined(OS_WIN)
-    // Surprisingly, we need neither a local nor a global lock here, on Windows.
-    // Because if we opened a file with `FILE_APPEND_DATA` flag only, the system
-    // will ensure that each appending is atomic.
-    // See https://msdn.microsoft.com/en-us/library/windows/hardware/ff548289(v=vs.85).aspx.
-    g_log_file = CreateFileW(g_log_file_path.c_str(),
-                             FILE_APPEND_DATA,
-                             FILE_SHARE_READ | FILE_SHARE_WRITE,
-                             nullptr,
-                             OPEN_ALWAYS,
-                             FILE_ATTRIBUTE_NORMAL,
-                             nullptr);
-    if (g_log_file == INVALID_HANDLE_VALUE) {
-        g_log_file_path = GetFallbackLogFilePath();
-        g_log_file = CreateFileW(g_log_file_path.c_str(),
-                                 FILE_APPEND_DATA,
-                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
-                                 nullptr,
-                                 OPEN_ALWAYS,
-                                 FILE_ATTRIBUTE_NORMAL,
-                                 nullptr);
-    }
+    return MoveFileExW(from.c_str(), to.c_str(), 0) != 0;
 #else
-    // Similarly, we make atomic appending on POSIX systems, which saves us from using
-    // a global lock.
-    g_log_file = open(g_log_file_path.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0666);
+    return rename(from.c_str(), to.c_str()) == 0;
 #endif
+}
 
-    return IsFileHandleValid(g_log_file);
+void WriteToFileHandle(FileHandle handle, const char* data, size_t length)
+{
+#if defined(OS_WIN)
+    DWORD bytes_written = 0;
+    WriteFile(handle, data, static_cast<DWORD>(length), &bytes_written, nullptr);
+#else
+    write(handle, data, length);
+#endif
 }
 
-}   // namespace
+// -*- Binary log format -*-
 
-namespace kbase {
+// A binary log file is a sequence of records, each of which begins with a 1-byte type and
+// a 4-byte length of its payload. Integers are in the byte order of the writing machine.
+// Decoders skip records of unknown types, so that new types can be introduced compatibly.
+// Since site ids are assigned at runtime, a site is described in the file before its first
+// message, and thus files from different builds can be decoded alike.
+enum BinaryRecordType : uint8_t {
+    // Begins records of a process: magic, uint16_t version, uint32_t pid, uint32_t log item
+    // options.
+    StreamHeaderRecord = 1,
+    // uint32_t pid, uint32_t site id, uint8_t severity, uint32_t line, file name.
+    SiteRecord = 2,
+    // uint32_t pid, uint32_t site id, int64_t timestamp in nanoseconds since epoch,
+    // uint64_t thread id, and arguments.
+    MessageRecord = 3,
+    // uint32_t pid, and a message already in text format.
+    TextRecord = 4
+};
 
-namespace internal {
+// Each argument of a message record begins with a 1-byte type.
+enum BinaryArgType : uint8_t {
+    // uint32_t length, and characters.
+    TextArg = 1,
+    // int64_t
+    SignedArg = 2,
+    // uint64_t
+    UnsignedArg = 3,
+    // double
+    FloatArg = 4,
+    // uint64_t
+    PointerArg = 5
+};
 
-LogSeverity GetMinSeverityLevel() noexcept
+constexpr char kBinaryLogMagic[] {'K', 'B', 'L', 'G'};
+constexpr uint16_t kBinaryLogVersion = 1;
+
+constexpr size_t kRecordHeaderSize = sizeof(uint8_t) + sizeof(uint32_t);
+constexpr size_t kStreamHeaderRecordSize =
+    kRecordHeaderSize + sizeof(kBinaryLogMagic) + sizeof(uint16_t) + sizeof(uint32_t) * 2;
+constexpr size_t kSiteRecordHeaderSize =
+    kRecordHeaderSize + sizeof(uint32_t) * 2 + sizeof(uint8_t) + sizeof(uint32_t);
+constexpr size_t kMessageRecordHeaderSize =
+    kRecordHeaderSize + sizeof(uint32_t) * 2 + sizeof(int64_t) + sizeof(uint64_t);
+constexpr size_t kTextRecordHeaderSize = kRecordHeaderSize + sizeof(uint32_t);
+
+constexpr size_t kNoTextArg = static_cast<size_t>(-1);
+
+LogFileFormat g_log_file_format = LogFileFormat::TextLogFormat;
+
+// Increases whenever a new log file is in use, so that sites are described again.
+std::atomic<uint32_t> g_log_file_generation {0};
+
+// Cached to save a system call per message; refreshed when a log file is opened.
+std::atomic<uint32_t> g_binary_log_pid {0};
+
+template<typename T>
+char* PutValue(char* dest, T value) noexcept
 {
-    return g_min_severity_level;
+    memcpy(dest, &value, sizeof(value));
+    return dest + sizeof(value);
 }
 
-}   // namespace internal
+template<typename T>
+bool GetValue(kbase::StringView& src, T& value) noexcept
+{
+    if (src.size() < sizeof(value)) {
+        return false;
+    }
 
-LoggingSettings::LoggingSettings() noexcept
- : min_severity_level(LogSeverity::LogInfo),
-   log_item_options(LogItemOptions::EnableTimestamp),
-   logging_destination(LoggingDestination::LogToFile),
-   old_file_disposal_option(OldFileDisposalOption::AppendToOldFile)
-{}
+    memcpy(&value, src.data(), sizeof(value));
+    src.RemovePrefix(sizeof(value));
 
-void ConfigureLoggingSettings(const LoggingSettings& settings)
+    return true;
+}
+
+char* PutRecordHeader(char* dest, BinaryRecordType type, size_t payload_length) noexcept
 {
-    g_min_severity_level = settings.min_severity_level;
-    g_log_item_options = settings.log_item_options;
-    g_logging_dest = settings.logging_destination;
-    g_old_file_option = settings.old_file_disposal_option;
+    dest = PutValue(dest, static_cast<uint8_t>(type));
+    return PutValue(dest, static_cast<uint32_t>(payload_length));
+}
 
-    if (!(g_logging_dest & LoggingDestination::LogToFile)) {
+bool IsBinaryLogFile()
+{
+    return g_log_file_format == LogFileFormat::BinaryLogFormat &&
+           (g_logging_dest & LoggingDestination::LogToFile);
+}
+
+// Called on every newly opened log file.
+void WriteStreamHeaderRecord(FileHandle file)
+{
+    if (g_log_file_format != LogFileFormat::BinaryLogFormat) {
         return;
     }
 
-    if (!settings.log_file_path.empty()) {
-        g_log_file_path = settings.log_file_path;
-    }
+    auto pid = static_cast<uint32_t>(GetCurrentProcessID());
+    g_binary_log_pid.store(pid, std::memory_order_relaxed);
 
-    CloseLogFile();
+    char record[kStreamHeaderRecordSize];
+    char* p = PutRecordHeader(record, StreamHeaderRecord, sizeof(record) - kRecordHeaderSize);
+    memcpy(p, kBinaryLogMagic, sizeof(kBinaryLogMagic));
+    p = PutValue(p + sizeof(kBinaryLogMagic), kBinaryLogVersion);
+    p = PutValue(p, pid);
+    PutValue(p, static_cast<uint32_t>(g_log_item_options));
 
-    InitLogFile();
+    WriteToFileHandle(file, record, sizeof(record));
 }
 
-LogMessage::LogMessage(const char* file, int line, LogSeverity severity)
-    : file_name_(ExtractFileName(file)), line_(line), severity_(severity)
+// `header` must have `kTextRecordHeaderSize` bytes, and is followed by the text.
+void FillTextRecordHeader(char* header, size_t text_length) noexcept
 {
-    InitMessageHeader();
+    char* p = PutRecordHeader(header, TextRecord, sizeof(uint32_t) + text_length);
+    PutValue(p, g_binary_log_pid.load(std::memory_order_relaxed));
 }
 
-LogMessage::~LogMessage()
+std::string MakeTextRecord(const std::string& text)
 {
-    if (severity_ == LogSeverity::LogFatal) {
-        stream_ << "\n";
-        StackWalker walker;
-        walker.DumpCallStack(stream_);
+    std::string record(kTextRecordHeaderSize, '\0');
+    FillTextRecordHeader(&record[0], text.length());
+    return record + text;
+}
+
+void AppendSiteRecord(std::string& records, const kbase::internal::LogSite& site)
+{
+    kbase::StringView file_name(site.file_name());
+    char header[kSiteRecordHeaderSize];
+    char* p = PutRecordHeader(header, SiteRecord,
+                              sizeof(header) - kRecordHeaderSize + file_name.length());
+    p = PutValue(p, g_binary_log_pid.load(std::memory_order_relaxed));
+    p = PutValue(p, site.id());
+    p = PutValue(p, static_cast<uint8_t>(site.severity()));
+    PutValue(p, static_cast<uint32_t>(site.line()));
+
+    records.append(header, sizeof(header)).append(file_name.data(), file_name.length());
+}
+
+// -*- Log file rotation -*-
+
+uint64_t g_max_log_file_size = 0;
+std::chrono::seconds g_max_log_file_age(0);
+size_t g_max_rotated_log_files = 0;
+kbase::LogRotationHook g_post_rotation_hook;
+
+// Writers share the lock, and thus never block each other; the rotation holds the lock
+// exclusively only for swapping `g_log_file`.
+// The lock is not used if no rotation is configured.
+std::shared_timed_mutex g_log_file_mutex;
+
+std::atomic<uint64_t> g_log_file_size {0};
+std::atomic<int64_t> g_log_file_expiry_time {0};
+std::atomic<bool> g_rotation_in_progress {false};
+
+bool IsRotationEnabled()
+{
+    return g_max_log_file_size != 0 || g_max_log_file_age.count() != 0;
+}
+
+int64_t GetSteadyTimeInSeconds()
+{
+    namespace chrono = std::chrono;
+    return chrono::duration_cast<chrono::seconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ResetLogFileUsage(uint64_t file_size)
+{
+    g_log_file_size.store(file_size, std::memory_order_relaxed);
+    g_log_file_expiry_time.store(GetSteadyTimeInSeconds() + g_max_log_file_age.count(),
+                                 std::memory_order_relaxed);
+}
+
+bool IsLogFileUsedUp(uint64_t file_size)
+{
+    return (g_max_log_file_size != 0 && file_size >= g_max_log_file_size) ||
+           (g_max_log_file_age.count() != 0 &&
+            GetSteadyTimeInSeconds() >= g_log_file_expiry_time.load(std::memory_order_relaxed));
+}
+
+// Numbers rotations of the process, so that rotated files never take a name twice.
+std::atomic<unsigned int> g_rotation_sequence {0};
+
+// Rotated files are named in the form like "debug.log.20160126-091438.000001", i.e. with the
+// time and the sequence number of the rotation, and thus are ordered by names.
+// The sequence number moves on if the name is taken, e.g. by another process.
+PathString MakeRotatedFilePath()
+{
+    tm local_time_now;
+    time_t raw_time = time(nullptr);
+    kbase::SecureLocalTime(&raw_time, &local_time_now);
+
+    char buf[22];
+    FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_year + 1900), 4, buf);
+    FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_mon + 1), 2, buf + 4);
+    FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_mday), 2, buf + 6);
+    buf[8] = '-';
+    FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_hour), 2, buf + 9);
+    FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_min), 2, buf + 11);
+    FormatZeroPadded(static_cast<unsigned int>(local_time_now.tm_sec), 2, buf + 13);
+    buf[15] = '.';
+
+    while (true) {
+        auto seq = g_rotation_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+        FormatZeroPadded(seq, 6, buf + 16);
+
+        PathString rotated_path = g_log_file_path;
+        rotated_path.append(1, PATH_LITERAL('.')).append(buf, buf + sizeof(buf));
+        if (!PathExists(rotated_path)) {
+            return rotated_path;
+        }
     }
+}
 
-    stream_ << std::endl;
-    std::string msg = stream_.str();
+// Runs the hook and disposes of old rotated files, off the logging threads.
+class LogRotationWorker {
+public:
+    LogRotationWorker()
+        : stopping_(false)
+    {
+        worker_ = std::thread(&LogRotationWorker::WorkerMain, this);
+    }
 
-    if ((g_logging_dest & LoggingDestination::LogToSystemDebugLog) ||
-        severity_ >= kAlwaysPrintErrorMinLevel) {
-#if defined(OS_WIN)
-        OutputDebugStringA(msg.c_str());
-#endif
-        // Log to standard error stream.
-        fwrite(msg.data(), sizeof(char), msg.length(), stderr);
-        fflush(stderr);
+    // Finishes pending tasks before going away.
+    ~LogRotationWorker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+
+        cv_.notify_one();
+        worker_.join();
     }
 
-    // If `InitLogFile` wasn't called at the start of the program, do it on the fly.
-    // However, if we unfortunately failed to initialize the log file, just skip the writting.
-    // Note that, if more than one thread in here try to call `InitLogFile`, there will be a
-    // race condition. This is why you should call `ConfigureLoggingSettings` at start.
-    if ((g_logging_dest & LoggingDestination::LogToFile) && InitLogFile()) {
-#if defined(OS_WIN)
-        DWORD bytes_written = 0;
-        WriteFile(g_log_file, msg.data(), static_cast<DWORD>(msg.length()), &bytes_written,
-                  nullptr);
-#else
-        write(g_log_file, msg.data(), msg.length());
-#endif
+    DISALLOW_COPY(LogRotationWorker);
+
+    DISALLOW_MOVE(LogRotationWorker);
+
+    void Post(const PathString& rotated_file)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back({rotated_file, g_post_rotation_hook, g_max_rotated_log_files});
+        }
+
+        cv_.notify_one();
+    }
+
+private:
+    struct Task {
+        PathString rotated_file;
+        kbase::LogRotationHook hook;
+        size_t max_rotated_files;
+    };
+
+    void WorkerMain()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                break;
+            }
+
+            auto task = std::move(tasks_.front());
+            tasks_.pop_front();
+
+            lock.unlock();
+            RunTask(task);
+            lock.lock();
+        }
+    }
+
+    void RunTask(const Task& task)
+    {
+        if (task.hook) {
+            task.hook(task.rotated_file);
+        }
+
+        // The hook takes over the disposal of the file if it moved the file away.
+        if (PathExists(task.rotated_file)) {
+            rotated_files_.push_back(task.rotated_file);
+        }
+
+        while (task.max_rotated_files != 0 && rotated_files_.size() > task.max_rotated_files) {
+            DeleteFilePath(rotated_files_.front());
+            rotated_files_.pop_front();
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Task> tasks_;
+    bool stopping_;
+    std::deque<PathString> rotated_files_;
+    std::thread worker_;
+};
+
+LogRotationWorker& GetLogRotationWorker()
+{
+    static LogRotationWorker worker;
+    return worker;
+}
+
+void RotateLogFile()
+{
+    // Other writers may have seen the file used up before it was rotated.
+    if (!IsLogFileUsedUp(g_log_file_size.load(std::memory_order_relaxed))) {
+        return;
+    }
+
+    // Writers keep appending to the renamed file until we swap in the new one.
+    // On failure, we restart counting to avoid retrying on every writing.
+    auto rotated_path = MakeRotatedFilePath();
+    if (!RenameFilePath(g_log_file_path, rotated_path)) {
+        ResetLogFileUsage(0);
+        return;
+    }
+
+    // Moves the file back, otherwise writers would keep appending to the renamed file, which
+    // is never disposed of, and later rotations would find the original path gone.
+    auto new_file = OpenLogFile(g_log_file_path);
+    if (!IsFileHandleValid(new_file)) {
+        RenameFilePath(rotated_path, g_log_file_path);
+        ResetLogFileUsage(0);
+        return;
+    }
+
+    WriteStreamHeaderRecord(new_file);
+
+    // Messages still pending in asynchronous mode may belong to sites described only in the
+    // old file, thus all sites are described in the new file in advance.
+    if (g_log_file_format == LogFileFormat::BinaryLogFormat) {
+        auto site_records = kbase::internal::MakeLogSiteRecords();
+        WriteToFileHandle(new_file, site_records.data(), site_records.size());
+    }
+
+    // Writers read the generation with the lock shared, and thus always see the generation
+    // of the file they are writing.
+    FileHandle old_file;
+    {
+        std::lock_guard<std::shared_timed_mutex> lock(g_log_file_mutex);
+        old_file = g_log_file;
+        g_log_file = new_file;
+        g_log_file_generation.fetch_add(1, std::memory_order_relaxed);
     }
+
+    ResetLogFileUsage(0);
+    CloseFileHandle(old_file);
+
+    GetLogRotationWorker().Post(rotated_path);
 }
 
-void LogMessage::InitMessageHeader()
+void RotateLogFileIfNeeded(size_t bytes_written)
 {
-    stream_ << "[";
+    auto file_size = g_log_file_size.fetch_add(bytes_written, std::memory_order_relaxed) +
+                     bytes_written;
+    if (!IsLogFileUsedUp(file_size)) {
+        return;
+    }
 
-    if (g_log_item_options & LogItemOptions::EnableTimestamp) {
-        OutputNowTimestamp(stream_);
+    // Only one thread does the rotation, and others just move on.
+    bool expected = false;
+    if (g_rotation_in_progress.compare_exchange_strong(expected, true,
+                                                       std::memory_order_acquire)) {
+        RotateLogFile();
+        g_rotation_in_progress.store(false, std::memory_order_release);
     }
+}
 
-    if (g_log_item_options & LogItemOptions::EnableProcessID) {
-        stream_ << " " << GetCurrentProcessID();
+void CloseLogFile()
+{
+    if (IsFileHandleValid(g_log_file)) {
+        CloseFileHandle(g_log_file);
+        g_log_file = kInvalidFileHandle;
     }
+}
 
-    if (g_log_item_options & LogItemOptions::EnableThreadID) {
-        stream_ << " " << std::this_thread::get_id();
+// Once this function succeed, `g_log_file` refers to a valid and writable file.
+// Returns true, if we initialized the log file successfully, false otherwise.
+bool InitLogFile()
+{
+    if (IsFileHandleValid(g_log_file)) {
+        return true;
+    }
+
+    if (g_log_file_path.empty()) {
+        g_log_file_path = GetDefaultLogFilePath();
+    }
+
+    if (g_old_file_option == OldFileDisposalOption::DeleteOldFile) {
+        DeleteFilePath(g_log_file_path);
+    }
+
+    g_log_file = OpenLogFile(g_log_file_path);
+
+#if defined(OS_WIN)
+    if (g_log_file == INVALID_HANDLE_VALUE) {
+        g_log_file_path = GetFallbackLogFilePath();
+        g_log_file = OpenLogFile(g_log_file_path);
+    }
+#endif
+
+    if (!IsFileHandleValid(g_log_file)) {
+        return false;
+    }
+
+    WriteStreamHeaderRecord(g_log_file);
+    g_log_file_generation.fetch_add(1, std::memory_order_relaxed);
+
+    ResetLogFileUsage(GetFileSize(g_log_file));
+
+    return true;
+}
+
+void WriteToLogFile(const char* data, size_t length)
+{
+    if (!IsRotationEnabled()) {
+        WriteToFileHandle(g_log_file, data, length);
+        return;
+    }
+
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(g_log_file_mutex);
+        WriteToFileHandle(g_log_file, data, length);
+    }
+
+    RotateLogFileIfNeeded(length);
+}
+
+class LogBuffer {
+public:
+    explicit LogBuffer(size_t capacity)
+        : data_(new char[capacity]), size_(0), capacity_(capacity)
+    {}
+
+    ~LogBuffer() = default;
+
+    DISALLOW_COPY(LogBuffer);
+
+    DISALLOW_MOVE(LogBuffer);
+
+    // Returns false, if there is no enough room for the data.
+    bool Append(const char* data, size_t length) noexcept
+    {
+        if (capacity_ - size_ < length) {
+            return false;
+        }
+
+        memcpy(data_.get() + size_, data, length);
+        size_ += length;
+
+        return true;
+    }
+
+    void Clear() noexcept
+    {
+        size_ = 0;
+    }
+
+    const char* data() const noexcept
+    {
+        return data_.get();
+    }
+
+    size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    size_t capacity() const noexcept
+    {
+        return capacity_;
+    }
+
+    bool empty() const noexcept
+    {
+        return size_ == 0;
+    }
+
+private:
+    std::unique_ptr<char[]> data_;
+    size_t size_;
+    size_t capacity_;
+};
+
+using LogBufferPtr = std::unique_ptr<LogBuffer>;
+using LogBufferList = std::vector<LogBufferPtr>;
+
+// Writes buffers in [begin, end) into the file with as few system calls as possible.
+// Returns the count of bytes written.
+size_t WriteToFileHandle(FileHandle handle,
+                         LogBufferList::const_iterator begin,
+                         LogBufferList::const_iterator end)
+{
+    size_t total_written = 0;
+
+#if defined(OS_WIN)
+    for (auto it = begin; it != end; ++it) {
+        WriteToFileHandle(handle, (*it)->data(), (*it)->size());
+        total_written += (*it)->size();
+    }
+#else
+    std::vector<iovec> vecs;
+    vecs.reserve(static_cast<size_t>(end - begin));
+    for (auto it = begin; it != end; ++it) {
+        vecs.push_back({const_cast<char*>((*it)->data()), (*it)->size()});
+    }
+
+    size_t first = 0;
+    while (first < vecs.size()) {
+        int count = static_cast<int>(std::min<size_t>(vecs.size() - first, IOV_MAX));
+        auto written = writev(handle, &vecs[first], count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // There is nowhere to report the failure, just give up this batch.
+            break;
+        }
+
+        total_written += static_cast<size_t>(written);
+
+        // Skips fully written segments, and adjusts the partially written one, if any.
+        auto bytes_left = static_cast<size_t>(written);
+        while (first < vecs.size() && bytes_left >= vecs[first].iov_len) {
+            bytes_left -= vecs[first].iov_len;
+            ++first;
+        }
+
+        if (bytes_left != 0) {
+            vecs[first].iov_base = static_cast<char*>(vecs[first].iov_base) + bytes_left;
+            vecs[first].iov_len -= bytes_left;
+        }
+    }
+#endif
+
+    return total_written;
+}
+
+// The size limit is checked per buffer rather than per batch, thus a file outgrows the limit
+// by at most one buffer.
+void WriteToLogFile(const LogBufferList& buffers)
+{
+    if (!IsRotationEnabled()) {
+        WriteToFileHandle(g_log_file, buffers.cbegin(), buffers.cend());
+        return;
+    }
+
+    auto first = buffers.cbegin();
+    while (first != buffers.cend()) {
+        // Takes as many buffers as the file can hold, but at least one.
+        auto file_size = g_log_file_size.load(std::memory_order_relaxed);
+        uint64_t room = std::numeric_limits<uint64_t>::max();
+        if (g_max_log_file_size != 0) {
+            room = file_size < g_max_log_file_size ? g_max_log_file_size - file_size : 0;
+        }
+
+        auto last = first;
+        uint64_t batch_size = (*last++)->size();
+        while (last != buffers.cend() && batch_size + (*last)->size() <= room) {
+            batch_size += (*last++)->size();
+        }
+
+        size_t bytes_written = 0;
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(g_log_file_mutex);
+            bytes_written = WriteToFileHandle(g_log_file, first, last);
+        }
+
+        RotateLogFileIfNeeded(bytes_written);
+        first = last;
+    }
+}
+
+// Producers append messages into the current buffer, which is handed over to the flusher
+// thread once it is full; the flusher periodically writes all filled buffers in a batch
+// and then recycles them.
+// At most `max_buffer_count` buffers can exist at the same time.
+class AsyncLogWriter {
+public:
+    AsyncLogWriter(std::chrono::milliseconds flush_interval,
+                   size_t buffer_size,
+                   size_t max_buffer_count,
+                   AsyncOverflowPolicy overflow_policy);
+
+    ~AsyncLogWriter() = default;
+
+    DISALLOW_COPY(AsyncLogWriter);
+
+    DISALLOW_MOVE(AsyncLogWriter);
+
+    void Append(const char* data, size_t length);
+
+    // Blocks until all messages appended before the call are written.
+    void Flush();
+
+    // Writes out pending messages and stops the flusher thread; messages appended afterwards
+    // are written on the calling thread.
+    void Stop();
+
+private:
+    void FlusherMain();
+
+    // Returns nullptr if no buffer is available and we are going to drop the message.
+    LogBufferPtr AcquireBuffer(size_t min_capacity, std::unique_lock<std::mutex>& lock);
+
+    void RecycleBuffer(LogBufferPtr buffer);
+
+private:
+    const std::chrono::milliseconds flush_interval_;
+    const size_t buffer_size_;
+    const size_t max_buffer_count_;
+    const AsyncOverflowPolicy overflow_policy_;
+
+    std::mutex mutex_;
+    std::condition_variable flush_cv_;
+    std::condition_variable written_cv_;
+    LogBufferPtr current_buffer_;
+    LogBufferList full_buffers_;
+    LogBufferList free_buffers_;
+    size_t allocated_buffer_count_;
+    uint64_t appended_count_;
+    uint64_t written_count_;
+    size_t dropped_count_;
+    bool flush_requested_;
+    bool stopping_;
+    bool stopped_;
+    std::thread flusher_;
+};
+
+AsyncLogWriter::AsyncLogWriter(std::chrono::milliseconds flush_interval,
+                               size_t buffer_size,
+                               size_t max_buffer_count,
+                               AsyncOverflowPolicy overflow_policy)
+    : flush_interval_(flush_interval),
+      buffer_size_(buffer_size),
+      max_buffer_count_(std::max(max_buffer_count, kMinAsyncBufferCount)),
+      overflow_policy_(overflow_policy),
+      allocated_buffer_count_(0),
+      appended_count_(0),
+      written_count_(0),
+      dropped_count_(0),
+      flush_requested_(false),
+      stopping_(false),
+      stopped_(false)
+{
+    flusher_ = std::thread(&AsyncLogWriter::FlusherMain, this);
+}
+
+void AsyncLogWriter::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return;
+        }
+
+        stopping_ = true;
+    }
+
+    flush_cv_.notify_one();
+    flusher_.join();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_buffers_.clear();
+}
+
+void AsyncLogWriter::Append(const char* data, size_t length)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        // Keeps the order with messages still pending.
+        if (stopping_) {
+            written_cv_.wait(lock, [this] { return stopped_; });
+            lock.unlock();
+            if (InitLogFile()) {
+                WriteToLogFile(data, length);
+            }
+
+            return;
+        }
+
+        if (current_buffer_ && current_buffer_->Append(data, length)) {
+            ++appended_count_;
+            return;
+        }
+
+        if (current_buffer_) {
+            if (current_buffer_->empty()) {
+                RecycleBuffer(std::move(current_buffer_));
+            } else {
+                full_buffers_.push_back(std::move(current_buffer_));
+                flush_cv_.notify_one();
+            }
+        }
+
+        auto buffer = AcquireBuffer(length, lock);
+        if (!buffer) {
+            if (stopping_) {
+                continue;
+            }
+
+            ++dropped_count_;
+            return;
+        }
+
+        // Another producer may have installed a new buffer while we were waiting.
+        if (current_buffer_) {
+            RecycleBuffer(std::move(buffer));
+        } else {
+            current_buffer_ = std::move(buffer);
+        }
+    }
+}
+
+void AsyncLogWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    auto target_count = appended_count_;
+    if (written_count_ >= target_count) {
+        return;
+    }
+
+    flush_requested_ = true;
+    flush_cv_.notify_one();
+    written_cv_.wait(lock, [this, target_count] {
+        return written_count_ >= target_count || stopped_;
+    });
+}
+
+LogBufferPtr AsyncLogWriter::AcquireBuffer(size_t min_capacity,
+                                           std::unique_lock<std::mutex>& lock)
+{
+    while (true) {
+        if (!free_buffers_.empty()) {
+            if (min_capacity <= buffer_size_) {
+                auto buffer = std::move(free_buffers_.back());
+                free_buffers_.pop_back();
+                return buffer;
+            }
+
+            // Gives up a regular buffer to make room for an oversized one.
+            if (allocated_buffer_count_ == max_buffer_count_) {
+                free_buffers_.pop_back();
+                --allocated_buffer_count_;
+            }
+        }
+
+        if (allocated_buffer_count_ < max_buffer_count_) {
+            ++allocated_buffer_count_;
+            return std::make_unique<LogBuffer>(std::max(min_capacity, buffer_size_));
+        }
+
+        if (overflow_policy_ == AsyncOverflowPolicy::DropOnOverflow || stopping_) {
+            return nullptr;
+        }
+
+        written_cv_.wait(lock);
+    }
+}
+
+void AsyncLogWriter::RecycleBuffer(LogBufferPtr buffer)
+{
+    // Oversized buffers are not worth keeping.
+    if (buffer->capacity() != buffer_size_) {
+        --allocated_buffer_count_;
+        return;
+    }
+
+    buffer->Clear();
+    free_buffers_.push_back(std::move(buffer));
+}
+
+void AsyncLogWriter::FlusherMain()
+{
+    LogBufferList buffers_to_write;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        flush_cv_.wait_for(lock, flush_interval_, [this] {
+            return stopping_ || flush_requested_ || !full_buffers_.empty();
+        });
+
+        if (current_buffer_ && !current_buffer_->empty()) {
+            full_buffers_.push_back(std::move(current_buffer_));
+        }
+
+        buffers_to_write.swap(full_buffers_);
+        auto written_count = appended_count_;
+        auto dropped_count = dropped_count_;
+        dropped_count_ = 0;
+        flush_requested_ = false;
+        bool stopping = stopping_;
+
+        lock.unlock();
+
+        if (InitLogFile()) {
+            if (dropped_count != 0) {
+                auto notice = "*** " + std::to_string(dropped_count) +
+                              " log messages were dropped due to buffer overflow ***\n";
+                if (g_log_file_format == LogFileFormat::BinaryLogFormat) {
+                    notice = MakeTextRecord(notice);
+                }
+
+                WriteToLogFile(notice.data(), notice.length());
+            }
+
+            if (!buffers_to_write.empty()) {
+                WriteToLogFile(buffers_to_write);
+            }
+        }
+
+        lock.lock();
+
+        for (auto& buffer : buffers_to_write) {
+            RecycleBuffer(std::move(buffer));
+        }
+
+        buffers_to_write.clear();
+        written_count_ = written_count;
+        stopped_ = stopping;
+        written_cv_.notify_all();
+
+        if (stopping) {
+            break;
+        }
+    }
+}
+
+// A stopped writer is kept until exit, because other threads may still be using it.
+class AsyncLogWriterList {
+public:
+    AsyncLogWriterList() = default;
+
+    // Writers must be stopped before being destroyed.
+    ~AsyncLogWriterList()
+    {
+        for (auto& writer : writers_) {
+            writer->Stop();
+        }
+    }
+
+    DISALLOW_COPY(AsyncLogWriterList);
+
+    DISALLOW_MOVE(AsyncLogWriterList);
+
+    AsyncLogWriter* Add(std::unique_ptr<AsyncLogWriter> writer)
+    {
+        writers_.push_back(std::move(writer));
+        return writers_.back().get();
+    }
+
+private:
+    std::vector<std::unique_ptr<AsyncLogWriter>> writers_;
+};
+
+AsyncLogWriterList& GetAsyncLogWriters()
+{
+    static AsyncLogWriterList writers;
+    return writers;
+}
+
+std::atomic<AsyncLogWriter*> g_async_writer {nullptr};
+
+// Whether `StopAsyncLogging` is registered with the alive `AtExitManager`.
+bool g_async_exit_callback_registered = false;
+
+// Pending messages are written out, and the log file is written synchronously afterwards.
+void StopAsyncLogging()
+{
+    auto writer = g_async_writer.exchange(nullptr, std::memory_order_acq_rel);
+    if (writer) {
+        writer->Stop();
+    }
+}
+
+void StartAsyncLogging(const kbase::LoggingSettings& settings)
+{
+    // Pending messages would be lost at exit, so we keep writing synchronously.
+    if (!kbase::AtExitManager::HasInstance()) {
+        return;
+    }
+
+    if (!g_async_exit_callback_registered) {
+        kbase::AtExitManager::RegisterCallback([] {
+            StopAsyncLogging();
+            g_async_exit_callback_registered = false;
+        });
+        g_async_exit_callback_registered = true;
+    }
+
+    auto writer = GetAsyncLogWriters().Add(
+        std::make_unique<AsyncLogWriter>(settings.async_flush_interval,
+                                         settings.async_buffer_size,
+                                         settings.async_max_buffer_count,
+                                         settings.async_overflow_policy));
+    g_async_writer.store(writer, std::memory_order_release);
+}
+
+// Writes a message or a binary record into the log file.
+void WriteLogRecord(const char* data, size_t length, bool flush)
+{
+    auto async_writer = g_async_writer.load(std::memory_order_acquire);
+    if (async_writer) {
+        async_writer->Append(data, length);
+        if (flush) {
+            async_writer->Flush();
+        }
+
+        return;
+    }
+
+    // If `InitLogFile` wasn't called at the start of the program, do it on the fly.
+    // However, if we unfortunately failed to initialize the log file, just skip the writting.
+    // Note that, if more than one thread in here try to call `InitLogFile`, there will be a
+    // race condition. This is why you should call `ConfigureLoggingSettings` at start.
+    if (InitLogFile()) {
+        WriteToLogFile(data, length);
+    }
+}
+
+// The site is marked only after the record was written, thus other threads may describe the
+// site again meanwhile, but no message of the site can go before its description.
+void DescribeLogSite(const kbase::internal::LogSite& site, uint32_t generation)
+{
+    std::string record;
+    AppendSiteRecord(record, site);
+    WriteLogRecord(record.data(), record.length(), false);
+
+    const_cast<kbase::internal::LogSite&>(site).MarkDescribedIn(generation);
+}
+
+// Unlike in asynchronous mode, the site is described right into the file where the message
+// goes, since the file can't be rotated in the meantime.
+void WriteMessageRecordSynchronously(const kbase::internal::LogSite& site,
+                                     const char* data,
+                                     size_t length)
+{
+    if (!InitLogFile()) {
+        return;
+    }
+
+    std::string site_record;
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(g_log_file_mutex, std::defer_lock);
+        if (IsRotationEnabled()) {
+            lock.lock();
+        }
+
+        auto generation = g_log_file_generation.load(std::memory_order_relaxed);
+        if (!site.IsDescribedIn(generation)) {
+            AppendSiteRecord(site_record, site);
+            WriteToFileHandle(g_log_file, site_record.data(), site_record.size());
+            const_cast<kbase::internal::LogSite&>(site).MarkDescribedIn(generation);
+        }
+
+        WriteToFileHandle(g_log_file, data, length);
+    }
+
+    if (IsRotationEnabled()) {
+        RotateLogFileIfNeeded(site_record.size() + length);
+    }
+}
+
+// -*- Binary log decoding -*-
+
+constexpr size_t kDecodingChunkSize = 64 * 1024;
+
+class BinaryLogDecoder {
+public:
+    explicit BinaryLogDecoder(std::ostream& out)
+        : out_(out)
+    {}
+
+    ~BinaryLogDecoder() = default;
+
+    DISALLOW_COPY(BinaryLogDecoder);
+
+    DISALLOW_MOVE(BinaryLogDecoder);
+
+    bool Decode(std::istream& in);
+
+private:
+    bool DecodeStreamHeader(kbase::StringView payload);
+
+    bool DecodeSite(kbase::StringView payload);
+
+    bool DecodeMessage(kbase::StringView payload);
+
+    bool DecodeText(kbase::StringView payload);
+
+private:
+    struct SiteInfo {
+        LogSeverity severity;
+        uint32_t line;
+        std::string file_name;
+    };
+
+    std::ostream& out_;
+    // Keyed by pid, since processes may share a log file.
+    std::map<uint32_t, LogItemOptions> item_options_;
+    std::map<std::pair<uint32_t, uint32_t>, SiteInfo> sites_;
+};
+
+bool BinaryLogDecoder::Decode(std::istream& in)
+{
+    bool header_seen = false;
+    std::string payload;
+    char header[kRecordHeaderSize];
+    while (in.read(header, sizeof(header))) {
+        kbase::StringView header_view(header, sizeof(header));
+        uint8_t type;
+        uint32_t length;
+        GetValue(header_view, type);
+        GetValue(header_view, length);
+
+        // The length may be corrupted, thus the payload grows only as far as the input goes.
+        payload.clear();
+        while (payload.size() < length) {
+            auto offset = payload.size();
+            auto chunk_size = std::min<size_t>(length - offset, kDecodingChunkSize);
+            payload.resize(offset + chunk_size);
+            if (!in.read(&payload[offset], static_cast<std::streamsize>(chunk_size))) {
+                return false;
+            }
+        }
+
+        // Must be a stream header at the beginning.
+        if (!header_seen && type != StreamHeaderRecord) {
+            return false;
+        }
+
+        kbase::StringView payload_view(payload.data(), payload.size());
+        bool succeeded = true;
+        switch (type) {
+            case StreamHeaderRecord:
+                succeeded = DecodeStreamHeader(payload_view);
+                header_seen = true;
+                break;
+
+            case SiteRecord:
+                succeeded = DecodeSite(payload_view);
+                break;
+
+            case MessageRecord:
+                succeeded = DecodeMessage(payload_view);
+                break;
+
+            case TextRecord:
+                succeeded = DecodeText(payload_view);
+                break;
+
+            default:
+                break;
+        }
+
+        if (!succeeded) {
+            return false;
+        }
+    }
+
+    // No partial record header.
+    return in.gcount() == 0;
+}
+
+bool BinaryLogDecoder::DecodeStreamHeader(kbase::StringView payload)
+{
+    uint16_t version;
+    uint32_t pid, item_options;
+    if (payload.size() < sizeof(kBinaryLogMagic) ||
+        memcmp(payload.data(), kBinaryLogMagic, sizeof(kBinaryLogMagic)) != 0) {
+        return false;
+    }
+
+    payload.RemovePrefix(sizeof(kBinaryLogMagic));
+    if (!GetValue(payload, version) || version > kBinaryLogVersion ||
+        !GetValue(payload, pid) || !GetValue(payload, item_options)) {
+        return false;
+    }
+
+    item_options_[pid] = static_cast<LogItemOptions>(item_options);
+
+    return true;
+}
+
+bool BinaryLogDecoder::DecodeSite(kbase::StringView payload)
+{
+    uint32_t pid, id, line;
+    uint8_t severity;
+    if (!GetValue(payload, pid) || !GetValue(payload, id) || !GetValue(payload, severity) ||
+        !GetValue(payload, line) || severity > enum_cast(LogSeverity::LogFatal)) {
+        return false;
+    }
+
+    sites_[std::make_pair(pid, id)] = {static_cast<LogSeverity>(severity), line,
+                                       payload.ToString()};
+
+    return true;
+}
+
+bool BinaryLogDecoder::DecodeMessage(kbase::StringView payload)
+{
+    uint32_t pid, id;
+    int64_t timestamp;
+    uint64_t tid;
+    if (!GetValue(payload, pid) || !GetValue(payload, id) || !GetValue(payload, timestamp) ||
+        !GetValue(payload, tid)) {
+        return false;
+    }
+
+    auto options = item_options_[pid];
+
+    kbase::LogStream stream;
+    stream << '[';
+
+    if (options & LogItemOptions::EnableTimestamp) {
+        namespace chrono = std::chrono;
+        OutputTimestamp(stream, chrono::system_clock::time_point(
+            chrono::duration_cast<chrono::system_clock::duration>(
+                chrono::nanoseconds(timestamp))));
+    }
+
+    if (options & LogItemOptions::EnableProcessID) {
+        stream << ' ' << pid;
+    }
+
+    if (options & LogItemOptions::EnableThreadID) {
+        stream << ' ' << tid;
+    }
+
+    // The site may have been described in the previous file, if the message was written
+    // right after a rotation.
+    auto site = sites_.find(std::make_pair(pid, id));
+    if (site != sites_.end()) {
+        stream << ' ' << kLogSeverityNames[enum_cast(site->second.severity)]
+               << ' ' << site->second.file_name << '(' << site->second.line << ")]";
+    } else {
+        stream << " UNKNOWN site#" << id << "(0)]";
+    }
+
+    while (!payload.empty()) {
+        uint8_t type;
+        GetValue(payload, type);
+        switch (type) {
+            case TextArg: {
+                uint32_t length;
+                if (!GetValue(payload, length) || payload.size() < length) {
+                    return false;
+                }
+
+                stream.Append(payload.data(), length);
+                payload.RemovePrefix(length);
+                break;
+            }
+
+            case SignedArg: {
+                int64_t value;
+                if (!GetValue(payload, value)) {
+                    return false;
+                }
+
+                stream << static_cast<long long>(value);
+                break;
+            }
+
+            case UnsignedArg: {
+                uint64_t value;
+                if (!GetValue(payload, value)) {
+                    return false;
+                }
+
+                stream << static_cast<unsigned long long>(value);
+                break;
+            }
+
+            case FloatArg: {
+                double value;
+                if (!GetValue(payload, value)) {
+                    return false;
+                }
+
+                stream << value;
+                break;
+            }
+
+            case PointerArg: {
+                uint64_t value;
+                if (!GetValue(payload, value)) {
+                    return false;
+                }
+
+                stream << reinterpret_cast<const void*>(static_cast<uintptr_t>(value));
+                break;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    stream << '\n';
+    out_.write(stream.data(), static_cast<std::streamsize>(stream.length()));
+
+    return true;
+}
+
+bool BinaryLogDecoder::DecodeText(kbase::StringView payload)
+{
+    uint32_t pid;
+    if (!GetValue(payload, pid)) {
+        return false;
+    }
+
+    out_.write(payload.data(), static_cast<std::streamsize>(payload.length()));
+
+    return true;
+}
+
+// -*- log sites -*-
+
+using kbase::internal::LogSite;
+
+struct VerboseModule {
+    std::string pattern;
+    int verbose_level;
+    bool match_full_path;
+};
+
+// Guards the site list and verbose settings.
+std::mutex g_log_site_mutex;
+LogSite* g_log_sites = nullptr;
+uint32_t g_log_site_count = 0;
+int g_max_verbose_level = 0;
+
+std::vector<VerboseModule>& GetVerboseModules()
+{
+    // Sites may be registered during static initialization.
+    static std::vector<VerboseModule> modules;
+    return modules;
+}
+
+// Supports wildcards `*` and `?`.
+bool MatchPattern(kbase::StringView str, kbase::StringView pattern)
+{
+    size_t si = 0, pi = 0;
+    size_t star_pi = kbase::StringView::npos, star_si = 0;
+    while (si < str.size()) {
+        if (pi < pattern.size() && (pattern[pi] == '?' || pattern[pi] == str[si])) {
+            ++si;
+            ++pi;
+        } else if (pi < pattern.size() && pattern[pi] == '*') {
+            star_pi = pi++;
+            star_si = si;
+        } else if (star_pi != kbase::StringView::npos) {
+            pi = star_pi + 1;
+            si = ++star_si;
+        } else {
+            return false;
+        }
+    }
+
+    while (pi < pattern.size() && pattern[pi] == '*') {
+        ++pi;
+    }
+
+    return pi == pattern.size();
+}
+
+// Malformed entries are ignored.
+std::vector<VerboseModule> ParseVerboseModules(const std::string& verbose_modules)
+{
+    std::vector<VerboseModule> modules;
+    size_t begin = 0;
+    while (begin < verbose_modules.size()) {
+        auto end = verbose_modules.find(',', begin);
+        if (end == std::string::npos) {
+            end = verbose_modules.size();
+        }
+
+        auto eq = verbose_modules.rfind('=', end - 1);
+        if (eq != std::string::npos && eq > begin && eq + 1 < end) {
+            std::string level_str(verbose_modules, eq + 1, end - eq - 1);
+            char* level_end = nullptr;
+            auto level = strtol(level_str.c_str(), &level_end, 10);
+            if (*level_end == '\0') {
+                std::string pattern(verbose_modules, begin, eq - begin);
+                bool match_full_path = pattern.find_first_of("/\\") != std::string::npos;
+                modules.push_back({std::move(pattern), static_cast<int>(level), match_full_path});
+            }
+        }
+
+        begin = end + 1;
+    }
+
+    return modules;
+}
+
+int GetVerboseLevelOfModule(const LogSite& site)
+{
+    kbase::StringView file_name(site.file_name());
+    kbase::StringView module_name = file_name.substr(0, file_name.rfind('.'));
+    for (const auto& module : GetVerboseModules()) {
+        if (MatchPattern(module.match_full_path ? kbase::StringView(site.file()) : module_name,
+                         module.pattern)) {
+            return module.verbose_level;
+        }
+    }
+
+    return g_max_verbose_level;
+}
+
+bool IsLogSiteEnabled(const LogSite& site)
+{
+    if (site.severity() < g_min_severity_level) {
+        return false;
+    }
+
+    int module_level = GetVerboseLevelOfModule(site);
+    if (site.verbose_level() != LogSite::NotVerbose) {
+        return site.verbose_level() <= module_level;
+    }
+
+    return module_level >= 0 || site.severity() >= kbase::LogSeverity::LogError;
+}
+
+}   // namespace
+
+namespace kbase {
+
+namespace internal {
+
+LogSeverity GetMinSeverityLevel() noexcept
+{
+    return g_min_severity_level;
+}
+
+// Must be called with `g_log_site_mutex` held.
+void RefreshLogSites()
+{
+    for (auto site = g_log_sites; site; site = site->next_) {
+        auto state = IsLogSiteEnabled(*site) ? LogSite::Enabled : LogSite::Disabled;
+        site->state_.store(state, std::memory_order_release);
+    }
+}
+
+std::string MakeLogSiteRecords()
+{
+    std::string records;
+
+    std::lock_guard<std::mutex> lock(g_log_site_mutex);
+    for (auto site = g_log_sites; site; site = site->next_) {
+        AppendSiteRecord(records, *site);
+    }
+
+    return records;
+}
+
+int LogSite::Register() noexcept
+{
+    std::lock_guard<std::mutex> lock(g_log_site_mutex);
+    auto state = state_.load(std::memory_order_relaxed);
+    if (state != Unregistered) {
+        return state;
+    }
+
+    file_name_ = ExtractFileName(file_);
+    id_ = ++g_log_site_count;
+    next_ = g_log_sites;
+    g_log_sites = this;
+
+    state = IsLogSiteEnabled(*this) ? Enabled : Disabled;
+    state_.store(state, std::memory_order_release);
+
+    return state;
+}
+
+bool LogSite::ShouldLogEveryT(double seconds) noexcept
+{
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto next_time = next_log_time_.load(std::memory_order_relaxed);
+    if (now < next_time) {
+        return false;
+    }
+
+    auto interval = static_cast<int64_t>(seconds * 1e9);
+    return next_log_time_.compare_exchange_strong(next_time, now + interval,
+                                                  std::memory_order_relaxed);
+}
+
+}   // namespace internal
+
+LoggingSettings::LoggingSettings() noexcept
+ : min_severity_level(LogSeverity::LogInfo),
+   log_item_options(LogItemOptions::EnableTimestamp),
+   logging_destination(LoggingDestination::LogToFile),
+   old_file_disposal_option(OldFileDisposalOption::AppendToOldFile),
+   timestamp_clock_source(TimestampClockSource::PreciseClock),
+   log_file_format(LogFileFormat::TextLogFormat),
+   max_log_file_size(0),
+   max_log_file_age(0),
+   max_rotated_log_files(0),
+   log_writing_mode(LogWritingMode::WriteSynchronously),
+   async_flush_interval(kDefaultAsyncFlushInterval),
+   async_buffer_size(kDefaultAsyncBufferSize),
+   async_max_buffer_count(kDefaultAsyncMaxBufferCount),
+   async_overflow_policy(AsyncOverflowPolicy::BlockOnOverflow),
+   max_verbose_level(0)
+{}
+
+void ConfigureLoggingSettings(const LoggingSettings& settings)
+{
+    // Drains pending messages before the log file may be replaced.
+    StopAsyncLogging();
+
+    g_min_severity_level = settings.min_severity_level;
+    ConfigureVerboseLogging(settings.max_verbose_level, settings.verbose_modules);
+    g_log_item_options = settings.log_item_options;
+    g_logging_dest = settings.logging_destination;
+    g_old_file_option = settings.old_file_disposal_option;
+    g_clock_source = settings.timestamp_clock_source;
+    g_log_file_format = settings.log_file_format;
+    g_max_log_file_size = settings.max_log_file_size;
+    g_max_log_file_age = settings.max_log_file_age;
+    g_max_rotated_log_files = settings.max_rotated_log_files;
+    g_post_rotation_hook = settings.post_rotation_hook;
+    g_monotonic_clock_anchor = MonotonicClockAnchor();
+
+    if (!(g_logging_dest & LoggingDestination::LogToFile)) {
+        return;
+    }
+
+    if (!settings.log_file_path.empty()) {
+        g_log_file_path = settings.log_file_path;
+    }
+
+    CloseLogFile();
+
+    InitLogFile();
+
+    if (settings.log_writing_mode == LogWritingMode::WriteAsynchronously) {
+        StartAsyncLogging(settings);
+    }
+}
+
+void ConfigureVerboseLogging(int max_verbose_level, const std::string& verbose_modules)
+{
+    auto modules = ParseVerboseModules(verbose_modules);
+
+    std::lock_guard<std::mutex> lock(g_log_site_mutex);
+    g_max_verbose_level = max_verbose_level;
+    GetVerboseModules().swap(modules);
+    internal::RefreshLogSites();
+}
+
+void FlushLogging()
+{
+    auto async_writer = g_async_writer.load(std::memory_order_acquire);
+    if (async_writer) {
+        async_writer->Flush();
+    }
+}
+
+bool DecodeBinaryLog(std::istream& in, std::ostream& out)
+{
+    BinaryLogDecoder decoder(out);
+    return decoder.Decode(in);
+}
+
+// -*- LogStream -*-
+
+class LogStream::StreamBuf : public std::streambuf {
+public:
+    explicit StreamBuf(LogStream& stream) noexcept
+        : stream_(stream)
+    {}
+
+    ~StreamBuf() = default;
+
+    DISALLOW_COPY(StreamBuf);
+
+    DISALLOW_MOVE(StreamBuf);
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            char c = traits_type::to_char_type(ch);
+            stream_.Append(&c, 1);
+        }
+
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* str, std::streamsize count) override
+    {
+        stream_.Append(str, static_cast<size_t>(count));
+        return count;
+    }
+
+private:
+    LogStream& stream_;
+};
+
+LogStream::LogStream() noexcept
+    : data_(inline_buf_), length_(0), capacity_(kInlineCapacity), binary_(false),
+      text_arg_pos_(kNoTextArg)
+{
+    data_[0] = '\0';
+}
+
+LogStream::~LogStream() = default;
+
+LogStream& LogStream::operator<<(bool value)
+{
+    if (UseOStreamForNumbers()) {
+        *ostream_ << value;
+        return *this;
+    }
+
+    return *this << (value ? '1' : '0');
+}
+
+LogStream& LogStream::operator<<(char ch)
+{
+    Append(&ch, 1);
+    return *this;
+}
+
+LogStream& LogStream::operator<<(short value)
+{
+    return AppendInteger(value);
+}
+
+LogStream& LogStream::operator<<(unsigned short value)
+{
+    return AppendInteger(value);
+}
+
+LogStream& LogStream::operator<<(int value)
+{
+    return AppendInteger(value);
+}
+
+LogStream& LogStream::operator<<(unsigned int value)
+{
+    return AppendInteger(value);
+}
+
+LogStream& LogStream::operator<<(long value)
+{
+    return AppendInteger(value);
+}
+
+LogStream& LogStream::operator<<(unsigned long value)
+{
+    return AppendInteger(value);
+}
+
+LogStream& LogStream::operator<<(long long value)
+{
+    return AppendInteger(value);
+}
+
+LogStream& LogStream::operator<<(unsigned long long value)
+{
+    return AppendInteger(value);
+}
+
+LogStream& LogStream::operator<<(float value)
+{
+    return AppendFloat(value, "%.*g");
+}
+
+LogStream& LogStream::operator<<(double value)
+{
+    return AppendFloat(value, "%.*g");
+}
+
+LogStream& LogStream::operator<<(long double value)
+{
+    return AppendFloat(value, "%.*Lg");
+}
+
+LogStream& LogStream::operator<<(const void* ptr)
+{
+    if (UseOStreamForNumbers()) {
+        *ostream_ << ptr;
+        return *this;
+    }
+
+    if (binary_) {
+        auto value = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr));
+        AppendBinaryArg(PointerArg, &value, sizeof(value));
+        return *this;
+    }
+
+    constexpr char kHexDigits[] = "0123456789abcdef";
+    char buf[2 + sizeof(uintptr_t) * 2];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    auto value = reinterpret_cast<uintptr_t>(ptr);
+    do {
+        *--p = kHexDigits[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+
+    *--p = 'x';
+    *--p = '0';
+    Append(p, static_cast<size_t>(end - p));
+
+    return *this;
+}
+
+LogStream& LogStream::operator<<(const char* str)
+{
+    if (!str) {
+        return *this << StringView("(null)");
+    }
+
+    Append(str, strlen(str));
+    return *this;
+}
+
+void LogStream::Append(const char* data, size_t length)
+{
+    if (binary_) {
+        AppendBinaryText(data, length);
+        return;
+    }
+
+    AppendBytes(data, length);
+}
+
+std::ostream& LogStream::ostream()
+{
+    if (!ostream_) {
+        stream_buf_ = std::make_unique<StreamBuf>(*this);
+        ostream_ = std::make_unique<std::ostream>(stream_buf_.get());
+    }
+
+    return *ostream_;
+}
+
+void LogStream::Reserve(size_t count)
+{
+    // Always leave room for the null-terminator.
+    if (capacity_ - length_ > count) {
+        return;
+    }
+
+    auto new_capacity = std::max(capacity_ * 2, length_ + count + 1);
+    std::unique_ptr<char[]> new_buf(new char[new_capacity]);
+    memcpy(new_buf.get(), data_, length_ + 1);
+
+    heap_buf_ = std::move(new_buf);
+    data_ = heap_buf_.get();
+    capacity_ = new_capacity;
+}
+
+void LogStream::AppendDecimal(unsigned long long value, bool negative)
+{
+    // Enough for the longest 64-bit integer and its sign.
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = FormatDecimalBackward(value, end);
+    if (negative) {
+        *--p = '-';
+    }
+
+    Append(p, static_cast<size_t>(end - p));
+}
+
+template<typename T>
+LogStream& LogStream::AppendInteger(T value)
+{
+    if (UseOStreamForNumbers()) {
+        *ostream_ << value;
+        return *this;
+    }
+
+    if (binary_) {
+        if (std::is_signed<T>::value) {
+            auto signed_value = static_cast<int64_t>(value);
+            AppendBinaryArg(SignedArg, &signed_value, sizeof(signed_value));
+        } else {
+            auto unsigned_value = static_cast<uint64_t>(value);
+            AppendBinaryArg(UnsignedArg, &unsigned_value, sizeof(unsigned_value));
+        }
+
+        return *this;
+    }
+
+    // Negates in unsigned domain, which is well-defined even for the minimum value.
+    auto abs_value = static_cast<unsigned long long>(value);
+    bool negative = IsNegative(value, std::is_signed<T>());
+    if (negative) {
+        abs_value = 0ULL - abs_value;
+    }
+
+    AppendDecimal(abs_value, negative);
+
+    return *this;
+}
+
+template<typename T>
+LogStream& LogStream::AppendFloat(T value, const char* spec)
+{
+    if (UseOStreamForNumbers()) {
+        *ostream_ << value;
+        return *this;
+    }
+
+    // The precision of long double is beyond what the default formatting shows.
+    if (binary_) {
+        auto double_value = static_cast<double>(value);
+        AppendBinaryArg(FloatArg, &double_value, sizeof(double_value));
+        return *this;
+    }
+
+    // Uses the same precision as a std::ostream does by default, and the decimal point of the
+    // classic locale as well.
+    constexpr int kDefaultPrecision = 6;
+    char buf[64];
+    int count = snprintf(buf, sizeof(buf), spec, kDefaultPrecision, value);
+    if (count > 0) {
+        auto length = std::min(static_cast<size_t>(count), sizeof(buf) - 1);
+        Append(buf, internal::NormalizeDecimalPoint(buf, length));
+    }
+
+    return *this;
+}
+
+bool LogStream::UseOStreamForNumbers() const
+{
+    if (!ostream_) {
+        return false;
+    }
+
+    constexpr auto kDefaultFlags = std::ios_base::skipws | std::ios_base::dec;
+    constexpr std::streamsize kDefaultPrecision = 6;
+
+    return ostream_->flags() != kDefaultFlags || ostream_->width() != 0 ||
+           ostream_->precision() != kDefaultPrecision;
+}
+
+void LogStream::AppendBytes(const void* data, size_t length)
+{
+    Reserve(length);
+    memcpy(data_ + length_, data, length);
+    length_ += length;
+    data_[length_] = '\0';
+}
+
+void LogStream::AppendBinaryArg(uint8_t type, const void* value, size_t size)
+{
+    char buf[sizeof(type) + sizeof(uint64_t)];
+    buf[0] = static_cast<char>(type);
+    memcpy(buf + sizeof(type), value, size);
+    AppendBytes(buf, sizeof(type) + size);
+    text_arg_pos_ = kNoTextArg;
+}
+
+// Adjacent pieces of text, e.g. string literals and outputs of `ostream_`, are merged into
+// one argument.
+void LogStream::AppendBinaryText(const char* data, size_t length)
+{
+    uint32_t text_length = 0;
+    if (text_arg_pos_ == kNoTextArg) {
+        char tag = static_cast<char>(TextArg);
+        AppendBytes(&tag, sizeof(tag));
+        text_arg_pos_ = length_;
+        AppendBytes(&text_length, sizeof(text_length));
+    } else {
+        memcpy(&text_length, data_ + text_arg_pos_, sizeof(text_length));
+    }
+
+    text_length += static_cast<uint32_t>(length);
+    memcpy(data_ + text_arg_pos_, &text_length, sizeof(text_length));
+    AppendBytes(data, length);
+}
+
+// -*- LogMessage -*-
+
+LogMessage::LogMessage(const char* file, int line, LogSeverity severity)
+    : site_(nullptr), file_name_(ExtractFileName(file)), line_(line), severity_(severity),
+      text_offset_(0)
+{
+    InitMessageHeader();
+}
+
+LogMessage::LogMessage(const internal::LogSite& site)
+    : site_(&site), file_name_(nullptr), line_(site.line()), severity_(site.severity()),
+      text_offset_(0)
+{
+    // Pairs with the release store of the site state, which was loaded in relaxed order, so
+    // that fields set at registration are visible.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    file_name_ = site.file_name();
+
+    // Messages also sent elsewhere are always composed in text.
+    if (IsBinaryLogFile() && severity_ < kAlwaysPrintErrorMinLevel &&
+        !(g_logging_dest & LoggingDestination::LogToSystemDebugLog)) {
+        InitBinaryRecordHeader();
+    } else {
+        InitMessageHeader();
+    }
+}
+
+LogMessage::~LogMessage()
+{
+    if (stream_.binary_) {
+        WriteBinaryRecord();
+        return;
+    }
+
+    if (severity_ == LogSeverity::LogFatal) {
+        stream_ << '\n';
+        StackWalker walker;
+        walker.DumpCallStack(stream_.ostream());
+    }
+
+    stream_ << '\n';
+    const char* msg = stream_.data() + text_offset_;
+    size_t msg_length = stream_.length() - text_offset_;
+
+    if ((g_logging_dest & LoggingDestination::LogToSystemDebugLog) ||
+        severity_ >= kAlwaysPrintErrorMinLevel) {
+#if defined(OS_WIN)
+        OutputDebugStringA(msg);
+#endif
+        // Log to standard error stream.
+        fwrite(msg, sizeof(char), msg_length, stderr);
+        fflush(stderr);
+    }
+
+    if (!(g_logging_dest & LoggingDestination::LogToFile)) {
+        return;
+    }
+
+    if (text_offset_ != 0) {
+        FillTextRecordHeader(stream_.data_, msg_length);
+        msg = stream_.data();
+        msg_length = stream_.length();
+    }
+
+    // The process is likely to be dying on a fatal error, thus we'd better make sure the
+    // message has been written when we are done here.
+    WriteLogRecord(msg, msg_length, severity_ == LogSeverity::LogFatal);
+}
+
+void LogMessage::InitMessageHeader()
+{
+    // Reserves room for the record header, which is filled when the message is complete.
+    if (IsBinaryLogFile()) {
+        char record_header[kTextRecordHeaderSize] {};
+        stream_.AppendBytes(record_header, sizeof(record_header));
+        text_offset_ = sizeof(record_header);
+    }
+
+    stream_ << '[';
+
+    if (g_log_item_options & LogItemOptions::EnableTimestamp) {
+        OutputNowTimestamp(stream_);
+    }
+
+    if (g_log_item_options & LogItemOptions::EnableProcessID) {
+        stream_ << ' ' << GetCurrentProcessID();
+    }
+
+    if (g_log_item_options & LogItemOptions::EnableThreadID) {
+        stream_ << ' ' << GetCurrentThreadID();
+    }
+
+    stream_ << ' ' << kLogSeverityNames[enum_cast(severity_)]
+            << ' ' << file_name_ << '(' << line_ << ")]";
+}
+
+void LogMessage::InitBinaryRecordHeader()
+{
+    namespace chrono = std::chrono;
+
+    stream_.EnableBinaryMode();
+
+    auto timestamp = chrono::duration_cast<chrono::nanoseconds>(
+        GetTimestampNow().time_since_epoch()).count();
+
+    // The record header is filled when the message is complete.
+    char header[kMessageRecordHeaderSize];
+    char* p = header + kRecordHeaderSize;
+    p = PutValue(p, g_binary_log_pid.load(std::memory_order_relaxed));
+    p = PutValue(p, site_->id());
+    p = PutValue(p, static_cast<int64_t>(timestamp));
+    PutValue(p, static_cast<uint64_t>(GetCurrentThreadID()));
+    stream_.AppendBytes(header, sizeof(header));
+}
+
+void LogMessage::WriteBinaryRecord()
+{
+    PutRecordHeader(stream_.data_, MessageRecord, stream_.length() - kRecordHeaderSize);
+
+    if (!g_async_writer.load(std::memory_order_acquire)) {
+        WriteMessageRecordSynchronously(*site_, stream_.data(), stream_.length());
+        return;
+    }
+
+    // The record may be written out after a rotation, which describes all sites in the new
+    // file for this reason.
+    auto generation = g_log_file_generation.load(std::memory_order_relaxed);
+    if (!site_->IsDescribedIn(generation)) {
+        DescribeLogSite(*site_, generation);
     }
 
-    stream_ << " " << kLogSeverityNames[enum_cast(severity_)]
-            << " " << file_name_ << '(' << line_ << ")]";
+    WriteLogRecord(stream_.data(), stream_.length(), false);
 }
 
 }   // namespace kbase
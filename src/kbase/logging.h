@@ -9,11 +9,16 @@
 #ifndef KBASE_LOGGING_H_
 #define KBASE_LOGGING_H_
 
-#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <ostream>
 #include <string>
 
 #include "kbase/basic_macros.h"
 #include "kbase/basic_types.h"
+#include "kbase/string_view.h"
 
 namespace kbase {
 
@@ -32,6 +37,9 @@ namespace internal {
 
 LogSeverity GetMinSeverityLevel() noexcept;
 
+// Returns records describing all registered sites, for a new binary log file.
+std::string MakeLogSiteRecords();
+
 }   // namespace internal
 
 enum LogItemOptions {
@@ -54,6 +62,38 @@ enum OldFileDisposalOption {
     DeleteOldFile
 };
 
+// In `BinaryLogFormat`, messages below ERROR level are written into the log file as binary
+// records, which store raw arguments instead of formatted text, and which can be decoded
+// back into text by `DecodeBinaryLog()`.
+enum LogFileFormat {
+    TextLogFormat,
+    BinaryLogFormat
+};
+
+enum LogWritingMode {
+    WriteSynchronously,
+    WriteAsynchronously
+};
+
+// Where timestamps in message headers come from.
+// `CoarseClock` is cheaper than `PreciseClock`, at the cost of precision in a few
+// milliseconds; `MonotonicClock` advances with a steady clock from the moment logging is
+// configured, and thus is not affected by adjustments of the system time.
+enum TimestampClockSource {
+    PreciseClock,
+    CoarseClock,
+    MonotonicClock
+};
+
+// Decides what to do with a new message, when all buffers are full in asynchronous mode.
+enum AsyncOverflowPolicy {
+    DropOnOverflow,
+    BlockOnOverflow
+};
+
+// Called with the path of a log file that has just been rotated.
+using LogRotationHook = std::function<void(const PathString& rotated_file)>;
+
 struct LoggingSettings {
     // Initializes to default values.
     // Note that, if `log_file_path` wasn't specified, use default path.
@@ -64,14 +104,209 @@ struct LoggingSettings {
     LoggingDestination logging_destination;
     OldFileDisposalOption old_file_disposal_option;
     PathString log_file_path;
+    TimestampClockSource timestamp_clock_source;
+    LogFileFormat log_file_format;
+
+    // The log file is renamed with a suffix of the time and a sequence number, e.g.
+    // debug.log.20160126-091438.000001, and a new one is created, once it has grown up to
+    // `max_log_file_size` bytes, or it has been written for `max_log_file_age` since being
+    // opened. Zero disables the condition.
+    // The size limit is checked after each write, thus a file may outgrow it by one message,
+    // or by one buffer in asynchronous mode.
+    uint64_t max_log_file_size;
+    std::chrono::seconds max_log_file_age;
+
+    // Keeps at most `max_rotated_log_files` files rotated by this process, and older ones are
+    // deleted. Zero means no limit.
+    size_t max_rotated_log_files;
+
+    // The hook, e.g. compressing the rotated file, runs on a background thread.
+    // If the hook moves the file away, it takes over the disposal of the file.
+    LogRotationHook post_rotation_hook;
+
+    // In asynchronous mode, messages to the log file are appended into in-memory buffers,
+    // and a background thread writes them out in batches.
+    // Messages sent to stderr are not affected, and are still written immediately.
+    LogWritingMode log_writing_mode;
+
+    // Settings below take effect only in asynchronous mode.
+    // Memory used for buffering is bounded by `async_buffer_size * async_max_buffer_count`.
+    std::chrono::milliseconds async_flush_interval;
+    size_t async_buffer_size;
+    size_t async_max_buffer_count;
+    AsyncOverflowPolicy async_overflow_policy;
+
+    // `VLOG(n)` statements are enabled if `n` is not greater than the verbose level of their
+    // modules, which is `max_verbose_level`, unless otherwise specified by `verbose_modules`.
+    // `verbose_modules` is a comma-separated list of `pattern=level` pairs, e.g.
+    // "net_*=2,file_util=1", where a pattern may contain wildcards `*` and `?`, and is matched
+    // against file names without extension, or against full paths if it contains a path
+    // separator. The first matched pattern wins.
+    // A negative level also mutes INFO and WARNING messages of the module.
+    int max_verbose_level;
+    std::string verbose_modules;
 };
 
 // You should better configure these settings at the beginning of the program, or
 // default settings are applied.
 // Note that, calling this function during the logging in a multithreaded context
 // is not safe.
+// If asynchronous mode is enabled, an `AtExitManager` instance must be alive, because
+// pending messages are written out when it is going out of scope.
 void ConfigureLoggingSettings(const LoggingSettings& settings);
 
+// Writes out all pending messages, and blocks until the writing is done.
+// It has no effect in synchronous mode.
+void FlushLogging();
+
+// Changes verbose levels at runtime; see `LoggingSettings` for the format of `verbose_modules`.
+// Unlike `ConfigureLoggingSettings()`, this function is safe to call while logging.
+void ConfigureVerboseLogging(int max_verbose_level, const std::string& verbose_modules);
+
+// Decodes a log file written in `BinaryLogFormat` into text format.
+// Returns false if the input is not a binary log file or is truncated, and messages decoded
+// until then are still output.
+bool DecodeBinaryLog(std::istream& in, std::ostream& out);
+
+namespace internal {
+
+// Each logging statement owns a statically initialized site descriptor, which is registered
+// when the statement is executed for the first time, and whose state is refreshed whenever
+// logging settings change.
+// Therefore, checking whether a statement is disabled costs only one relaxed load.
+class LogSite {
+public:
+    enum : int {
+        NotVerbose = -1
+    };
+
+    constexpr LogSite(const char* file, int line, LogSeverity severity, int verbose_level) noexcept
+        : file_(file),
+          line_(line),
+          severity_(severity),
+          verbose_level_(verbose_level),
+          file_name_(nullptr),
+          id_(0),
+          next_(nullptr),
+          state_(Unregistered),
+          occurrences_(0),
+          next_log_time_(0),
+          described_generation_(0)
+    {}
+
+    DISALLOW_COPY(LogSite);
+
+    DISALLOW_MOVE(LogSite);
+
+    // Returns this site if it is enabled; returns nullptr otherwise.
+    LogSite* GetIfEnabled() noexcept
+    {
+        auto state = state_.load(std::memory_order_relaxed);
+        if (state == Disabled) {
+            return nullptr;
+        }
+
+        if (state == Unregistered) {
+            state = Register();
+        } else {
+            // Pairs with release-stores of the state, so that fields set in `Register()` are
+            // visible to the thread seeing the site enabled.
+            state = state_.load(std::memory_order_acquire);
+        }
+
+        return state == Enabled ? this : nullptr;
+    }
+
+    // Counters below are shared by all threads executing the statement.
+
+    bool ShouldLogEveryN(unsigned int n) noexcept
+    {
+        return occurrences_.fetch_add(1, std::memory_order_relaxed) % n == 0;
+    }
+
+    bool ShouldLogFirstN(unsigned int n) noexcept
+    {
+        return occurrences_.load(std::memory_order_relaxed) < n &&
+               occurrences_.fetch_add(1, std::memory_order_relaxed) < n;
+    }
+
+    bool ShouldLogEveryT(double seconds) noexcept;
+
+    // Accessors below are valid only after the site was found enabled.
+
+    const char* file() const noexcept
+    {
+        return file_;
+    }
+
+    // File name without directory part.
+    const char* file_name() const noexcept
+    {
+        return file_name_;
+    }
+
+    int line() const noexcept
+    {
+        return line_;
+    }
+
+    LogSeverity severity() const noexcept
+    {
+        return severity_;
+    }
+
+    int verbose_level() const noexcept
+    {
+        return verbose_level_;
+    }
+
+    // Sites are numbered from 1 in the order they are registered.
+    uint32_t id() const noexcept
+    {
+        return id_;
+    }
+
+    // A binary log file describes a site before its first message in the file.
+
+    bool IsDescribedIn(uint32_t file_generation) const noexcept
+    {
+        return described_generation_.load(std::memory_order_relaxed) == file_generation;
+    }
+
+    void MarkDescribedIn(uint32_t file_generation) noexcept
+    {
+        described_generation_.store(file_generation, std::memory_order_relaxed);
+    }
+
+private:
+    enum State : int {
+        Unregistered = -1,
+        Disabled = 0,
+        Enabled = 1
+    };
+
+    int Register() noexcept;
+
+    friend void RefreshLogSites();
+
+    friend std::string MakeLogSiteRecords();
+
+private:
+    const char* file_;
+    int line_;
+    LogSeverity severity_;
+    int verbose_level_;
+    const char* file_name_;
+    uint32_t id_;
+    LogSite* next_;
+    std::atomic<int> state_;
+    std::atomic<unsigned int> occurrences_;
+    std::atomic<int64_t> next_log_time_;
+    std::atomic<uint32_t> described_generation_;
+};
+
+}   // namespace internal
+
 // Surprisingly, a macro `ERROR` is defined as 0 in file <wingdi.h>, which is
 // included by <windows.h>, so we add a special macro to handle this peculiar
 // chaos, in case the file was included.
@@ -106,27 +341,226 @@ void ConfigureLoggingSettings(const LoggingSettings& settings);
 #define LOG_STREAM(severity) \
     COMPACT_LOG_##severity.stream()
 
+// Defines a site descriptor for the statement, and evaluates to a reference to it.
+// The site is initialized once, thus `verbose_level` must be a constant expression.
+#define LOG_SITE(severity, verbose_level) \
+    ([]() noexcept -> kbase::internal::LogSite& { \
+        static_assert((verbose_level) >= kbase::internal::LogSite::NotVerbose, \
+                      "The verbose level must be a constant expression"); \
+        static kbase::internal::LogSite site(__FILE__, __LINE__, LOG_SEVERITY_FOR_##severity, \
+                                             verbose_level); \
+        return site; \
+    }())
+
+// The loop body runs at most once, and `condition` is evaluated only if the site is enabled.
+// Unlike a conditional expression, a statement is required here to have the site reachable
+// from both the condition and the message.
+#define LAZY_SITE_STREAM(site, condition) \
+    for (kbase::internal::LogSite* kbase_log_site = (site).GetIfEnabled(); \
+         kbase_log_site && (condition); kbase_log_site = nullptr) \
+        kbase::LogMessage(*kbase_log_site).stream()
+
 #define LOG(severity) \
-    LAZY_STREAM(LOG_STREAM(severity), LOG_IS_ON(severity))
+    LAZY_SITE_STREAM(LOG_SITE(severity, kbase::internal::LogSite::NotVerbose), true)
 #define LOG_IF(severity, condition) \
-    LAZY_STREAM(LOG_STREAM(severity), LOG_IS_ON(severity) && (condition))
+    LAZY_SITE_STREAM(LOG_SITE(severity, kbase::internal::LogSite::NotVerbose), (condition))
+
+// Logs on the 1st, (n+1)th, (2n+1)th... execution of the statement.
+#define LOG_EVERY_N(severity, n) \
+    LAZY_SITE_STREAM(LOG_SITE(severity, kbase::internal::LogSite::NotVerbose), \
+                     kbase_log_site->ShouldLogEveryN(n))
+
+// Logs on the first n executions of the statement.
+#define LOG_FIRST_N(severity, n) \
+    LAZY_SITE_STREAM(LOG_SITE(severity, kbase::internal::LogSite::NotVerbose), \
+                     kbase_log_site->ShouldLogFirstN(n))
+
+// Logs at most once in every `seconds` seconds.
+#define LOG_EVERY_T(severity, seconds) \
+    LAZY_SITE_STREAM(LOG_SITE(severity, kbase::internal::LogSite::NotVerbose), \
+                     kbase_log_site->ShouldLogEveryT(seconds))
 
+// Verbose messages are in INFO level.
+#define VLOG(verbose_level) \
+    LAZY_SITE_STREAM(LOG_SITE(INFO, (verbose_level)), true)
+#define VLOG_IF(verbose_level, condition) \
+    LAZY_SITE_STREAM(LOG_SITE(INFO, (verbose_level)), (condition))
+
+#if !defined(NDEBUG)
+#define DLOG(severity) LOG(severity)
+#define DLOG_IF(severity, condition) LOG_IF(severity, condition)
+#else
 #define DLOG(severity) \
-    LAZY_STREAM(LOG_STREAM(severity), DLOG_IS_ON(severity))
+    LAZY_STREAM(LOG_STREAM(severity), false)
 #define DLOG_IF(severity, condition) \
-    LAZY_STREAM(LOG_STREAM(severity), DLOG_IS_ON(severity) && (condition))
+    LAZY_STREAM(LOG_STREAM(severity), false && (condition))
+#endif
+
+// A lightweight output stream used for composing a log message.
+// Characters are written into an inline buffer, and go to the heap only when a message is
+// unusually long. Built-in types are formatted by hand, i.e. neither memory allocation nor
+// locale lookup is involved; other types are still supported as long as they have an
+// `operator<<` overloaded for `std::ostream`.
+class LogStream {
+public:
+    LogStream() noexcept;
+
+    ~LogStream();
+
+    DISALLOW_COPY(LogStream);
+
+    DISALLOW_MOVE(LogStream);
+
+    LogStream& operator<<(bool value);
+
+    LogStream& operator<<(char ch);
+
+    LogStream& operator<<(signed char ch)
+    {
+        return *this << static_cast<char>(ch);
+    }
+
+    LogStream& operator<<(unsigned char ch)
+    {
+        return *this << static_cast<char>(ch);
+    }
+
+    LogStream& operator<<(short value);
+
+    LogStream& operator<<(unsigned short value);
+
+    LogStream& operator<<(int value);
+
+    LogStream& operator<<(unsigned int value);
+
+    LogStream& operator<<(long value);
+
+    LogStream& operator<<(unsigned long value);
+
+    LogStream& operator<<(long long value);
+
+    LogStream& operator<<(unsigned long long value);
+
+    LogStream& operator<<(float value);
+
+    LogStream& operator<<(double value);
+
+    LogStream& operator<<(long double value);
+
+    LogStream& operator<<(const void* ptr);
+
+    LogStream& operator<<(const char* str);
+
+    LogStream& operator<<(const std::string& str)
+    {
+        Append(str.data(), str.length());
+        return *this;
+    }
+
+    LogStream& operator<<(StringView str)
+    {
+        Append(str.data(), str.length());
+        return *this;
+    }
+
+    // Manipulators, such as std::hex, take effect on subsequent numbers, just like what
+    // they do on a normal std::ostream.
+
+    LogStream& operator<<(std::ostream& (*manipulator)(std::ostream&))
+    {
+        manipulator(ostream());
+        return *this;
+    }
+
+    LogStream& operator<<(std::ios_base& (*manipulator)(std::ios_base&))
+    {
+        manipulator(ostream());
+        return *this;
+    }
+
+    template<typename T>
+    LogStream& operator<<(const T& value)
+    {
+        ostream() << value;
+        return *this;
+    }
+
+    void Append(const char* data, size_t length);
+
+    // Returns the std::ostream that outputs into this stream.
+    // It is created on demand, and is used for those types we don't format by hand.
+    std::ostream& ostream();
+
+    // The data is always null-terminated.
+    const char* data() const noexcept
+    {
+        return data_;
+    }
+
+    size_t length() const noexcept
+    {
+        return length_;
+    }
+
+private:
+    // Ensures at least `count` characters, apart from the null-terminator, can be appended.
+    void Reserve(size_t count);
+
+    void AppendDecimal(unsigned long long value, bool negative);
+
+    template<typename T>
+    LogStream& AppendInteger(T value);
+
+    template<typename T>
+    LogStream& AppendFloat(T value, const char* spec);
+
+    // Formatting numbers via `ostream_` if any stream manipulator is in effect.
+    bool UseOStreamForNumbers() const;
+
+    // In binary mode, numbers are stored in raw bytes following their type tags, and text is
+    // stored with its length; see logging.cpp for details.
+    void EnableBinaryMode() noexcept
+    {
+        binary_ = true;
+    }
+
+    void AppendBytes(const void* data, size_t length);
+
+    void AppendBinaryArg(uint8_t type, const void* value, size_t size);
+
+    void AppendBinaryText(const char* data, size_t length);
+
+    friend class LogMessage;
+
+private:
+    class StreamBuf;
+
+    static constexpr size_t kInlineCapacity = 1024U;
+    char inline_buf_[kInlineCapacity];
+    char* data_;
+    size_t length_;
+    size_t capacity_;
+    std::unique_ptr<char[]> heap_buf_;
+    std::unique_ptr<StreamBuf> stream_buf_;
+    std::unique_ptr<std::ostream> ostream_;
+    bool binary_;
+    // The offset of the length of the last text argument, if it is at the end of the stream.
+    size_t text_arg_pos_;
+};
 
 class LogMessage {
 public:
     LogMessage(const char* file, int line, LogSeverity severity);
 
+    explicit LogMessage(const internal::LogSite& site);
+
     ~LogMessage();
 
     DISALLOW_COPY(LogMessage);
 
     DISALLOW_MOVE(LogMessage);
 
-    std::ostream& stream() noexcept
+    LogStream& stream() noexcept
     {
         return stream_;
     }
@@ -139,16 +573,24 @@ private:
     // is enabled.
     void InitMessageHeader();
 
+    void InitBinaryRecordHeader();
+
+    void WriteBinaryRecord();
+
 private:
+    const internal::LogSite* site_;
     const char* file_name_;
     int line_;
     LogSeverity severity_;
-    std::ostringstream stream_;
+    LogStream stream_;
+    // Where the text message begins; text messages in a binary log file are prefixed with
+    // a record header.
+    size_t text_offset_;
 };
 
 // Used to suppress compiler warning or intellisense error.
 struct LogMessageVoidfy {
-    void operator&(const std::ostream&) const noexcept
+    void operator&(const LogStream&) const noexcept
     {}
 };
 
@@ -9,12 +9,26 @@
 #ifndef KBASE_LRU_CACHE_H_
 #define KBASE_LRU_CACHE_H_
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "kbase/basic_macros.h"
 #include "kbase/error_exception_util.h"
+#include "kbase/string_view.h"
 
 namespace kbase {
 
@@ -30,52 +44,1259 @@ struct HashMap {
     using MapType = std::unordered_map<Key, Value>;
 };
 
+// Selects the node-pooled storage for LRUCache, see below; used elsewhere, it is the same
+// as HashMap.
+template<typename Key, typename Value>
+struct PooledHashMap {
+    using MapType = std::unordered_map<Key, Value>;
+};
+
+namespace internal {
+
+// Keys are indexed and looked up by their views if they have, so that lookups with e.g. a
+// StringView or a C-string need no temporary std::string.
+// Views of keys must have std::hash, if keys are hashed.
+template<typename Key>
+struct LRUCacheKeyView {
+    using type = Key;
+};
+
+template<>
+struct LRUCacheKeyView<std::string> {
+    using type = StringView;
+};
+
+template<>
+struct LRUCacheKeyView<std::wstring> {
+    using type = WStringView;
+};
+
+// Bookkeeping of a cached entry.
+struct LRUCacheEntryMetadata {
+    LRUCacheEntryMetadata() noexcept
+        : expiry(std::chrono::steady_clock::time_point::max()), weight(1), tag(0),
+          access_count(0)
+    {}
+
+    std::chrono::steady_clock::time_point expiry;
+    size_t weight;
+    // Used by the eviction policy to keep a few bits of its state.
+    uint8_t tag;
+    // Hits since cached, saturated; counted only if the cache collects statistics.
+    uint16_t access_count;
+};
+
+// Keeps cached entries in an order maintained by the eviction policy, and indexes them by
+// keys. Each entry also has its metadata.
+// Entries are in a std::list, and keys are indexed by `Map`; a key view in the index refers
+// to the key in its entry, whose address never changes.
+template<typename Key, typename Entry, template<typename, typename> class Map>
+class LRUCacheStorage {
+public:
+    using key_type = Key;
+    using key_view_type = typename LRUCacheKeyView<Key>::type;
+    using value_type = std::pair<const Key, Entry>;
+
+private:
+    struct Node : value_type {
+        template<typename EntryType>
+        Node(const Key& key, EntryType&& entry)
+            : value_type(key, std::forward<EntryType>(entry))
+        {}
+
+        LRUCacheEntryMetadata metadata;
+    };
+
+    using EntryList = std::list<Node>;
+    using KeyTable = typename Map<key_view_type, typename EntryList::iterator>::MapType;
+
+public:
+    using iterator = typename EntryList::iterator;
+    using const_iterator = typename EntryList::const_iterator;
+    using reverse_iterator = typename EntryList::reverse_iterator;
+    using const_reverse_iterator = typename EntryList::const_reverse_iterator;
+
+    explicit LRUCacheStorage(size_t /* max_size */) noexcept(
+        std::is_nothrow_default_constructible<EntryList>::value &&
+        std::is_nothrow_default_constructible<KeyTable>::value)
+    {}
+
+    ~LRUCacheStorage() = default;
+
+    DISALLOW_COPY(LRUCacheStorage);
+
+    DEFAULT_MOVE(LRUCacheStorage);
+
+    const_iterator find(const key_view_type& key) const
+    {
+        auto key_it = key_table_.find(key);
+        return key_it == key_table_.end() ? entries_.end() : key_it->second;
+    }
+
+    iterator find(const key_view_type& key)
+    {
+        auto key_it = key_table_.find(key);
+        return key_it == key_table_.end() ? entries_.end() : key_it->second;
+    }
+
+    // Inserts an entry before `pos`, and `key` must not exist.
+    template<typename EntryType>
+    iterator Insert(const_iterator pos, const Key& key, EntryType&& entry)
+    {
+        auto entry_it = entries_.emplace(pos, key, std::forward<EntryType>(entry));
+        key_table_.insert({key_view_type(entry_it->first), entry_it});
+        return entry_it;
+    }
+
+    // Moves the entry at `entry_pos` to before `pos`.
+    void Move(const_iterator pos, const_iterator entry_pos) noexcept
+    {
+        entries_.splice(pos, entries_, entry_pos);
+    }
+
+    iterator erase(const_iterator pos)
+    {
+        key_table_.erase(key_view_type(pos->first));
+        return entries_.erase(pos);
+    }
+
+    LRUCacheEntryMetadata& metadata(const_iterator pos) noexcept
+    {
+        return const_cast<Node&>(*pos).metadata;
+    }
+
+    // Returns the iterator in this storage for the `pos` from the storage moved into it.
+    iterator Rebind(const_iterator pos) noexcept
+    {
+        return entries_.erase(pos, pos);
+    }
+
+    size_t size() const noexcept
+    {
+        return entries_.size();
+    }
+
+    iterator begin() noexcept { return entries_.begin(); }
+
+    const_iterator begin() const noexcept { return entries_.begin(); }
+
+    iterator end() noexcept { return entries_.end(); }
+
+    const_iterator end() const noexcept { return entries_.end(); }
+
+private:
+    EntryList entries_;
+    KeyTable key_table_;
+};
+
+// Entries are kept in a pool of fixed-size blocks, and are linked by indices rather than
+// pointers; keys are indexed by an open-addressing hash table of entry indices.
+// Each key is stored only once, and entries freed are reused, thus no allocation happens
+// once the pool and the hash table have grown for the maximum size.
+template<typename Key, typename Entry>
+class LRUCacheStorage<Key, Entry, PooledHashMap> {
+public:
+    using key_type = Key;
+    using key_view_type = typename LRUCacheKeyView<Key>::type;
+    using value_type = std::pair<const Key, Entry>;
+
+private:
+    using IndexType = uint32_t;
+
+    static constexpr IndexType kNullIndex = std::numeric_limits<IndexType>::max();
+
+    struct Node {
+        typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type storage;
+        uint64_t hash;
+        IndexType prev;
+        IndexType next;
+        LRUCacheEntryMetadata metadata;
+
+        value_type& value() noexcept
+        {
+            return *reinterpret_cast<value_type*>(&storage);
+        }
+    };
+
+    template<typename ValueType>
+    class Iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = typename std::remove_const<ValueType>::type;
+        using difference_type = ptrdiff_t;
+        using pointer = ValueType*;
+        using reference = ValueType&;
+
+        Iterator() noexcept
+            : storage_(nullptr), index_(kNullIndex)
+        {}
+
+        // Converts an iterator into a const_iterator.
+        template<typename Other,
+                 typename = std::enable_if_t<std::is_convertible<Other*, ValueType*>::value>>
+        Iterator(const Iterator<Other>& other) noexcept
+            : storage_(other.storage_), index_(other.index_)
+        {}
+
+        reference operator*() const noexcept
+        {
+            return storage_->node(index_).value();
+        }
+
+        pointer operator->() const noexcept
+        {
+            return &storage_->node(index_).value();
+        }
+
+        Iterator& operator++() noexcept
+        {
+            index_ = storage_->node(index_).next;
+            return *this;
+        }
+
+        Iterator operator++(int) noexcept
+        {
+            auto self = *this;
+            ++*this;
+            return self;
+        }
+
+        Iterator& operator--() noexcept
+        {
+            index_ = index_ == kNullIndex ? storage_->tail_ : storage_->node(index_).prev;
+            return *this;
+        }
+
+        Iterator operator--(int) noexcept
+        {
+            auto self = *this;
+            --*this;
+            return self;
+        }
+
+        friend bool operator==(const Iterator& lhs, const Iterator& rhs) noexcept
+        {
+            return lhs.index_ == rhs.index_;
+        }
+
+        friend bool operator!=(const Iterator& lhs, const Iterator& rhs) noexcept
+        {
+            return !(lhs == rhs);
+        }
+
+    private:
+        Iterator(const LRUCacheStorage* storage, IndexType index) noexcept
+            : storage_(storage), index_(index)
+        {}
+
+        friend class LRUCacheStorage;
+
+        template<typename>
+        friend class Iterator;
+
+    private:
+        const LRUCacheStorage* storage_;
+        IndexType index_;
+    };
+
+public:
+    using iterator = Iterator<value_type>;
+    using const_iterator = Iterator<const value_type>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    // A cache with a small maximum size lives in a single block.
+    explicit LRUCacheStorage(size_t max_size) noexcept
+        : block_shift_(kMinBlockShift),
+          used_count_(0),
+          free_head_(kNullIndex),
+          head_(kNullIndex),
+          tail_(kNullIndex),
+          size_(0),
+          slot_shift_(0)
+    {
+        while (block_shift_ < kMaxBlockShift && (size_t(1) << block_shift_) < max_size) {
+            ++block_shift_;
+        }
+    }
+
+    LRUCacheStorage(LRUCacheStorage&& other) noexcept
+        : LRUCacheStorage(0)
+    {
+        swap(other);
+    }
+
+    // `rhs` is left empty, as std::list does.
+    LRUCacheStorage& operator=(LRUCacheStorage&& rhs) noexcept
+    {
+        if (this != &rhs) {
+            LRUCacheStorage storage(std::move(rhs));
+            swap(storage);
+        }
+
+        return *this;
+    }
+
+    ~LRUCacheStorage()
+    {
+        for (auto index = head_; index != kNullIndex; index = node(index).next) {
+            node(index).value().~value_type();
+        }
+    }
+
+    DISALLOW_COPY(LRUCacheStorage);
+
+    const_iterator find(const key_view_type& key) const
+    {
+        return const_iterator(this, FindIndex(key));
+    }
+
+    iterator find(const key_view_type& key)
+    {
+        return iterator(this, FindIndex(key));
+    }
+
+    // Inserts an entry before `pos`, and `key` must not exist.
+    template<typename EntryType>
+    iterator Insert(const_iterator pos, const Key& key, EntryType&& entry)
+    {
+        // Keeps the load factor no more than 3/4.
+        if ((size_ + 1) * 4 > slots_.size() * 3) {
+            Rehash(std::max<size_t>(slots_.size() * 2, 16));
+        }
+
+        auto index = AllocateNode();
+        auto& new_node = node(index);
+        try {
+            new (&new_node.storage) value_type(key, std::forward<EntryType>(entry));
+        } catch (...) {
+            FreeNode(index);
+            throw;
+        }
+
+        new_node.hash = HashKey(new_node.value().first);
+        new_node.metadata = LRUCacheEntryMetadata();
+        Link(index, pos.index_);
+        InsertSlot(index);
+        ++size_;
+
+        return iterator(this, index);
+    }
+
+    // Moves the entry at `entry_pos` to before `pos`.
+    void Move(const_iterator pos, const_iterator entry_pos) noexcept
+    {
+        if (pos.index_ != entry_pos.index_) {
+            Unlink(entry_pos.index_);
+            Link(entry_pos.index_, pos.index_);
+        }
+    }
+
+    iterator erase(const_iterator pos)
+    {
+        auto index = pos.index_;
+        auto next = node(index).next;
+        EraseSlot(index);
+        Unlink(index);
+        node(index).value().~value_type();
+        FreeNode(index);
+        --size_;
+
+        return iterator(this, next);
+    }
+
+    LRUCacheEntryMetadata& metadata(const_iterator pos) noexcept
+    {
+        return node(pos.index_).metadata;
+    }
+
+    // Returns the iterator in this storage for the `pos` from the storage moved into it.
+    iterator Rebind(const_iterator pos) noexcept
+    {
+        return iterator(this, pos.index_);
+    }
+
+    size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    iterator begin() noexcept { return iterator(this, head_); }
+
+    const_iterator begin() const noexcept { return const_iterator(this, head_); }
+
+    iterator end() noexcept { return iterator(this, kNullIndex); }
+
+    const_iterator end() const noexcept { return const_iterator(this, kNullIndex); }
+
+private:
+    static constexpr size_t kMinBlockShift = 4;
+    static constexpr size_t kMaxBlockShift = 12;
+
+    Node& node(IndexType index) const noexcept
+    {
+        return blocks_[index >> block_shift_][index & ((IndexType(1) << block_shift_) - 1)];
+    }
+
+    // The hash is mixed, and the table uses its high bits.
+    static uint64_t HashKey(const key_view_type& key)
+    {
+        auto hash = std::hash<key_view_type>()(key);
+        return static_cast<uint64_t>(hash) * UINT64_C(0x9E3779B97F4A7C15);
+    }
+
+    IndexType AllocateNode()
+    {
+        if (free_head_ != kNullIndex) {
+            auto index = free_head_;
+            free_head_ = node(index).next;
+            return index;
+        }
+
+        size_t block_size = size_t(1) << block_shift_;
+        if (used_count_ == blocks_.size() * block_size) {
+            ENSURE(CHECK, used_count_ + block_size < kNullIndex)(used_count_).Require();
+            blocks_.push_back(std::make_unique<Node[]>(block_size));
+        }
+
+        return static_cast<IndexType>(used_count_++);
+    }
+
+    void FreeNode(IndexType index) noexcept
+    {
+        node(index).next = free_head_;
+        free_head_ = index;
+    }
+
+    // Links the node before the node at `pos`.
+    void Link(IndexType index, IndexType pos) noexcept
+    {
+        auto& linked = node(index);
+        linked.next = pos;
+        linked.prev = pos == kNullIndex ? tail_ : node(pos).prev;
+        (linked.prev == kNullIndex ? head_ : node(linked.prev).next) = index;
+        (pos == kNullIndex ? tail_ : node(pos).prev) = index;
+    }
+
+    void Unlink(IndexType index) noexcept
+    {
+        auto& unlinked = node(index);
+        (unlinked.prev == kNullIndex ? head_ : node(unlinked.prev).next) = unlinked.next;
+        (unlinked.next == kNullIndex ? tail_ : node(unlinked.next).prev) = unlinked.prev;
+    }
+
+    IndexType FindIndex(const key_view_type& key) const
+    {
+        if (size_ == 0) {
+            return kNullIndex;
+        }
+
+        auto hash = HashKey(key);
+        size_t mask = slots_.size() - 1;
+        for (size_t i = hash >> slot_shift_; slots_[i] != kNullIndex; i = (i + 1) & mask) {
+            auto& candidate = node(slots_[i]);
+            if (candidate.hash == hash &&
+                std::equal_to<key_view_type>()(candidate.value().first, key)) {
+                return slots_[i];
+            }
+        }
+
+        return kNullIndex;
+    }
+
+    void InsertSlot(IndexType index) noexcept
+    {
+        size_t mask = slots_.size() - 1;
+        size_t i = node(index).hash >> slot_shift_;
+        while (slots_[i] != kNullIndex) {
+            i = (i + 1) & mask;
+        }
+
+        slots_[i] = index;
+    }
+
+    // Uses backward shift deletion, so that no tombstone is left.
+    void EraseSlot(IndexType index) noexcept
+    {
+        size_t mask = slots_.size() - 1;
+        size_t hole = node(index).hash >> slot_shift_;
+        while (slots_[hole] != index) {
+            hole = (hole + 1) & mask;
+        }
+
+        for (size_t i = (hole + 1) & mask; slots_[i] != kNullIndex; i = (i + 1) & mask) {
+            // The entry can fill the hole, unless its home slot lies in (hole, i].
+            size_t home = node(slots_[i]).hash >> slot_shift_;
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                slots_[hole] = slots_[i];
+                hole = i;
+            }
+        }
+
+        slots_[hole] = kNullIndex;
+    }
+
+    void Rehash(size_t slot_count)
+    {
+        std::vector<IndexType> slots(slot_count, kNullIndex);
+        slots_.swap(slots);
+        slot_shift_ = 64;
+        for (size_t count = slot_count; count > 1; count >>= 1) {
+            --slot_shift_;
+        }
+
+        for (auto index = head_; index != kNullIndex; index = node(index).next) {
+            InsertSlot(index);
+        }
+    }
+
+    void swap(LRUCacheStorage& other) noexcept
+    {
+        using std::swap;
+        swap(blocks_, other.blocks_);
+        swap(block_shift_, other.block_shift_);
+        swap(used_count_, other.used_count_);
+        swap(free_head_, other.free_head_);
+        swap(head_, other.head_);
+        swap(tail_, other.tail_);
+        swap(size_, other.size_);
+        swap(slots_, other.slots_);
+        swap(slot_shift_, other.slot_shift_);
+    }
+
+private:
+    std::vector<std::unique_ptr<Node[]>> blocks_;
+    size_t block_shift_;
+    size_t used_count_;
+    IndexType free_head_;
+    IndexType head_;
+    IndexType tail_;
+    size_t size_;
+    std::vector<IndexType> slots_;
+    size_t slot_shift_;
+};
+
+template<typename Key, typename Entry>
+constexpr typename LRUCacheStorage<Key, Entry, PooledHashMap>::IndexType
+    LRUCacheStorage<Key, Entry, PooledHashMap>::kNullIndex;
+
+template<typename Key, typename Entry>
+constexpr size_t LRUCacheStorage<Key, Entry, PooledHashMap>::kMinBlockShift;
+
+template<typename Key, typename Entry>
+constexpr size_t LRUCacheStorage<Key, Entry, PooledHashMap>::kMaxBlockShift;
+
+// A count-min sketch of access frequencies, whose counters saturate at 15 and are halved
+// periodically, so that the estimates favor recent accesses.
+class FrequencySketch {
+public:
+    // Each row has at least twice as many counters as entries, i.e. 8 bytes per entry.
+    explicit FrequencySketch(size_t entry_count)
+        : width_(64), width_shift_(58), addition_count_(0)
+    {
+        while (width_ < entry_count * 2) {
+            width_ <<= 1;
+            --width_shift_;
+        }
+
+        counters_.assign(width_ * kDepth, 0);
+        sample_size_ = width_ * 10;
+    }
+
+    // Grows for `entry_count` entries, and counts are reset on growth.
+    // An estimate is still good enough if the sketch failed to grow.
+    void EnsureCapacity(size_t entry_count) noexcept
+    {
+        if (width_ >= entry_count * 2) {
+            return;
+        }
+
+        size_t new_width = width_;
+        size_t new_width_shift = width_shift_;
+        while (new_width < entry_count * 2) {
+            new_width <<= 1;
+            --new_width_shift;
+        }
+
+        try {
+            std::vector<uint8_t> counters(new_width * kDepth, 0);
+            counters_.swap(counters);
+        } catch (const std::bad_alloc&) {
+            return;
+        }
+
+        width_ = new_width;
+        width_shift_ = new_width_shift;
+        addition_count_ = 0;
+        sample_size_ = width_ * 10;
+    }
+
+    void Increment(uint64_t hash) noexcept
+    {
+        if (counters_.empty()) {
+            return;
+        }
+
+        // Conservative update only increments the minimal counters, which reduces
+        // overestimation.
+        uint8_t* counters[kDepth];
+        uint8_t min_count = kMaxCount;
+        for (size_t row = 0; row < kDepth; ++row) {
+            counters[row] = &counters_[GetCounterIndex(row, hash)];
+            min_count = std::min(min_count, *counters[row]);
+        }
+
+        if (min_count == kMaxCount) {
+            return;
+        }
+
+        for (auto counter : counters) {
+            if (*counter == min_count) {
+                ++*counter;
+            }
+        }
+
+        if (++addition_count_ == sample_size_) {
+            Age();
+        }
+    }
+
+    uint8_t Estimate(uint64_t hash) const noexcept
+    {
+        if (counters_.empty()) {
+            return 0;
+        }
+
+        uint8_t min_count = kMaxCount;
+        for (size_t row = 0; row < kDepth; ++row) {
+            min_count = std::min(min_count, counters_[GetCounterIndex(row, hash)]);
+        }
+
+        return min_count;
+    }
+
+    void Clear() noexcept
+    {
+        std::fill(counters_.begin(), counters_.end(), uint8_t(0));
+        addition_count_ = 0;
+    }
+
+private:
+    static constexpr size_t kDepth = 4;
+    static constexpr uint8_t kMaxCount = 15;
+
+    size_t GetCounterIndex(size_t row, uint64_t hash) const noexcept
+    {
+        // Each row projects the hash with a distinct odd multiplier, and uses high bits.
+        static constexpr uint64_t kSeeds[kDepth] {
+            UINT64_C(0x9E3779B97F4A7C15), UINT64_C(0xC2B2AE3D27D4EB4F),
+            UINT64_C(0x165667B19E3779F9), UINT64_C(0xD6E8FEB86659FD93)
+        };
+
+        return row * width_ + static_cast<size_t>((hash * kSeeds[row]) >> width_shift_);
+    }
+
+    void Age() noexcept
+    {
+        for (auto& count : counters_) {
+            count >>= 1;
+        }
+
+        addition_count_ /= 2;
+    }
+
+private:
+    std::vector<uint8_t> counters_;
+    size_t width_;
+    size_t width_shift_;
+    size_t addition_count_;
+    size_t sample_size_;
+};
+
+// Default hooks of eviction policies, each of which is called by LRUCache, and can be
+// hidden by a policy.
+template<typename Storage>
+class EvictionPolicyBase {
+public:
+    using key_view_type = typename Storage::key_view_type;
+    using iterator = typename Storage::iterator;
+    using const_iterator = typename Storage::const_iterator;
+
+    // Called on the moved-from policy, whose storage has been emptied.
+    void Reset() noexcept
+    {}
+
+    // Called after the storage and the policy have been moved.
+    void OnMove(Storage& /* storage */) noexcept
+    {}
+
+    // Called on every Get() and Put().
+    void OnLookup(const key_view_type& /* key */) noexcept
+    {}
+
+    const_iterator InsertPosition(Storage& storage) noexcept
+    {
+        return storage.end();
+    }
+
+    void OnInsert(Storage& /* storage */, iterator /* pos */) noexcept
+    {}
+
+    void OnAccess(Storage& /* storage */, iterator /* pos */) noexcept
+    {}
+
+    // The storage is not empty.
+    iterator SelectVictim(Storage& storage) noexcept
+    {
+        return storage.begin();
+    }
+
+    // Returns false if `candidate` should not be cached in place of `victim`.
+    bool Admit(const key_view_type& /* candidate */, const_iterator /* victim */) noexcept
+    {
+        return true;
+    }
+
+    void OnErase(Storage& /* storage */, const_iterator /* pos */) noexcept
+    {}
+};
+
+}   // namespace internal
+
+// Eviction policies for LRUCache.
+// Each of them defines a nested `Policy` template parameterized by the storage type, just
+// like `MapType` of TreeMap and HashMap.
+// A policy is constructed with the maximum number of entries, which is 0 if the number is
+// unbounded or unknown, e.g. when the cache weighs entries.
+
+// Evicts the least recently used entry, and iteration is from the least to the most
+// recently used entry.
+struct LRUEviction {
+    template<typename Storage>
+    class Policy : public internal::EvictionPolicyBase<Storage> {
+    public:
+        using typename internal::EvictionPolicyBase<Storage>::iterator;
+
+        explicit Policy(size_t /* max_size */) noexcept
+        {}
+
+        void OnAccess(Storage& storage, iterator pos) noexcept
+        {
+            storage.Move(storage.end(), pos);
+        }
+    };
+};
+
+// Segmented LRU splits entries into a probationary segment and a protected one.
+// New entries enter the probationary segment, and are promoted to the protected segment
+// when accessed again; entries overflowing from the protected segment are demoted back
+// to the most recently used end of the probationary segment, which is where victims come
+// from. Thus entries accessed only once, e.g. by a scan, can't flush entries of the hot
+// set out.
+// Iteration is over the probationary segment and then the protected one, both from the
+// least to the most recently used.
+struct SegmentedLRUEviction {
+    template<typename Storage>
+    class Policy : public internal::EvictionPolicyBase<Storage> {
+    public:
+        using typename internal::EvictionPolicyBase<Storage>::iterator;
+        using typename internal::EvictionPolicyBase<Storage>::const_iterator;
+
+        // The protected segment takes 80% of the capacity, or of entries cached if the
+        // maximum number of entries is unknown.
+        explicit Policy(size_t max_entry_count) noexcept
+            : protected_capacity_(max_entry_count / 5 * 4),
+              protected_count_(0)
+        {}
+
+        void Reset() noexcept
+        {
+            protected_count_ = 0;
+        }
+
+        void OnMove(Storage& storage) noexcept
+        {
+            if (protected_count_ != 0) {
+                boundary_ = storage.Rebind(boundary_);
+            }
+        }
+
+        const_iterator InsertPosition(Storage& storage) noexcept
+        {
+            return protected_count_ == 0 ? storage.end() : boundary_;
+        }
+
+        void OnAccess(Storage& storage, iterator pos) noexcept
+        {
+            if (storage.metadata(pos).tag == kProtected) {
+                if (pos == boundary_ && ++boundary_ == storage.end()) {
+                    // The only protected entry.
+                    boundary_ = pos;
+                    return;
+                }
+
+                storage.Move(storage.end(), pos);
+                return;
+            }
+
+            storage.metadata(pos).tag = kProtected;
+            storage.Move(storage.end(), pos);
+            if (protected_count_++ == 0) {
+                boundary_ = pos;
+            }
+
+            if (protected_count_ > GetProtectedCapacity(storage)) {
+                storage.metadata(boundary_).tag = kProbationary;
+                ++boundary_;
+                --protected_count_;
+            }
+        }
+
+        void OnErase(Storage& storage, const_iterator pos) noexcept
+        {
+            if (storage.metadata(pos).tag == kProtected) {
+                if (pos == boundary_) {
+                    ++boundary_;
+                }
+
+                --protected_count_;
+            }
+        }
+
+    private:
+        size_t GetProtectedCapacity(const Storage& storage) const noexcept
+        {
+            return std::max<size_t>(protected_capacity_ != 0 ? protected_capacity_ :
+                                                               storage.size() / 5 * 4,
+                                    1);
+        }
+
+    private:
+        static constexpr uint8_t kProbationary = 0;
+        static constexpr uint8_t kProtected = 1;
+
+        // Zero if it follows the number of entries cached.
+        size_t protected_capacity_;
+        size_t protected_count_;
+        // The least recently used entry in the protected segment, if any.
+        iterator boundary_;
+    };
+};
+
+// CLOCK approximates LRU without reordering entries on access, which merely sets the
+// referenced bit of the entry. To find a victim, the clock hand sweeps entries in a
+// circle and clears their referenced bits, until it meets an entry not referenced.
+// Iteration is in the order of insertion, starting from an arbitrary position.
+struct ClockEviction {
+    template<typename Storage>
+    class Policy : public internal::EvictionPolicyBase<Storage> {
+    public:
+        using typename internal::EvictionPolicyBase<Storage>::iterator;
+        using typename internal::EvictionPolicyBase<Storage>::const_iterator;
+
+        explicit Policy(size_t /* max_size */) noexcept
+            : has_hand_(false)
+        {}
+
+        void Reset() noexcept
+        {
+            has_hand_ = false;
+        }
+
+        void OnMove(Storage& storage) noexcept
+        {
+            if (has_hand_) {
+                hand_ = storage.Rebind(hand_);
+            }
+        }
+
+        // New entries are examined last.
+        const_iterator InsertPosition(Storage& storage) noexcept
+        {
+            return has_hand_ ? hand_ : storage.end();
+        }
+
+        void OnInsert(Storage& /* storage */, iterator pos) noexcept
+        {
+            if (!has_hand_) {
+                hand_ = pos;
+                has_hand_ = true;
+            }
+        }
+
+        void OnAccess(Storage& storage, iterator pos) noexcept
+        {
+            storage.metadata(pos).tag = kReferenced;
+        }
+
+        iterator SelectVictim(Storage& storage) noexcept
+        {
+            while (storage.metadata(hand_).tag == kReferenced) {
+                storage.metadata(hand_).tag = 0;
+                Advance(storage);
+            }
+
+            return hand_;
+        }
+
+        void OnErase(Storage& storage, const_iterator pos) noexcept
+        {
+            if (pos == hand_) {
+                has_hand_ = storage.size() > 1;
+                Advance(storage);
+            }
+        }
+
+    private:
+        void Advance(Storage& storage) noexcept
+        {
+            if (++hand_ == storage.end()) {
+                hand_ = storage.begin();
+            }
+        }
+
+    private:
+        static constexpr uint8_t kReferenced = 1;
+
+        bool has_hand_;
+        iterator hand_;
+    };
+};
+
+// TinyLFU admits a new entry only if it is accessed more frequently than the victim it
+// would replace, and access frequencies of both cached and non-cached keys are estimated
+// by a count-min sketch. It works on top of another eviction policy, which selects victims.
+// Put() returns end() if the entry is not admitted. Views of keys must have std::hash.
+template<typename EvictionPolicy = SegmentedLRUEviction>
+struct TinyLFUAdmission {
+    template<typename Storage>
+    class Policy : public EvictionPolicy::template Policy<Storage> {
+    private:
+        using BasePolicy = typename EvictionPolicy::template Policy<Storage>;
+
+    public:
+        using typename BasePolicy::key_view_type;
+        using typename BasePolicy::iterator;
+        using typename BasePolicy::const_iterator;
+
+        explicit Policy(size_t max_entry_count)
+            : BasePolicy(max_entry_count), sketch_(max_entry_count)
+        {}
+
+        void Reset() noexcept
+        {
+            BasePolicy::Reset();
+            sketch_.Clear();
+        }
+
+        void OnLookup(const key_view_type& key) noexcept
+        {
+            BasePolicy::OnLookup(key);
+            sketch_.Increment(std::hash<key_view_type>()(key));
+        }
+
+        // The sketch grows with entries, if their maximum number is unknown.
+        void OnInsert(Storage& storage, iterator pos) noexcept
+        {
+            BasePolicy::OnInsert(storage, pos);
+            sketch_.EnsureCapacity(storage.size());
+        }
+
+        bool Admit(const key_view_type& candidate, const_iterator victim) noexcept
+        {
+            return BasePolicy::Admit(candidate, victim) &&
+                   sketch_.Estimate(std::hash<key_view_type>()(candidate)) >
+                       sketch_.Estimate(std::hash<key_view_type>()(victim->first));
+        }
+
+    private:
+        internal::FrequencySketch sketch_;
+    };
+};
+
+// Why an entry is evicted from LRUCache.
+enum class EvictionCause {
+    // Evicted for the capacity, including by Evict().
+    Capacity,
+    // Its time-to-live has elapsed.
+    Expired,
+    // Its entry is replaced by Put().
+    Replaced
+};
+
+// A snapshot of statistics of a cache, which can be dumped into logs.
+struct LRUCacheStatsSnapshot {
+    // Bucket 0 counts entries never hit since cached, and bucket i counts entries hit
+    // [2^(i-1), 2^i) times.
+    static constexpr size_t kFrequencyBucketCount = 17;
+
+    LRUCacheStatsSnapshot() noexcept
+        : hits(0), misses(0), inserts(0), updates(0), rejections(0), capacity_evictions(0),
+          expirations(0), size(0), weight(0), max_size(0), sampled_entry_count(0),
+          access_frequencies()
+    {}
+
+    double hit_rate() const noexcept
+    {
+        auto lookups = hits + misses;
+        return lookups == 0 ? 0.0 : static_cast<double>(hits) / lookups;
+    }
+
+    LRUCacheStatsSnapshot& operator+=(const LRUCacheStatsSnapshot& rhs) noexcept
+    {
+        hits += rhs.hits;
+        misses += rhs.misses;
+        inserts += rhs.inserts;
+        updates += rhs.updates;
+        rejections += rhs.rejections;
+        capacity_evictions += rhs.capacity_evictions;
+        expirations += rhs.expirations;
+        size += rhs.size;
+        weight += rhs.weight;
+        max_size += rhs.max_size;
+        sampled_entry_count += rhs.sampled_entry_count;
+        for (size_t i = 0; i < kFrequencyBucketCount; ++i) {
+            access_frequencies[i] += rhs.access_frequencies[i];
+        }
+
+        return *this;
+    }
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t updates;
+    // Entries not cached, as they are heavier than the capacity, or are not admitted.
+    uint64_t rejections;
+    uint64_t capacity_evictions;
+    uint64_t expirations;
+    size_t size;
+    size_t weight;
+    size_t max_size;
+    // The histogram of hits of sampled entries.
+    size_t sampled_entry_count;
+    std::array<size_t, kFrequencyBucketCount> access_frequencies;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const LRUCacheStatsSnapshot& stats)
+{
+    os << "hits: " << stats.hits << ", misses: " << stats.misses
+       << ", hit rate: " << stats.hit_rate() * 100 << "%, inserts: " << stats.inserts
+       << ", updates: " << stats.updates << ", rejections: " << stats.rejections
+       << ", capacity evictions: " << stats.capacity_evictions
+       << ", expirations: " << stats.expirations << ", size: " << stats.size
+       << ", weight: " << stats.weight << "/" << stats.max_size
+       << ", access frequencies of " << stats.sampled_entry_count << " samples: {";
+    for (size_t i = 0; i < LRUCacheStatsSnapshot::kFrequencyBucketCount; ++i) {
+        if (stats.access_frequencies[i] == 0) {
+            continue;
+        }
+
+        if (i < 2) {
+            os << " " << i;
+        } else {
+            os << " " << (size_t(1) << (i - 1)) << "-" << (size_t(1) << i) - 1;
+        }
+
+        os << ": " << stats.access_frequencies[i];
+    }
+
+    return os << " }";
+}
+
+// Statistics collectors for LRUCache, which are notified of each operation.
+
+// Collects nothing, and costs nothing.
+struct NoLRUCacheStats {
+    static constexpr bool kEnabled = false;
+
+    void OnHit(internal::LRUCacheEntryMetadata& /* metadata */) noexcept
+    {}
+
+    void OnMiss() noexcept
+    {}
+
+    void OnInsert() noexcept
+    {}
+
+    void OnUpdate() noexcept
+    {}
+
+    void OnReject() noexcept
+    {}
+
+    void OnEvict(EvictionCause /* cause */) noexcept
+    {}
+
+    void Reset() noexcept
+    {}
+
+    void Fill(LRUCacheStatsSnapshot& /* snapshot */) const noexcept
+    {}
+};
+
+// Counts operations, and hits of each entry.
+class LRUCacheStats {
+public:
+    static constexpr bool kEnabled = true;
+
+    LRUCacheStats() noexcept
+        : hits_(0), misses_(0), inserts_(0), updates_(0), rejections_(0),
+          capacity_evictions_(0), expirations_(0)
+    {}
+
+    void OnHit(internal::LRUCacheEntryMetadata& metadata) noexcept
+    {
+        ++hits_;
+        if (metadata.access_count != std::numeric_limits<uint16_t>::max()) {
+            ++metadata.access_count;
+        }
+    }
+
+    void OnMiss() noexcept
+    {
+        ++misses_;
+    }
+
+    void OnInsert() noexcept
+    {
+        ++inserts_;
+    }
+
+    void OnUpdate() noexcept
+    {
+        ++updates_;
+    }
+
+    void OnReject() noexcept
+    {
+        ++rejections_;
+    }
+
+    void OnEvict(EvictionCause cause) noexcept
+    {
+        if (cause == EvictionCause::Capacity) {
+            ++capacity_evictions_;
+        } else if (cause == EvictionCause::Expired) {
+            ++expirations_;
+        }
+    }
+
+    void Reset() noexcept
+    {
+        *this = LRUCacheStats();
+    }
+
+    void Fill(LRUCacheStatsSnapshot& snapshot) const noexcept
+    {
+        snapshot.hits = hits_;
+        snapshot.misses = misses_;
+        snapshot.inserts = inserts_;
+        snapshot.updates = updates_;
+        snapshot.rejections = rejections_;
+        snapshot.capacity_evictions = capacity_evictions_;
+        snapshot.expirations = expirations_;
+    }
+
+private:
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t inserts_;
+    uint64_t updates_;
+    uint64_t rejections_;
+    uint64_t capacity_evictions_;
+    uint64_t expirations_;
+};
+
 // A cache container that allows O(logn)-time, i.e. TreeMap-based implementation,
 // or O(1)-time, i.e. HashMap-based implementation, access to entries using a key.
+// PooledHashMap-based implementation is also O(1)-time, and is more cache-friendly and
+// allocates far less, but its iterators are invalidated when the cache is moved.
 // If auto eviction is enabled, LRU-replacement algorithm would be employed when
-// the cache runs out its free storage.
-template<typename Key, typename Entry, template<typename, typename> class Map = TreeMap>
+// the cache runs out its free storage; and another algorithm can be employed by
+// `EvictionPolicy`, see above.
+// The capacity is the number of entries by default, or the total weight of entries given
+// by a weigher, e.g. their sizes in bytes.
+// Entries can also expire after their time-to-live. An expired entry is removed when it is
+// accessed via Get(), or swept gradually by Put(), and before its removal, it still
+// counts in size() and is visible to iteration, but not to find().
+// Entries with std::string or std::wstring keys can be looked up by StringView or WStringView,
+// or anything convertible, without creating a temporary key.
+// Statistics are collected only if `Stats` is LRUCacheStats.
+template<typename Key, typename Entry, template<typename, typename> class Map = TreeMap,
+         typename EvictionPolicy = LRUEviction, typename Stats = NoLRUCacheStats>
 class LRUCache {
-public:
-    using key_type = Key;
-    using value_type = std::pair<const Key, Entry>;
-
 private:
-    using CachedEntryList = std::list<value_type>;
-    using KeyTable = typename Map<Key, typename CachedEntryList::iterator>::MapType;
+    using Storage = internal::LRUCacheStorage<Key, Entry, Map>;
+    using Policy = typename EvictionPolicy::template Policy<Storage>;
 
 public:
+    using key_type = Key;
+    // Keys are looked up by this type, e.g. StringView for std::string keys.
+    using key_view_type = typename Storage::key_view_type;
+    using value_type = std::pair<const Key, Entry>;
     using size_type = size_t;
-    using iterator = typename CachedEntryList::iterator;
-    using const_iterator = typename CachedEntryList::const_iterator;
-    using reverse_iterator = typename CachedEntryList::reverse_iterator;
-    using const_reverse_iterator = typename CachedEntryList::const_reverse_iterator;
+    using iterator = typename Storage::iterator;
+    using const_iterator = typename Storage::const_iterator;
+    using reverse_iterator = typename Storage::reverse_iterator;
+    using const_reverse_iterator = typename Storage::const_reverse_iterator;
+    using Clock = std::chrono::steady_clock;
+    using TimeToLive = Clock::duration;
+    // Weights must not change while entries are cached.
+    using Weigher = std::function<size_type(const Key&, const Entry&)>;
+    // Called right before an entry is evicted, and must not modify the cache.
+    // Entries erased via erase() are not notified.
+    using EvictionCallback = std::function<void(const Key&, Entry&, EvictionCause)>;
 
     enum : size_type {
         NoAutoEvict = 0
     };
 
     explicit LRUCache(size_type max_size) noexcept(
-        std::is_nothrow_default_constructible<CachedEntryList>::value &&
-        std::is_nothrow_default_constructible<KeyTable>::value)
-        : max_size_(max_size)
+        std::is_nothrow_constructible<Storage, size_type>::value &&
+        std::is_nothrow_constructible<Policy, size_type>::value)
+        : LRUCache(max_size, max_size, WithMaxEntryCount())
     {}
 
-    LRUCache(LRUCache&& other) noexcept(
-        std::is_nothrow_move_constructible<CachedEntryList>::value &&
-        std::is_nothrow_move_constructible<KeyTable>::value)
+    // The capacity `max_weight` is the maximum total weight of entries.
+    // Since the number of entries is unknown, the storage and the eviction policy grow with
+    // entries cached.
+    LRUCache(size_type max_weight, Weigher weigher)
+        : LRUCache(max_weight, 0, WithMaxEntryCount())
+    {
+        weigher_ = std::move(weigher);
+    }
+
+    LRUCache(LRUCache&& other) noexcept(std::is_nothrow_move_constructible<Storage>::value &&
+                                        std::is_nothrow_move_constructible<Policy>::value)
         : max_size_(other.max_size_),
-          entry_ordering_list_(std::move(other.entry_ordering_list_)),
-          key_table_(std::move(other.key_table_))
-    {}
+          storage_(std::move(other.storage_)),
+          policy_(std::move(other.policy_)),
+          weigher_(std::move(other.weigher_)),
+          eviction_callback_(std::move(other.eviction_callback_)),
+          total_weight_(other.total_weight_),
+          default_time_to_live_(other.default_time_to_live_),
+          has_expiry_(other.has_expiry_),
+          has_sweep_pos_(other.has_sweep_pos_),
+          stats_(other.stats_)
+    {
+        OnMoved(other);
+    }
 
-    LRUCache& operator=(LRUCache&& rhs) noexcept(
-        std::is_nothrow_move_assignable<CachedEntryList>::value &&
-        std::is_nothrow_move_assignable<KeyTable>::value)
+    LRUCache& operator=(LRUCache&& rhs) noexcept(std::is_nothrow_move_assignable<Storage>::value &&
+                                                 std::is_nothrow_move_assignable<Policy>::value)
     {
         if (this != &rhs) {
-            entry_ordering_list_ = std::move(rhs.entry_ordering_list_);
-            key_table_ = std::move(rhs.key_table_);
+            storage_ = std::move(rhs.storage_);
+            policy_ = std::move(rhs.policy_);
+            weigher_ = std::move(rhs.weigher_);
+            eviction_callback_ = std::move(rhs.eviction_callback_);
+            total_weight_ = rhs.total_weight_;
+            default_time_to_live_ = rhs.default_time_to_live_;
+            has_expiry_ = rhs.has_expiry_;
+            has_sweep_pos_ = rhs.has_sweep_pos_;
+            stats_ = rhs.stats_;
+            OnMoved(rhs);
             // Work-around for assigning to a const variable.
             size_type* new_max_size = const_cast<size_type*>(&max_size_);
             *new_max_size = rhs.max_size_;
@@ -88,35 +1309,72 @@ public:
 
     DISALLOW_COPY(LRUCache);
 
+    void set_eviction_callback(EvictionCallback callback)
+    {
+        eviction_callback_ = std::move(callback);
+    }
+
+    // Applies to entries put without their own time-to-live afterwards.
+    // TimeToLive::max() means never expiring, and is the default.
+    void set_default_time_to_live(TimeToLive time_to_live) noexcept
+    {
+        default_time_to_live_ = time_to_live;
+    }
+
+    TimeToLive default_time_to_live() const noexcept
+    {
+        return default_time_to_live_;
+    }
+
     // Add a pair of <key, entry> into the cache. If the key already exists, update
     // the entry.
     // If auto-eviction is enabled for the cache, and also cache runs out its free
     // storage, then LRU replacement algorithm is employed when caching into new
     // entry.
+    // Returns end() if the eviction policy refuses to cache the entry, or the entry is
+    // heavier than the capacity.
 
     iterator Put(const Key& key, const Entry& entry)
     {
-        return PutInternal(key, entry);
+        return PutInternal(key, entry, default_time_to_live_);
     }
 
     iterator Put(const Key& key, Entry&& entry)
     {
-        return PutInternal(key, std::move(entry));
+        return PutInternal(key, std::move(entry), default_time_to_live_);
+    }
+
+    iterator Put(const Key& key, const Entry& entry, TimeToLive time_to_live)
+    {
+        return PutInternal(key, entry, time_to_live);
+    }
+
+    iterator Put(const Key& key, Entry&& entry, TimeToLive time_to_live)
+    {
+        return PutInternal(key, std::move(entry), time_to_live);
     }
 
     // Returns the iterator to the value associated with `key`.
     // Returns end() if no matched value was found.
-    // Access to a cached entry marks this entry as recently used by moving it to
+    // Access to a cached entry marks this entry as recently used, e.g. by moving it to
     // the tail of cached entry list.
-    iterator Get(const Key& key)
+    iterator Get(const key_view_type& key)
     {
-        auto key_it = key_table_.find(key);
-        if (key_it == key_table_.end()) {
+        policy_.OnLookup(key);
+        auto entry_it = storage_.find(key);
+        if (entry_it == end()) {
+            stats_.OnMiss();
+            return entry_it;
+        }
+
+        if (has_expiry_ && IsExpired(entry_it, Clock::now())) {
+            stats_.OnMiss();
+            Evict(entry_it, EvictionCause::Expired);
             return end();
         }
 
-        auto entry_it = key_it->second;
-        entry_ordering_list_.splice(entry_ordering_list_.end(), entry_ordering_list_, entry_it);
+        stats_.OnHit(storage_.metadata(entry_it));
+        policy_.OnAccess(storage_, entry_it);
 
         return entry_it;
     }
@@ -125,39 +1383,59 @@ public:
     // Returns end() if no such value was found.
     // These two functions does not touch the entry, i.e. will not mark the entry recently used.
 
-    const_iterator find(const Key& key) const
+    const_iterator find(const key_view_type& key) const
     {
-        auto key_it = key_table_.find(key);
-        if (key_it == key_table_.end()) {
+        auto entry_it = storage_.find(key);
+        if (entry_it != end() && has_expiry_ && IsExpired(entry_it, Clock::now())) {
             return end();
         }
 
-        return key_it->second;
+        return entry_it;
     }
 
-    iterator find(const Key& key)
+    iterator find(const key_view_type& key)
     {
-        auto key_it = key_table_.find(key);
-        if (key_it == key_table_.end()) {
+        auto entry_it = storage_.find(key);
+        if (entry_it != end() && has_expiry_ && IsExpired(entry_it, Clock::now())) {
             return end();
         }
 
-        return key_it->second;
+        return entry_it;
     }
 
     // Erases the value with specific iterator, and returns the iterator to
     // the next value.
     iterator erase(const_iterator pos)
     {
-        key_table_.erase(pos->first);
-        return entry_ordering_list_.erase(pos);
+        total_weight_ -= storage_.metadata(pos).weight;
+        policy_.OnErase(storage_, pos);
+        bool erasing_sweep_pos = has_sweep_pos_ && pos == sweep_pos_;
+        auto next = storage_.erase(pos);
+        if (erasing_sweep_pos) {
+            sweep_pos_ = next;
+            has_sweep_pos_ = next != end();
+        }
+
+        return next;
+    }
+
+    // Erases the value associated with `key`, and returns the number of values erased.
+    size_type erase(const key_view_type& key)
+    {
+        auto entry_it = storage_.find(key);
+        if (entry_it == end()) {
+            return 0;
+        }
+
+        erase(entry_it);
+        return 1;
     }
 
     // Evict a single entry, or |count_to_evict| entries from cache.
 
     void Evict()
     {
-        erase(entry_ordering_list_.begin());
+        Evict(policy_.SelectVictim(storage_), EvictionCause::Capacity);
     }
 
     void Evict(size_type count_to_evict)
@@ -168,14 +1446,20 @@ public:
         }
     }
 
+    // Removes all expired entries.
+    void RemoveExpired()
+    {
+        SweepExpired(size());
+    }
+
     size_type size() const
     {
-        return entry_ordering_list_.size();
+        return storage_.size();
     }
 
     bool empty() const
     {
-        return entry_ordering_list_.empty();
+        return size() == 0;
     }
 
     size_type max_size() const
@@ -183,49 +1467,220 @@ public:
         return max_size_;
     }
 
+    // Returns the total weight of entries, which is the same as size() if the cache
+    // has no weigher.
+    size_type weight() const noexcept
+    {
+        return total_weight_;
+    }
+
     bool auto_evict() const
     {
         return max_size_ != 0;
     }
 
-    iterator begin() { return entry_ordering_list_.begin(); }
+    // Returns the statistics since the cache was created or the statistics were reset.
+    // Access frequencies are sampled from at most `max_sample_count` entries evenly spaced
+    // in the iteration order, and sampling walks through all entries.
+    LRUCacheStatsSnapshot GetStats(size_type max_sample_count = 1024) const
+    {
+        static_assert(Stats::kEnabled, "The cache collects no statistics");
+
+        LRUCacheStatsSnapshot snapshot;
+        stats_.Fill(snapshot);
+        snapshot.size = size();
+        snapshot.weight = weight();
+        snapshot.max_size = max_size();
+
+        auto stride = std::max<size_type>(size() / std::max<size_type>(max_sample_count, 1), 1);
+        size_type index = 0;
+        for (auto it = begin(); it != end() && snapshot.sampled_entry_count < max_sample_count;
+             ++it, ++index) {
+            if (index % stride != 0) {
+                continue;
+            }
+
+            size_t bucket = 0;
+            for (auto count = const_cast<Storage&>(storage_).metadata(it).access_count;
+                 count != 0; count >>= 1) {
+                ++bucket;
+            }
+
+            ++snapshot.access_frequencies[bucket];
+            ++snapshot.sampled_entry_count;
+        }
+
+        return snapshot;
+    }
+
+    // Resets counters, but not hits of each entry.
+    void ResetStats() noexcept
+    {
+        stats_.Reset();
+    }
 
-    const_iterator begin() const { return entry_ordering_list_.begin(); }
+    iterator begin() { return storage_.begin(); }
 
-    const_iterator cbegin() const { return entry_ordering_list_.cbegin(); }
+    const_iterator begin() const { return storage_.begin(); }
 
-    iterator end() { return entry_ordering_list_.end(); }
+    const_iterator cbegin() const { return storage_.begin(); }
 
-    const_iterator end() const { return entry_ordering_list_.end(); }
+    iterator end() { return storage_.end(); }
 
-    const_iterator cend() const { return entry_ordering_list_.cend(); }
+    const_iterator end() const { return storage_.end(); }
+
+    const_iterator cend() const { return storage_.end(); }
 
 private:
+    struct WithMaxEntryCount {};
+
+    // `max_entry_count` is 0 if the number of entries is unbounded or unknown.
+    LRUCache(size_type max_size, size_type max_entry_count, WithMaxEntryCount) noexcept(
+        std::is_nothrow_constructible<Storage, size_type>::value &&
+        std::is_nothrow_constructible<Policy, size_type>::value)
+        : max_size_(max_size),
+          storage_(max_entry_count),
+          policy_(max_entry_count),
+          total_weight_(0),
+          default_time_to_live_(TimeToLive::max()),
+          has_expiry_(false),
+          has_sweep_pos_(false)
+    {}
+
+    // Expired entries are swept by this many at a time.
+    static constexpr size_type kSweepBatchSize = 2;
+
+    bool IsExpired(const_iterator pos, Clock::time_point now) const
+    {
+        return const_cast<Storage&>(storage_).metadata(pos).expiry <= now;
+    }
+
+    Clock::time_point GetExpiry(TimeToLive time_to_live)
+    {
+        if (time_to_live == TimeToLive::max()) {
+            return Clock::time_point::max();
+        }
+
+        has_expiry_ = true;
+        return Clock::now() + time_to_live;
+    }
+
+    void Evict(iterator pos, EvictionCause cause)
+    {
+        if (eviction_callback_) {
+            eviction_callback_(pos->first, pos->second, cause);
+        }
+
+        stats_.OnEvict(cause);
+        erase(pos);
+    }
+
+    // Checks at most `count` entries from where the last sweep stopped.
+    void SweepExpired(size_type count)
+    {
+        if (!has_expiry_) {
+            return;
+        }
+
+        auto now = Clock::now();
+        for (size_type i = 0; i < count && !empty(); ++i) {
+            auto pos = has_sweep_pos_ ? sweep_pos_ : begin();
+            sweep_pos_ = std::next(pos);
+            has_sweep_pos_ = sweep_pos_ != end();
+            if (IsExpired(pos, now)) {
+                Evict(pos, EvictionCause::Expired);
+            }
+        }
+    }
+
+    void OnMoved(LRUCache& other) noexcept
+    {
+        policy_.OnMove(storage_);
+        other.policy_.Reset();
+        if (has_sweep_pos_) {
+            sweep_pos_ = storage_.Rebind(other.sweep_pos_);
+        }
+
+        other.total_weight_ = 0;
+        other.has_sweep_pos_ = false;
+        other.stats_.Reset();
+    }
+
     template<typename KeyType, typename EntryType>
-    iterator PutInternal(const KeyType& key, EntryType&& entry)
+    iterator PutInternal(const KeyType& key, EntryType&& entry, TimeToLive time_to_live)
     {
-        auto key_it = key_table_.find(key);
-        if (key_it != key_table_.end()) {
-            auto entry_it = key_it->second;
+        policy_.OnLookup(key);
+        SweepExpired(kSweepBatchSize);
+        size_type new_weight = weigher_ ? weigher_(key, entry) : 1;
+        auto entry_it = storage_.find(key);
+        if (entry_it != end()) {
+            if (eviction_callback_) {
+                eviction_callback_(entry_it->first, entry_it->second, EvictionCause::Replaced);
+            }
+
+            stats_.OnUpdate();
             entry_it->second = std::forward<EntryType>(entry);
-            entry_ordering_list_.splice(entry_ordering_list_.end(), entry_ordering_list_, entry_it);
+            auto& metadata = storage_.metadata(entry_it);
+            total_weight_ = total_weight_ - metadata.weight + new_weight;
+            metadata.weight = new_weight;
+            metadata.expiry = GetExpiry(time_to_live);
+            policy_.OnAccess(storage_, entry_it);
+
+            // The entry itself is evicted, if it has become heavier than the capacity.
+            while (auto_evict() && total_weight_ > max_size_) {
+                auto victim = policy_.SelectVictim(storage_);
+                bool evicting_self = victim == entry_it;
+                Evict(victim, EvictionCause::Capacity);
+                if (evicting_self) {
+                    return end();
+                }
+            }
+
             return entry_it;
         }
 
-        if (auto_evict() && max_size() == size()) {
-            Evict();
+        if (auto_evict()) {
+            if (new_weight > max_size_) {
+                stats_.OnReject();
+                return end();
+            }
+
+            while (total_weight_ + new_weight > max_size_) {
+                auto victim = policy_.SelectVictim(storage_);
+                if (!policy_.Admit(key, victim)) {
+                    stats_.OnReject();
+                    return end();
+                }
+
+                Evict(victim, EvictionCause::Capacity);
+            }
         }
 
-        entry_ordering_list_.push_back({key, std::forward<EntryType>(entry)});
-        auto rv = key_table_.insert({key, std::prev(entry_ordering_list_.end())});
+        entry_it = storage_.Insert(policy_.InsertPosition(storage_), key,
+                                   std::forward<EntryType>(entry));
+        auto& metadata = storage_.metadata(entry_it);
+        metadata.weight = new_weight;
+        metadata.expiry = GetExpiry(time_to_live);
+        total_weight_ += new_weight;
+        policy_.OnInsert(storage_, entry_it);
+        stats_.OnInsert();
 
-        return rv.first->second;
+        return entry_it;
     }
 
 private:
     const size_type max_size_;
-    CachedEntryList entry_ordering_list_;
-    KeyTable key_table_;
+    Storage storage_;
+    Policy policy_;
+    Weigher weigher_;
+    EvictionCallback eviction_callback_;
+    size_type total_weight_;
+    TimeToLive default_time_to_live_;
+    bool has_expiry_;
+    // Where the next sweep for expired entries starts.
+    bool has_sweep_pos_;
+    iterator sweep_pos_;
+    Stats stats_;
 };
 
 }   // namespace kbase
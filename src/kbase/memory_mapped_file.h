@@ -0,0 +1,70 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#if defined(_MSC_VER)
+#pragma once
+#endif
+
+#ifndef KBASE_MEMORY_MAPPED_FILE_H_
+#define KBASE_MEMORY_MAPPED_FILE_H_
+
+#include "kbase/basic_macros.h"
+#include "kbase/basic_types.h"
+#include "kbase/path.h"
+
+namespace kbase {
+
+// Maps a whole file into memory for reading.
+class MemoryMappedFile {
+public:
+    // How the mapped data is going to be accessed, which is a hint for the system to
+    // arrange read-ahead.
+    enum class AccessPattern {
+        Normal,
+        Sequential,
+        Random
+    };
+
+    MemoryMappedFile() noexcept;
+
+    ~MemoryMappedFile();
+
+    DISALLOW_COPY(MemoryMappedFile);
+
+    DISALLOW_MOVE(MemoryMappedFile);
+
+    // Closes the file currently mapped, if any, and maps the file at `path`.
+    // Returns true if succeeded, and an empty file is considered mapped with no data.
+    bool Open(const Path& path, AccessPattern pattern = AccessPattern::Normal);
+
+    void Close() noexcept;
+
+    bool IsValid() const noexcept
+    {
+        return valid_;
+    }
+
+    const byte* data() const noexcept
+    {
+        return data_;
+    }
+
+    size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    // Hints that data in the range is going to be needed soon, so the system can read it in
+    // ahead of time.
+    void Prefetch(size_t offset, size_t length) const noexcept;
+
+private:
+    const byte* data_;
+    size_t size_;
+    bool valid_;
+};
+
+}   // namespace kbase
+
+#endif  // KBASE_MEMORY_MAPPED_FILE_H_
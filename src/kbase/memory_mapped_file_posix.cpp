@@ -0,0 +1,110 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#include "kbase/memory_mapped_file.h"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kbase/scope_guard.h"
+
+namespace {
+
+using kbase::MemoryMappedFile;
+
+int GetAdvice(MemoryMappedFile::AccessPattern pattern)
+{
+    switch (pattern) {
+        case MemoryMappedFile::AccessPattern::Sequential:
+            return MADV_SEQUENTIAL;
+
+        case MemoryMappedFile::AccessPattern::Random:
+            return MADV_RANDOM;
+
+        default:
+            return MADV_NORMAL;
+    }
+}
+
+}   // namespace
+
+namespace kbase {
+
+MemoryMappedFile::MemoryMappedFile() noexcept
+    : data_(nullptr), size_(0), valid_(false)
+{}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+    Close();
+}
+
+bool MemoryMappedFile::Open(const Path& path, AccessPattern pattern)
+{
+    Close();
+
+    int fd = open(path.value().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    // The mapping stays valid after the file is closed.
+    ON_SCOPE_EXIT { close(fd); };
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+        return false;
+    }
+
+    auto file_size = static_cast<size_t>(file_stat.st_size);
+    if (file_size == 0) {
+        valid_ = true;
+        return true;
+    }
+
+    void* ptr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+
+    if (pattern != AccessPattern::Normal) {
+        madvise(ptr, file_size, GetAdvice(pattern));
+    }
+
+    data_ = static_cast<const byte*>(ptr);
+    size_ = file_size;
+    valid_ = true;
+
+    return true;
+}
+
+void MemoryMappedFile::Close() noexcept
+{
+    if (data_ != nullptr) {
+        munmap(const_cast<byte*>(data_), size_);
+    }
+
+    data_ = nullptr;
+    size_ = 0;
+    valid_ = false;
+}
+
+void MemoryMappedFile::Prefetch(size_t offset, size_t length) const noexcept
+{
+    if (offset >= size_ || length == 0) {
+        return;
+    }
+
+    // The address must be page-aligned.
+    auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t aligned_offset = offset / page_size * page_size;
+    size_t end = offset + std::min(length, size_ - offset);
+    madvise(const_cast<byte*>(data_) + aligned_offset, end - aligned_offset, MADV_WILLNEED);
+}
+
+}   // namespace kbase
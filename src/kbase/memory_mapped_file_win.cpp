@@ -0,0 +1,116 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#include "kbase/memory_mapped_file.h"
+
+#include <algorithm>
+
+#include <Windows.h>
+
+#include "kbase/scoped_handle.h"
+
+namespace {
+
+using kbase::MemoryMappedFile;
+
+DWORD GetFileFlags(MemoryMappedFile::AccessPattern pattern)
+{
+    switch (pattern) {
+        case MemoryMappedFile::AccessPattern::Sequential:
+            return FILE_FLAG_SEQUENTIAL_SCAN;
+
+        case MemoryMappedFile::AccessPattern::Random:
+            return FILE_FLAG_RANDOM_ACCESS;
+
+        default:
+            return FILE_ATTRIBUTE_NORMAL;
+    }
+}
+
+struct MemoryRangeEntry {
+    PVOID VirtualAddress;
+    SIZE_T NumberOfBytes;
+};
+
+}   // namespace
+
+namespace kbase {
+
+MemoryMappedFile::MemoryMappedFile() noexcept
+    : data_(nullptr), size_(0), valid_(false)
+{}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+    Close();
+}
+
+bool MemoryMappedFile::Open(const Path& path, AccessPattern pattern)
+{
+    Close();
+
+    ScopedHandle file(CreateFileW(path.value().c_str(), GENERIC_READ, FILE_SHARE_READ,
+                                  nullptr, OPEN_EXISTING, GetFileFlags(pattern), nullptr));
+    if (!file) {
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file.get(), &file_size)) {
+        return false;
+    }
+
+    if (file_size.QuadPart == 0) {
+        valid_ = true;
+        return true;
+    }
+
+    // The view keeps the mapping object alive after both handles are closed.
+    ScopedHandle mapping(CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+    if (!mapping) {
+        return false;
+    }
+
+    void* ptr = MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+    if (!ptr) {
+        return false;
+    }
+
+    data_ = static_cast<const byte*>(ptr);
+    size_ = static_cast<size_t>(file_size.QuadPart);
+    valid_ = true;
+
+    return true;
+}
+
+void MemoryMappedFile::Close() noexcept
+{
+    if (data_ != nullptr) {
+        UnmapViewOfFile(data_);
+    }
+
+    data_ = nullptr;
+    size_ = 0;
+    valid_ = false;
+}
+
+void MemoryMappedFile::Prefetch(size_t offset, size_t length) const noexcept
+{
+    if (offset >= size_ || length == 0) {
+        return;
+    }
+
+    // Available since Windows 8.
+    DECLARE_DLL_FUNCTION(PrefetchVirtualMemory,
+                         BOOL(WINAPI*)(HANDLE, ULONG_PTR, MemoryRangeEntry*, ULONG),
+                         "kernel32.dll");
+    if (!PrefetchVirtualMemory) {
+        return;
+    }
+
+    MemoryRangeEntry entry {const_cast<byte*>(data_) + offset, std::min(length, size_ - offset)};
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &entry, 0);
+}
+
+}   // namespace kbase
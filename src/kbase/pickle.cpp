@@ -5,6 +5,7 @@
 #include "kbase/pickle.h"
 
 #include <algorithm>
+#include <cstddef>
 
 #include "kbase/secure_c_runtime.h"
 #include "kbase/string_util.h"
@@ -26,112 +27,540 @@ void SanitizePadding(kbase::byte* padding_begin, size_t padding_size)
     }
 }
 
+constexpr size_t kArenaAlignment = alignof(std::max_align_t);
+
+class HeapPickleAllocator : public kbase::PickleAllocator {
+public:
+    void* Reallocate(void* ptr, size_t, size_t new_size) override
+    {
+        return realloc(ptr, new_size);
+    }
+
+    void Free(void* ptr, size_t) noexcept override
+    {
+        free(ptr);
+    }
+};
+
+HeapPickleAllocator g_heap_allocator;
+
 }   // namespace
 
 namespace kbase {
 
-PickleReader::PickleReader(const void* pickled_data, size_t size_in_bytes) noexcept
-    : read_ptr_(static_cast<const byte*>(pickled_data) + sizeof(Pickle::Header)),
-      data_end_(read_ptr_ + size_in_bytes - sizeof(Pickle::Header))
+PickleReader::PickleReader() noexcept
+    : read_ptr_(nullptr),
+      data_end_(nullptr),
+      has_error_(false),
+      compact_(false),
+      next_segment_(nullptr),
+      segments_end_(nullptr),
+      following_size_(0),
+      segment_offset_(0)
 {}
 
+// The payload size in the header is not trusted, and the reader is marked as failed if
+// the header is incomplete or claims more data than given.
+PickleReader::PickleReader(const void* pickled_data, size_t size_in_bytes) noexcept
+    : read_ptr_(static_cast<const byte*>(pickled_data)),
+      data_end_(read_ptr_),
+      has_error_(false),
+      compact_(false),
+      next_segment_(nullptr),
+      segments_end_(nullptr),
+      following_size_(0),
+      segment_offset_(0)
+{
+    Pickle::Header header;
+    if (pickled_data == nullptr || size_in_bytes < sizeof(header)) {
+        SetError();
+        return;
+    }
+
+    memcpy(&header, pickled_data, sizeof(header));
+    compact_ = header.compact();
+    read_ptr_ += sizeof(header);
+    size_t available_size = size_in_bytes - sizeof(header);
+    data_end_ = read_ptr_ + std::min<size_t>(header.payload_size(), available_size);
+    if (header.payload_size() > available_size) {
+        SetError();
+    }
+}
+
 PickleReader::PickleReader(const Pickle& pickle) noexcept
     : read_ptr_(pickle.payload()),
-      data_end_(pickle.end_of_payload())
-{}
+      data_end_(pickle.has_external_segments() ? pickle.payload() : pickle.end_of_payload()),
+      has_error_(false),
+      compact_(pickle.header_->compact()),
+      next_segment_(nullptr),
+      segments_end_(nullptr),
+      following_size_(0),
+      segment_offset_(0)
+{
+    // External segments are not in the internal buffer.
+    if (pickle.has_external_segments()) {
+        SetError();
+    }
+}
+
+PickleReader::PickleReader(const PickleSegment* segments, size_t count) noexcept
+    : read_ptr_(nullptr),
+      data_end_(nullptr),
+      has_error_(false),
+      compact_(false),
+      next_segment_(nullptr),
+      segments_end_(nullptr),
+      following_size_(0),
+      segment_offset_(0)
+{
+    Pickle::Header header;
+    if (segments == nullptr || count == 0 || segments[0].size < sizeof(header)) {
+        SetError();
+        return;
+    }
+
+    memcpy(&header, segments[0].data, sizeof(header));
+    compact_ = header.compact();
+
+    size_t first_size = segments[0].size - sizeof(header);
+    size_t available_size = first_size;
+    for (size_t i = 1; i < count; ++i) {
+        available_size += segments[i].size;
+    }
+
+    first_size = std::min<size_t>(first_size, header.payload_size());
+    read_ptr_ = static_cast<const byte*>(segments[0].data) + sizeof(header);
+    data_end_ = read_ptr_ + first_size;
+    next_segment_ = segments + 1;
+    segments_end_ = segments + count;
+    following_size_ = header.payload_size() - first_size;
+    segment_offset_ = first_size;
+    if (header.payload_size() > available_size) {
+        SetError();
+    }
+}
 
 PickleReader& PickleReader::operator>>(std::string& value)
 {
-    PickleReader& reader = *this;
-    size_t length;
-    reader >> length;
-    if (length != 0) {
-        auto* dest = WriteInto(value, length + 1);
-        ReadRawData(dest, sizeof(std::string::value_type) * length);
+    StringView view;
+    if (ReadStringView(view)) {
+        value.assign(view.data(), view.length());
+    } else {
+        value.clear();
     }
 
-    return reader;
+    return *this;
 }
 
 PickleReader& PickleReader::operator>>(std::wstring& value)
 {
-    PickleReader& reader = *this;
-    size_t length;
-    reader >> length;
-    if (length != 0) {
-        auto* dest = WriteInto(value, length + 1);
-        ReadRawData(dest, sizeof(std::wstring::value_type) * length);
+    WStringView view;
+    if (ReadWStringView(view)) {
+        value.assign(view.data(), view.length());
+    } else {
+        value.clear();
     }
 
-    return reader;
+    return *this;
 }
 
 void PickleReader::ReadRawData(void* dest, size_t size_in_bytes)
 {
-    ENSURE(CHECK, !!*this && size_in_bytes != 0).Require();
+    ENSURE(CHECK, size_in_bytes != 0).Require();
+    if (!HasContiguousData(size_in_bytes)) {
+        SetError();
+        memset(dest, 0, size_in_bytes);
+        return;
+    }
+
     SecureMemcpy(dest, size_in_bytes, read_ptr_, size_in_bytes);
     SeekReadPosition(size_in_bytes);
 }
 
+bool PickleReader::ReadStringView(StringView& value)
+{
+    return ReadBasicStringView(value);
+}
+
+bool PickleReader::ReadWStringView(WStringView& value)
+{
+    return ReadBasicStringView(value);
+}
+
+bool PickleReader::ReadRawView(const byte*& data, size_t size_in_bytes)
+{
+    if (has_error_ || !HasContiguousData(size_in_bytes)) {
+        data = nullptr;
+        SetError();
+        return false;
+    }
+
+    data = read_ptr_;
+    SeekReadPosition(size_in_bytes);
+
+    return true;
+}
+
+template<typename CharT>
+bool PickleReader::ReadBasicStringView(BasicStringView<CharT>& value)
+{
+    size_t length;
+    *this >> length;
+
+    // Avoids overflow in calculating the size in bytes.
+    const byte* data = nullptr;
+    if (has_error_ || length > remaining_size() / sizeof(CharT) ||
+        !ReadRawView(data, length * sizeof(CharT))) {
+        SetError();
+        value = BasicStringView<CharT>();
+        return false;
+    }
+
+    value = BasicStringView<CharT>(reinterpret_cast<const CharT*>(data), length);
+
+    return true;
+}
+
+bool PickleReader::ReadContainerSize(size_t& size) noexcept
+{
+    *this >> size;
+    if (size > remaining_size()) {
+        SetError();
+        size = 0;
+    }
+
+    return !has_error_;
+}
+
 template<typename T>
 void PickleReader::ReadBuiltIn(T& value)
 {
     static_assert(std::is_fundamental<T>::value, "T is not built-in type");
-    value = *reinterpret_cast<const T*>(read_ptr_);
-    SeekReadPosition(sizeof(T));
+    size_t remaining = contiguous_size();
+    if (sizeof(T) > remaining || (compact_ && internal::IsVarintEncoded<T>::value)) {
+        ReadBuiltInSlowPath(value);
+        return;
+    }
+
+    // The data may be unaligned when it comes from an external buffer.
+    memcpy(&value, read_ptr_, sizeof(T));
+
+    constexpr size_t kAlignedSize = internal::AlignPickledOffset(sizeof(T));
+    read_ptr_ += !compact_ && kAlignedSize <= remaining ? kAlignedSize : sizeof(T);
 }
 
+// Handles varints, reads on segment boundaries, and errors, and is kept out of the
+// fast path.
+template<typename T>
+NOINLINE void PickleReader::ReadBuiltInSlowPath(T& value)
+{
+    if (compact_ && internal::IsVarintEncoded<T>::value) {
+        uint64_t raw;
+        if (!ReadVarint(raw) || !internal::FromVarintValue(raw, value)) {
+            SetError();
+            value = T();
+        }
+
+        return;
+    }
+
+    if (!MoveToNextSegment(sizeof(T))) {
+        SetError();
+        value = T();
+        return;
+    }
+
+    ReadBuiltIn(value);
+}
+
+bool PickleReader::ReadVarint(uint64_t& value) noexcept
+{
+    constexpr size_t kMaxVarintSize = 10;
+    uint64_t result = 0;
+    HasContiguousData(1);
+    for (size_t i = 0; i < kMaxVarintSize && read_ptr_ + i < data_end_; ++i) {
+        uint64_t bits = read_ptr_[i] & 0x7F;
+        // The 10th byte can contribute only one bit.
+        if (i == kMaxVarintSize - 1 && bits > 1) {
+            break;
+        }
+
+        result |= bits << (7 * i);
+        if ((read_ptr_[i] & 0x80) == 0) {
+            read_ptr_ += i + 1;
+            value = result;
+            return true;
+        }
+    }
+
+    SetError();
+    value = 0;
+    return false;
+}
+
+// `data_size` must be not greater than remaining size.
 void PickleReader::SeekReadPosition(size_t data_size) noexcept
 {
-    size_t rounded_size = RoundToMultiple(data_size, sizeof(uint32_t));
-    if (read_ptr_ + rounded_size > data_end_) {
+    if (compact_) {
         read_ptr_ += data_size;
-    } else {
-        read_ptr_ += rounded_size;
+        return;
     }
+
+    size_t rounded_size = RoundToMultiple(data_size, sizeof(uint32_t));
+    read_ptr_ += std::min(rounded_size, contiguous_size());
+}
+
+// Fields never span segments, thus the current segment must have been exhausted.
+bool PickleReader::MoveToNextSegment(size_t size) noexcept
+{
+    if (read_ptr_ != data_end_) {
+        return false;
+    }
+
+    while (next_segment_ != segments_end_ && following_size_ != 0) {
+        auto segment = next_segment_++;
+        size_t segment_size = std::min(segment->size, following_size_);
+        following_size_ -= segment_size;
+        read_ptr_ = static_cast<const byte*>(segment->data);
+        data_end_ = read_ptr_ + segment_size;
+
+        // Paddings after a field ending the previous segment are in this segment.
+        size_t offset = segment_offset_;
+        segment_offset_ += segment_size;
+        size_t padding_size = compact_ ? 0 : internal::AlignPickledOffset(offset) - offset;
+        if (padding_size > segment_size) {
+            return false;
+        }
+
+        read_ptr_ += padding_size;
+        if (read_ptr_ != data_end_) {
+            return size <= contiguous_size();
+        }
+    }
+
+    return false;
 }
 
 void PickleReader::SkipData(size_t data_size) noexcept
 {
+    if (!HasContiguousData(data_size)) {
+        SetError();
+        return;
+    }
+
     SeekReadPosition(data_size);
 }
 
+// -*- PickleRecordReader -*-
+
+PickleRecordReader::PickleRecordReader(const void* data, size_t size_in_bytes) noexcept
+    : data_begin_(static_cast<const byte*>(data)),
+      read_ptr_(data_begin_),
+      data_end_(data_begin_ + (data ? size_in_bytes : 0)),
+      has_error_(false)
+{}
+
+bool PickleRecordReader::Next(PickleReader& reader) noexcept
+{
+    size_t remaining = static_cast<size_t>(data_end_ - read_ptr_);
+    if (has_error_ || remaining == 0) {
+        return false;
+    }
+
+    // Messages are packed, and a header may be unaligned.
+    Pickle::Header header;
+    if (remaining < sizeof(header)) {
+        has_error_ = true;
+        return false;
+    }
+
+    memcpy(&header, read_ptr_, sizeof(header));
+    if (header.payload_size() > remaining - sizeof(header)) {
+        has_error_ = true;
+        return false;
+    }
+
+    size_t record_size = sizeof(header) + header.payload_size();
+    reader = PickleReader(read_ptr_, record_size);
+    read_ptr_ += record_size;
+
+    return true;
+}
+
+// -*- PickleAllocator -*-
+
+// static
+PickleAllocator* PickleAllocator::Default()
+{
+    return &g_heap_allocator;
+}
+
+PickleArena::PickleArena(size_t block_size)
+    : block_size_(block_size), current_(nullptr), end_(nullptr), last_block_(nullptr)
+{}
+
+PickleArena::~PickleArena()
+{
+    for (const auto& chunk : chunks_) {
+        free(chunk.data);
+    }
+}
+
+void* PickleArena::Allocate(size_t size)
+{
+    size = RoundToMultiple(size, kArenaAlignment);
+    if (static_cast<size_t>(end_ - current_) < size) {
+        size_t chunk_size = std::max(block_size_, size);
+        auto chunk = static_cast<byte*>(malloc(chunk_size));
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+
+        chunks_.push_back(Chunk{chunk, chunk_size});
+        current_ = chunk;
+        end_ = chunk + chunk_size;
+    }
+
+    last_block_ = current_;
+    current_ += size;
+
+    return last_block_;
+}
+
+void* PickleArena::Reallocate(void* ptr, size_t old_size, size_t new_size)
+{
+    // Grows the last block in place, if possible.
+    size_t rounded_size = RoundToMultiple(new_size, kArenaAlignment);
+    if (ptr != nullptr && ptr == last_block_ &&
+        rounded_size <= static_cast<size_t>(end_ - last_block_)) {
+        current_ = last_block_ + rounded_size;
+        return ptr;
+    }
+
+    void* block = Allocate(new_size);
+    if (block != nullptr && ptr != nullptr) {
+        memcpy(block, ptr, std::min(old_size, new_size));
+    }
+
+    return block;
+}
+
+void PickleArena::Free(void* ptr, size_t) noexcept
+{
+    if (ptr != nullptr && ptr == last_block_) {
+        current_ = last_block_;
+        last_block_ = nullptr;
+    }
+}
+
+void PickleArena::Reset() noexcept
+{
+    if (chunks_.empty()) {
+        return;
+    }
+
+    for (size_t i = 1; i < chunks_.size(); ++i) {
+        free(chunks_[i].data);
+    }
+
+    chunks_.resize(1);
+    current_ = chunks_.front().data;
+    end_ = current_ + chunks_.front().size;
+    last_block_ = nullptr;
+}
+
 // -*- Pickle -*-
 
 Pickle::Pickle()
-    : header_(nullptr), capacity_(0)
+    : Pickle(PickleEncoding::Aligned)
+{}
+
+Pickle::Pickle(PickleEncoding encoding)
+    : Pickle(PickleAllocator::Default(), kCapacityUnit - sizeof(Header), encoding)
+{}
+
+Pickle::Pickle(PickleAllocator* allocator, size_t payload_capacity, PickleEncoding encoding)
+    : allocator_(allocator),
+      header_(nullptr),
+      capacity_(0),
+      external_size_(0),
+      external_write_threshold_(0)
 {
-    ResizeCapacity(kCapacityUnit);
-    header_->payload_size = 0;
+    ENSURE(CHECK, allocator != nullptr && payload_capacity <= kMaxPayloadSize)
+        (payload_capacity).Require();
+    ResizeCapacity(sizeof(Header) + payload_capacity);
+    header_->bits = encoding == PickleEncoding::Compact ? Header::kCompactFlag : 0;
 }
 
 Pickle::Pickle(const void* data, size_t size_in_bytes)
-    : header_(nullptr), capacity_(0)
+    : allocator_(PickleAllocator::Default()),
+      header_(nullptr),
+      capacity_(0),
+      external_size_(0),
+      external_write_threshold_(0)
 {
     ENSURE(CHECK, data != nullptr && size_in_bytes > 0).Require();
     ResizeCapacity(size_in_bytes);
     SecureMemcpy(header_, capacity_, data, size_in_bytes);
 }
 
+Pickle::Pickle(const void* data, size_t size_in_bytes, ExternalBufferTag)
+    : allocator_(PickleAllocator::Default()),
+      header_(nullptr),
+      capacity_(0),
+      external_size_(0),
+      external_write_threshold_(0)
+{
+    ENSURE(CHECK, reinterpret_cast<uintptr_t>(data) % alignof(Header) == 0)(data).Require();
+
+    Header header;
+    bool complete = data != nullptr && size_in_bytes >= sizeof(header);
+    if (complete) {
+        memcpy(&header, data, sizeof(header));
+        complete = header.payload_size() <= size_in_bytes - sizeof(header);
+    }
+
+    ENSURE(RAISE, complete)(size_in_bytes).Require("Incomplete pickled buffer!");
+    header_ = static_cast<Header*>(const_cast<void*>(data));
+}
+
+// static
+Pickle Pickle::FromExternalBuffer(const void* data, size_t size_in_bytes)
+{
+    return Pickle(data, size_in_bytes, ExternalBufferTag());
+}
+
 Pickle::Pickle(const Pickle& other)
-    : header_(nullptr), capacity_(0)
+    : allocator_(other.allocator_),
+      header_(nullptr),
+      capacity_(0),
+      external_blobs_(other.external_blobs_),
+      external_size_(other.external_size_),
+      external_write_threshold_(other.external_write_threshold_)
 {
     ResizeCapacity(other.size());
     SecureMemcpy(header_, capacity_, other.header_, other.size());
 }
 
 Pickle::Pickle(Pickle&& other) noexcept
-    : header_(other.header_), capacity_(other.capacity_)
+    : allocator_(other.allocator_),
+      header_(other.header_),
+      capacity_(other.capacity_),
+      external_blobs_(std::move(other.external_blobs_)),
+      external_size_(other.external_size_),
+      external_write_threshold_(other.external_write_threshold_)
 {
     other.header_ = nullptr;
     other.capacity_ = 0;
+    other.external_blobs_.clear();
+    other.external_size_ = 0;
 }
 
 Pickle::~Pickle()
 {
     // Technically, only pickles having been moved have null header.
-    if (header_ != nullptr) {
-        free(header_);
+    if (header_ != nullptr && !is_external()) {
+        allocator_->Free(header_, capacity_);
     }
 }
 
@@ -143,6 +572,9 @@ Pickle& Pickle::operator=(const Pickle& rhs)
         }
 
         SecureMemcpy(header_, capacity_, rhs.header_, rhs.size());
+        external_blobs_ = rhs.external_blobs_;
+        external_size_ = rhs.external_size_;
+        external_write_threshold_ = rhs.external_write_threshold_;
     }
 
     return *this;
@@ -151,25 +583,47 @@ Pickle& Pickle::operator=(const Pickle& rhs)
 Pickle& Pickle::operator=(Pickle&& rhs) noexcept
 {
     if (this != &rhs) {
-        Header* old_header = header_;
+        if (header_ != nullptr && !is_external()) {
+            allocator_->Free(header_, capacity_);
+        }
 
+        allocator_ = rhs.allocator_;
         header_ = rhs.header_;
         capacity_ = rhs.capacity_;
+        external_blobs_ = std::move(rhs.external_blobs_);
+        external_size_ = rhs.external_size_;
+        external_write_threshold_ = rhs.external_write_threshold_;
         rhs.header_ = nullptr;
         rhs.capacity_ = 0;
-
-        free(old_header);
+        rhs.external_blobs_.clear();
+        rhs.external_size_ = 0;
     }
 
     return *this;
 }
 
+void Pickle::Reserve(size_t payload_capacity)
+{
+    ENSURE(CHECK, payload_capacity <= kMaxPayloadSize)(payload_capacity).Require();
+    size_t required_capacity = sizeof(Header) + payload_capacity;
+    if (required_capacity > capacity_) {
+        ResizeCapacity(required_capacity);
+    }
+}
+
 void Pickle::ResizeCapacity(size_t new_capacity)
 {
     ENSURE(CHECK, new_capacity > capacity_).Require();
 
-    new_capacity = RoundToMultiple(new_capacity, kCapacityUnit);
-    void* ptr = realloc(header_, new_capacity);
+    void* ptr = nullptr;
+    if (is_external()) {
+        ptr = allocator_->Reallocate(nullptr, 0, new_capacity);
+        if (ptr != nullptr) {
+            memcpy(ptr, header_, std::min(size(), new_capacity));
+        }
+    } else {
+        ptr = allocator_->Reallocate(header_, capacity_, new_capacity);
+    }
 
     ENSURE(RAISE, ptr != nullptr).Require("Failed to realloc a new memory block!");
     header_ = static_cast<Header*>(ptr);
@@ -203,6 +657,11 @@ Pickle& Pickle::operator<<(const std::wstring& value)
 void Pickle::Write(const void* data, size_t size_in_bytes)
 {
     ENSURE(CHECK, size_in_bytes != 0).Require();
+    if (external_write_threshold_ != 0 && size_in_bytes >= external_write_threshold_) {
+        WriteExternal(data, size_in_bytes);
+        return;
+    }
+
     size_t last_payload_size = payload_size();
     byte* dest = SeekWritePosition(size_in_bytes);
     size_t free_buf_size = capacity_ - (dest - reinterpret_cast<byte*>(header_));
@@ -215,34 +674,99 @@ template<typename T>
 void Pickle::WriteBuiltIn(T value)
 {
     static_assert(std::is_fundamental<T>::value, "T is not built-in type");
+    if (header_->compact() && internal::IsVarintEncoded<T>::value) {
+        WriteVarint(internal::ToVarintValue(value));
+        return;
+    }
+
     size_t last_payload_size = payload_size();
     constexpr size_t size_in_bytes = sizeof(T);
     byte* dest = SeekWritePosition(size_in_bytes);
-    *reinterpret_cast<T*>(dest) = value;
+    memcpy(dest, &value, size_in_bytes);
     size_t padding_size = payload_size() - last_payload_size - size_in_bytes;
     SanitizePadding(dest - padding_size, padding_size);
 }
 
+void Pickle::WriteVarint(uint64_t value)
+{
+    byte buf[10];
+    size_t size = 0;
+    do {
+        buf[size] = static_cast<byte>(value & 0x7F);
+        value >>= 7;
+        if (value != 0) {
+            buf[size] |= 0x80;
+        }
+
+        ++size;
+    } while (value != 0);
+
+    memcpy(SeekWritePosition(size), buf, size);
+}
+
+void Pickle::WriteExternal(const void* data, size_t size_in_bytes)
+{
+    // Paddings before the external data stay in the internal buffer.
+    size_t last_payload_size = payload_size();
+    byte* position = SeekWritePosition(0);
+    size_t padding_size = payload_size() - last_payload_size;
+    SanitizePadding(position - padding_size, padding_size);
+
+    size_t required_size = payload_size() + size_in_bytes;
+    ENSURE(CHECK, required_size <= kMaxPayloadSize)(required_size).Require();
+    external_blobs_.push_back(ExternalBlob{size(), data, size_in_bytes});
+    external_size_ += size_in_bytes;
+    header_->set_payload_size(required_size);
+}
+
+std::vector<PickleSegment> Pickle::GetSegments() const
+{
+    std::vector<PickleSegment> segments;
+    segments.reserve(external_blobs_.size() * 2 + 1);
+
+    auto buffer = reinterpret_cast<const byte*>(header_);
+    size_t begin = 0;
+    for (const auto& blob : external_blobs_) {
+        if (blob.buffer_offset > begin) {
+            segments.push_back(PickleSegment{buffer + begin, blob.buffer_offset - begin});
+            begin = blob.buffer_offset;
+        }
+
+        segments.push_back(PickleSegment{blob.data, blob.size});
+    }
+
+    segments.push_back(PickleSegment{buffer + begin, size() - begin});
+    if (segments.back().size == 0) {
+        segments.pop_back();
+    }
+
+    return segments;
+}
+
 byte* Pickle::SeekWritePosition(size_t length)
 {
-    // Writing starts at a uint32-aligned offset.
-    size_t offset = RoundToMultiple(header_->payload_size, sizeof(uint32_t));
+    // Writing starts at a uint32-aligned offset, unless in compact encoding.
+    size_t offset = header_->compact() ? header_->payload_size() :
+                                         RoundToMultiple(header_->payload_size(), sizeof(uint32_t));
     size_t required_size = offset + length;
-    size_t required_total_size = required_size + sizeof(Header);
+
+    // External segments are not in the internal buffer.
+    size_t buffer_offset = offset - external_size_;
+    size_t required_total_size = buffer_offset + length + sizeof(Header);
 
     if (required_total_size > capacity_) {
-        ResizeCapacity(std::max(capacity_ << 1, required_total_size));
+        ResizeCapacity(RoundToMultiple(std::max(capacity_ << 1, required_total_size),
+                                       kCapacityUnit));
     }
 
-    ENSURE(CHECK, required_size <= std::numeric_limits<uint32_t>::max())(required_size).Require();
-    header_->payload_size = static_cast<uint32_t>(required_size);
+    ENSURE(CHECK, required_size <= kMaxPayloadSize)(required_size).Require();
+    header_->set_payload_size(required_size);
 
-    return mutable_payload() + offset;
+    return mutable_payload() + buffer_offset;
 }
 
 // Explicit instantiation.
 
-template void PickleReader::ReadBuiltIn(bool&);
 template void PickleReader::ReadBuiltIn(int8_t&);
 template void PickleReader::ReadBuiltIn(uint8_t&);
 template void PickleReader::ReadBuiltIn(short&);
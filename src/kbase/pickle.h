@@ -9,10 +9,15 @@
 #ifndef KBASE_PICKLE_H_
 #define KBASE_PICKLE_H_
 
+#include <array>
 #include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
 #include <list>
 #include <map>
 #include <set>
+#include <type_traits>
 #include <unordered_set>
 #include <unordered_map>
 #include <vector>
@@ -20,31 +25,154 @@
 #include "kbase/basic_macros.h"
 #include "kbase/basic_types.h"
 #include "kbase/error_exception_util.h"
+#include "kbase/string_view.h"
 
 namespace kbase {
 
 class Pickle;
 
+// The wire format of a pickle, which is recorded in its header.
+// Aligned: every field is stored in its native representation, starting on a 4-byte aligned
+//   offset; this is the default and the fastest.
+// Compact: integers wider than one byte, including lengths and sizes, are stored in LEB128
+//   varints, and signed ones are zigzag-encoded first; fields are not padded.
+enum class PickleEncoding {
+    Aligned,
+    Compact
+};
+
+namespace internal {
+
+// Every field in a pickle starts on a 4-byte aligned offset.
+constexpr size_t AlignPickledOffset(size_t offset) noexcept
+{
+    return (offset + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+}
+
+// Returns the size of consecutive fields in a pickle, including paddings between them.
+constexpr size_t GetPickledFieldsSize(std::initializer_list<size_t> field_sizes) noexcept
+{
+    size_t total_size = 0;
+    for (auto size : field_sizes) {
+        total_size = AlignPickledOffset(total_size) + size;
+    }
+
+    return total_size;
+}
+
+template<typename T>
+using IsVarintEncoded = std::integral_constant<bool,
+                                               std::is_integral<T>::value && (sizeof(T) > 1)>;
+
+template<typename T>
+constexpr uint64_t ToVarintValue(T value, std::true_type /* is_signed */) noexcept
+{
+    return (static_cast<uint64_t>(static_cast<int64_t>(value)) << 1) ^
+           static_cast<uint64_t>(static_cast<int64_t>(value) >> 63);
+}
+
+template<typename T>
+constexpr uint64_t ToVarintValue(T value, std::false_type /* is_signed */) noexcept
+{
+    return static_cast<uint64_t>(value);
+}
+
+template<typename T>
+constexpr uint64_t ToVarintValue(T value) noexcept
+{
+    return ToVarintValue(value, std::is_signed<T>());
+}
+
+// Returns false if the decoded value doesn't fit in T.
+template<typename T>
+bool FromVarintValue(uint64_t raw, T& value, std::true_type /* is_signed */) noexcept
+{
+    auto decoded = static_cast<int64_t>(raw >> 1) ^ -static_cast<int64_t>(raw & 1);
+    if (decoded < static_cast<int64_t>(std::numeric_limits<T>::min()) ||
+        decoded > static_cast<int64_t>(std::numeric_limits<T>::max())) {
+        return false;
+    }
+
+    value = static_cast<T>(decoded);
+    return true;
+}
+
+template<typename T>
+bool FromVarintValue(uint64_t raw, T& value, std::false_type /* is_signed */) noexcept
+{
+    if (raw > static_cast<uint64_t>(std::numeric_limits<T>::max())) {
+        return false;
+    }
+
+    value = static_cast<T>(raw);
+    return true;
+}
+
+template<typename T>
+bool FromVarintValue(uint64_t raw, T& value) noexcept
+{
+    return FromVarintValue(raw, value, std::is_signed<T>());
+}
+
+}   // namespace internal
+
+// A segment of a pickled message, in the spirit of `iovec`.
+struct PickleSegment {
+    const void* data;
+    size_t size;
+};
+
+// Reading never goes beyond the pickled data, which thus can come from untrusted sources.
+// Once a read fails because of no enough data, the reader is marked as having an error and
+// is exhausted, the value read is left empty, and all subsequent reads fail too.
 class PickleReader {
 public:
+    // Constructs a reader having no data, e.g. to be reset by `PickleRecordReader::Next()`.
+    PickleReader() noexcept;
+
     PickleReader(const void* pickled_data, size_t size_in_bytes) noexcept;
 
+    // The reader is marked as failed if the pickle has external segments.
     explicit PickleReader(const Pickle& pickle) noexcept;
 
+    // Reads a message in segments, e.g. the ones from `Pickle::GetSegments()`, without
+    // joining them. The first segment must contain the header, and a field must not
+    // span two segments; otherwise the reader is marked as failed.
+    // `segments` must outlive the reader.
+    PickleReader(const PickleSegment* segments, size_t count) noexcept;
+
     DEFAULT_COPY(PickleReader);
 
     DEFAULT_MOVE(PickleReader);
 
     ~PickleReader() = default;
 
+    // Returns true, if there is data remaining.
     explicit operator bool() const noexcept
     {
-        return read_ptr_ < data_end_;
+        return read_ptr_ < data_end_ || following_size_ != 0;
+    }
+
+    bool has_error() const noexcept
+    {
+        return has_error_;
+    }
+
+    PickleEncoding encoding() const noexcept
+    {
+        return compact_ ? PickleEncoding::Compact : PickleEncoding::Aligned;
+    }
+
+    size_t remaining_size() const noexcept
+    {
+        return contiguous_size() + following_size_;
     }
 
     PickleReader& operator>>(bool& value)
     {
-        ReadBuiltIn(value);
+        uint8_t byte_value;
+        ReadBuiltIn(byte_value);
+        value = byte_value != 0;
         return *this;
     }
 
@@ -115,10 +243,62 @@ public:
     // Copy serialized raw bytes into `dest` in the size of `size_in_bytes`.
     void ReadRawData(void* dest, size_t size_in_bytes);
 
+    // Functions below read data without copying, and the results refer directly to the
+    // pickled buffer, thus they are valid only as long as the buffer is alive.
+    // If there is no enough data, they return false, leave the results empty, and make the
+    // reader exhausted.
+
+    bool ReadStringView(StringView& value);
+
+    bool ReadWStringView(WStringView& value);
+
+    bool ReadRawView(const byte*& data, size_t size_in_bytes);
+
     // Skips read pointer by at least `data_size` bytes.
     void SkipData(size_t data_size) noexcept;
 
+    // Reads consecutive fields in built-in types with only one range check.
+    // Returns false if there is no enough data, and then all fields are zeroed.
+    // Fields in compact encoding have variable sizes, and are read one by one.
+    template<typename... T>
+    bool ReadFields(T&... fields) noexcept;
+
+    // Reads the number of elements of a container, which must not be more than remaining
+    // bytes, because every element takes at least one byte.
+    // Returns false if the size is invalid, and then `size` is zero.
+    bool ReadContainerSize(size_t& size) noexcept;
+
+    // Reads `count` elements in arithmetic type, which were written by `Pickle::WriteArray()`,
+    // with only one range check, unless they are varints.
+    // Returns false if there is no enough data, and then all elements are zeroed.
+    template<typename T>
+    bool ReadArray(T* dest, size_t count) noexcept;
+
+    // Marks the reader as failed, and makes it exhausted.
+    // Custom readers can also use it to reject invalid data.
+    void SetError() noexcept
+    {
+        has_error_ = true;
+        read_ptr_ = data_end_;
+        following_size_ = 0;
+    }
+
 private:
+    // Returns the size of remaining data in the current segment.
+    size_t contiguous_size() const noexcept
+    {
+        return static_cast<size_t>(data_end_ - read_ptr_);
+    }
+
+    // Returns true, if the next `size` bytes are in one segment, moving to the next segment
+    // if the current one is exhausted.
+    bool HasContiguousData(size_t size) noexcept
+    {
+        return size <= contiguous_size() || MoveToNextSegment(size);
+    }
+
+    bool MoveToNextSegment(size_t size) noexcept;
+
     // Seeks to the next position by advancing at least `data_szie` bytes.
     // Any interpolated paddings would be skipped.
     void SeekReadPosition(size_t data_size) noexcept;
@@ -127,9 +307,231 @@ private:
     template<typename T>
     void ReadBuiltIn(T& value);
 
+    template<typename T>
+    void ReadBuiltInSlowPath(T& value);
+
+    // Decodes a LEB128 varint; marks the reader as failed if it is truncated or overlong.
+    bool ReadVarint(uint64_t& value) noexcept;
+
+    template<typename T>
+    bool ReadCompactArray(T* dest, size_t count, std::true_type /* is_varint */) noexcept;
+
+    template<typename T>
+    bool ReadCompactArray(T* dest, size_t count, std::false_type /* is_varint */) noexcept;
+
+    template<typename CharT>
+    bool ReadBasicStringView(BasicStringView<CharT>& value);
+
+    template<typename T>
+    static void ReadFieldAt(const byte* base, size_t& offset, T& field) noexcept
+    {
+        static_assert(std::is_fundamental<T>::value, "T is not built-in type");
+        offset = internal::AlignPickledOffset(offset);
+        memcpy(&field, base + offset, sizeof(T));
+        offset += sizeof(T);
+    }
+
+    static void ReadFieldAt(const byte* base, size_t& offset, bool& field) noexcept
+    {
+        uint8_t byte_value;
+        ReadFieldAt(base, offset, byte_value);
+        field = byte_value != 0;
+    }
+
+
+private:
+    const byte* read_ptr_;
+    const byte* data_end_;
+    bool has_error_;
+    bool compact_;
+    // Used only when reading in segments.
+    const PickleSegment* next_segment_;
+    const PickleSegment* segments_end_;
+    size_t following_size_;
+    size_t segment_offset_;
+};
+
+template<typename... T>
+bool PickleReader::ReadFields(T&... fields) noexcept
+{
+    using expander = int[];
+    if (compact_) {
+        (void)expander{0, ((*this >> fields), 0)...};
+        if (has_error_) {
+            (void)expander{0, (fields = T(), 0)...};
+        }
+
+        return !has_error_;
+    }
+
+    constexpr size_t kFieldsSize = internal::GetPickledFieldsSize({sizeof(T)...});
+    if (!HasContiguousData(kFieldsSize)) {
+        SetError();
+        (void)expander{0, (fields = T(), 0)...};
+        return false;
+    }
+
+    // Offsets are constants after inlining.
+    size_t offset = 0;
+    (void)expander{0, (ReadFieldAt(read_ptr_, offset, fields), 0)...};
+    SeekReadPosition(kFieldsSize);
+
+    return true;
+}
+
+template<typename T>
+bool PickleReader::ReadArray(T* dest, size_t count) noexcept
+{
+    static_assert(std::is_arithmetic<T>::value, "T is not arithmetic type");
+    if (count == 0) {
+        return !has_error_;
+    }
+
+    if (compact_) {
+        return ReadCompactArray(dest, count, internal::IsVarintEncoded<T>());
+    }
+
+    // The last element has no trailing padding; and the check avoids overflow.
+    constexpr size_t kSlotSize = internal::AlignPickledOffset(sizeof(T));
+    HasContiguousData(sizeof(T));
+    size_t remaining = contiguous_size();
+    if (remaining < sizeof(T) || count - 1 > (remaining - sizeof(T)) / kSlotSize) {
+        SetError();
+        memset(dest, 0, count * sizeof(T));
+        return false;
+    }
+
+    if (kSlotSize == sizeof(T)) {
+        memcpy(dest, read_ptr_, count * sizeof(T));
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(dest + i, read_ptr_ + i * kSlotSize, sizeof(T));
+        }
+    }
+
+    SeekReadPosition((count - 1) * kSlotSize + sizeof(T));
+
+    return true;
+}
+
+template<typename T>
+bool PickleReader::ReadCompactArray(T* dest, size_t count, std::true_type) noexcept
+{
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t raw;
+        if (!ReadVarint(raw) || !internal::FromVarintValue(raw, dest[i])) {
+            SetError();
+            memset(dest, 0, count * sizeof(T));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template<typename T>
+bool PickleReader::ReadCompactArray(T* dest, size_t count, std::false_type) noexcept
+{
+    if (!HasContiguousData(sizeof(T)) || count > contiguous_size() / sizeof(T)) {
+        SetError();
+        memset(dest, 0, count * sizeof(T));
+        return false;
+    }
+
+    memcpy(dest, read_ptr_, count * sizeof(T));
+    read_ptr_ += count * sizeof(T);
+
+    return true;
+}
+
+// Iterates over pickled messages stored back to back in a buffer, e.g. a memory-mapped
+// file, and every message is read in place without being copied.
+// The header of each message is validated against the data remaining, so that the buffer
+// can come from untrusted sources.
+class PickleRecordReader {
+public:
+    PickleRecordReader(const void* data, size_t size_in_bytes) noexcept;
+
+    DEFAULT_COPY(PickleRecordReader);
+
+    DEFAULT_MOVE(PickleRecordReader);
+
+    ~PickleRecordReader() = default;
+
+    // Resets `reader` to read the next message and returns true.
+    // Returns false if there is no more message, or the next message is incomplete, and in
+    // the latter case, the record reader is marked as having an error.
+    bool Next(PickleReader& reader) noexcept;
+
+    bool has_error() const noexcept
+    {
+        return has_error_;
+    }
+
+    // Returns the offset of the next message from the beginning of the buffer.
+    size_t offset() const noexcept
+    {
+        return static_cast<size_t>(read_ptr_ - data_begin_);
+    }
+
 private:
+    const byte* data_begin_;
     const byte* read_ptr_;
     const byte* data_end_;
+    bool has_error_;
+};
+
+// Pickle obtains its buffer from an allocator, which must outlive all pickles using it.
+class PickleAllocator {
+public:
+    virtual ~PickleAllocator() = default;
+
+    // Returns a block of `new_size` bytes, preserving the first `old_size` bytes of the block
+    // `ptr`, which is null for a new allocation; returns null on failure.
+    virtual void* Reallocate(void* ptr, size_t old_size, size_t new_size) = 0;
+
+    virtual void Free(void* ptr, size_t size) noexcept = 0;
+
+    // Returns the allocator backed by the heap, which is used by default.
+    static PickleAllocator* Default();
+};
+
+// A bump allocator which releases all memory at once, and suits pickles of a short lifetime,
+// e.g. messages built for one request.
+// Freeing a block only reclaims it if it is the last one allocated.
+class PickleArena : public PickleAllocator {
+public:
+    explicit PickleArena(size_t block_size = kDefaultBlockSize);
+
+    ~PickleArena();
+
+    DISALLOW_COPY(PickleArena);
+
+    DISALLOW_MOVE(PickleArena);
+
+    void* Reallocate(void* ptr, size_t old_size, size_t new_size) override;
+
+    void Free(void* ptr, size_t size) noexcept override;
+
+    // Releases all blocks allocated, and keeps only the first memory chunk for reuse.
+    // Any pickle still using the arena is invalidated.
+    void Reset() noexcept;
+
+private:
+    void* Allocate(size_t size);
+
+private:
+    struct Chunk {
+        byte* data;
+        size_t size;
+    };
+
+    static constexpr const size_t kDefaultBlockSize = 4096U;
+    size_t block_size_;
+    std::vector<Chunk> chunks_;
+    byte* current_;
+    byte* end_;
+    byte* last_block_;
 };
 
 // Underlying memory layout:
@@ -138,21 +540,56 @@ private:
 // |header|seg_1|seg_2|#|seg_3|...|seg_n|   |
 // +------+-----+-----+-+-----+---+-----+---+
 //        <---------- payload ---------->
-// Note that, every segment starts on the address that is 4-byte aligned, thus
-// there might be a padding between two logically consecutive segments.
+// Note that, in aligned encoding, every segment starts on the address that is 4-byte aligned,
+// thus there might be a padding between two logically consecutive segments.
 
 class Pickle {
 private:
+    // The encoding flag takes the highest bit of the size field, which is always zero in
+    // pickles of aligned encoding.
+    // Bits are masked by hand, since the layout of bit-fields is implementation-defined.
     struct Header {
-        uint32_t payload_size;
+        static constexpr const uint32_t kCompactFlag = 1U << 31;
+
+        uint32_t bits;
+
+        uint32_t payload_size() const noexcept
+        {
+            return bits & ~kCompactFlag;
+        }
+
+        bool compact() const noexcept
+        {
+            return (bits & kCompactFlag) != 0;
+        }
+
+        void set_payload_size(size_t size) noexcept
+        {
+            bits = (bits & kCompactFlag) | (static_cast<uint32_t>(size) & ~kCompactFlag);
+        }
     };
 
+    static constexpr const size_t kMaxPayloadSize = Header::kCompactFlag - 1;
+
 public:
     Pickle();
 
+    explicit Pickle(PickleEncoding encoding);
+
+    // Allocates the buffer from `allocator`, and reserves exactly `payload_capacity` bytes for
+    // the payload up front.
+    Pickle(PickleAllocator* allocator, size_t payload_capacity,
+           PickleEncoding encoding = PickleEncoding::Aligned);
+
     // Creates from a given serialized buffer.
     Pickle(const void* data, size_t size_in_bytes);
 
+    // Wraps a serialized buffer owned by others without copying. The buffer must be 4-byte
+    // aligned and outlive the pickle, and is never modified: the first write copies it into
+    // a buffer of the pickle's own.
+    // Throws an exception if the buffer is not a complete pickle.
+    static Pickle FromExternalBuffer(const void* data, size_t size_in_bytes);
+
     Pickle(const Pickle& other);
 
     Pickle(Pickle&& other) noexcept;
@@ -163,16 +600,19 @@ public:
 
     ~Pickle();
 
+    // If the pickle has external segments, the internal buffer holds only data other than
+    // external segments, and `GetSegments()` should be used instead.
     const void* data() const noexcept
     {
         return header_;
     }
 
-    // Returns the size of internal data, including header, in bytes.
+    // Returns the size of pickled data, including header, in bytes.
+    // Like `data()`, only the internal buffer is counted if the pickle has external segments.
     size_t size() const noexcept
     {
         ENSURE(CHECK, header_ != nullptr).Require();
-        return sizeof(Header) + header_->payload_size;
+        return sizeof(Header) + header_->payload_size() - external_size_;
     }
 
     const byte* payload() const noexcept
@@ -183,9 +623,19 @@ public:
     size_t payload_size() const noexcept
     {
         ENSURE(CHECK, header_ != nullptr).Require();
-        return header_->payload_size;
+        return header_->payload_size();
     }
 
+    PickleEncoding encoding() const noexcept
+    {
+        ENSURE(CHECK, header_ != nullptr).Require();
+        return header_->compact() ? PickleEncoding::Compact : PickleEncoding::Aligned;
+    }
+
+    // Ensures that the payload can grow to `payload_capacity` bytes without reallocations.
+    // The capacity reserved is exact.
+    void Reserve(size_t payload_capacity);
+
     // Returns true, if no payload.
     // Returns false, otherwise.
     bool payload_empty() const noexcept
@@ -264,13 +714,49 @@ public:
     Pickle& operator<<(const std::wstring& value);
 
     // Serializes data in bytes with specified length.
+    // If external writes are enabled, and the size reaches the threshold, the data is not
+    // copied, but referred to as an external segment, and thus must outlive the pickle.
     void Write(const void* data, size_t size_in_bytes);
 
+    // Enables external writes for data not less than `threshold_in_bytes`; or disables them,
+    // if `threshold_in_bytes` is 0, which is the default.
+    void set_external_write_threshold(size_t threshold_in_bytes) noexcept
+    {
+        external_write_threshold_ = threshold_in_bytes;
+    }
+
+    bool has_external_segments() const noexcept
+    {
+        return !external_blobs_.empty();
+    }
+
+    // Returns segments of the pickled data in order, including the header, which are suitable
+    // for vectored I/O, e.g. writev() or sendmsg().
+    // Segments concatenated are identical to the data pickled without external writes.
+    std::vector<PickleSegment> GetSegments() const;
+
+    // Serializes `count` elements in arithmetic type at once, and the result is identical to
+    // what writing them one by one produces.
+    template<typename T>
+    void WriteArray(const T* data, size_t count);
+
 private:
-    // Resizes the capacity of the internal buffer. This function internally rounds the
-    // `new_capacity` up to the nearest multiple of predefined storage unit.
+    struct ExternalBufferTag {};
+
+    Pickle(const void* data, size_t size_in_bytes, ExternalBufferTag);
+
+    // Resizes the capacity of the internal buffer to exactly `new_capacity` bytes.
+    // If the pickle wraps an external buffer, its data is copied into the new buffer.
     void ResizeCapacity(size_t new_capacity);
 
+    // Returns true, if the pickle wraps an external buffer.
+    bool is_external() const noexcept
+    {
+        return capacity_ == 0 && header_ != nullptr;
+    }
+
+    void WriteExternal(const void* data, size_t size_in_bytes);
+
     // Locates to an uint32-aligned offset as the starting position, and resizes
     // the internal buffer if free space is less than demand(padding plus `length`).
     byte* SeekWritePosition(size_t length);
@@ -279,6 +765,14 @@ private:
     template<typename T>
     void WriteBuiltIn(T value);
 
+    void WriteVarint(uint64_t value);
+
+    template<typename T>
+    void WriteCompactArray(const T* data, size_t count, std::true_type /* is_varint */);
+
+    template<typename T>
+    void WriteCompactArray(const T* data, size_t count, std::false_type /* is_varint */);
+
     byte* mutable_payload() const noexcept
     {
         return const_cast<byte*>(payload());
@@ -291,22 +785,112 @@ private:
 
 private:
     static constexpr const size_t kCapacityUnit = 64U;
+    PickleAllocator* allocator_;
     Header* header_;
+    // Zero, if the pickle wraps an external buffer.
     size_t capacity_;
 
+    // External segments are placed into the internal buffer at `buffer_offset`.
+    struct ExternalBlob {
+        size_t buffer_offset;
+        const void* data;
+        size_t size;
+    };
+
+    std::vector<ExternalBlob> external_blobs_;
+    size_t external_size_;
+    size_t external_write_threshold_;
+
     friend class PickleReader;
+    friend class PickleRecordReader;
 };
 
-// Support for usual containers
+template<typename T>
+void Pickle::WriteArray(const T* data, size_t count)
+{
+    static_assert(std::is_arithmetic<T>::value, "T is not arithmetic type");
+    if (count == 0) {
+        return;
+    }
+
+    if (header_->compact()) {
+        WriteCompactArray(data, count, internal::IsVarintEncoded<T>());
+        return;
+    }
+
+    // Every element takes a 4-byte aligned slot, except the last one has no trailing padding.
+    constexpr size_t kSlotSize = internal::AlignPickledOffset(sizeof(T));
+    size_t data_size = (count - 1) * kSlotSize + sizeof(T);
+    size_t last_payload_size = payload_size();
+    byte* dest = SeekWritePosition(data_size);
+    size_t padding_size = payload_size() - last_payload_size - data_size;
+    memset(dest - padding_size, 0, padding_size);
+
+    if (kSlotSize == sizeof(T)) {
+        memcpy(dest, data, count * sizeof(T));
+    } else {
+        memset(dest, 0, data_size);
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(dest + i * kSlotSize, data + i, sizeof(T));
+        }
+    }
+}
 
 template<typename T>
-Pickle& operator<<(Pickle& pickle, const std::vector<T>& value)
+void Pickle::WriteCompactArray(const T* data, size_t count, std::true_type)
+{
+    for (size_t i = 0; i < count; ++i) {
+        WriteVarint(internal::ToVarintValue(data[i]));
+    }
+}
+
+template<typename T>
+void Pickle::WriteCompactArray(const T* data, size_t count, std::false_type)
+{
+    memcpy(SeekWritePosition(count * sizeof(T)), data, count * sizeof(T));
+}
+
+namespace internal {
+
+// Elements of these types are serialized in bulk.
+// bool is excluded, since std::vector<bool> is not contiguous, and bytes read must be
+// normalized.
+template<typename T>
+using IsBulkPickleable = std::integral_constant<bool,
+                                                std::is_arithmetic<T>::value &&
+                                                !std::is_same<T, bool>::value>;
+
+template<typename Container>
+void WritePickleElements(Pickle& pickle, const Container& value, std::true_type)
+{
+    pickle.WriteArray(value.data(), value.size());
+}
+
+template<typename Container>
+void WritePickleElements(Pickle& pickle, const Container& value, std::false_type)
 {
-    pickle << value.size();
     for (const auto& ele : value) {
         pickle << ele;
     }
+}
+
+}   // namespace internal
+
+// Support for usual containers
+
+template<typename T>
+Pickle& operator<<(Pickle& pickle, const std::vector<T>& value)
+{
+    pickle << value.size();
+    internal::WritePickleElements(pickle, value, internal::IsBulkPickleable<T>());
+    return pickle;
+}
 
+template<typename T, size_t N>
+Pickle& operator<<(Pickle& pickle, const std::array<T, N>& value)
+{
+    pickle << value.size();
+    internal::WritePickleElements(pickle, value, internal::IsBulkPickleable<T>());
     return pickle;
 }
 
@@ -376,16 +960,73 @@ Pickle& operator<<(Pickle& pickle, const std::unordered_map<Key, T, Hash, KeyEqu
     return pickle;
 }
 
+namespace internal {
+
 template<typename T>
-PickleReader& operator>>(PickleReader& reader, std::vector<T>& value)
+void ReadPickleElements(PickleReader& reader, std::vector<T>& value, size_t size, std::true_type)
 {
-    size_t size;
-    reader >> size;
+    auto old_size = value.size();
+    value.resize(old_size + size);
+    if (!reader.ReadArray(value.data() + old_size, size)) {
+        value.resize(old_size);
+    }
+}
+
+template<typename T>
+void ReadPickleElements(PickleReader& reader, std::vector<T>& value, size_t size,
+                        std::false_type)
+{
+    value.reserve(value.size() + size);
     for (size_t i = 0; i < size; ++i) {
         T ele;
         reader >> ele;
+        if (reader.has_error()) {
+            break;
+        }
+
         value.push_back(std::move(ele));
     }
+}
+
+template<typename T, size_t N>
+void ReadPickleElements(PickleReader& reader, std::array<T, N>& value, std::true_type)
+{
+    reader.ReadArray(value.data(), N);
+}
+
+template<typename T, size_t N>
+void ReadPickleElements(PickleReader& reader, std::array<T, N>& value, std::false_type)
+{
+    for (auto& ele : value) {
+        reader >> ele;
+    }
+}
+
+}   // namespace internal
+
+template<typename T>
+PickleReader& operator>>(PickleReader& reader, std::vector<T>& value)
+{
+    size_t size;
+    if (reader.ReadContainerSize(size)) {
+        internal::ReadPickleElements(reader, value, size, internal::IsBulkPickleable<T>());
+    }
+
+    return reader;
+}
+
+// The number of elements must match.
+template<typename T, size_t N>
+PickleReader& operator>>(PickleReader& reader, std::array<T, N>& value)
+{
+    size_t size;
+    if (reader.ReadContainerSize(size)) {
+        if (size == N) {
+            internal::ReadPickleElements(reader, value, internal::IsBulkPickleable<T>());
+        } else {
+            reader.SetError();
+        }
+    }
 
     return reader;
 }
@@ -394,10 +1035,17 @@ template<typename T>
 PickleReader& operator>>(PickleReader& reader, std::list<T>& value)
 {
     size_t size;
-    reader >> size;
+    if (!reader.ReadContainerSize(size)) {
+        return reader;
+    }
+
     for (size_t i = 0; i < size; ++i) {
         T ele;
         reader >> ele;
+        if (reader.has_error()) {
+            break;
+        }
+
         value.push_back(std::move(ele));
     }
 
@@ -415,10 +1063,17 @@ template<typename Key, typename Compare = std::less<Key>>
 PickleReader& operator>>(PickleReader& reader, std::set<Key, Compare>& value)
 {
     size_t size;
-    reader >> size;
+    if (!reader.ReadContainerSize(size)) {
+        return reader;
+    }
+
     for (size_t i = 0; i < size; ++i) {
         Key ele;
         reader >> ele;
+        if (reader.has_error()) {
+            break;
+        }
+
         value.insert(std::move(ele));
     }
 
@@ -429,10 +1084,17 @@ template<typename Key, typename T, typename Compare = std::less<Key>>
 PickleReader& operator>>(PickleReader& reader, std::map<Key, T, Compare>& value)
 {
     size_t size;
-    reader >> size;
+    if (!reader.ReadContainerSize(size)) {
+        return reader;
+    }
+
     for (size_t i = 0; i < size; ++i) {
         std::pair<Key, T> ele;
         reader >> ele;
+        if (reader.has_error()) {
+            break;
+        }
+
         value.emplace(std::move(ele));
     }
 
@@ -443,10 +1105,17 @@ template<typename Key, typename Hash = std::hash<Key>, typename KeyEqual = std::
 PickleReader& operator>>(PickleReader& reader, std::unordered_set<Key, Hash, KeyEqual>& value)
 {
     size_t size;
-    reader >> size;
+    if (!reader.ReadContainerSize(size)) {
+        return reader;
+    }
+
     for (size_t i = 0; i < size; ++i) {
         Key ele;
         reader >> ele;
+        if (reader.has_error()) {
+            break;
+        }
+
         value.insert(std::move(ele));
     }
 
@@ -461,10 +1130,17 @@ template<
 PickleReader& operator>>(PickleReader& reader, std::unordered_map<Key, T, Hash, KeyEqual>& value)
 {
     size_t size;
-    reader >> size;
+    if (!reader.ReadContainerSize(size)) {
+        return reader;
+    }
+
     for (size_t i = 0; i < size; ++i) {
         std::pair<Key, T> ele;
         reader >> ele;
+        if (reader.has_error()) {
+            break;
+        }
+
         value.emplace(std::move(ele));
     }
 
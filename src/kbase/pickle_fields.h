@@ -0,0 +1,477 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#if defined(_MSC_VER)
+#pragma once
+#endif
+
+#ifndef KBASE_PICKLE_FIELDS_H_
+#define KBASE_PICKLE_FIELDS_H_
+
+#include <memory>
+#include <tuple>
+#include <utility>
+
+#include "kbase/basic_macros.h"
+#include "kbase/pickle.h"
+
+// Declares members of a class to be pickled, in order, and must be used inside the class
+// definition, e.g.
+//   struct Point {
+//       int x;
+//       int y;
+//       KBASE_PICKLE_FIELDS(Point, x, y);
+//   };
+// Then the class can be written into a Pickle and read from a PickleReader like built-in
+// types. Members can be of any pickle-able type, including other such classes.
+// At most 16 members are supported.
+#define KBASE_PICKLE_FIELDS(Type, ...)                                                      \
+    friend auto KBasePickleFields(const Type*)                                              \
+    {                                                                                       \
+        return std::make_tuple(KBASE_PICKLE_MEMBER_POINTERS(Type, __VA_ARGS__));            \
+    }
+
+// Helper macros for expanding member pointers from a list of member names.
+// Expanding __VA_ARGS__ explicitly makes the traditional preprocessor of MSVC happy.
+
+#define KBASE_PICKLE_EXPAND(x) x
+
+#define KBASE_PICKLE_ARG_COUNT(...)                                                         \
+    KBASE_PICKLE_EXPAND(KBASE_PICKLE_ARG_COUNT_IMPL(__VA_ARGS__,                            \
+                                                    16, 15, 14, 13, 12, 11, 10, 9,          \
+                                                    8, 7, 6, 5, 4, 3, 2, 1))
+
+#define KBASE_PICKLE_ARG_COUNT_IMPL(_1, _2, _3, _4, _5, _6, _7, _8,                         \
+                                    _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+
+#define KBASE_PICKLE_MEMBER_POINTERS(Type, ...)                                             \
+    KBASE_PICKLE_EXPAND(CONCATENATE(KBASE_PICKLE_MEMBERS_,                                  \
+                                    KBASE_PICKLE_ARG_COUNT(__VA_ARGS__))(Type, __VA_ARGS__))
+
+#define KBASE_PICKLE_MEMBERS_1(T, m) &T::m
+#define KBASE_PICKLE_MEMBERS_2(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_1(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_3(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_2(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_4(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_3(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_5(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_4(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_6(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_5(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_7(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_6(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_8(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_7(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_9(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_8(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_10(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_9(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_11(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_10(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_12(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_11(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_13(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_12(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_14(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_13(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_15(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_14(T, __VA_ARGS__))
+#define KBASE_PICKLE_MEMBERS_16(T, m, ...) &T::m, KBASE_PICKLE_EXPAND(KBASE_PICKLE_MEMBERS_15(T, __VA_ARGS__))
+
+namespace kbase {
+
+namespace internal {
+
+// -*- Traits -*-
+
+template<typename T, typename = void>
+struct HasPickleFields : std::false_type {};
+
+template<typename T>
+struct HasPickleFields<T, decltype(void(KBasePickleFields(static_cast<const T*>(nullptr))))>
+    : std::true_type {};
+
+// A tuple of member pointers.
+template<typename T>
+using PickleFieldsOf = decltype(KBasePickleFields(static_cast<const T*>(nullptr)));
+
+// Types like std::optional, whose values may be absent.
+template<typename T, typename = void>
+struct IsOptionalLike : std::false_type {};
+
+template<typename T>
+struct IsOptionalLike<T, decltype(void(std::declval<const T&>().has_value()),
+                                  void(*std::declval<const T&>()),
+                                  void(std::declval<T&>().emplace()))>
+    : std::true_type {};
+
+constexpr bool AllOf(std::initializer_list<bool> conditions) noexcept
+{
+    for (auto condition : conditions) {
+        if (!condition) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The size of a type pickled in aligned encoding, if it is a constant; or zero, otherwise.
+template<typename T, typename = void>
+struct FixedPickledSize : std::integral_constant<size_t, 0> {};
+
+template<typename T>
+struct FixedPickledSize<T, std::enable_if_t<std::is_arithmetic<T>::value>>
+    : std::integral_constant<size_t, sizeof(T)> {};
+
+template<typename Fields>
+struct FixedPickledFieldsSize;
+
+template<typename... C, typename... M>
+struct FixedPickledFieldsSize<std::tuple<M C::*...>>
+    : std::integral_constant<size_t,
+                             AllOf({FixedPickledSize<M>::value != 0 ...}) ?
+                                 GetPickledFieldsSize({FixedPickledSize<M>::value...}) : 0> {};
+
+template<typename T>
+struct FixedPickledSize<T, std::enable_if_t<HasPickleFields<T>::value>>
+    : FixedPickledFieldsSize<PickleFieldsOf<T>> {};
+
+// Classes with only fields in built-in types are read with only one range check.
+template<typename Fields>
+struct HasFundamentalFieldsOnly;
+
+template<typename... C, typename... M>
+struct HasFundamentalFieldsOnly<std::tuple<M C::*...>>
+    : std::integral_constant<bool, AllOf({std::is_fundamental<M>::value...})> {};
+
+// -*- Pickled size -*-
+
+// Functions below return the offset in the payload where the pickled `value` ends, if it
+// were pickled at `offset`.
+
+inline size_t GetVarintSize(uint64_t value) noexcept
+{
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 7) {
+        ++size;
+    }
+
+    return size;
+}
+
+template<typename T, std::enable_if_t<std::is_arithmetic<T>::value, int> = 0>
+size_t GetPickledEnd(size_t offset, T value, bool compact) noexcept;
+
+template<typename CharT>
+size_t GetPickledEnd(size_t offset, const std::basic_string<CharT>& value, bool compact) noexcept;
+
+template<typename T>
+size_t GetPickledEnd(size_t offset, const std::vector<T>& value, bool compact) noexcept;
+
+template<typename T, size_t N>
+size_t GetPickledEnd(size_t offset, const std::array<T, N>& value, bool compact) noexcept;
+
+template<typename T>
+size_t GetPickledEnd(size_t offset, const std::list<T>& value, bool compact) noexcept;
+
+template<typename T1, typename T2>
+size_t GetPickledEnd(size_t offset, const std::pair<T1, T2>& value, bool compact) noexcept;
+
+template<typename Key, typename Compare>
+size_t GetPickledEnd(size_t offset, const std::set<Key, Compare>& value, bool compact) noexcept;
+
+template<typename Key, typename T, typename Compare>
+size_t GetPickledEnd(size_t offset, const std::map<Key, T, Compare>& value,
+                     bool compact) noexcept;
+
+template<typename Key, typename Hash, typename KeyEqual>
+size_t GetPickledEnd(size_t offset, const std::unordered_set<Key, Hash, KeyEqual>& value,
+                     bool compact) noexcept;
+
+template<typename Key, typename T, typename Hash, typename KeyEqual>
+size_t GetPickledEnd(size_t offset, const std::unordered_map<Key, T, Hash, KeyEqual>& value,
+                     bool compact) noexcept;
+
+template<typename T>
+size_t GetPickledEnd(size_t offset, const std::unique_ptr<T>& value, bool compact) noexcept;
+
+template<typename T, std::enable_if_t<IsOptionalLike<T>::value, int> = 0>
+size_t GetPickledEnd(size_t offset, const T& value, bool compact) noexcept;
+
+template<typename T, std::enable_if_t<HasPickleFields<T>::value, int> = 0>
+size_t GetPickledEnd(size_t offset, const T& value, bool compact) noexcept;
+
+template<typename T, std::enable_if_t<std::is_arithmetic<T>::value, int>>
+size_t GetPickledEnd(size_t offset, T value, bool compact) noexcept
+{
+    if (compact) {
+        return offset +
+               (IsVarintEncoded<T>::value ? GetVarintSize(ToVarintValue(value)) : sizeof(T));
+    }
+
+    return AlignPickledOffset(offset) + sizeof(T);
+}
+
+template<typename CharT>
+size_t GetPickledEnd(size_t offset, const std::basic_string<CharT>& value, bool compact) noexcept
+{
+    offset = GetPickledEnd(offset, value.size(), compact);
+    if (value.empty()) {
+        return offset;
+    }
+
+    return (compact ? offset : AlignPickledOffset(offset)) + value.size() * sizeof(CharT);
+}
+
+template<typename T>
+size_t GetPickledElementsEnd(size_t offset, const T* data, size_t count, bool compact,
+                             std::true_type /* is_bulk */) noexcept
+{
+    if (count == 0) {
+        return offset;
+    }
+
+    if (!compact) {
+        return AlignPickledOffset(offset) + (count - 1) * AlignPickledOffset(sizeof(T)) +
+               sizeof(T);
+    }
+
+    if (!IsVarintEncoded<T>::value) {
+        return offset + count * sizeof(T);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        offset += GetVarintSize(ToVarintValue(data[i]));
+    }
+
+    return offset;
+}
+
+template<typename Container>
+size_t GetPickledElementsEnd(size_t offset, const Container& value, bool compact) noexcept
+{
+    for (const auto& ele : value) {
+        offset = GetPickledEnd(offset, ele, compact);
+    }
+
+    return offset;
+}
+
+template<typename T>
+size_t GetPickledElementsEnd(size_t offset, const T* data, size_t count, bool compact,
+                             std::false_type /* is_bulk */) noexcept
+{
+    for (size_t i = 0; i < count; ++i) {
+        offset = GetPickledEnd(offset, data[i], compact);
+    }
+
+    return offset;
+}
+
+template<typename T>
+size_t GetPickledEnd(size_t offset, const std::vector<T>& value, bool compact) noexcept
+{
+    offset = GetPickledEnd(offset, value.size(), compact);
+    return GetPickledElementsEnd(offset, value.data(), value.size(), compact,
+                                 IsBulkPickleable<T>());
+}
+
+template<typename T, size_t N>
+size_t GetPickledEnd(size_t offset, const std::array<T, N>& value, bool compact) noexcept
+{
+    offset = GetPickledEnd(offset, value.size(), compact);
+    return GetPickledElementsEnd(offset, value.data(), N, compact, IsBulkPickleable<T>());
+}
+
+template<typename T>
+size_t GetPickledEnd(size_t offset, const std::list<T>& value, bool compact) noexcept
+{
+    return GetPickledElementsEnd(GetPickledEnd(offset, value.size(), compact), value, compact);
+}
+
+template<typename T1, typename T2>
+size_t GetPickledEnd(size_t offset, const std::pair<T1, T2>& value, bool compact) noexcept
+{
+    return GetPickledEnd(GetPickledEnd(offset, value.first, compact), value.second, compact);
+}
+
+template<typename Key, typename Compare>
+size_t GetPickledEnd(size_t offset, const std::set<Key, Compare>& value, bool compact) noexcept
+{
+    return GetPickledElementsEnd(GetPickledEnd(offset, value.size(), compact), value, compact);
+}
+
+template<typename Key, typename T, typename Compare>
+size_t GetPickledEnd(size_t offset, const std::map<Key, T, Compare>& value,
+                     bool compact) noexcept
+{
+    return GetPickledElementsEnd(GetPickledEnd(offset, value.size(), compact), value, compact);
+}
+
+template<typename Key, typename Hash, typename KeyEqual>
+size_t GetPickledEnd(size_t offset, const std::unordered_set<Key, Hash, KeyEqual>& value,
+                     bool compact) noexcept
+{
+    return GetPickledElementsEnd(GetPickledEnd(offset, value.size(), compact), value, compact);
+}
+
+template<typename Key, typename T, typename Hash, typename KeyEqual>
+size_t GetPickledEnd(size_t offset, const std::unordered_map<Key, T, Hash, KeyEqual>& value,
+                     bool compact) noexcept
+{
+    return GetPickledElementsEnd(GetPickledEnd(offset, value.size(), compact), value, compact);
+}
+
+template<typename T>
+size_t GetPickledEnd(size_t offset, const std::unique_ptr<T>& value, bool compact) noexcept
+{
+    offset = GetPickledEnd(offset, value != nullptr, compact);
+    return value ? GetPickledEnd(offset, *value, compact) : offset;
+}
+
+template<typename T, std::enable_if_t<IsOptionalLike<T>::value, int>>
+size_t GetPickledEnd(size_t offset, const T& value, bool compact) noexcept
+{
+    offset = GetPickledEnd(offset, static_cast<bool>(value.has_value()), compact);
+    return value.has_value() ? GetPickledEnd(offset, *value, compact) : offset;
+}
+
+template<typename T, typename Fields, size_t... I>
+size_t GetPickledFieldsEnd(size_t offset, const T& value, const Fields& fields, bool compact,
+                           std::index_sequence<I...>) noexcept
+{
+    using expander = int[];
+    (void)expander{0, (offset = GetPickledEnd(offset, value.*std::get<I>(fields), compact), 0)...};
+    return offset;
+}
+
+template<typename T, std::enable_if_t<HasPickleFields<T>::value, int>>
+size_t GetPickledEnd(size_t offset, const T& value, bool compact) noexcept
+{
+    // The first field is aligned, and so are the rest.
+    constexpr size_t kFixedSize = FixedPickledSize<T>::value;
+    if (!compact && kFixedSize != 0) {
+        return AlignPickledOffset(offset) + kFixedSize;
+    }
+
+    using Fields = PickleFieldsOf<T>;
+    return GetPickledFieldsEnd(offset, value, KBasePickleFields(&value), compact,
+                               std::make_index_sequence<std::tuple_size<Fields>::value>());
+}
+
+// -*- Reading and writing -*-
+
+template<typename T, typename Fields, size_t... I>
+void WritePickleFields(Pickle& pickle, const T& value, const Fields& fields,
+                       std::index_sequence<I...>)
+{
+    using expander = int[];
+    (void)expander{0, ((pickle << value.*std::get<I>(fields)), 0)...};
+}
+
+template<typename T, typename Fields, size_t... I>
+void ReadPickleFields(PickleReader& reader, T& value, const Fields& fields,
+                      std::index_sequence<I...>, std::true_type /* fundamental_only */)
+{
+    reader.ReadFields(value.*std::get<I>(fields)...);
+}
+
+template<typename T, typename Fields, size_t... I>
+void ReadPickleFields(PickleReader& reader, T& value, const Fields& fields,
+                      std::index_sequence<I...>, std::false_type /* fundamental_only */)
+{
+    using expander = int[];
+    (void)expander{0, ((reader >> value.*std::get<I>(fields)), 0)...};
+}
+
+}   // namespace internal
+
+template<typename T, std::enable_if_t<internal::HasPickleFields<T>::value, int> = 0>
+Pickle& operator<<(Pickle& pickle, const T& value)
+{
+    using Fields = internal::PickleFieldsOf<T>;
+    internal::WritePickleFields(pickle, value, KBasePickleFields(&value),
+                                std::make_index_sequence<std::tuple_size<Fields>::value>());
+    return pickle;
+}
+
+template<typename T, std::enable_if_t<internal::HasPickleFields<T>::value, int> = 0>
+PickleReader& operator>>(PickleReader& reader, T& value)
+{
+    using Fields = internal::PickleFieldsOf<T>;
+    internal::ReadPickleFields(reader, value, KBasePickleFields(&value),
+                               std::make_index_sequence<std::tuple_size<Fields>::value>(),
+                               internal::HasFundamentalFieldsOnly<Fields>());
+    return reader;
+}
+
+// A value which may be absent is pickled as a bool indicating its presence, followed by
+// the value if present.
+
+template<typename T>
+Pickle& operator<<(Pickle& pickle, const std::unique_ptr<T>& value)
+{
+    pickle << (value != nullptr);
+    if (value) {
+        pickle << *value;
+    }
+
+    return pickle;
+}
+
+template<typename T>
+PickleReader& operator>>(PickleReader& reader, std::unique_ptr<T>& value)
+{
+    bool present = false;
+    reader >> present;
+    value.reset();
+    if (present && !reader.has_error()) {
+        auto new_value = std::make_unique<T>();
+        reader >> *new_value;
+        if (!reader.has_error()) {
+            value = std::move(new_value);
+        }
+    }
+
+    return reader;
+}
+
+template<typename T, std::enable_if_t<internal::IsOptionalLike<T>::value, int> = 0>
+Pickle& operator<<(Pickle& pickle, const T& value)
+{
+    pickle << static_cast<bool>(value.has_value());
+    if (value.has_value()) {
+        pickle << *value;
+    }
+
+    return pickle;
+}
+
+template<typename T, std::enable_if_t<internal::IsOptionalLike<T>::value, int> = 0>
+PickleReader& operator>>(PickleReader& reader, T& value)
+{
+    bool present = false;
+    reader >> present;
+    value = T();
+    if (present && !reader.has_error()) {
+        value.emplace();
+        reader >> *value;
+        if (reader.has_error()) {
+            value = T();
+        }
+    }
+
+    return reader;
+}
+
+// Returns the size in bytes of the payload of a pickle, in which only `value` is written.
+// For classes whose fields are all of fixed sizes, the size in aligned encoding is a
+// compile-time constant; for others, the size is calculated by walking over `value`.
+template<typename T>
+size_t GetPickledSize(const T& value, PickleEncoding encoding = PickleEncoding::Aligned)
+{
+    return internal::GetPickledEnd(0, value, encoding == PickleEncoding::Compact);
+}
+
+// Returns a pickle in which `value` is written, and its buffer is allocated only once.
+template<typename T>
+Pickle MakePickle(const T& value, PickleEncoding encoding = PickleEncoding::Aligned,
+                  PickleAllocator* allocator = PickleAllocator::Default())
+{
+    Pickle pickle(allocator, GetPickledSize(value, encoding), encoding);
+    pickle << value;
+    return pickle;
+}
+
+}   // namespace kbase
+
+#endif  // KBASE_PICKLE_FIELDS_H_
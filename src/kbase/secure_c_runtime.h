@@ -54,14 +54,12 @@ inline void SecureLocalTime(const time_t* time, tm* tm)
 #else
     memset(tm, 0, sizeof(struct tm));
 
-    auto rv = localtime(time);
+    auto rv = localtime_r(time, tm);
 
     if (!rv) {
         ENSURE(CHECK, NotReached())(errno).Require();
         return;
     }
-
-    *tm = *rv;
 #endif
 }
 
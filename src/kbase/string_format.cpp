@@ -4,8 +4,17 @@
 
 #include "kbase/string_format.h"
 
+#include <algorithm>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
 #include "kbase/basic_macros.h"
+#include "kbase/concurrent_lru_cache.h"
 #include "kbase/scope_guard.h"
+#include "kbase/singleton.h"
 
 #if defined(OS_POSIX)
 #include <cstdarg>
@@ -13,9 +22,14 @@
 
 namespace {
 
+using kbase::BasicPreparedFormat;
+using kbase::ConcurrentLRUCache;
 using kbase::FormatError;
+using kbase::LeakySingletonTraits;
 using kbase::NotReached;
+using kbase::Singleton;
 using kbase::internal::FormatTraits;
+using kbase::internal::NormalizeDecimalPoint;
 using kbase::internal::Placeholder;
 using kbase::internal::PlaceholderList;
 using kbase::internal::IsDigit;
@@ -169,6 +183,162 @@ typename FormatTraits<CharT>::String AnalyzeFormatT(const CharT* fmt, Placeholde
     return analyzed_fmt;
 }
 
+constexpr char kDigitPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+constexpr char kLowerHexDigits[] = "0123456789abcdef";
+constexpr char kUpperHexDigits[] = "0123456789ABCDEF";
+
+char* FormatDecimalBackward(unsigned long long value, char* end) noexcept
+{
+    while (value >= 100) {
+        auto index = static_cast<size_t>(value % 100) * 2;
+        value /= 100;
+        *--end = kDigitPairs[index + 1];
+        *--end = kDigitPairs[index];
+    }
+
+    if (value >= 10) {
+        auto index = static_cast<size_t>(value) * 2;
+        *--end = kDigitPairs[index + 1];
+        *--end = kDigitPairs[index];
+    } else {
+        *--end = static_cast<char>('0' + value);
+    }
+
+    return end;
+}
+
+// For bases of powers of 2.
+template<unsigned int BitsPerDigit>
+char* FormatPowerOf2Backward(unsigned long long value, const char* digits, char* end) noexcept
+{
+    constexpr unsigned long long kMask = (1ULL << BitsPerDigit) - 1;
+    do {
+        *--end = digits[value & kMask];
+        value >>= BitsPerDigit;
+    } while (value != 0);
+
+    return end;
+}
+
+float ParseFloat(const char* str, float)
+{
+    return strtof(str, nullptr);
+}
+
+double ParseFloat(const char* str, double)
+{
+    return strtod(str, nullptr);
+}
+
+long double ParseFloat(const char* str, long double)
+{
+    return strtold(str, nullptr);
+}
+
+template<typename T>
+size_t FormatFloatT(char* buf, size_t buf_size, T value, char type, bool show_pos,
+                    bool has_precision, size_t precision) noexcept
+{
+    char fmt[8] = "%";
+    char* ptr = fmt + 1;
+    if (show_pos) {
+        *ptr++ = '+';
+    }
+
+    *ptr++ = '.';
+    *ptr++ = '*';
+    if (std::is_same<T, long double>::value) {
+        *ptr++ = 'L';
+    }
+
+    bool shortest = false;
+    if (type == 'e' || type == 'E') {
+        *ptr = type;
+        // The default precision of streams.
+        precision = has_precision ? precision : 6;
+    } else if (has_precision) {
+        *ptr = 'f';
+    } else {
+        *ptr = 'g';
+        shortest = true;
+    }
+
+    // Precisions less than digits10 could not be shorter, as trailing zeros are removed.
+    // The round-trip check parses the output before normalization, as strtod() and its
+    // siblings expect the decimal point of the same locale.
+    if (shortest) {
+        for (auto digits = std::numeric_limits<T>::digits10;
+             digits < std::numeric_limits<T>::max_digits10; ++digits) {
+            int length = snprintf(buf, buf_size, fmt, digits, value);
+            if (length >= 0 && static_cast<size_t>(length) < buf_size &&
+                ParseFloat(buf, T()) == value) {
+                return NormalizeDecimalPoint(buf, static_cast<size_t>(length));
+            }
+        }
+
+        precision = std::numeric_limits<T>::max_digits10;
+    }
+
+    int length = snprintf(buf, buf_size, fmt, static_cast<int>(precision), value);
+    if (length < 0) {
+        return 0;
+    }
+
+    if (static_cast<size_t>(length) >= buf_size) {
+        return static_cast<size_t>(length);
+    }
+
+    return NormalizeDecimalPoint(buf, static_cast<size_t>(length));
+}
+
+constexpr size_t kCachedFormatCapacity = 1024;
+
+template<typename CharT>
+class FormatCache {
+public:
+    FormatCache()
+        : cache_(kCachedFormatCapacity)
+    {}
+
+    ~FormatCache() = default;
+
+    DISALLOW_COPY(FormatCache);
+
+    DISALLOW_MOVE(FormatCache);
+
+    BasicPreparedFormat<CharT> Get(const CharT* fmt)
+    {
+        auto prepared = cache_.GetOrCompute(fmt, [fmt] {
+            return BasicPreparedFormat<CharT>(fmt);
+        });
+
+        // The address may have been reused by another format string.
+        if (prepared.format() != fmt) {
+            prepared = BasicPreparedFormat<CharT>(fmt);
+            cache_.Put(fmt, prepared);
+        }
+
+        return prepared;
+    }
+
+private:
+    ConcurrentLRUCache<const CharT*, BasicPreparedFormat<CharT>> cache_;
+};
+
+// Leaky, since formatting may happen during application exit.
+template<typename CharT>
+BasicPreparedFormat<CharT> GetCachedFormatT(const CharT* fmt)
+{
+    using Cache = FormatCache<CharT>;
+    return Singleton<Cache, LeakySingletonTraits<Cache>>::instance()->Get(fmt);
+}
+
 } // namespace
 
 namespace kbase {
@@ -235,6 +405,16 @@ void StringPrintf(std::wstring& str, const wchar_t* fmt, ...)
     StringAppendPrintfT(str, fmt, args);
 }
 
+PreparedFormat GetCachedFormat(const char* fmt)
+{
+    return GetCachedFormatT(fmt);
+}
+
+WPreparedFormat GetCachedFormat(const wchar_t* fmt)
+{
+    return GetCachedFormatT(fmt);
+}
+
 namespace internal {
 
 std::string AnalyzeFormat(const char* fmt, PlaceholderList<char>& placeholders)
@@ -247,6 +427,64 @@ std::wstring AnalyzeFormat(const wchar_t* fmt, PlaceholderList<wchar_t>& placeho
     return AnalyzeFormatT(fmt, placeholders);
 }
 
+char* FormatIntegerBackward(unsigned long long value, char type, char* end) noexcept
+{
+    switch (type) {
+        case 'b':
+            return FormatPowerOf2Backward<1>(value, kLowerHexDigits, end);
+
+        case 'o':
+            return FormatPowerOf2Backward<3>(value, kLowerHexDigits, end);
+
+        case 'x':
+            return FormatPowerOf2Backward<4>(value, kLowerHexDigits, end);
+
+        case 'X':
+            return FormatPowerOf2Backward<4>(value, kUpperHexDigits, end);
+
+        default:
+            return FormatDecimalBackward(value, end);
+    }
+}
+
+size_t NormalizeDecimalPoint(char* buf, size_t length) noexcept
+{
+    const char* decimal_point = localeconv()->decimal_point;
+    if (!decimal_point || !*decimal_point || strcmp(decimal_point, ".") == 0) {
+        return length;
+    }
+
+    size_t point_size = strlen(decimal_point);
+    auto end = buf + length;
+    auto pos = std::search(buf, end, decimal_point, decimal_point + point_size);
+    if (pos == end) {
+        return length;
+    }
+
+    *pos = '.';
+    std::copy(pos + point_size, end + 1, pos + 1);
+
+    return length - (point_size - 1);
+}
+
+size_t FormatFloat(char* buf, size_t buf_size, float value, char type, bool show_pos,
+                   bool has_precision, size_t precision) noexcept
+{
+    return FormatFloatT(buf, buf_size, value, type, show_pos, has_precision, precision);
+}
+
+size_t FormatFloat(char* buf, size_t buf_size, double value, char type, bool show_pos,
+                   bool has_precision, size_t precision) noexcept
+{
+    return FormatFloatT(buf, buf_size, value, type, show_pos, has_precision, precision);
+}
+
+size_t FormatFloat(char* buf, size_t buf_size, long double value, char type, bool show_pos,
+                   bool has_precision, size_t precision) noexcept
+{
+    return FormatFloatT(buf, buf_size, value, type, show_pos, has_precision, precision);
+}
+
 }   // namespace internal
 
 }   // namespace kbase
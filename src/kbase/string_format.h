@@ -10,12 +10,20 @@
 #define KBASE_STRING_FORMAT_H_
 
 #include <algorithm>
+#include <cstdint>
 #include <iomanip>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "kbase/basic_macros.h"
 #include "kbase/error_exception_util.h"
+#include "kbase/string_view.h"
 
 namespace kbase {
 
@@ -30,6 +38,14 @@ public:
     {}
 };
 
+// The result of FormatToBuffer().
+struct FormatToBufferResult {
+    // The length of the whole formatted string, excluding the terminating null character.
+    size_t size;
+    // True if the buffer is too small to hold the whole formatted string.
+    bool truncated;
+};
+
 // All Printf-series functions may throw an exception, if the size of the buffer that stores
 // the formatted data exceeds the threshold.
 
@@ -48,6 +64,9 @@ void StringPrintf(std::wstring& str, const wchar_t* fmt, ...);
 void StringAppendPrintf(std::string& str, const char* fmt, ...);
 void StringAppendPrintf(std::wstring& str, const wchar_t* fmt, ...);
 
+template<typename CharT>
+class BasicPreparedFormat;
+
 namespace internal {
 
 template<typename CharT>
@@ -119,266 +138,769 @@ inline unsigned long StrToUL(const wchar_t* str, wchar_t*& end_ptr)
     return wcstoul(str, &end_ptr, 10);
 }
 
-inline bool IsTypeSpecifier(char ch)
+// -*- Format specifiers -*-
+
+// Raises FormatError; when it is reached while parsing at compile time, the parsing fails
+// to be a constant expression, and thus becomes a compile error.
+[[noreturn]] inline void ThrowFormatError(const char* reason)
 {
-    return ch == 'b' || ch == 'x' || ch == 'X' || ch == 'o' || ch == 'e' || ch == 'E';
+    throw FormatError(reason);
 }
 
-inline bool IsTypeSpecifier(wchar_t ch)
+template<typename CharT>
+constexpr bool IsAsciiDigit(CharT ch) noexcept
 {
-    return ch == L'b' || ch == L'x' || ch == L'X' || ch == L'o' || ch == L'e' || ch == L'E';
+    return ch >= '0' && ch <= '9';
 }
 
+enum class FormatAlign {
+    None,
+    Left,
+    Right
+};
+
+// A parsed specifier of a placeholder.
 template<typename CharT>
-SpecifierCategory GuessNextSpecCategory(const CharT* spec)
+struct FormatSpec {
+    constexpr FormatSpec() noexcept
+        : fill(' '), align(FormatAlign::None), show_pos(false), width(0),
+          has_precision(false), precision(0), type(0)
+    {}
+
+    CharT fill;
+    FormatAlign align;
+    bool show_pos;
+    size_t width;
+    bool has_precision;
+    size_t precision;
+    // One of type specifiers, or 0 if absent.
+    CharT type;
+};
+
+template<typename CharT>
+constexpr size_t ParseDigits(const CharT*& ptr, const CharT* end) noexcept
 {
-    // Maybe we have finished parsing.
-    if (*spec == '\0') {
-        return SpecifierCategory::None;
+    size_t value = 0;
+    for (; ptr != end && IsAsciiDigit(*ptr); ++ptr) {
+        value = value * 10 + static_cast<size_t>(*ptr - '0');
     }
 
-    if (*(spec + 1) == '<' || *(spec + 1) == '>') {
-        return SpecifierCategory::PaddingAlign;
-    }
+    return value;
+}
 
-    if (*spec == '+') {
-        return SpecifierCategory::Sign;
-    }
+// Parses a specifier in [first, last), with the rules documented at StringFormat().
+template<typename CharT>
+constexpr FormatSpec<CharT> ParseFormatSpec(const CharT* first, const CharT* last)
+{
+    FormatSpec<CharT> spec;
+    auto last_spec_type = SpecifierCategory::None;
+    auto ptr = first;
+    while (ptr != last) {
+        auto spec_type = SpecifierCategory::None;
+        if (last - ptr >= 2 && (ptr[1] == '<' || ptr[1] == '>')) {
+            spec_type = SpecifierCategory::PaddingAlign;
+            spec.fill = ptr[0];
+            spec.align = ptr[1] == '<' ? FormatAlign::Left : FormatAlign::Right;
+            ptr += 2;
+        } else if (*ptr == '+') {
+            spec_type = SpecifierCategory::Sign;
+            spec.show_pos = true;
+            ++ptr;
+        } else if (IsAsciiDigit(*ptr)) {
+            spec_type = SpecifierCategory::Width;
+            spec.width = ParseDigits(ptr, last);
+        } else if (*ptr == '.') {
+            spec_type = SpecifierCategory::Precision;
+            spec.has_precision = true;
+            spec.precision = ParseDigits(++ptr, last);
+        } else if (*ptr == 'b' || *ptr == 'x' || *ptr == 'X' || *ptr == 'o' || *ptr == 'e' ||
+                   *ptr == 'E') {
+            spec_type = SpecifierCategory::Type;
+            spec.type = *ptr++;
+        } else {
+            ThrowFormatError("Unknown format specifier");
+        }
 
-    if (IsDigit(*spec)) {
-        return SpecifierCategory::Width;
-    }
+        if (spec_type <= last_spec_type) {
+            ThrowFormatError("Format specifiers are out of order");
+        }
 
-    if (*spec == '.') {
-        return SpecifierCategory::Precision;
+        last_spec_type = spec_type;
     }
 
-    if (IsTypeSpecifier(*spec)) {
-        return SpecifierCategory::Type;
-    }
+    return spec;
+}
 
-    ENSURE(RAISE, NotReached()).Require<FormatError>();
-    return SpecifierCategory::None;
+// -*- Formatting arguments -*-
+
+enum class FormatArgKind {
+    Bool,
+    Char,
+    Integer,
+    Float,
+    String,
+    Stream
+};
+
+template<FormatArgKind Kind>
+using FormatArgTag = std::integral_constant<FormatArgKind, Kind>;
+
+template<typename T>
+struct IsCharType : std::integral_constant<bool,
+                                           std::is_same<T, char>::value ||
+                                           std::is_same<T, signed char>::value ||
+                                           std::is_same<T, unsigned char>::value ||
+                                           std::is_same<T, wchar_t>::value ||
+                                           std::is_same<T, char16_t>::value ||
+                                           std::is_same<T, char32_t>::value> {};
+
+// Characters of other types are left to streams.
+template<typename CharT, typename T>
+struct IsCharOf : std::integral_constant<bool,
+                                         std::is_same<T, CharT>::value ||
+                                         (std::is_same<CharT, char>::value &&
+                                          IsCharType<T>::value && sizeof(T) == 1)> {};
+
+template<typename CharT, typename T>
+struct FormatArgKindOf : std::integral_constant<FormatArgKind,
+    std::is_same<T, bool>::value ? FormatArgKind::Bool :
+    IsCharOf<CharT, T>::value ? FormatArgKind::Char :
+    std::is_integral<T>::value && !IsCharType<T>::value ? FormatArgKind::Integer :
+    std::is_floating_point<T>::value ? FormatArgKind::Float :
+    std::is_convertible<const T&, BasicStringView<CharT>>::value ? FormatArgKind::String :
+    FormatArgKind::Stream> {};
+
+// Enough for 64 binary digits and a sign.
+constexpr size_t kMaxFormattedIntegerLength = 66;
+
+// Writes `value` in the base given by the type specifier, or in decimal if it is absent,
+// backwards from `end`, and returns the position of the first digit.
+char* FormatIntegerBackward(unsigned long long value, char type, char* end) noexcept;
+
+// snprintf() honors LC_NUMERIC, which may use a decimal point other than '.', e.g. ',' in
+// de_DE; replaces it with '.' in the null-terminated `buf` of `length` characters, so that the
+// output doesn't depend on the global C locale, and returns the new length.
+size_t NormalizeDecimalPoint(char* buf, size_t length) noexcept;
+
+// Writes `value` into `buf` as snprintf() does, but always with '.' as the decimal point, and
+// returns the length of the whole result.
+// Without a precision or an exponent type specifier, `value` is written in the shortest form
+// that reads back as the same value.
+size_t FormatFloat(char* buf, size_t buf_size, float value, char type, bool show_pos,
+                   bool has_precision, size_t precision) noexcept;
+size_t FormatFloat(char* buf, size_t buf_size, double value, char type, bool show_pos,
+                   bool has_precision, size_t precision) noexcept;
+size_t FormatFloat(char* buf, size_t buf_size, long double value, char type, bool show_pos,
+                   bool has_precision, size_t precision) noexcept;
+
+// Appends characters in [first, last) to `out`, which is either a string or a
+// FormatBufferOutput; characters are widened if necessary.
+
+template<typename Out, typename SrcCharT>
+void AppendChars(Out& out, const SrcCharT* first, const SrcCharT* last)
+{
+    out.append(first, last);
+}
+
+template<typename CharT, typename SrcCharT>
+void AppendChars(std::basic_string<CharT>& out, const SrcCharT* first, const SrcCharT* last)
+{
+    // Appending a range of other characters constructs a temporary string.
+    auto old_size = out.size();
+    out.resize(old_size + static_cast<size_t>(last - first));
+    std::copy(first, last, &out[old_size]);
 }
 
 template<typename CharT>
-void ApplyPaddingAlignFormat(const CharT* spec,
-                             SpecifierCategory last_spec_type,
-                             typename FormatTraits<CharT>::Stream& stream,
-                             const CharT*& spec_end)
+void AppendChars(std::basic_string<CharT>& out, const CharT* first, const CharT* last)
+{
+    out.append(first, static_cast<size_t>(last - first));
+}
+
+// Appends `length` characters at `data`, padded to the width of `spec`; characters are
+// widened if necessary.
+template<typename Out, typename CharT, typename SrcCharT>
+void AppendPadded(Out& out, const SrcCharT* data, size_t length, const FormatSpec<CharT>& spec)
 {
-    ENSURE(RAISE, last_spec_type < SpecifierCategory::PaddingAlign).Require<FormatError>();
+    size_t padding = spec.width > length ? spec.width - length : 0;
+    if (padding != 0 && spec.align != FormatAlign::Left) {
+        out.append(padding, spec.fill);
+    }
 
-    typename FormatTraits<CharT>::Stream& os = stream;
+    AppendChars(out, data, data + length);
 
-    CharT fill_ch = *spec++;
-    os << std::setfill(fill_ch);
-    if (*spec == '<') {
-        os << std::left;
-    } else {
-        os << std::right;
+    if (padding != 0 && spec.align == FormatAlign::Left) {
+        out.append(padding, spec.fill);
     }
+}
 
-    spec_end = spec + 1;
+template<typename T>
+constexpr bool IsNegative(T value, std::true_type /* is_signed */) noexcept
+{
+    return value < 0;
 }
 
-template<typename CharT>
-void ApplySignFormat(const CharT* spec,
-                     SpecifierCategory last_spec_type,
-                     typename FormatTraits<CharT>::Stream& stream,
-                     const CharT*& spec_end)
+template<typename T>
+constexpr bool IsNegative(T, std::false_type /* is_signed */) noexcept
 {
-    ENSURE(RAISE, last_spec_type < SpecifierCategory::Sign).Require<FormatError>();
+    return false;
+}
 
-    typename FormatTraits<CharT>::Stream& os = stream;
+template<typename Out, typename CharT, typename T>
+void AppendFormattedArg(Out& out, T value,
+                        const FormatSpec<CharT>& spec, FormatArgTag<FormatArgKind::Integer>)
+{
+    using UnsignedT = std::make_unsigned_t<T>;
+
+    // Only decimal numbers are signed, as streams do.
+    bool decimal = spec.type != 'b' && spec.type != 'o' && spec.type != 'x' && spec.type != 'X';
+    bool negative = decimal && IsNegative(value, std::is_signed<T>());
+    auto magnitude = static_cast<UnsignedT>(value);
+    if (negative) {
+        magnitude = static_cast<UnsignedT>(0 - magnitude);
+    }
 
-    os << std::showpos;
+    char buf[kMaxFormattedIntegerLength];
+    auto end = buf + kMaxFormattedIntegerLength;
+    auto ptr = FormatIntegerBackward(magnitude, static_cast<char>(spec.type), end);
+    if (negative) {
+        *--ptr = '-';
+    } else if (decimal && spec.show_pos && std::is_signed<T>::value) {
+        *--ptr = '+';
+    }
 
-    spec_end = spec + 1;
+    AppendPadded(out, ptr, static_cast<size_t>(end - ptr), spec);
 }
 
-template<typename CharT>
-void ApplyWidthFormat(const CharT* spec,
-                      SpecifierCategory last_spec_type,
-                      typename FormatTraits<CharT>::Stream& stream,
-                      const CharT*& spec_end)
+// Booleans are written as 1 or 0, or as true or false with type specifier `b`.
+template<typename Out, typename CharT>
+void AppendFormattedArg(Out& out, bool value,
+                        const FormatSpec<CharT>& spec, FormatArgTag<FormatArgKind::Bool>)
 {
-    ENSURE(RAISE, last_spec_type < SpecifierCategory::Width).Require<FormatError>();
+    if (spec.type == 'b') {
+        auto text = value ? "true" : "false";
+        AppendPadded(out, text, value ? 4 : 5, spec);
+        return;
+    }
+
+    auto number_spec = spec;
+    number_spec.type = 0;
+    AppendFormattedArg(out, static_cast<int>(value), number_spec,
+                       FormatArgTag<FormatArgKind::Integer>());
+}
 
-    typename FormatTraits<CharT>::Stream& os = stream;
+template<typename Out, typename CharT, typename T>
+void AppendFormattedArg(Out& out, T value,
+                        const FormatSpec<CharT>& spec, FormatArgTag<FormatArgKind::Char>)
+{
+    auto ch = static_cast<CharT>(value);
+    AppendPadded(out, &ch, 1, spec);
+}
 
-    CharT* digit_end = nullptr;
-    auto width = StrToUL(spec, digit_end);
-    os << std::setw(width);
+template<typename Out, typename CharT, typename T>
+void AppendFormattedArg(Out& out, T value,
+                        const FormatSpec<CharT>& spec, FormatArgTag<FormatArgKind::Float>)
+{
+    constexpr size_t kBufferSize = 64;
+    char buf[kBufferSize];
+    auto type = static_cast<char>(spec.type);
+    auto length = FormatFloat(buf, kBufferSize, value, type, spec.show_pos, spec.has_precision,
+                              spec.precision);
+    if (length < kBufferSize) {
+        AppendPadded(out, buf, length, spec);
+        return;
+    }
 
-    spec_end = digit_end;
+    // Only for huge numbers in fixed form, or large precisions.
+    // The length may shrink once the decimal point of the locale is normalized.
+    std::vector<char> large_buf(length + 1);
+    length = FormatFloat(large_buf.data(), large_buf.size(), value, type, spec.show_pos,
+                         spec.has_precision, spec.precision);
+    AppendPadded(out, large_buf.data(), length, spec);
 }
 
 template<typename CharT>
-void ApplyPrecisionFormat(const CharT* spec,
-                          SpecifierCategory last_spec_type,
-                          typename FormatTraits<CharT>::Stream& stream,
-                          const CharT*& spec_end)
+BasicStringView<CharT> ToFormatStringView(const CharT* str, std::true_type /* is_pointer */)
 {
-    ENSURE(RAISE, last_spec_type < SpecifierCategory::Precision).Require<FormatError>();
-
-    typename FormatTraits<CharT>::Stream& os = stream;
+    // Streams write nothing for null pointers.
+    return str ? BasicStringView<CharT>(str) : BasicStringView<CharT>();
+}
 
-    CharT* digit_end = nullptr;
-    auto precision_size = StrToUL(spec + 1, digit_end);
-    os << std::fixed << std::setprecision(precision_size);
+template<typename CharT, typename T>
+BasicStringView<CharT> ToFormatStringView(const T& str, std::false_type /* is_pointer */)
+{
+    return BasicStringView<CharT>(str);
+}
 
-    spec_end = digit_end;
+template<typename Out, typename CharT, typename T>
+void AppendFormattedArg(Out& out, const T& arg,
+                        const FormatSpec<CharT>& spec, FormatArgTag<FormatArgKind::String>)
+{
+    auto str = ToFormatStringView<CharT>(arg, std::is_pointer<std::decay_t<T>>());
+    AppendPadded(out, str.data(), str.size(), spec);
 }
 
-template<typename CharT>
-void ApplyTypeFormat(const CharT* spec,
-                     SpecifierCategory last_spec_type,
-                     typename FormatTraits<CharT>::Stream& stream,
-                     const CharT*& spec_end)
+// Types other than built-in ones are formatted by their `operator<<`, and their outputs are
+// padded as a whole.
+template<typename Out, typename CharT, typename Arg>
+void AppendFormattedArg(Out& out, const Arg& arg,
+                        const FormatSpec<CharT>& spec, FormatArgTag<FormatArgKind::Stream>)
 {
-    ENSURE(RAISE, last_spec_type < SpecifierCategory::Type).Require<FormatError>();
+    typename FormatTraits<CharT>::Stream stream;
+    if (spec.show_pos) {
+        stream << std::showpos;
+    }
 
-    typename FormatTraits<CharT>::Stream& os = stream;
+    if (spec.has_precision) {
+        stream << std::fixed << std::setprecision(static_cast<int>(spec.precision));
+    }
 
-    CharT type_mark = *spec;
-    switch (type_mark) {
+    switch (spec.type) {
         case 'b':
-            os << std::boolalpha;
+            stream << std::boolalpha;
             break;
 
         case 'x':
-            os << std::hex;
+            stream << std::hex;
             break;
 
         case 'X':
-            os << std::hex << std::uppercase;
+            stream << std::hex << std::uppercase;
             break;
 
         case 'o':
-            os << std::oct;
+            stream << std::oct;
             break;
 
         case 'e':
-            os << std::scientific;
+            stream << std::scientific;
             break;
 
         case 'E':
-            os << std::scientific << std::uppercase;
+            stream << std::scientific << std::uppercase;
             break;
 
         default:
-            ENSURE(CHECK, NotReached()).Require();
             break;
     }
 
-    spec_end = spec + 1;
+    stream << arg;
+    auto str = stream.str();
+    AppendPadded(out, str.data(), str.size(), spec);
 }
 
-template<typename CharT, typename Arg>
-void FormatArgWithSpecifier(Arg&& arg,
-                            const typename FormatTraits<CharT>::String& specifier,
-                            typename FormatTraits<CharT>::Stream& stream,
-                            typename FormatTraits<CharT>::String& formatted)
+// Formats built-in numbers, characters and strings directly into `out`.
+template<typename Out, typename CharT, typename Arg>
+void AppendFormattedArg(Out& out, const Arg& arg, const FormatSpec<CharT>& spec)
 {
-    if (specifier.empty()) {
-        stream << arg;
-        formatted = stream.str();
-        return;
+    AppendFormattedArg(out, arg, spec, FormatArgTag<FormatArgKindOf<CharT, Arg>::value>());
+}
+
+// -*- Parsing format strings -*-
+
+// Parses a format string with the same rules as AnalyzeFormat(), and hands pieces over to
+// `handler.AddLiteral(begin, length)` and `handler.AddPlaceholder(arg_index, spec)` in order.
+// It can be done at compile time with a literal handler.
+template<typename CharT, typename Handler>
+constexpr void ParseFormatTo(const CharT* fmt, Handler& handler)
+{
+    size_t literal_begin = 0;
+    size_t i = 0;
+    while (fmt[i] != '\0') {
+        if (fmt[i] == '{') {
+            if (fmt[i + 1] == '{') {
+                // Keeps the first `{` as literal text.
+                handler.AddLiteral(literal_begin, i + 1 - literal_begin);
+                i += 2;
+                literal_begin = i;
+                continue;
+            }
+
+            handler.AddLiteral(literal_begin, i - literal_begin);
+            ++i;
+            if (!IsAsciiDigit(fmt[i])) {
+                ThrowFormatError("Placeholder has no index");
+            }
+
+            auto index_begin = fmt + i;
+            auto index_end = index_begin;
+            while (IsAsciiDigit(*index_end)) {
+                ++index_end;
+            }
+
+            auto arg_index = ParseDigits(index_begin, index_end);
+            i = static_cast<size_t>(index_end - fmt);
+            FormatSpec<CharT> spec;
+            if (fmt[i] == ':') {
+                auto spec_begin = ++i;
+                for (; fmt[i] != '}'; ++i) {
+                    if (fmt[i] == '\0' || fmt[i] == '{') {
+                        ThrowFormatError("Placeholder is not closed");
+                    }
+                }
+
+                spec = ParseFormatSpec(fmt + spec_begin, fmt + i);
+            } else if (fmt[i] != '}') {
+                ThrowFormatError("Placeholder is not closed");
+            }
+
+            handler.AddPlaceholder(arg_index, spec);
+            ++i;
+            literal_begin = i;
+        } else if (fmt[i] == '}') {
+            if (fmt[i + 1] != '}') {
+                ThrowFormatError("Unpaired `}`");
+            }
+
+            handler.AddLiteral(literal_begin, i + 1 - literal_begin);
+            i += 2;
+            literal_begin = i;
+        } else {
+            ++i;
+        }
     }
 
-    auto spec = specifier.data();
-    auto last_spec_type = SpecifierCategory::None;
-    auto next_spec_type = SpecifierCategory::None;
-    while ((next_spec_type = GuessNextSpecCategory(spec)) != SpecifierCategory::None) {
-        switch (next_spec_type) {
-            case SpecifierCategory::PaddingAlign:
-                ApplyPaddingAlignFormat(spec, last_spec_type, stream, spec);
-                last_spec_type = SpecifierCategory::PaddingAlign;
-                break;
-
-            case SpecifierCategory::Sign:
-                ApplySignFormat(spec, last_spec_type, stream, spec);
-                last_spec_type = SpecifierCategory::Sign;
-                break;
-
-            case SpecifierCategory::Width:
-                ApplyWidthFormat(spec, last_spec_type, stream, spec);
-                last_spec_type = SpecifierCategory::Width;
-                break;
-
-            case SpecifierCategory::Precision:
-                ApplyPrecisionFormat(spec, last_spec_type, stream, spec);
-                last_spec_type = SpecifierCategory::Precision;
-                break;
-
-            case SpecifierCategory::Type:
-                ApplyTypeFormat(spec, last_spec_type, stream, spec);
-                last_spec_type = SpecifierCategory::Type;
-                break;
-
-            default:
-                ENSURE(CHECK, NotReached()).Require();
-                break;
+    handler.AddLiteral(literal_begin, i - literal_begin);
+}
+
+// -*- Formatting at runtime -*-
+
+// Writes into a buffer of fixed capacity; characters beyond the capacity are discarded but
+// still counted, and thus it only counts if the capacity is 0.
+template<typename CharT>
+class FormatBufferOutput {
+public:
+    FormatBufferOutput(CharT* buf, size_t capacity) noexcept
+        : buf_(buf), capacity_(capacity), size_(0)
+    {}
+
+    void append(size_t count, CharT ch) noexcept
+    {
+        if (size_ < capacity_) {
+            std::fill_n(buf_ + size_, std::min(count, capacity_ - size_), ch);
         }
+
+        size_ += count;
     }
 
-    stream << arg;
-    formatted = stream.str();
+    template<typename SrcCharT>
+    void append(const SrcCharT* first, const SrcCharT* last) noexcept
+    {
+        auto count = static_cast<size_t>(last - first);
+        if (size_ < capacity_) {
+            std::copy_n(first, std::min(count, capacity_ - size_), buf_ + size_);
+        }
+
+        size_ += count;
+    }
+
+    // The number of characters ever appended, including discarded ones.
+    size_t size() const noexcept
+    {
+        return size_;
+    }
+
+private:
+    CharT* buf_;
+    size_t capacity_;
+    size_t size_;
+};
+
+template<size_t I, typename Out, typename CharT, typename... Args>
+std::enable_if_t<(I == sizeof...(Args))>
+    AppendFormattedArgAt(Out& /* out */, size_t /* index */, const FormatSpec<CharT>& /* spec */,
+                         const std::tuple<const Args&...>& /* args */)
+{}
+
+// Runtime indices are checked by the caller.
+template<size_t I, typename Out, typename CharT, typename... Args>
+std::enable_if_t<(I < sizeof...(Args))>
+    AppendFormattedArgAt(Out& out, size_t index, const FormatSpec<CharT>& spec,
+                         const std::tuple<const Args&...>& args)
+{
+    if (index == I) {
+        AppendFormattedArg(out, std::get<I>(args), spec);
+    } else {
+        AppendFormattedArgAt<I + 1>(out, index, spec, args);
+    }
+}
+
+// Writes pieces of a format string into `out` as soon as they are parsed, and thus neither
+// parsed results nor formatted arguments are stored anywhere else.
+template<typename Out, typename CharT, typename... Args>
+class FormatWriter {
+public:
+    FormatWriter(Out& out, const CharT* fmt, const Args&... args)
+        : out_(out), fmt_(fmt), args_(args...)
+    {}
+
+    DISALLOW_COPY(FormatWriter);
+
+    void AddLiteral(size_t begin, size_t length)
+    {
+        if (length != 0) {
+            AppendChars(out_, fmt_ + begin, fmt_ + begin + length);
+        }
+    }
+
+    void AddPlaceholder(size_t arg_index, const FormatSpec<CharT>& spec)
+    {
+        if (arg_index >= sizeof...(Args)) {
+            ThrowFormatError("Placeholder refers to a missing argument");
+        }
+
+        AppendFormattedArgAt<0>(out_, arg_index, spec, args_);
+    }
+
+private:
+    Out& out_;
+    const CharT* fmt_;
+    std::tuple<const Args&...> args_;
+};
+
+// Formats in one pass; if an exception is thrown, `out` may have been partially written.
+template<typename Out, typename CharT, typename... Args>
+void AppendFormat(Out& out, const CharT* fmt, const Args&... args)
+{
+    FormatWriter<Out, CharT, Args...> writer(out, fmt, args...);
+    ParseFormatTo(fmt, writer);
 }
 
+// -*- Compile-time parsed format strings -*-
+
+// A piece of a format string, which is either literal text, or a placeholder.
 template<typename CharT>
-typename FormatTraits<CharT>::String StringFormatT(const typename FormatTraits<CharT>::String& fmt,
-                                                   PlaceholderList<CharT>& placeholders,
-                                                   size_t arg_count)
-{
-    bool all_args_processed = std::all_of(placeholders.begin(), placeholders.end(),
-                                          [arg_count](const auto& placeholder) {
-                                              return placeholder.index < arg_count;
-                                          });
-    ENSURE(RAISE, all_args_processed).Require<FormatError>();
-
-    auto formatted_str(fmt);
-
-    // Sort in the decreasing order of pos, since we are going to expand `formatted_str`
-    // from right to left.
-    std::sort(placeholders.begin(), placeholders.end(), [](const auto& lhs, const auto& rhs) {
-                  return lhs.pos > rhs.pos;
-              });
-
-    for (const auto& placeholder : placeholders) {
-        formatted_str.replace(placeholder.pos, 1, placeholder.formatted);
+struct FormatSegment {
+    constexpr FormatSegment() noexcept
+        : is_literal(true), begin(0), length(0), arg_index(0), spec()
+    {}
+
+    bool is_literal;
+    // The text of a literal segment is [begin, begin + length) of the format string.
+    size_t begin;
+    size_t length;
+    size_t arg_index;
+    FormatSpec<CharT> spec;
+};
+
+// At most `N` segments are kept, while all of them are counted.
+template<typename CharT, size_t N>
+struct ParsedFormat {
+    constexpr ParsedFormat() noexcept
+        : segments(), segment_count(0), literal_length(0), placeholder_count(0),
+          required_arg_count(0), used_arg_mask(0)
+    {}
+
+    constexpr void AddLiteral(size_t begin, size_t length) noexcept
+    {
+        if (length == 0) {
+            return;
+        }
+
+        if (segment_count < N) {
+            segments[segment_count].begin = begin;
+            segments[segment_count].length = length;
+        }
+
+        ++segment_count;
+        literal_length += length;
     }
 
-    return formatted_str;
-}
-
-template<typename CharT, typename Arg, typename... Args>
-typename FormatTraits<CharT>::String StringFormatT(const typename FormatTraits<CharT>::String& fmt,
-                                                   PlaceholderList<CharT>& placeholders,
-                                                   size_t arg_processing_index,
-                                                   Arg&& arg,
-                                                   Args&&... args)
-{
-    // One argument may associate with multiple placeholders.
-    auto associated_placeholders = std::equal_range(placeholders.begin(),
-                                                    placeholders.end(),
-                                                    arg_processing_index,
-                                                    typename Placeholder<CharT>::RangeCompare());
-    typename FormatTraits<CharT>::Stream output;
-    auto default_fmt_flags = output.flags();
-    for (auto it = associated_placeholders.first; it != associated_placeholders.second; ++it) {
-        FormatArgWithSpecifier<CharT, Arg>(std::forward<Arg>(arg),
-                                           it->format_specifier,
-                                           output,
-                                           it->formatted);
-        // Reset stream for reuse.
-        output.str(typename FormatTraits<CharT>::String());
-        output.clear();
-        output.flags(default_fmt_flags);
+    constexpr void AddPlaceholder(size_t arg_index, const FormatSpec<CharT>& spec) noexcept
+    {
+        if (segment_count < N) {
+            segments[segment_count].is_literal = false;
+            segments[segment_count].arg_index = arg_index;
+            segments[segment_count].spec = spec;
+        }
+
+        ++segment_count;
+        ++placeholder_count;
+        required_arg_count = std::max(required_arg_count, arg_index + 1);
+        if (arg_index < 64) {
+            used_arg_mask |= UINT64_C(1) << arg_index;
+        }
     }
 
-    return StringFormatT(fmt, placeholders, arg_processing_index + 1, std::forward<Args>(args)...);
+    FormatSegment<CharT> segments[N];
+    size_t segment_count;
+    size_t literal_length;
+    size_t placeholder_count;
+    size_t required_arg_count;
+    uint64_t used_arg_mask;
+};
+
+template<typename CharT, size_t N>
+constexpr ParsedFormat<CharT, N> ParseFormat(const CharT* fmt)
+{
+    ParsedFormat<CharT, N> parsed;
+    ParseFormatTo(fmt, parsed);
+
+    return parsed;
+}
+
+// Holds a format string literal given by `Source::data()`, which is parsed at compile time.
+template<typename Source>
+struct CompiledFormat {
+    using CharT = std::remove_const_t<std::remove_pointer_t<decltype(Source::data())>>;
+
+    static constexpr const CharT* data() noexcept
+    {
+        return Source::data();
+    }
+
+    static constexpr size_t kSegmentCount = ParseFormat<CharT, 1>(Source::data()).segment_count;
+
+    static constexpr ParsedFormat<CharT, (kSegmentCount > 0 ? kSegmentCount : 1)> kParsed =
+        ParseFormat<CharT, (kSegmentCount > 0 ? kSegmentCount : 1)>(Source::data());
+};
+
+template<typename Source>
+constexpr size_t CompiledFormat<Source>::kSegmentCount;
+
+template<typename Source>
+constexpr ParsedFormat<typename CompiledFormat<Source>::CharT,
+                       (CompiledFormat<Source>::kSegmentCount > 0 ?
+                            CompiledFormat<Source>::kSegmentCount : 1)>
+    CompiledFormat<Source>::kParsed;
+
+template<typename Format, size_t I, typename Out, typename ArgTuple>
+void AppendCompiledSegment(Out& out, const ArgTuple& /* args */, std::true_type /* is_literal */)
+{
+    constexpr auto& segment = Format::kParsed.segments[I];
+    AppendChars(out, Format::data() + segment.begin,
+                Format::data() + segment.begin + segment.length);
+}
+
+template<typename Format, size_t I, typename Out, typename ArgTuple>
+void AppendCompiledSegment(Out& out, const ArgTuple& args, std::false_type /* is_literal */)
+{
+    constexpr auto& segment = Format::kParsed.segments[I];
+    AppendFormattedArg(out, std::get<segment.arg_index>(args), segment.spec);
+}
+
+template<typename Format, typename Out, typename ArgTuple, size_t... I>
+void AppendCompiledSegments(Out& out, const ArgTuple& args, std::index_sequence<I...>)
+{
+    using expander = int[];
+    (void)expander{0, (AppendCompiledSegment<Format, I>(
+        out, args,
+        std::integral_constant<bool, Format::kParsed.segments[I].is_literal>()), 0)...};
+}
+
+template<typename Format, typename Out, typename... Args>
+void AppendCompiledFormat(Out& out, const Args&... args)
+{
+    constexpr auto& parsed = Format::kParsed;
+    static_assert(parsed.required_arg_count <= sizeof...(Args),
+                  "Format string refers to more arguments than given");
+    constexpr uint64_t kArgMask = sizeof...(Args) >= 64 ?
+        ~UINT64_C(0) : (UINT64_C(1) << (sizeof...(Args) % 64)) - 1;
+    static_assert((parsed.used_arg_mask & kArgMask) == kArgMask,
+                  "Some arguments are not referred by the format string");
+
+    AppendCompiledSegments<Format>(out, std::forward_as_tuple(args...),
+                                   std::make_index_sequence<Format::kSegmentCount>());
+}
+
+// Keeps `out` unchanged if an exception is thrown.
+template<typename CharT, typename Fn>
+void AppendToString(typename FormatTraits<CharT>::String& out, Fn fn)
+{
+    auto old_size = out.size();
+    try {
+        fn(out);
+    } catch (...) {
+        out.resize(old_size);
+        throw;
+    }
+}
+
+// Terminates the output with a null character, if `capacity` is not 0.
+template<typename CharT, typename Fn>
+FormatToBufferResult FormatToBufferT(CharT* buf, size_t capacity, Fn fn)
+{
+    FormatBufferOutput<CharT> output(buf, capacity > 0 ? capacity - 1 : 0);
+    fn(output);
+    if (capacity > 0) {
+        buf[std::min(output.size(), capacity - 1)] = CharT();
+    }
+
+    return FormatToBufferResult{output.size(), output.size() >= capacity};
+}
+
+template<typename CharT, typename Fn>
+size_t FormattedSizeT(Fn fn)
+{
+    FormatBufferOutput<CharT> output(nullptr, 0);
+    fn(output);
+
+    return output.size();
+}
+
+// -*- Prepared format strings -*-
+
+// Holds a copy of a runtime format string, and segments parsed from it.
+template<typename CharT>
+struct PreparedFormatData {
+    explicit PreparedFormatData(BasicStringView<CharT> fmt)
+        : format(fmt.data(), fmt.size()), literal_length(0), placeholder_count(0),
+          required_arg_count(0)
+    {
+        ParseFormatTo(format.c_str(), *this);
+    }
+
+    DISALLOW_COPY(PreparedFormatData);
+
+    void AddLiteral(size_t begin, size_t length)
+    {
+        if (length == 0) {
+            return;
+        }
+
+        FormatSegment<CharT> segment;
+        segment.begin = begin;
+        segment.length = length;
+        segments.push_back(segment);
+        literal_length += length;
+    }
+
+    void AddPlaceholder(size_t arg_index, const FormatSpec<CharT>& spec)
+    {
+        FormatSegment<CharT> segment;
+        segment.is_literal = false;
+        segment.arg_index = arg_index;
+        segment.spec = spec;
+        segments.push_back(segment);
+        ++placeholder_count;
+        required_arg_count = std::max(required_arg_count, arg_index + 1);
+    }
+
+    typename FormatTraits<CharT>::String format;
+    std::vector<FormatSegment<CharT>> segments;
+    size_t literal_length;
+    size_t placeholder_count;
+    size_t required_arg_count;
+};
+
+// Arguments are checked before anything is written.
+template<typename Out, typename CharT, typename... Args>
+void AppendPreparedFormat(Out& out, const BasicPreparedFormat<CharT>& fmt, const Args&... args)
+{
+    const auto& data = *fmt.data_;
+    if (data.required_arg_count > sizeof...(Args)) {
+        ThrowFormatError("Placeholder refers to a missing argument");
+    }
+
+    std::tuple<const Args&...> arg_tuple(args...);
+    auto text = data.format.data();
+    for (const auto& segment : data.segments) {
+        if (segment.is_literal) {
+            AppendChars(out, text + segment.begin, text + segment.begin + segment.length);
+        } else {
+            AppendFormattedArgAt<0>(out, segment.arg_index, segment.spec, arg_tuple);
+        }
+    }
 }
 
 }   // namespace internal
@@ -391,8 +913,13 @@ typename FormatTraits<CharT>::String StringFormatT(const typename FormatTraits<C
 // align := `<` for left-alignemnt with fill character and `>` for right-alignment.
 // sign := +, prepend `+` with the positive number.
 // width := the width of the field.
-// .precision := floating-point precision.
-// type := can be one of [b, x, X, o, e, E].
+// .precision := floating-point precision, in fixed notation unless with `e` or `E`.
+// type := can be one of [b, x, X, o, e, E]; `b` writes integers in binary, and booleans as
+//         true or false.
+// Floating-point numbers without precision or type are written in the shortest form that
+// reads back as the same value.
+// Built-in numbers, characters and strings are formatted directly, and other types are
+// formatted by their `operator<<`.
 // Specifier marks `fill` and `align` **must** be in presence together.
 // Although all of these specifier marks are optional, their relative orders, if any
 // present, do matter; otherwise, a StringFormatSpecifierError exception would be raised.
@@ -400,29 +927,249 @@ typename FormatTraits<CharT>::String StringFormatT(const typename FormatTraits<C
 // mark is simply ignored, and no exception would be raised.
 
 template<typename... Args>
-std::string StringFormat(const char* fmt, Args&&... args)
+std::string StringFormat(const char* fmt, const Args&... args)
+{
+    std::string str;
+    internal::AppendFormat(str, fmt, args...);
+
+    return str;
+}
+
+template<typename... Args>
+std::wstring StringFormat(const wchar_t* fmt, const Args&... args)
+{
+    std::wstring str;
+    internal::AppendFormat(str, fmt, args...);
+
+    return str;
+}
+
+// Formats with a format string literal wrapped by KBASE_FORMAT(), which is parsed and
+// validated at compile time, and thus an invalid format string, or a placeholder referring
+// to a missing argument, or an argument referred by no placeholder, is a compile error.
+// The output is preallocated, and is built by appending pieces in order, without any parsing
+// at runtime.
+// e.g. auto str = StringFormat(KBASE_FORMAT("{0:0>4X} {1}"), 255, "test");
+
+template<typename Source, typename... Args>
+std::basic_string<typename internal::CompiledFormat<Source>::CharT>
+    StringFormat(internal::CompiledFormat<Source> /* fmt */, const Args&... args)
 {
     using namespace kbase::internal;
 
-    PlaceholderList<char> placeholders;
-    placeholders.reserve(sizeof...(args));
-    auto analyzed_fmt = AnalyzeFormat(fmt, placeholders);
+    using Format = CompiledFormat<Source>;
+    constexpr auto& parsed = Format::kParsed;
 
-    return StringFormatT(analyzed_fmt, placeholders, 0, std::forward<Args>(args)...);
+    // Guesses that each argument takes a few characters.
+    constexpr size_t kArgSizeHint = 8;
+    typename FormatTraits<typename Format::CharT>::String str;
+    str.reserve(parsed.literal_length + parsed.placeholder_count * kArgSizeHint);
+    AppendCompiledFormat<Format>(str, args...);
+
+    return str;
 }
 
+// The following functions format without allocating memory of their own, and thus callers
+// can format into reused strings or buffers with no allocation in steady state.
+// Format strings are either runtime ones, or ones wrapped by KBASE_FORMAT().
+
+// Appends the formatted string to `out`; `out` is unchanged if an exception is thrown.
+
 template<typename... Args>
-std::wstring StringFormat(const wchar_t* fmt, Args&&... args)
+void StringFormatTo(std::string& out, const char* fmt, const Args&... args)
 {
-    using namespace kbase::internal;
+    internal::AppendToString<char>(out, [&](auto& str) {
+        internal::AppendFormat(str, fmt, args...);
+    });
+}
 
-    PlaceholderList<wchar_t> placeholders;
-    placeholders.reserve(sizeof...(args));
-    auto analyzed_fmt = AnalyzeFormat(fmt, placeholders);
+template<typename... Args>
+void StringFormatTo(std::wstring& out, const wchar_t* fmt, const Args&... args)
+{
+    internal::AppendToString<wchar_t>(out, [&](auto& str) {
+        internal::AppendFormat(str, fmt, args...);
+    });
+}
+
+template<typename Source, typename... Args>
+void StringFormatTo(std::basic_string<typename internal::CompiledFormat<Source>::CharT>& out,
+                    internal::CompiledFormat<Source> /* fmt */, const Args&... args)
+{
+    using Format = internal::CompiledFormat<Source>;
+    internal::AppendToString<typename Format::CharT>(out, [&](auto& str) {
+        internal::AppendCompiledFormat<Format>(str, args...);
+    });
+}
+
+// Writes the formatted string into `buf` of `capacity` characters, like snprintf() does:
+// the output is truncated to fit in, and is always null-terminated unless `capacity` is 0.
+// The content of `buf` is unspecified if an exception is thrown.
+// e.g. char buf[64]; auto result = FormatToBuffer(buf, sizeof(buf), "{0}", value);
+
+template<typename... Args>
+FormatToBufferResult FormatToBuffer(char* buf, size_t capacity, const char* fmt,
+                                    const Args&... args)
+{
+    return internal::FormatToBufferT(buf, capacity, [&](auto& output) {
+        internal::AppendFormat(output, fmt, args...);
+    });
+}
+
+template<typename... Args>
+FormatToBufferResult FormatToBuffer(wchar_t* buf, size_t capacity, const wchar_t* fmt,
+                                    const Args&... args)
+{
+    return internal::FormatToBufferT(buf, capacity, [&](auto& output) {
+        internal::AppendFormat(output, fmt, args...);
+    });
+}
+
+template<typename Source, typename... Args>
+FormatToBufferResult FormatToBuffer(typename internal::CompiledFormat<Source>::CharT* buf,
+                                    size_t capacity, internal::CompiledFormat<Source> /* fmt */,
+                                    const Args&... args)
+{
+    return internal::FormatToBufferT(buf, capacity, [&](auto& output) {
+        internal::AppendCompiledFormat<internal::CompiledFormat<Source>>(output, args...);
+    });
+}
+
+// Returns the length of the formatted string, without writing it anywhere.
+
+template<typename... Args>
+size_t FormattedSize(const char* fmt, const Args&... args)
+{
+    return internal::FormattedSizeT<char>([&](auto& output) {
+        internal::AppendFormat(output, fmt, args...);
+    });
+}
+
+template<typename... Args>
+size_t FormattedSize(const wchar_t* fmt, const Args&... args)
+{
+    return internal::FormattedSizeT<wchar_t>([&](auto& output) {
+        internal::AppendFormat(output, fmt, args...);
+    });
+}
 
-    return StringFormatT(analyzed_fmt, placeholders, 0, std::forward<Args>(args)...);
+template<typename Source, typename... Args>
+size_t FormattedSize(internal::CompiledFormat<Source> /* fmt */, const Args&... args)
+{
+    using Format = internal::CompiledFormat<Source>;
+    return internal::FormattedSizeT<typename Format::CharT>([&](auto& output) {
+        internal::AppendCompiledFormat<Format>(output, args...);
+    });
+}
+
+// -*- Prepared format strings -*-
+
+// A runtime format string, e.g. one from a configuration file or a localization table, which
+// is parsed once and then used for formatting many times.
+// It is cheap to copy, since copies share the parsed result, and is safe to be used by
+// multiple threads at the same time.
+// e.g. PreparedFormat fmt(LoadMessage("greeting")); auto str = fmt("0xCC", 1);
+template<typename CharT>
+class BasicPreparedFormat {
+public:
+    using String = std::basic_string<CharT>;
+
+    // Throws FormatError if `fmt` is invalid.
+    // Only characters before the first null character are used.
+    explicit BasicPreparedFormat(BasicStringView<CharT> fmt)
+        : data_(std::make_shared<internal::PreparedFormatData<CharT>>(fmt))
+    {}
+
+    ~BasicPreparedFormat() = default;
+
+    DEFAULT_COPY(BasicPreparedFormat);
+
+    DEFAULT_MOVE(BasicPreparedFormat);
+
+    template<typename... Args>
+    String operator()(const Args&... args) const
+    {
+        return StringFormat(*this, args...);
+    }
+
+    const String& format() const noexcept
+    {
+        return data_->format;
+    }
+
+    // The number of arguments required by placeholders.
+    size_t required_arg_count() const noexcept
+    {
+        return data_->required_arg_count;
+    }
+
+private:
+    template<typename Out, typename C, typename... Args>
+    friend void internal::AppendPreparedFormat(Out& out, const BasicPreparedFormat<C>& fmt,
+                                               const Args&... args);
+
+private:
+    std::shared_ptr<const internal::PreparedFormatData<CharT>> data_;
+};
+
+using PreparedFormat = BasicPreparedFormat<char>;
+using WPreparedFormat = BasicPreparedFormat<wchar_t>;
+
+// Returns the prepared format of `fmt` from a process-wide cache, in which the format string
+// is looked up by its address, and is parsed only on first use.
+// A format string with the same address but different content is prepared again, and thus
+// `fmt` is not required to live forever; the least recently used ones are evicted when the
+// cache is full.
+// Throws FormatError if `fmt` is invalid, and nothing is cached then.
+PreparedFormat GetCachedFormat(const char* fmt);
+WPreparedFormat GetCachedFormat(const wchar_t* fmt);
+
+// Formatting functions for prepared format strings, which throw FormatError if a placeholder
+// refers to a missing argument, before anything is written.
+
+template<typename CharT, typename... Args>
+std::basic_string<CharT> StringFormat(const BasicPreparedFormat<CharT>& fmt, const Args&... args)
+{
+    std::basic_string<CharT> str;
+    internal::AppendPreparedFormat(str, fmt, args...);
+
+    return str;
+}
+
+template<typename CharT, typename... Args>
+void StringFormatTo(std::basic_string<CharT>& out, const BasicPreparedFormat<CharT>& fmt,
+                    const Args&... args)
+{
+    internal::AppendToString<CharT>(out, [&](auto& str) {
+        internal::AppendPreparedFormat(str, fmt, args...);
+    });
+}
+
+template<typename CharT, typename... Args>
+FormatToBufferResult FormatToBuffer(CharT* buf, size_t capacity,
+                                    const BasicPreparedFormat<CharT>& fmt, const Args&... args)
+{
+    return internal::FormatToBufferT(buf, capacity, [&](auto& output) {
+        internal::AppendPreparedFormat(output, fmt, args...);
+    });
+}
+
+template<typename CharT, typename... Args>
+size_t FormattedSize(const BasicPreparedFormat<CharT>& fmt, const Args&... args)
+{
+    return internal::FormattedSizeT<CharT>([&](auto& output) {
+        internal::AppendPreparedFormat(output, fmt, args...);
+    });
 }
 
 }   // namespace kbase
 
+// Wraps a narrow or wide string literal as a compile-time parsed format string.
+#define KBASE_FORMAT(fmt) \
+    ([] { \
+        struct KBaseFormatSource { \
+            static constexpr auto data() noexcept { return fmt; } \
+        }; \
+        return kbase::internal::CompiledFormat<KBaseFormatSource>(); \
+    }())
+
 #endif  // KBASE_STRING_FORMAT_H_
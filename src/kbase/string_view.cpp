@@ -0,0 +1,450 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#include "kbase/string_view.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STRING_SEARCH_SIMD 1
+#endif
+
+#if defined(STRING_SEARCH_SIMD)
+#include <immintrin.h>
+#if defined(COMPILER_MSVC)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(COMPILER_MSVC)
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace {
+
+using kbase::internal::kNotFoundOffset;
+
+// Strings shorter than this are searched byte by byte.
+constexpr size_t kMinSimdLength = 16;
+
+// Sets larger than this are matched with bitmaps, when AVX2 is not available.
+constexpr size_t kMaxSmallSetSize = 8;
+
+// A set of bytes as a 256-bit bitmap, which is laid out for lookups by SIMD shuffles: a byte
+// is in the row selected by its bit 7, the column selected by its low nibble, and is the bit
+// selected by its bits 4 to 6.
+class ByteSet {
+public:
+    ByteSet(const char* set, size_t set_length) noexcept
+        : rows_()
+    {
+        for (size_t i = 0; i < set_length; ++i) {
+            auto byte = static_cast<uint8_t>(set[i]);
+            rows_[byte >> 7][byte & 0x0F] |= static_cast<uint8_t>(1 << ((byte >> 4) & 7));
+        }
+    }
+
+    bool Contains(char ch) const noexcept
+    {
+        auto byte = static_cast<uint8_t>(ch);
+        return (rows_[byte >> 7][byte & 0x0F] & (1 << ((byte >> 4) & 7))) != 0;
+    }
+
+    const char* row(size_t index) const noexcept
+    {
+        return reinterpret_cast<const char*>(rows_[index]);
+    }
+
+private:
+    uint8_t rows_[2][16];
+};
+
+// Returns the offset of the first byte whose membership in `set` is `member`.
+size_t FindByMembership(const char* str, size_t length, const ByteSet& set, bool member) noexcept
+{
+    for (size_t i = 0; i < length; ++i) {
+        if (set.Contains(str[i]) == member) {
+            return i;
+        }
+    }
+
+    return kNotFoundOffset;
+}
+
+size_t FindScalar(const char* str, size_t length, const char* target,
+                  size_t target_length) noexcept
+{
+    for (size_t i = 0; i + target_length <= length; ++i) {
+        if (str[i] == target[0] && memcmp(str + i + 1, target + 1, target_length - 1) == 0) {
+            return i;
+        }
+    }
+
+    return kNotFoundOffset;
+}
+
+size_t FindLastCharScalar(const char* str, size_t length, char ch) noexcept
+{
+    for (auto i = length; i != 0; --i) {
+        if (str[i - 1] == ch) {
+            return i - 1;
+        }
+    }
+
+    return kNotFoundOffset;
+}
+
+#if defined(STRING_SEARCH_SIMD)
+
+unsigned CountTrailingZeros(uint32_t mask) noexcept
+{
+#if defined(COMPILER_MSVC)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+unsigned HighestBitIndex(uint32_t mask) noexcept
+{
+#if defined(COMPILER_MSVC)
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return index;
+#else
+    return 31 - static_cast<unsigned>(__builtin_clz(mask));
+#endif
+}
+
+bool DetectAVX2() noexcept
+{
+#if defined(COMPILER_MSVC)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+
+    // The OS must save YMM registers as well.
+    __cpuid(info, 1);
+    constexpr int kOSXSave = 1 << 27;
+    if ((info[2] & kOSXSave) == 0 || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+bool HasAVX2() noexcept
+{
+    static const bool has_avx2 = DetectAVX2();
+    return has_avx2;
+}
+
+__m128i Load16(const char* ptr) noexcept
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+}
+
+TARGET_AVX2 __m256i Load32(const char* ptr) noexcept
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+}
+
+// -*- SSE2 -*-
+
+size_t FindCharSSE2(const char* str, size_t length, char ch) noexcept
+{
+    auto pattern = _mm_set1_epi8(ch);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(Load16(str + i), pattern));
+        if (mask != 0) {
+            return i + CountTrailingZeros(static_cast<uint32_t>(mask));
+        }
+    }
+
+    auto ptr = static_cast<const char*>(memchr(str + i, ch, length - i));
+    return ptr ? static_cast<size_t>(ptr - str) : kNotFoundOffset;
+}
+
+size_t FindLastCharSSE2(const char* str, size_t length, char ch) noexcept
+{
+    auto pattern = _mm_set1_epi8(ch);
+    auto i = length;
+    for (; i >= 16; i -= 16) {
+        auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(Load16(str + i - 16), pattern));
+        if (mask != 0) {
+            return i - 16 + HighestBitIndex(static_cast<uint32_t>(mask));
+        }
+    }
+
+    return FindLastCharScalar(str, i, ch);
+}
+
+// Compares the first and the last characters of `target` for 16 positions at once, and then
+// compares the rest only for positions matched.
+size_t FindSSE2(const char* str, size_t length, const char* target, size_t target_length) noexcept
+{
+    auto first = _mm_set1_epi8(target[0]);
+    auto last = _mm_set1_epi8(target[target_length - 1]);
+    size_t i = 0;
+    for (; i + target_length - 1 + 16 <= length; i += 16) {
+        auto first_eq = _mm_cmpeq_epi8(Load16(str + i), first);
+        auto last_eq = _mm_cmpeq_epi8(Load16(str + i + target_length - 1), last);
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(first_eq, last_eq)));
+        while (mask != 0) {
+            auto offset = i + CountTrailingZeros(mask);
+            if (memcmp(str + offset + 1, target + 1, target_length - 2) == 0) {
+                return offset;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    auto result = FindScalar(str + i, length - i, target, target_length);
+    return result == kNotFoundOffset ? kNotFoundOffset : i + result;
+}
+
+// Compares each block with every character in the set.
+size_t FindFirstOfSSE2(const char* str, size_t length, const char* set, size_t set_length,
+                       const ByteSet& byte_set, bool member) noexcept
+{
+    __m128i patterns[kMaxSmallSetSize];
+    for (size_t k = 0; k < set_length; ++k) {
+        patterns[k] = _mm_set1_epi8(set[k]);
+    }
+
+    uint32_t flip = member ? 0 : 0xFFFF;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        auto block = Load16(str + i);
+        auto matched = _mm_cmpeq_epi8(block, patterns[0]);
+        for (size_t k = 1; k < set_length; ++k) {
+            matched = _mm_or_si128(matched, _mm_cmpeq_epi8(block, patterns[k]));
+        }
+
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(matched)) ^ flip;
+        if (mask != 0) {
+            return i + CountTrailingZeros(mask);
+        }
+    }
+
+    auto result = FindByMembership(str + i, length - i, byte_set, member);
+    return result == kNotFoundOffset ? kNotFoundOffset : i + result;
+}
+
+// -*- AVX2 -*-
+
+TARGET_AVX2 size_t FindCharAVX2(const char* str, size_t length, char ch) noexcept
+{
+    auto pattern = _mm256_set1_epi8(ch);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        auto mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(Load32(str + i), pattern));
+        if (mask != 0) {
+            return i + CountTrailingZeros(static_cast<uint32_t>(mask));
+        }
+    }
+
+    auto result = FindCharSSE2(str + i, length - i, ch);
+    return result == kNotFoundOffset ? kNotFoundOffset : i + result;
+}
+
+TARGET_AVX2 size_t FindLastCharAVX2(const char* str, size_t length, char ch) noexcept
+{
+    auto pattern = _mm256_set1_epi8(ch);
+    auto i = length;
+    for (; i >= 32; i -= 32) {
+        auto mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(Load32(str + i - 32), pattern));
+        if (mask != 0) {
+            return i - 32 + HighestBitIndex(static_cast<uint32_t>(mask));
+        }
+    }
+
+    return FindLastCharSSE2(str, i, ch);
+}
+
+TARGET_AVX2 size_t FindAVX2(const char* str, size_t length, const char* target,
+                            size_t target_length) noexcept
+{
+    auto first = _mm256_set1_epi8(target[0]);
+    auto last = _mm256_set1_epi8(target[target_length - 1]);
+    size_t i = 0;
+    for (; i + target_length - 1 + 32 <= length; i += 32) {
+        auto first_eq = _mm256_cmpeq_epi8(Load32(str + i), first);
+        auto last_eq = _mm256_cmpeq_epi8(Load32(str + i + target_length - 1), last);
+        auto mask = static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_and_si256(first_eq, last_eq)));
+        while (mask != 0) {
+            auto offset = i + CountTrailingZeros(mask);
+            if (memcmp(str + offset + 1, target + 1, target_length - 2) == 0) {
+                return offset;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    auto result = FindSSE2(str + i, length - i, target, target_length);
+    return result == kNotFoundOffset ? kNotFoundOffset : i + result;
+}
+
+// Looks up the bitmap of the set for 32 bytes at once: the low nibble of each byte selects
+// a column of bits by shuffling, and its high nibble selects the bit.
+TARGET_AVX2 size_t FindFirstOfAVX2(const char* str, size_t length, const ByteSet& set,
+                                   bool member) noexcept
+{
+    auto low_rows = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(set.row(0))));
+    auto high_rows = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(set.row(1))));
+    auto bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                 1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    auto nibble_mask = _mm256_set1_epi8(0x0F);
+    auto zero = _mm256_setzero_si256();
+
+    uint32_t flip = member ? ~UINT32_C(0) : 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        auto block = Load32(str + i);
+        auto low = _mm256_and_si256(block, nibble_mask);
+        auto high = _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble_mask);
+        // The row is selected by the highest bit of the byte.
+        auto rows = _mm256_blendv_epi8(_mm256_shuffle_epi8(low_rows, low),
+                                       _mm256_shuffle_epi8(high_rows, low), block);
+        auto hit = _mm256_and_si256(rows, _mm256_shuffle_epi8(bits, high));
+        auto missed = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, zero)));
+        auto mask = missed ^ flip;
+        if (mask != 0) {
+            return i + CountTrailingZeros(mask);
+        }
+    }
+
+    auto result = FindByMembership(str + i, length - i, set, member);
+    return result == kNotFoundOffset ? kNotFoundOffset : i + result;
+}
+
+#endif  // STRING_SEARCH_SIMD
+
+size_t FindFirstOfImpl(const char* str, size_t length, const char* set, size_t set_length,
+                       bool member) noexcept
+{
+    if (set_length == 0) {
+        return member || length == 0 ? kNotFoundOffset : 0;
+    }
+
+    // Results are often near the beginning, e.g. when tokenizing, and thus the first bytes are
+    // examined one by one, without the setup for vectorized search.
+    ByteSet byte_set(set, set_length);
+    auto prefix_length = std::min(length, kMinSimdLength);
+    auto result = FindByMembership(str, prefix_length, byte_set, member);
+    if (result != kNotFoundOffset || prefix_length == length) {
+        return result;
+    }
+
+    str += prefix_length;
+    length -= prefix_length;
+
+#if defined(STRING_SEARCH_SIMD)
+    if (HasAVX2()) {
+        result = FindFirstOfAVX2(str, length, byte_set, member);
+    } else if (set_length <= kMaxSmallSetSize) {
+        result = FindFirstOfSSE2(str, length, set, set_length, byte_set, member);
+    } else {
+        result = FindByMembership(str, length, byte_set, member);
+    }
+#else
+    result = FindByMembership(str, length, byte_set, member);
+#endif
+
+    return result == kNotFoundOffset ? kNotFoundOffset : prefix_length + result;
+}
+
+}   // namespace
+
+namespace kbase {
+
+namespace internal {
+
+size_t StringSearch<char, std::char_traits<char>>::Find(const char* str, size_t length,
+                                                        const char* target,
+                                                        size_t target_length) noexcept
+{
+    if (target_length == 0) {
+        return 0;
+    }
+
+    if (target_length == 1) {
+        return FindChar(str, length, target[0]);
+    }
+
+    if (target_length > length) {
+        return kNotFoundOffset;
+    }
+
+#if defined(STRING_SEARCH_SIMD)
+    return HasAVX2() ? FindAVX2(str, length, target, target_length) :
+                       FindSSE2(str, length, target, target_length);
+#else
+    return FindScalar(str, length, target, target_length);
+#endif
+}
+
+size_t StringSearch<char, std::char_traits<char>>::FindChar(const char* str, size_t length,
+                                                            char ch) noexcept
+{
+#if defined(STRING_SEARCH_SIMD)
+    if (length >= kMinSimdLength) {
+        return HasAVX2() ? FindCharAVX2(str, length, ch) : FindCharSSE2(str, length, ch);
+    }
+#endif
+
+    auto ptr = static_cast<const char*>(memchr(str, ch, length));
+    return ptr ? static_cast<size_t>(ptr - str) : kNotFoundOffset;
+}
+
+size_t StringSearch<char, std::char_traits<char>>::FindLastChar(const char* str, size_t length,
+                                                                char ch) noexcept
+{
+#if defined(STRING_SEARCH_SIMD)
+    if (length >= kMinSimdLength) {
+        return HasAVX2() ? FindLastCharAVX2(str, length, ch) : FindLastCharSSE2(str, length, ch);
+    }
+#endif
+
+    return FindLastCharScalar(str, length, ch);
+}
+
+size_t StringSearch<char, std::char_traits<char>>::FindFirstOf(const char* str, size_t length,
+                                                               const char* set,
+                                                               size_t set_length) noexcept
+{
+    return FindFirstOfImpl(str, length, set, set_length, true);
+}
+
+size_t StringSearch<char, std::char_traits<char>>::FindFirstNotOf(const char* str,
+                                                                  size_t length,
+                                                                  const char* set,
+                                                                  size_t set_length) noexcept
+{
+    return FindFirstOfImpl(str, length, set, set_length, false);
+}
+
+}   // namespace internal
+
+}   // namespace kbase
@@ -53,6 +53,79 @@ constexpr size_t StringLength(const CharT* str)
     return *str ? StringLength(str + 1) + 1 : 0;
 }
 
+constexpr size_t kNotFoundOffset = static_cast<size_t>(-1);
+
+// Searches in [str, str + length), and returns the offset of the result, or kNotFoundOffset
+// if there is no such result.
+template<typename CharT, typename Traits>
+struct StringSearch {
+    static size_t Find(const CharT* str, size_t length, const CharT* target,
+                       size_t target_length) noexcept
+    {
+        auto end = str + length;
+        auto it = std::search(str, end, target, target + target_length, Traits::eq);
+        return it == end && target_length != 0 ? kNotFoundOffset : static_cast<size_t>(it - str);
+    }
+
+    static size_t FindChar(const CharT* str, size_t length, CharT ch) noexcept
+    {
+        auto ptr = Traits::find(str, length, ch);
+        return ptr ? static_cast<size_t>(ptr - str) : kNotFoundOffset;
+    }
+
+    static size_t FindLastChar(const CharT* str, size_t length, CharT ch) noexcept
+    {
+        for (auto i = length; i != 0; --i) {
+            if (Traits::eq(str[i - 1], ch)) {
+                return i - 1;
+            }
+        }
+
+        return kNotFoundOffset;
+    }
+
+    static size_t FindFirstOf(const CharT* str, size_t length, const CharT* set,
+                              size_t set_length) noexcept
+    {
+        for (size_t i = 0; i < length; ++i) {
+            if (Traits::find(set, set_length, str[i])) {
+                return i;
+            }
+        }
+
+        return kNotFoundOffset;
+    }
+
+    static size_t FindFirstNotOf(const CharT* str, size_t length, const CharT* set,
+                                 size_t set_length) noexcept
+    {
+        for (size_t i = 0; i < length; ++i) {
+            if (!Traits::find(set, set_length, str[i])) {
+                return i;
+            }
+        }
+
+        return kNotFoundOffset;
+    }
+};
+
+// Narrow strings are searched with SSE2 or AVX2 instructions if the CPU supports.
+template<>
+struct StringSearch<char, std::char_traits<char>> {
+    static size_t Find(const char* str, size_t length, const char* target,
+                       size_t target_length) noexcept;
+
+    static size_t FindChar(const char* str, size_t length, char ch) noexcept;
+
+    static size_t FindLastChar(const char* str, size_t length, char ch) noexcept;
+
+    static size_t FindFirstOf(const char* str, size_t length, const char* set,
+                              size_t set_length) noexcept;
+
+    static size_t FindFirstNotOf(const char* str, size_t length, const char* set,
+                                 size_t set_length) noexcept;
+};
+
 }   // namespace internal
 
 template<typename CharT, typename Traits = std::char_traits<CharT>>
@@ -288,21 +361,21 @@ public:
 
     size_type find(BasicStringView view, size_type pos = 0) const noexcept
     {
-        if (length() < view.length() + pos) {
+        if (pos > length() || view.length() > length() - pos) {
             return npos;
         }
 
-        auto it = std::search(begin() + pos, end(), view.begin(), view.end(), Traits::eq);
-        if (it == end()) {
-            return npos;
-        }
-
-        return static_cast<size_type>(std::distance(begin(), it));
+        return ToPosition(Search::Find(data_ + pos, length() - pos, view.data(), view.length()),
+                          pos);
     }
 
     size_type find(CharT ch, size_type pos = 0) const noexcept
     {
-        return find(BasicStringView(&ch, 1), pos);
+        if (pos >= length()) {
+            return npos;
+        }
+
+        return ToPosition(Search::FindChar(data_ + pos, length() - pos, ch), pos);
     }
 
     size_type find(const CharT* str, size_type pos, size_type count) const noexcept
@@ -338,7 +411,11 @@ public:
 
     size_type rfind(CharT ch, size_type pos = npos) const noexcept
     {
-        return rfind(BasicStringView(&ch, 1), pos);
+        if (empty()) {
+            return npos;
+        }
+
+        return ToPosition(Search::FindLastChar(data_, std::min(pos, length() - 1) + 1, ch), 0);
     }
 
     size_type rfind(const CharT* str, size_type pos, size_type count) const noexcept
@@ -357,17 +434,14 @@ public:
             return npos;
         }
 
-        auto it = std::find_first_of(begin() + pos, end(), view.begin(), view.end(), Traits::eq);
-        if (it == end()) {
-            return npos;
-        }
-
-        return static_cast<size_type>(std::distance(begin(), it));
+        return ToPosition(Search::FindFirstOf(data_ + pos, length() - pos, view.data(),
+                                              view.length()),
+                          pos);
     }
 
     size_type find_first_of(CharT ch, size_type pos = 0) const noexcept
     {
-        return find_first_of(BasicStringView(&ch, 1), 0);
+        return find(ch, pos);
     }
 
     size_type find_first_of(const CharT* str, size_type pos, size_type count) const noexcept
@@ -423,20 +497,14 @@ public:
             return npos;
         }
 
-        for (auto i = pos; i < length(); ++i) {
-            if (std::none_of(view.begin(), view.end(), [this, i](CharT ch) {
-                                 return Traits::eq(data_[i], ch);
-                             })) {
-                return i;
-            }
-        }
-
-        return npos;
+        return ToPosition(Search::FindFirstNotOf(data_ + pos, length() - pos, view.data(),
+                                                 view.length()),
+                          pos);
     }
 
     size_type find_first_not_of(CharT ch, size_type pos = 0) const noexcept
     {
-        return find_fisrt_not_of(BasicStringView(&ch, 1), pos);
+        return find_first_not_of(BasicStringView(&ch, 1), pos);
     }
 
     size_type find_first_not_of(const CharT* str, size_type pos, size_type count) const noexcept
@@ -486,6 +554,14 @@ public:
         return find_last_not_of(BasicStringView(str), pos);
     }
 
+private:
+    using Search = internal::StringSearch<CharT, Traits>;
+
+    static constexpr size_type ToPosition(size_t offset, size_type base) noexcept
+    {
+        return offset == internal::kNotFoundOffset ? npos : base + offset;
+    }
+
 private:
     const value_type* data_;
     size_type length_;
@@ -0,0 +1,255 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#include <atomic>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "kbase/concurrent_lru_cache.h"
+
+namespace {
+
+struct IntHash {
+    size_t operator()(int key) const noexcept
+    {
+        return static_cast<size_t>(key);
+    }
+};
+
+}   // namespace
+
+namespace kbase {
+
+TEST(ConcurrentLRUCacheTest, Construction)
+{
+    ConcurrentLRUCache<int, std::string> cache(1000);
+    EXPECT_TRUE(cache.auto_evict());
+    EXPECT_EQ(1000, cache.capacity());
+    EXPECT_GE(cache.shard_count(), 1);
+    EXPECT_EQ(0, cache.shard_count() & (cache.shard_count() - 1));
+    EXPECT_TRUE(cache.empty());
+
+    ConcurrentLRUCache<int, std::string, TreeMap, IntHash> tree_cache(
+        ConcurrentLRUCache<int, std::string, TreeMap, IntHash>::NoAutoEvict, 5);
+    EXPECT_FALSE(tree_cache.auto_evict());
+    EXPECT_EQ(8, tree_cache.shard_count());
+}
+
+TEST(ConcurrentLRUCacheTest, PutGetAndErase)
+{
+    ConcurrentLRUCache<int, std::string> cache(100, 4);
+    cache.Put(1, "one");
+    std::string two = "two";
+    cache.Put(2, two);
+    EXPECT_EQ(2, cache.size());
+
+    std::string value;
+    EXPECT_TRUE(cache.Get(1, value));
+    EXPECT_EQ("one", value);
+    EXPECT_FALSE(cache.Get(3, value));
+    EXPECT_EQ("one", value);
+
+    cache.Put(1, "uno");
+    EXPECT_TRUE(cache.Get(1, value));
+    EXPECT_EQ("uno", value);
+    EXPECT_EQ(2, cache.size());
+
+    EXPECT_TRUE(cache.erase(1));
+    EXPECT_FALSE(cache.erase(1));
+    EXPECT_FALSE(cache.Get(1, value));
+
+    cache.clear();
+    EXPECT_TRUE(cache.empty());
+}
+
+TEST(ConcurrentLRUCacheTest, ApproximateCapacity)
+{
+    // Each shard holds at most 25 entries, and evicts its least recently used one.
+    ConcurrentLRUCache<int, int> cache(100, 4);
+    for (int i = 0; i < 1000; ++i) {
+        cache.Put(i, i);
+        int value;
+        EXPECT_TRUE(cache.Get(0, value));
+    }
+
+    EXPECT_LE(cache.size(), 100);
+    EXPECT_GE(cache.size(), 75);
+
+    // The hot entry was never evicted.
+    int value = -1;
+    EXPECT_TRUE(cache.Get(0, value));
+    EXPECT_EQ(0, value);
+
+    // Other eviction policies.
+    ConcurrentLRUCache<int, int, PooledHashMap, std::hash<int>, SegmentedLRUEviction>
+        slru_cache(100, 4);
+    for (int i = 0; i < 1000; ++i) {
+        slru_cache.Put(i, i);
+        EXPECT_TRUE(slru_cache.Get(0, value));
+    }
+
+    EXPECT_LE(slru_cache.size(), 100);
+
+    // A single shard holds everything.
+    ConcurrentLRUCache<int, int> single_shard(10, 1);
+    for (int i = 0; i < 100; ++i) {
+        single_shard.Put(i, i);
+    }
+
+    EXPECT_EQ(10, single_shard.size());
+    EXPECT_TRUE(single_shard.Get(99, value));
+    EXPECT_FALSE(single_shard.Get(89, value));
+}
+
+TEST(ConcurrentLRUCacheTest, GetOrCompute)
+{
+    ConcurrentLRUCache<int, std::string> cache(100);
+    int computed_count = 0;
+    auto compute = [&computed_count] {
+        ++computed_count;
+        return std::string("computed");
+    };
+
+    EXPECT_EQ("computed", cache.GetOrCompute(1, compute));
+    EXPECT_EQ("computed", cache.GetOrCompute(1, compute));
+    EXPECT_EQ(1, computed_count);
+
+    // Failures are not cached.
+    EXPECT_THROW(cache.GetOrCompute(2, []() -> std::string {
+        throw std::runtime_error("failed");
+    }), std::runtime_error);
+    std::string value;
+    EXPECT_FALSE(cache.Get(2, value));
+    EXPECT_EQ("computed", cache.GetOrCompute(2, compute));
+    EXPECT_EQ(2, computed_count);
+}
+
+TEST(ConcurrentLRUCacheTest, ModifiedWhileComputing)
+{
+    ConcurrentLRUCache<int, std::string> cache(100);
+
+    // Runs a computation of `key` on another thread, which is blocked until `release` is set.
+    auto compute_slowly = [&cache](int key, std::shared_future<void> release) {
+        std::promise<void> started;
+        auto started_future = started.get_future();
+        std::thread computer([&cache, key, release, started = std::move(started)]() mutable {
+            auto value = cache.GetOrCompute(key, [release, &started] {
+                started.set_value();
+                release.wait();
+                return std::string("stale");
+            });
+            EXPECT_EQ("stale", value);
+        });
+        started_future.wait();
+        return computer;
+    };
+
+    // Erased while computing; later calls don't wait for the dropped computation.
+    {
+        std::promise<void> release;
+        auto computer = compute_slowly(1, release.get_future().share());
+        EXPECT_FALSE(cache.erase(1));
+        EXPECT_EQ("fresh", cache.GetOrCompute(1, [] { return std::string("fresh"); }));
+        release.set_value();
+        computer.join();
+
+        std::string value;
+        EXPECT_TRUE(cache.Get(1, value));
+        EXPECT_EQ("fresh", value);
+    }
+
+    {
+        std::promise<void> release;
+        auto computer = compute_slowly(2, release.get_future().share());
+        EXPECT_FALSE(cache.erase(2));
+        release.set_value();
+        computer.join();
+
+        std::string value;
+        EXPECT_FALSE(cache.Get(2, value));
+    }
+
+    // Put while computing.
+    {
+        std::promise<void> release;
+        auto computer = compute_slowly(3, release.get_future().share());
+        cache.Put(3, "put");
+        release.set_value();
+        computer.join();
+
+        std::string value;
+        EXPECT_TRUE(cache.Get(3, value));
+        EXPECT_EQ("put", value);
+    }
+}
+
+TEST(ConcurrentLRUCacheTest, ConcurrentAccess)
+{
+    constexpr int kThreadCount = 8;
+    constexpr int kKeyCount = 64;
+    ConcurrentLRUCache<int, int> cache(ConcurrentLRUCache<int, int>::NoAutoEvict, 4);
+    std::atomic<int> computed_count(0);
+    std::atomic<bool> started(false);
+
+    // All threads request the same keys, and each key is computed only once.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreadCount; ++t) {
+        threads.emplace_back([&] {
+            while (!started) {
+                std::this_thread::yield();
+            }
+
+            for (int key = 0; key < kKeyCount; ++key) {
+                int value = cache.GetOrCompute(key, [&computed_count, key] {
+                    ++computed_count;
+                    std::this_thread::yield();
+                    return key * 2;
+                });
+                EXPECT_EQ(key * 2, value);
+                cache.Put(key + kKeyCount, key);
+            }
+        });
+    }
+
+    started = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(kKeyCount, computed_count);
+    EXPECT_EQ(kKeyCount * 2, cache.size());
+}
+
+TEST(ConcurrentLRUCacheTest, Stats)
+{
+    ConcurrentLRUCache<int, int, HashMap, std::hash<int>, LRUEviction, LRUCacheStats>
+        cache(100, 4);
+    for (int i = 0; i < 10; ++i) {
+        cache.Put(i, i);
+    }
+
+    int value;
+    for (int i = 0; i < 20; ++i) {
+        cache.Get(i, value);
+    }
+
+    auto stats = cache.GetStats();
+    EXPECT_EQ(10, stats.hits);
+    EXPECT_EQ(10, stats.misses);
+    EXPECT_EQ(10, stats.inserts);
+    EXPECT_EQ(10, stats.size);
+    EXPECT_EQ(100, stats.max_size);
+    EXPECT_EQ(10, stats.sampled_entry_count);
+    EXPECT_EQ(10, stats.access_frequencies[1]);
+
+    cache.ResetStats();
+    EXPECT_EQ(0, cache.GetStats().hits);
+}
+
+}   // namespace kbase
@@ -2,12 +2,23 @@
  @ 0xCCCCCCCC
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <clocale>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
 #include <thread>
 #include <vector>
 
 #include "gtest/gtest.h"
 
+#include "kbase/at_exit_manager.h"
 #include "kbase/basic_types.h"
 #include "kbase/logging.h"
 
@@ -38,6 +49,85 @@ bool PathExists(const kbase::PathString& path)
 #endif
 }
 
+struct Point {
+    int x;
+    int y;
+};
+
+std::ostream& operator<<(std::ostream& os, const Point& pt)
+{
+    os << "(" << pt.x << ", " << pt.y << ")";
+    return os;
+}
+
+// Checks if the header of `line` starts with a timestamp like "[20160126 09:14:38,456 ".
+bool HasValidTimestamp(const std::string& line)
+{
+    constexpr char kPattern[] = "[dddddddd dd:dd:dd,ddd ";
+    constexpr size_t kPatternLength = sizeof(kPattern) - 1;
+    if (line.length() < kPatternLength) {
+        return false;
+    }
+
+    for (size_t i = 0; i < kPatternLength; ++i) {
+        bool matched = kPattern[i] == 'd' ? isdigit(static_cast<unsigned char>(line[i])) != 0 :
+                                            kPattern[i] == line[i];
+        if (!matched) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::string ReadFileContent(const kbase::PathString& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+size_t CountFileLines(const kbase::PathString& path)
+{
+    std::ifstream in(path);
+    size_t count = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        ++count;
+    }
+
+    return count;
+}
+
+// Each instantiation has sites of its own, which are thus used for the first time by all
+// threads calling it.
+template<int N>
+void LogFromFreshSites(int thread_id)
+{
+    LOG(INFO) << "thread " << thread_id;
+    VLOG(1) << "verbose thread " << thread_id;
+    LOG_EVERY_N(INFO, 2) << "every 2nd of thread " << thread_id;
+}
+
+void RunOnThreadsAtOnce(int thread_count, void (*fn)(int))
+{
+    std::atomic<bool> ready {false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i) {
+        threads.emplace_back([&ready, fn, i] {
+            while (!ready.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+
+            fn(i);
+        });
+    }
+
+    ready.store(true, std::memory_order_release);
+    for (auto& th : threads) {
+        th.join();
+    }
+}
+
 }   // namespace
 
 namespace kbase {
@@ -84,6 +174,595 @@ TEST(LoggingTest, CustomLogFileName)
     ASSERT_TRUE(::PathExists(log_name));
 }
 
+TEST(LoggingTest, AsyncWriting)
+{
+    constexpr int kThreadCount = 4;
+    constexpr int kMessagesPerThread = 1000;
+
+    PathString log_name(PATH_LITERAL("async_test_debug.log"));
+    {
+        AtExitManager exit_manager;
+
+        LoggingSettings logging_settings;
+        logging_settings.log_file_path = log_name;
+        logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+        logging_settings.log_writing_mode = LogWritingMode::WriteAsynchronously;
+        logging_settings.async_buffer_size = 4096;
+        logging_settings.async_max_buffer_count = 4;
+        ConfigureLoggingSettings(logging_settings);
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreadCount; ++i) {
+            threads.emplace_back([i] {
+                for (int j = 0; j < kMessagesPerThread; ++j) {
+                    LOG(INFO) << "thread " << i << " message " << j;
+                }
+            });
+        }
+
+        for (auto& th : threads) {
+            th.join();
+        }
+
+        FlushLogging();
+        EXPECT_EQ(kThreadCount * kMessagesPerThread, CountFileLines(log_name));
+
+        LOG(INFO) << "written at exit";
+    }
+
+    EXPECT_EQ(kThreadCount * kMessagesPerThread + 1, CountFileLines(log_name));
+
+    ConfigureLoggingSettings(LoggingSettings());
+}
+
+TEST(LoggingTest, AsyncWritingWithoutExitManager)
+{
+    PathString log_name(PATH_LITERAL("async_no_exit_manager_debug.log"));
+    LoggingSettings logging_settings;
+    logging_settings.log_file_path = log_name;
+    logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+    logging_settings.log_writing_mode = LogWritingMode::WriteAsynchronously;
+
+    // Configuring again doesn't pile up exit callbacks, nor require an exit manager.
+    ConfigureLoggingSettings(logging_settings);
+    ConfigureLoggingSettings(logging_settings);
+
+    LOG(INFO) << "written synchronously";
+    EXPECT_EQ(1, CountFileLines(log_name));
+
+    ConfigureLoggingSettings(LoggingSettings());
+}
+
+TEST(LoggingTest, LogStreamFormatting)
+{
+    {
+        LogStream stream;
+        stream << 123 << ' ' << -45L << ' ' << 0U << ' ' << std::numeric_limits<int64_t>::min()
+               << ' ' << std::numeric_limits<uint64_t>::max();
+        EXPECT_EQ(std::string("123 -45 0 -9223372036854775808 18446744073709551615"),
+                  std::string(stream.data(), stream.length()));
+    }
+
+    {
+        LogStream stream;
+        stream << true << ' ' << 3.25 << ' ' << 1.0f / 3 << ' ' << std::string("str") << ' '
+               << StringView("view") << ' ' << static_cast<const char*>(nullptr);
+        EXPECT_EQ(std::string("1 3.25 0.333333 str view (null)"), stream.data());
+    }
+
+    // Manipulators and types having no built-in support.
+    {
+        LogStream stream;
+        stream << 255 << ' ' << std::hex << 255 << ' ' << std::setw(4) << std::setfill('0')
+               << std::dec << 7 << ' ' << Point{1, 2};
+        EXPECT_EQ(std::string("255 ff 0007 (1, 2)"), stream.data());
+    }
+
+    // Long messages are kept in their entirety.
+    {
+        LogStream stream;
+        std::string long_text(5000, 'x');
+        stream << "head " << long_text << " tail";
+        EXPECT_EQ("head " + long_text + " tail", std::string(stream.data(), stream.length()));
+    }
+}
+
+TEST(LoggingTest, LogStreamFormattingIgnoresLocale)
+{
+    const char* locale = nullptr;
+    const char* names[] {"de_DE.UTF-8", "de_DE.utf8", "de_DE", "German_Germany.1252"};
+    for (auto name : names) {
+        locale = setlocale(LC_NUMERIC, name);
+        if (locale) {
+            break;
+        }
+    }
+
+    // No locale with a non-dot decimal point is available.
+    if (!locale) {
+        return;
+    }
+
+    LogStream stream;
+    stream << 3.25 << ' ' << 1.5F << ' ' << 0.1L << ' ' << 1e100;
+    setlocale(LC_NUMERIC, "C");
+    EXPECT_EQ(std::string("3.25 1.5 0.1 1e+100"), stream.data());
+}
+
+TEST(LoggingTest, TimestampClockSources)
+{
+    PathString log_name(PATH_LITERAL("timestamp_test_debug.log"));
+    TimestampClockSource sources[] {
+        TimestampClockSource::PreciseClock,
+        TimestampClockSource::CoarseClock,
+        TimestampClockSource::MonotonicClock
+    };
+
+    for (auto source : sources) {
+        LoggingSettings logging_settings;
+        logging_settings.log_file_path = log_name;
+        logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+        logging_settings.timestamp_clock_source = source;
+        ConfigureLoggingSettings(logging_settings);
+
+        // Spans across at least one second to make the cached part renewed.
+        LOG(INFO) << "first";
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        LOG(INFO) << "second";
+
+        std::ifstream in(log_name);
+        std::string first_line, second_line;
+        ASSERT_TRUE(std::getline(in, first_line) && std::getline(in, second_line));
+        EXPECT_TRUE(HasValidTimestamp(first_line)) << first_line;
+        EXPECT_TRUE(HasValidTimestamp(second_line)) << second_line;
+        EXPECT_NE(first_line.substr(0, 19), second_line.substr(0, 19));
+    }
+
+    ConfigureLoggingSettings(LoggingSettings());
+}
+
+TEST(LoggingTest, LogFileRotation)
+{
+    constexpr size_t kMaxFileSize = 1024;
+    constexpr size_t kMaxRotatedFiles = 2;
+
+    std::mutex mutex;
+    std::vector<PathString> rotated_files;
+
+    PathString log_name(PATH_LITERAL("rotation_test_debug.log"));
+    LoggingSettings logging_settings;
+    logging_settings.log_file_path = log_name;
+    logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+    logging_settings.max_log_file_size = kMaxFileSize;
+    logging_settings.max_rotated_log_files = kMaxRotatedFiles;
+    logging_settings.post_rotation_hook = [&mutex, &rotated_files](const PathString& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        rotated_files.push_back(path);
+    };
+    ConfigureLoggingSettings(logging_settings);
+
+    for (int i = 0; i < 100; ++i) {
+        LOG(INFO) << "rotation test message " << i;
+    }
+
+    EXPECT_LT(CountFileLines(log_name), 100U);
+
+    // Post-rotation work is done asynchronously.
+    size_t existing_count = 0;
+    for (int retry = 0; retry < 50; ++retry) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::lock_guard<std::mutex> lock(mutex);
+        existing_count = std::count_if(rotated_files.begin(), rotated_files.end(),
+                                       [](const PathString& path) { return ::PathExists(path); });
+        if (rotated_files.size() > kMaxRotatedFiles && existing_count == kMaxRotatedFiles) {
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        EXPECT_GT(rotated_files.size(), kMaxRotatedFiles);
+        EXPECT_EQ(kMaxRotatedFiles, existing_count);
+        for (const auto& path : rotated_files) {
+            EXPECT_EQ(0U, path.find(log_name + PATH_LITERAL(".")));
+        }
+
+        // Each rotation takes a distinct name, and names are in the order of rotations.
+        EXPECT_TRUE(std::adjacent_find(rotated_files.begin(), rotated_files.end(),
+                                       std::greater_equal<PathString>()) == rotated_files.end());
+    }
+
+    ConfigureLoggingSettings(LoggingSettings());
+}
+
+TEST(LoggingTest, LogFileRotationInAsyncMode)
+{
+    constexpr size_t kMaxFileSize = 16 * 1024;
+    constexpr size_t kBufferSize = 4096;
+    constexpr int kThreadCount = 4;
+    constexpr int kMessagesPerThread = 4000;
+
+    std::mutex mutex;
+    std::vector<PathString> rotated_files;
+
+    PathString log_name(PATH_LITERAL("async_rotation_test_debug.log"));
+    {
+        AtExitManager exit_manager;
+
+        LoggingSettings logging_settings;
+        logging_settings.log_file_path = log_name;
+        logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+        logging_settings.max_log_file_size = kMaxFileSize;
+        logging_settings.post_rotation_hook = [&mutex, &rotated_files](const PathString& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            rotated_files.push_back(path);
+        };
+        logging_settings.log_writing_mode = LogWritingMode::WriteAsynchronously;
+        logging_settings.async_buffer_size = kBufferSize;
+        ConfigureLoggingSettings(logging_settings);
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreadCount; ++i) {
+            threads.emplace_back([i] {
+                for (int j = 0; j < kMessagesPerThread; ++j) {
+                    LOG(INFO) << "thread " << i << " message " << j;
+                }
+            });
+        }
+
+        for (auto& th : threads) {
+            th.join();
+        }
+    }
+
+    ConfigureLoggingSettings(LoggingSettings());
+
+    // Files outgrow the limit by at most one buffer, even if buffers are written in batches.
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_GT(rotated_files.size(), 1U);
+    for (const auto& path : rotated_files) {
+        EXPECT_LE(ReadFileContent(path).size(), kMaxFileSize + kBufferSize);
+    }
+}
+
+TEST(LoggingTest, LogFileRotationHookMovesFile)
+{
+    constexpr size_t kMaxRotatedFiles = 2;
+
+    std::mutex mutex;
+    size_t rotation_count = 0;
+    std::vector<PathString> kept_files;
+
+    // Files moved away by the hook don't count in `max_rotated_log_files`.
+    PathString log_name(PATH_LITERAL("rotation_hook_test_debug.log"));
+    LoggingSettings logging_settings;
+    logging_settings.log_file_path = log_name;
+    logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+    logging_settings.max_log_file_size = 1024;
+    logging_settings.max_rotated_log_files = kMaxRotatedFiles;
+    logging_settings.post_rotation_hook =
+        [&mutex, &rotation_count, &kept_files](const PathString& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (rotation_count++ % 2 == 0) {
+                kept_files.push_back(path);
+                return;
+            }
+
+            PathString moved_path = path + PATH_LITERAL(".moved");
+#if defined(OS_WIN)
+            MakeFileMove(Path(path), Path(moved_path));
+#else
+            rename(path.c_str(), moved_path.c_str());
+#endif
+        };
+    ConfigureLoggingSettings(logging_settings);
+
+    for (int i = 0; i < 100; ++i) {
+        LOG(INFO) << "rotation hook test message " << i;
+    }
+
+    size_t existing_count = 0;
+    for (int retry = 0; retry < 50; ++retry) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::lock_guard<std::mutex> lock(mutex);
+        existing_count = std::count_if(kept_files.begin(), kept_files.end(),
+                                       [](const PathString& path) { return ::PathExists(path); });
+        if (kept_files.size() > kMaxRotatedFiles && existing_count == kMaxRotatedFiles) {
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        EXPECT_GT(kept_files.size(), kMaxRotatedFiles);
+        EXPECT_EQ(kMaxRotatedFiles, existing_count);
+    }
+
+    ConfigureLoggingSettings(LoggingSettings());
+}
+
+TEST(LoggingTest, RateLimitedLogging)
+{
+    PathString log_name(PATH_LITERAL("rate_limit_test_debug.log"));
+    LoggingSettings logging_settings;
+    logging_settings.log_file_path = log_name;
+    logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+    ConfigureLoggingSettings(logging_settings);
+
+    for (int i = 0; i < 10; ++i) {
+        LOG_EVERY_N(INFO, 3) << "every 3rd " << i;
+    }
+
+    EXPECT_EQ(4U, CountFileLines(log_name));
+
+    for (int i = 0; i < 10; ++i) {
+        LOG_FIRST_N(INFO, 2) << "first 2 " << i;
+    }
+
+    EXPECT_EQ(6U, CountFileLines(log_name));
+
+    for (int i = 0; i < 10; ++i) {
+        LOG_EVERY_T(INFO, 60) << "every minute " << i;
+    }
+
+    EXPECT_EQ(7U, CountFileLines(log_name));
+
+    // Counters are not advanced when sites are disabled.
+    int evaluated = 0;
+    auto count_evaluation = [&evaluated] { return ++evaluated; };
+    logging_settings.min_severity_level = LogSeverity::LogWarning;
+    ConfigureLoggingSettings(logging_settings);
+    for (int i = 0; i < 10; ++i) {
+        LOG_EVERY_N(INFO, 1) << count_evaluation();
+    }
+
+    EXPECT_EQ(0, evaluated);
+    EXPECT_EQ(0U, CountFileLines(log_name));
+
+    ConfigureLoggingSettings(LoggingSettings());
+}
+
+TEST(LoggingTest, VerboseModules)
+{
+    PathString log_name(PATH_LITERAL("vmodule_test_debug.log"));
+    LoggingSettings logging_settings;
+    logging_settings.log_file_path = log_name;
+    logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+    ConfigureLoggingSettings(logging_settings);
+
+    auto log_all = [] {
+        LOG(INFO) << "info";
+        LOG(ERROR) << "error";
+        VLOG(0) << "verbose 0";
+        VLOG(1) << "verbose 1";
+        VLOG(2) << "verbose 2";
+    };
+
+    log_all();
+    EXPECT_EQ(3U, CountFileLines(log_name));
+
+    ConfigureVerboseLogging(1, "");
+    log_all();
+    EXPECT_EQ(7U, CountFileLines(log_name));
+
+    // The first matched pattern wins.
+    ConfigureVerboseLogging(0, "no_such_module=1,logging_unit*=2,logging_unittest=0");
+    log_all();
+    EXPECT_EQ(12U, CountFileLines(log_name));
+
+    // Muted modules still keep errors.
+    ConfigureVerboseLogging(0, "logging_unitte?t=-1");
+    log_all();
+    EXPECT_EQ(13U, CountFileLines(log_name));
+
+    // Malformed entries are ignored.
+    ConfigureVerboseLogging(0, "logging_unittest,=1,logging_unittest=x");
+    log_all();
+    EXPECT_EQ(16U, CountFileLines(log_name));
+
+    ConfigureLoggingSettings(LoggingSettings());
+}
+
+TEST(LoggingTest, BinaryLogFormat)
+{
+    auto log_samples = [] {
+        LOG(INFO) << "integers " << 42 << ' ' << -7 << ' ' << 7U << ' '
+                  << std::numeric_limits<long long>::min() << " bool " << true;
+        LOG(WARNING) << "floats " << 3.25 << ' ' << 1.5F << ' ' << 0.1L << " pointer "
+                     << reinterpret_cast<const void*>(0x1234) << " null " << static_cast<const char*>(nullptr);
+        LOG(INFO) << "strings " << std::string("std") << ' ' << StringView("view") << ' '
+                  << Point{1, 2} << std::hex << ' ' << 255 << std::dec << ' ' << 255;
+        LOG_IF(INFO, false) << "never";
+        LOG(ERROR) << "errors are kept in text";
+    };
+
+    PathString text_log_name(PATH_LITERAL("text_format_test_debug.log"));
+    PathString binary_log_name(PATH_LITERAL("binary_format_test_debug.log"));
+
+    LoggingSettings logging_settings;
+    logging_settings.log_item_options = LogItemOptions::EnableNone;
+    logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+    logging_settings.log_file_path = text_log_name;
+    ConfigureLoggingSettings(logging_settings);
+    log_samples();
+
+    logging_settings.log_file_path = binary_log_name;
+    logging_settings.log_file_format = LogFileFormat::BinaryLogFormat;
+    ConfigureLoggingSettings(logging_settings);
+    log_samples();
+
+    // Decodes into exactly what is written in text format.
+    {
+        std::ifstream in(binary_log_name, std::ios::binary);
+        std::ostringstream out;
+        EXPECT_TRUE(DecodeBinaryLog(in, out));
+        EXPECT_EQ(ReadFileContent(text_log_name), out.str());
+        EXPECT_NE(ReadFileContent(binary_log_name), out.str());
+    }
+
+    // Headers with all items, and sites described again in a new file.
+    logging_settings.log_item_options = LogItemOptions::EnableAll;
+    ConfigureLoggingSettings(logging_settings);
+    log_samples();
+
+    {
+        std::ifstream in(binary_log_name, std::ios::binary);
+        std::ostringstream out;
+        EXPECT_TRUE(DecodeBinaryLog(in, out));
+        std::istringstream lines(out.str());
+        std::string line;
+        size_t count = 0;
+        while (std::getline(lines, line)) {
+            ++count;
+            EXPECT_TRUE(HasValidTimestamp(line)) << line;
+            EXPECT_EQ(std::string::npos, line.find("UNKNOWN")) << line;
+        }
+
+        EXPECT_EQ(4U, count);
+    }
+
+    // Not a binary log file.
+    {
+        std::ifstream in(text_log_name, std::ios::binary);
+        std::ostringstream out;
+        EXPECT_FALSE(DecodeBinaryLog(in, out));
+    }
+
+    // A corrupted record length fails the decoding, rather than exhausting the memory.
+    {
+        std::istringstream intact_in(ReadFileContent(binary_log_name));
+        std::ostringstream intact_out;
+        EXPECT_TRUE(DecodeBinaryLog(intact_in, intact_out));
+
+        std::string corrupted = ReadFileContent(binary_log_name);
+        corrupted.append("\x03\xff\xff\xff\xff", 5).append("truncated");
+        std::istringstream in(corrupted);
+        std::ostringstream out;
+        EXPECT_FALSE(DecodeBinaryLog(in, out));
+        EXPECT_EQ(intact_out.str(), out.str());
+    }
+
+    ConfigureLoggingSettings(LoggingSettings());
+}
+
+TEST(LoggingTest, BinaryLogRotationInAsyncMode)
+{
+    constexpr int kThreadCount = 4;
+    constexpr int kMessagesPerThread = 2000;
+
+    std::mutex mutex;
+    std::vector<PathString> log_files;
+
+    PathString log_name(PATH_LITERAL("binary_rotation_test_debug.log"));
+    {
+        AtExitManager exit_manager;
+
+        LoggingSettings logging_settings;
+        logging_settings.log_file_path = log_name;
+        logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+        logging_settings.log_file_format = LogFileFormat::BinaryLogFormat;
+        logging_settings.max_log_file_size = 16 * 1024;
+        logging_settings.post_rotation_hook = [&mutex, &log_files](const PathString& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            log_files.push_back(path);
+        };
+        logging_settings.log_writing_mode = LogWritingMode::WriteAsynchronously;
+        logging_settings.async_buffer_size = 4096;
+        ConfigureLoggingSettings(logging_settings);
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreadCount; ++i) {
+            threads.emplace_back([i] {
+                for (int j = 0; j < kMessagesPerThread; ++j) {
+                    LOG(INFO) << "thread " << i << " message " << j;
+                }
+            });
+        }
+
+        for (auto& th : threads) {
+            th.join();
+        }
+    }
+
+    ConfigureLoggingSettings(LoggingSettings());
+
+    // Each file describes all sites of messages in it.
+    size_t message_count = 0;
+    for (int retry = 0; retry < 50; ++retry) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::lock_guard<std::mutex> lock(mutex);
+        auto files = log_files;
+        files.push_back(log_name);
+        message_count = 0;
+        for (const auto& file : files) {
+            std::ifstream in(file, std::ios::binary);
+            std::ostringstream out;
+            EXPECT_TRUE(DecodeBinaryLog(in, out));
+            std::istringstream lines(out.str());
+            std::string line;
+            while (std::getline(lines, line)) {
+                ++message_count;
+                ASSERT_EQ(std::string::npos, line.find("UNKNOWN")) << line;
+            }
+        }
+
+        if (message_count == kThreadCount * kMessagesPerThread) {
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_GT(log_files.size(), 1U);
+    EXPECT_EQ(static_cast<size_t>(kThreadCount * kMessagesPerThread), message_count);
+}
+
+TEST(LoggingTest, FirstUseOfSitesFromMultipleThreads)
+{
+    constexpr int kThreadCount = 6;
+    constexpr size_t kLineCount = kThreadCount * 2 + kThreadCount / 2;
+
+    auto check_lines = [&](const std::string& content) {
+        std::istringstream lines(content);
+        std::string line;
+        size_t count = 0;
+        while (std::getline(lines, line)) {
+            ++count;
+            EXPECT_NE(std::string::npos, line.find("logging_unittest.cpp(")) << line;
+        }
+
+        EXPECT_EQ(kLineCount, count);
+    };
+
+    PathString text_log_name(PATH_LITERAL("first_use_text_test_debug.log"));
+    PathString binary_log_name(PATH_LITERAL("first_use_binary_test_debug.log"));
+
+    LoggingSettings logging_settings;
+    logging_settings.log_item_options = LogItemOptions::EnableAll;
+    logging_settings.old_file_disposal_option = OldFileDisposalOption::DeleteOldFile;
+    logging_settings.max_verbose_level = 1;
+    logging_settings.log_file_path = text_log_name;
+    ConfigureLoggingSettings(logging_settings);
+    RunOnThreadsAtOnce(kThreadCount, &LogFromFreshSites<0>);
+    check_lines(ReadFileContent(text_log_name));
+
+    {
+        AtExitManager exit_manager;
+
+        logging_settings.log_file_path = binary_log_name;
+        logging_settings.log_file_format = LogFileFormat::BinaryLogFormat;
+        logging_settings.log_writing_mode = LogWritingMode::WriteAsynchronously;
+        ConfigureLoggingSettings(logging_settings);
+        RunOnThreadsAtOnce(kThreadCount, &LogFromFreshSites<1>);
+    }
+
+    ConfigureLoggingSettings(LoggingSettings());
+
+    std::ifstream in(binary_log_name, std::ios::binary);
+    std::ostringstream out;
+    EXPECT_TRUE(DecodeBinaryLog(in, out));
+    check_lines(out.str());
+}
+
 TEST(LoggingTest, FatalLevelCallStack)
 {
     ConfigureLoggingSettings(LoggingSettings());
@@ -2,7 +2,14 @@
  @ 0xCCCCCCCC
 */
 
+#include <chrono>
 #include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -155,4 +162,555 @@ TEST(LRUCacheTest, move_semantics)
     EXPECT_TRUE(CacheOrderingMatch(messy_dt, {65, 66, 67, 68}));
 }
 
+TEST(LRUCacheTest, PooledStorage)
+{
+    using Dict = LRUCache<int, std::string, PooledHashMap>;
+    Dict dt(4);
+    dt.Put(65, "A");
+    dt.Put(66, "B");
+    dt.Put(67, "C");
+    dt.Put(68, "D");
+    EXPECT_TRUE(CacheOrderingMatch(dt, {65, 66, 67, 68}));
+
+    EXPECT_EQ("B", dt.Get(66)->second);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {65, 67, 68, 66}));
+    EXPECT_EQ(dt.end(), dt.Get(70));
+
+    dt.Put(69, "E");
+    EXPECT_TRUE(CacheOrderingMatch(dt, {67, 68, 66, 69}));
+    EXPECT_EQ(dt.end(), dt.find(65));
+
+    const Dict& const_dt = dt;
+    EXPECT_EQ("D", const_dt.find(68)->second);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {67, 68, 66, 69}));
+
+    auto it = dt.erase(dt.find(68));
+    EXPECT_EQ(66, it->first);
+    EXPECT_EQ(69, (--dt.end())->first);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {67, 66, 69}));
+
+    Dict moved(std::move(dt));
+    EXPECT_TRUE(CacheOrderingMatch(moved, {67, 66, 69}));
+    dt = std::move(moved);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {67, 66, 69}));
+
+    dt.Evict(dt.size());
+    EXPECT_TRUE(dt.empty());
+
+    using PtrTable = LRUCache<std::string, std::unique_ptr<int>, PooledHashMap>;
+    PtrTable ptrs(PtrTable::NoAutoEvict);
+    for (int i = 0; i < 1000; ++i) {
+        ptrs.Put(std::to_string(i), std::make_unique<int>(i));
+    }
+
+    EXPECT_EQ(1000, ptrs.size());
+    EXPECT_EQ(500, *ptrs.find("500")->second);
+}
+
+TEST(LRUCacheTest, PooledStorageMatchesListStorage)
+{
+    // Keys colliding in low bits stress probing and backward shift deletion.
+    LRUCache<int, int, HashMap> expected(200);
+    LRUCache<int, int, PooledHashMap> actual(200);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> key_dist(0, 500);
+    for (int i = 0; i < 50000; ++i) {
+        int key = key_dist(rng) * 1024;
+        switch (rng() % 4) {
+            case 0: {
+                auto expected_it = expected.Get(key);
+                auto actual_it = actual.Get(key);
+                ASSERT_EQ(expected_it == expected.end(), actual_it == actual.end());
+                break;
+            }
+
+            case 1: {
+                auto it = actual.find(key);
+                ASSERT_EQ(expected.find(key) == expected.end(), it == actual.end());
+                if (it != actual.end()) {
+                    expected.erase(expected.find(key));
+                    actual.erase(it);
+                }
+                break;
+            }
+
+            default:
+                expected.Put(key, i);
+                actual.Put(key, i);
+                break;
+        }
+    }
+
+    ASSERT_EQ(expected.size(), actual.size());
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), actual.begin()));
+}
+
+template<template<typename, typename> class Map>
+void TestSegmentedLRU()
+{
+    // The protected segment holds 4 entries.
+    using Dict = LRUCache<int, int, Map, SegmentedLRUEviction>;
+    Dict dt(5);
+    for (int i = 1; i <= 5; ++i) {
+        dt.Put(i, i);
+    }
+
+    dt.Get(1);
+    dt.Get(2);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {3, 4, 5, 1, 2}));
+
+    // A scan doesn't flush entries accessed more than once.
+    for (int i = 6; i <= 20; ++i) {
+        dt.Put(i, i);
+    }
+
+    EXPECT_TRUE(CacheOrderingMatch(dt, {18, 19, 20, 1, 2}));
+
+    // Overflowing entries of the protected segment are demoted.
+    for (int i : {18, 19, 20}) {
+        dt.Get(i);
+    }
+
+    EXPECT_TRUE(CacheOrderingMatch(dt, {1, 2, 18, 19, 20}));
+    dt.Put(21, 21);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {21, 2, 18, 19, 20}));
+
+    dt.erase(dt.find(18));
+    dt.Get(2);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {21, 19, 20, 2}));
+
+    Dict moved(std::move(dt));
+    EXPECT_TRUE(dt.empty());
+    moved.Get(21);
+    moved.Put(22, 22);
+    EXPECT_TRUE(CacheOrderingMatch(moved, {22, 19, 20, 2, 21}));
+}
+
+TEST(LRUCacheTest, SegmentedLRUEviction)
+{
+    TestSegmentedLRU<HashMap>();
+    TestSegmentedLRU<PooledHashMap>();
+}
+
+template<template<typename, typename> class Map>
+void TestClock()
+{
+    using Dict = LRUCache<int, int, Map, ClockEviction>;
+    Dict dt(3);
+    dt.Put(1, 1);
+    dt.Put(2, 2);
+    dt.Put(3, 3);
+
+    // The hand stays at 1, and new entries are inserted right before it.
+    EXPECT_TRUE(CacheOrderingMatch(dt, {2, 3, 1}));
+
+    // Access doesn't reorder entries.
+    EXPECT_EQ(1, dt.Get(1)->second);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {2, 3, 1}));
+
+    // The hand skips 1 and clears its referenced bit, then evicts 2.
+    dt.Put(4, 4);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {4, 3, 1}));
+
+    dt.Get(3);
+    dt.Put(5, 5);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {5, 4, 3}));
+
+    dt.Evict(3);
+    EXPECT_TRUE(dt.empty());
+    dt.Put(6, 6);
+    dt.Put(7, 7);
+    EXPECT_TRUE(CacheOrderingMatch(dt, {7, 6}));
+}
+
+TEST(LRUCacheTest, ClockEviction)
+{
+    TestClock<HashMap>();
+    TestClock<PooledHashMap>();
+}
+
+TEST(LRUCacheTest, TinyLFUAdmission)
+{
+    using Dict = LRUCache<int, int, PooledHashMap, TinyLFUAdmission<>>;
+    Dict dt(10);
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 10; ++i) {
+            if (dt.Get(i) == dt.end()) {
+                dt.Put(i, i);
+            }
+        }
+    }
+
+    // Keys seen only once are not admitted.
+    for (int i = 100; i < 200; ++i) {
+        EXPECT_EQ(dt.end(), dt.Put(i, i));
+    }
+
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_NE(dt.end(), dt.find(i));
+    }
+
+    // A key becoming popular is admitted eventually.
+    bool admitted = false;
+    for (int round = 0; round < 10 && !admitted; ++round) {
+        admitted = dt.Get(500) != dt.end() || dt.Put(500, 500) != dt.end();
+    }
+
+    EXPECT_TRUE(admitted);
+    EXPECT_EQ(10, dt.size());
+}
+
+template<typename EvictionPolicy>
+void TestStorageEquivalence()
+{
+    LRUCache<int, int, HashMap, EvictionPolicy> expected(100);
+    LRUCache<int, int, PooledHashMap, EvictionPolicy> actual(100);
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> key_dist(0, 300);
+    for (int i = 0; i < 20000; ++i) {
+        int key = key_dist(rng);
+        switch (rng() % 5) {
+            case 0:
+            case 1:
+                ASSERT_EQ(expected.Get(key) == expected.end(), actual.Get(key) == actual.end());
+                break;
+
+            case 2: {
+                auto it = actual.find(key);
+                if (it != actual.end()) {
+                    expected.erase(expected.find(key));
+                    actual.erase(it);
+                }
+                break;
+            }
+
+            default:
+                ASSERT_EQ(expected.Put(key, i) == expected.end(),
+                          actual.Put(key, i) == actual.end());
+                break;
+        }
+
+        if (i == 10000) {
+            auto moved = std::move(actual);
+            actual = std::move(moved);
+        }
+    }
+
+    ASSERT_EQ(expected.size(), actual.size());
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), actual.begin()));
+}
+
+TEST(LRUCacheTest, EvictionPoliciesOnStorages)
+{
+    TestStorageEquivalence<LRUEviction>();
+    TestStorageEquivalence<SegmentedLRUEviction>();
+    TestStorageEquivalence<ClockEviction>();
+    TestStorageEquivalence<TinyLFUAdmission<SegmentedLRUEviction>>();
+    TestStorageEquivalence<TinyLFUAdmission<ClockEviction>>();
+}
+
+template<template<typename, typename> class Map>
+void TestWeigher()
+{
+    using Cache = LRUCache<int, std::string, Map>;
+    Cache cache(10, [](int, const std::string& value) {
+        return value.size();
+    });
+    EXPECT_EQ(10, cache.max_size());
+
+    cache.Put(1, "abcd");
+    cache.Put(2, "efg");
+    cache.Put(3, "hij");
+    EXPECT_EQ(10, cache.weight());
+    EXPECT_EQ(3, cache.size());
+
+    // Evicts entries until the new one fits.
+    cache.Put(4, "klmnop");
+    EXPECT_TRUE(CacheOrderingMatch(cache, {3, 4}));
+    EXPECT_EQ(9, cache.weight());
+
+    // Updating an entry changes its weight, and may evict others.
+    cache.Put(3, "hijklmn");
+    EXPECT_TRUE(CacheOrderingMatch(cache, {3}));
+    EXPECT_EQ(7, cache.weight());
+
+    // Entries heavier than the capacity are never cached.
+    EXPECT_EQ(cache.end(), cache.Put(5, "heavier than max"));
+    EXPECT_EQ(cache.end(), cache.Put(3, "heavier than max"));
+    EXPECT_TRUE(cache.empty());
+    EXPECT_EQ(0, cache.weight());
+
+    cache.Put(6, "a");
+    cache.Put(7, "bc");
+    cache.erase(cache.find(6));
+    EXPECT_EQ(2, cache.weight());
+
+    Cache moved(std::move(cache));
+    EXPECT_EQ(2, moved.weight());
+    EXPECT_EQ(0, cache.weight());
+    moved.Put(8, "defghijk");
+    EXPECT_TRUE(CacheOrderingMatch(moved, {7, 8}));
+    EXPECT_EQ(10, moved.weight());
+
+    // Without a weigher, weight is the number of entries.
+    LRUCache<int, int, Map> counted(3);
+    counted.Put(1, 1);
+    counted.Put(2, 2);
+    EXPECT_EQ(2, counted.weight());
+}
+
+template<template<typename, typename> class Map>
+void TestTimeToLive()
+{
+    using Cache = LRUCache<int, int, Map>;
+    Cache cache(10);
+    cache.Put(1, 1, std::chrono::milliseconds(1));
+    cache.Put(2, 2);
+    cache.Put(3, 3, std::chrono::hours(1));
+    cache.set_default_time_to_live(std::chrono::milliseconds(1));
+    cache.Put(4, 4);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    // Expired entries are invisible to lookups, but are still cached until being removed.
+    EXPECT_EQ(cache.end(), cache.find(1));
+    EXPECT_EQ(4, cache.size());
+    EXPECT_EQ(cache.end(), cache.Get(1));
+    EXPECT_EQ(3, cache.size());
+    EXPECT_NE(cache.end(), cache.Get(2));
+    EXPECT_NE(cache.end(), cache.Get(3));
+
+    cache.RemoveExpired();
+    EXPECT_TRUE(CacheOrderingMatch(cache, {2, 3}));
+
+    // Putting a key again renews its time-to-live.
+    cache.Put(2, 20, std::chrono::milliseconds(1));
+    cache.Put(2, 21, std::chrono::hours(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_NE(cache.end(), cache.Get(2));
+
+    // Puts sweep expired entries gradually.
+    Cache swept(Cache::NoAutoEvict);
+    for (int i = 0; i < 6; ++i) {
+        swept.Put(i, i, std::chrono::milliseconds(1));
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i = 10; i < 20; ++i) {
+        swept.Put(i, i);
+    }
+
+    EXPECT_EQ(10, swept.size());
+    EXPECT_EQ(10, swept.begin()->first);
+}
+
+template<template<typename, typename> class Map>
+void TestEvictionCallback()
+{
+    using Cache = LRUCache<int, std::unique_ptr<int>, Map>;
+    std::vector<std::pair<int, EvictionCause>> evicted;
+    int released = 0;
+    Cache cache(2);
+    cache.set_eviction_callback([&](const int& key, std::unique_ptr<int>& entry,
+                                    EvictionCause cause) {
+        evicted.emplace_back(key, cause);
+        released += *entry;
+        entry.reset();
+    });
+
+    cache.Put(1, std::make_unique<int>(1));
+    cache.Put(2, std::make_unique<int>(2));
+    cache.Put(1, std::make_unique<int>(10));
+    cache.Put(3, std::make_unique<int>(3));
+    cache.Put(4, std::make_unique<int>(4), std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(cache.end(), cache.Get(4));
+    cache.Evict();
+    cache.Put(5, std::make_unique<int>(5));
+    cache.erase(cache.find(5));
+
+    std::vector<std::pair<int, EvictionCause>> expected {
+        {1, EvictionCause::Replaced},
+        {2, EvictionCause::Capacity},
+        {1, EvictionCause::Capacity},
+        {4, EvictionCause::Expired},
+        {3, EvictionCause::Capacity}
+    };
+    EXPECT_EQ(expected, evicted);
+    EXPECT_EQ(1 + 2 + 10 + 4 + 3, released);
+    EXPECT_TRUE(cache.empty());
+}
+
+TEST(LRUCacheTest, Weigher)
+{
+    TestWeigher<TreeMap>();
+    TestWeigher<HashMap>();
+    TestWeigher<PooledHashMap>();
+}
+
+// Eviction policies follow the number of entries cached, rather than the capacity in weight.
+TEST(LRUCacheTest, WeigherWithEvictionPolicies)
+{
+    auto weigh = [](int, int) -> size_t {
+        return 10;
+    };
+
+    // The protected segment takes 8 of 10 entries, thus a new entry is not evicted by the
+    // next one.
+    LRUCache<int, int, HashMap, SegmentedLRUEviction> slru(100, weigh);
+    for (int i = 1; i <= 10; ++i) {
+        slru.Put(i, i);
+    }
+
+    for (int i = 1; i <= 10; ++i) {
+        slru.Get(i);
+    }
+
+    slru.Put(11, 11);
+    slru.Put(12, 12);
+    EXPECT_NE(slru.end(), slru.Get(11));
+    EXPECT_EQ(10, slru.size());
+
+    // The sketch is not sized by the capacity in weight.
+    LRUCache<int, int, PooledHashMap, TinyLFUAdmission<>> tiny_lfu(size_t(1) << 30, weigh);
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_NE(tiny_lfu.end(), tiny_lfu.Put(i, i));
+    }
+
+    EXPECT_EQ(1000, tiny_lfu.size());
+
+    LRUCache<int, int, PooledHashMap, TinyLFUAdmission<>> admission(100, weigh);
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 10; ++i) {
+            if (admission.Get(i) == admission.end()) {
+                admission.Put(i, i);
+            }
+        }
+    }
+
+    for (int i = 100; i < 200; ++i) {
+        EXPECT_EQ(admission.end(), admission.Put(i, i));
+    }
+
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_NE(admission.end(), admission.find(i));
+    }
+}
+
+TEST(LRUCacheTest, TimeToLive)
+{
+    TestTimeToLive<TreeMap>();
+    TestTimeToLive<HashMap>();
+    TestTimeToLive<PooledHashMap>();
+}
+
+TEST(LRUCacheTest, EvictionCallback)
+{
+    TestEvictionCallback<TreeMap>();
+    TestEvictionCallback<HashMap>();
+    TestEvictionCallback<PooledHashMap>();
+}
+
+template<template<typename, typename> class Map, typename EvictionPolicy>
+void TestHeterogeneousLookup()
+{
+    LRUCache<std::string, int, Map, EvictionPolicy> cache(3);
+    cache.Put("one", 1);
+    cache.Put(std::string("two"), 2);
+    cache.Put("three", 3);
+
+    StringView key("one, two");
+    auto it = cache.Get(key.substr(0, 3));
+    ASSERT_NE(cache.end(), it);
+    EXPECT_EQ(1, it->second);
+    EXPECT_NE(cache.end(), cache.find(key.substr(5)));
+    EXPECT_NE(cache.end(), cache.find("three"));
+    EXPECT_EQ(cache.end(), cache.find(key));
+
+    EXPECT_EQ(1, cache.erase(StringView("two")));
+    EXPECT_EQ(0, cache.erase("two"));
+    EXPECT_EQ(2, cache.size());
+
+    // Keys viewed by the index are kept valid on moves.
+    auto moved = std::move(cache);
+    moved.Put("four", 4);
+    EXPECT_NE(moved.end(), moved.Get("one"));
+    EXPECT_NE(moved.end(), moved.Get(std::string("four")));
+    EXPECT_EQ(1, moved.erase("three"));
+
+    LRUCache<std::wstring, int, Map, EvictionPolicy> wcache(3);
+    wcache.Put(L"kbase", 0);
+    EXPECT_NE(wcache.end(), wcache.Get(WStringView(L"kbase")));
+}
+
+TEST(LRUCacheTest, HeterogeneousLookup)
+{
+    TestHeterogeneousLookup<TreeMap, LRUEviction>();
+    TestHeterogeneousLookup<HashMap, LRUEviction>();
+    TestHeterogeneousLookup<PooledHashMap, LRUEviction>();
+    TestHeterogeneousLookup<HashMap, TinyLFUAdmission<SegmentedLRUEviction>>();
+}
+
+TEST(LRUCacheTest, Stats)
+{
+    using Cache = LRUCache<int, int, PooledHashMap, LRUEviction, LRUCacheStats>;
+    Cache cache(4);
+    for (int i = 0; i < 6; ++i) {
+        cache.Put(i, i);
+    }
+
+    cache.Put(5, 50);
+    cache.Put(6, 6, std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i = 0; i < 5; ++i) {
+        cache.Get(3);
+    }
+
+    cache.Get(4);
+    cache.Get(0);
+    cache.Get(6);
+
+    // Entries: 4 hit once, 5 never, 3 hit 5 times.
+    auto stats = cache.GetStats();
+    EXPECT_EQ(6, stats.hits);
+    EXPECT_EQ(2, stats.misses);
+    EXPECT_DOUBLE_EQ(0.75, stats.hit_rate());
+    EXPECT_EQ(7, stats.inserts);
+    EXPECT_EQ(1, stats.updates);
+    EXPECT_EQ(0, stats.rejections);
+    EXPECT_EQ(3, stats.capacity_evictions);
+    EXPECT_EQ(1, stats.expirations);
+    EXPECT_EQ(3, stats.size);
+    EXPECT_EQ(4, stats.max_size);
+    EXPECT_EQ(3, stats.sampled_entry_count);
+    EXPECT_EQ(1, stats.access_frequencies[0]);
+    EXPECT_EQ(1, stats.access_frequencies[1]);
+    EXPECT_EQ(1, stats.access_frequencies[3]);
+
+    EXPECT_EQ(1, cache.GetStats(1).sampled_entry_count);
+
+    std::ostringstream dump;
+    dump << stats;
+    EXPECT_NE(std::string::npos, dump.str().find("hits: 6, misses: 2, hit rate: 75%"));
+    EXPECT_NE(std::string::npos, dump.str().find("{ 0: 1 1: 1 4-7: 1 }"));
+
+    // Counters move with the cache.
+    Cache moved(std::move(cache));
+    EXPECT_EQ(6, moved.GetStats().hits);
+    EXPECT_EQ(0, cache.GetStats().hits);
+
+    moved.ResetStats();
+    stats = moved.GetStats();
+    EXPECT_EQ(0, stats.hits);
+    EXPECT_EQ(0, stats.inserts);
+    EXPECT_EQ(1, stats.access_frequencies[3]);
+
+    // Rejections.
+    LRUCache<int, std::string, TreeMap, LRUEviction, LRUCacheStats> weighted(
+        4, [](int, const std::string& value) {
+            return value.size();
+        });
+    weighted.Put(1, "too heavy");
+    EXPECT_EQ(1, weighted.GetStats().rejections);
+}
+
 }   // namespace kbase
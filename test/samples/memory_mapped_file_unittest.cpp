@@ -0,0 +1,141 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "kbase/memory_mapped_file.h"
+#include "kbase/pickle.h"
+#include "kbase/scope_guard.h"
+
+namespace {
+
+using kbase::MemoryMappedFile;
+using kbase::Path;
+
+const Path kRecordFile(PATH_LITERAL("memory_mapped_file_records.bin"));
+
+void RemoveFile(const Path& path)
+{
+#if defined(OS_WIN)
+    _wremove(path.value().c_str());
+#else
+    std::remove(path.value().c_str());
+#endif
+}
+
+// Writes `count` pickled messages into the file, and returns the size of the file.
+size_t WriteRecords(const Path& path, int count)
+{
+    std::ofstream out(path.value(), std::ios::binary | std::ios::trunc);
+    size_t file_size = 0;
+    for (int i = 0; i < count; ++i) {
+        kbase::Pickle pickle;
+        pickle << i << std::string(static_cast<size_t>(i % 7), 'k');
+        out.write(static_cast<const char*>(pickle.data()), pickle.size());
+        file_size += pickle.size();
+    }
+
+    return file_size;
+}
+
+}   // namespace
+
+namespace kbase {
+
+TEST(MemoryMappedFileTest, ReadRecords)
+{
+    ON_SCOPE_EXIT { RemoveFile(kRecordFile); };
+
+    constexpr int kRecordCount = 1000;
+    size_t file_size = WriteRecords(kRecordFile, kRecordCount);
+
+    MemoryMappedFile file;
+    ASSERT_TRUE(file.Open(kRecordFile, MemoryMappedFile::AccessPattern::Sequential));
+    ASSERT_TRUE(file.IsValid());
+    ASSERT_EQ(file_size, file.size());
+    file.Prefetch(0, file.size());
+
+    PickleRecordReader records(file.data(), file.size());
+    PickleReader reader;
+    int count = 0;
+    while (records.Next(reader)) {
+        int value = -1;
+        StringView text;
+        reader >> value;
+        reader.ReadStringView(text);
+        EXPECT_FALSE(reader.has_error());
+        EXPECT_EQ(count, value);
+        EXPECT_EQ(static_cast<size_t>(count % 7), text.size());
+        // Strings are viewed in place.
+        EXPECT_TRUE(text.empty() ||
+                    (text.data() > reinterpret_cast<const char*>(file.data()) &&
+                     text.data() < reinterpret_cast<const char*>(file.data() + file.size())));
+        ++count;
+    }
+
+    EXPECT_EQ(kRecordCount, count);
+    EXPECT_FALSE(records.has_error());
+
+    file.Close();
+    EXPECT_FALSE(file.IsValid());
+    EXPECT_EQ(nullptr, file.data());
+}
+
+TEST(MemoryMappedFileTest, TruncatedFile)
+{
+    ON_SCOPE_EXIT { RemoveFile(kRecordFile); };
+
+    size_t file_size = WriteRecords(kRecordFile, 3);
+    std::string content;
+    {
+        MemoryMappedFile file;
+        ASSERT_TRUE(file.Open(kRecordFile));
+        content.assign(reinterpret_cast<const char*>(file.data()), file.size() - 1);
+    }
+
+    {
+        std::ofstream out(kRecordFile.value(), std::ios::binary | std::ios::trunc);
+        out.write(content.data(), content.size());
+    }
+
+    MemoryMappedFile file;
+    ASSERT_TRUE(file.Open(kRecordFile, MemoryMappedFile::AccessPattern::Random));
+    ASSERT_EQ(file_size - 1, file.size());
+
+    PickleRecordReader records(file.data(), file.size());
+    PickleReader reader;
+    int count = 0;
+    while (records.Next(reader)) {
+        ++count;
+    }
+
+    EXPECT_EQ(2, count);
+    EXPECT_TRUE(records.has_error());
+}
+
+TEST(MemoryMappedFileTest, EmptyOrNonexistentFile)
+{
+    ON_SCOPE_EXIT { RemoveFile(kRecordFile); };
+
+    WriteRecords(kRecordFile, 0);
+    MemoryMappedFile file;
+    ASSERT_TRUE(file.Open(kRecordFile));
+    EXPECT_TRUE(file.IsValid());
+    EXPECT_EQ(0U, file.size());
+    file.Prefetch(0, 100);
+
+    PickleRecordReader records(file.data(), file.size());
+    PickleReader reader;
+    EXPECT_FALSE(records.Next(reader));
+    EXPECT_FALSE(records.has_error());
+
+    EXPECT_FALSE(file.Open(Path(PATH_LITERAL("memory_mapped_file_nonexistent.bin"))));
+    EXPECT_FALSE(file.IsValid());
+}
+
+}   // namespace kbase
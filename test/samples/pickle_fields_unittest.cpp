@@ -0,0 +1,284 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "kbase/pickle_fields.h"
+
+namespace {
+
+using kbase::GetPickledSize;
+using kbase::MakePickle;
+using kbase::Pickle;
+using kbase::PickleEncoding;
+using kbase::PickleReader;
+
+struct Point {
+    int x;
+    int64_t y;
+    bool visible;
+
+    KBASE_PICKLE_FIELDS(Point, x, y, visible);
+};
+
+bool operator==(const Point& lhs, const Point& rhs)
+{
+    return lhs.x == rhs.x && lhs.y == rhs.y && lhs.visible == rhs.visible;
+}
+
+struct Segment {
+    Point start;
+    Point end;
+    uint8_t color;
+
+    KBASE_PICKLE_FIELDS(Segment, start, end, color);
+};
+
+// A minimal optional type, in the shape of std::optional.
+template<typename T>
+class Maybe {
+public:
+    bool has_value() const
+    {
+        return engaged_;
+    }
+
+    T& emplace()
+    {
+        engaged_ = true;
+        value_ = T();
+        return value_;
+    }
+
+    T& operator*()
+    {
+        return value_;
+    }
+
+    const T& operator*() const
+    {
+        return value_;
+    }
+
+private:
+    bool engaged_ = false;
+    T value_ {};
+};
+
+class Shape {
+public:
+    Shape() = default;
+
+    Shape(std::string name, std::vector<Point> points)
+        : name_(std::move(name)), points_(std::move(points))
+    {}
+
+    void set_tags(std::map<std::string, int> tags)
+    {
+        tags_ = std::move(tags);
+    }
+
+    void set_outline(const Segment& outline)
+    {
+        outline_ = std::make_unique<Segment>(outline);
+    }
+
+    void set_weight(double weight)
+    {
+        weight_.emplace() = weight;
+    }
+
+    const std::string& name() const
+    {
+        return name_;
+    }
+
+    const std::vector<Point>& points() const
+    {
+        return points_;
+    }
+
+    const std::map<std::string, int>& tags() const
+    {
+        return tags_;
+    }
+
+    const Segment* outline() const
+    {
+        return outline_.get();
+    }
+
+    const Maybe<double>& weight() const
+    {
+        return weight_;
+    }
+
+private:
+    std::string name_;
+    std::vector<Point> points_;
+    std::vector<short> ids_ {1, -300, 20000};
+    std::map<std::string, int> tags_;
+    std::unique_ptr<Segment> outline_;
+    Maybe<double> weight_;
+
+    KBASE_PICKLE_FIELDS(Shape, name_, points_, ids_, tags_, outline_, weight_);
+};
+
+Shape MakeShape()
+{
+    Shape shape("triangle", {{1, -2, true}, {300, INT64_C(1) << 40, false}, {-7, 0, true}});
+    shape.set_tags({{"layer", 3}, {"z-order", -1}});
+    shape.set_outline({{0, 0, true}, {100000, -100000, false}, 0xFF});
+    shape.set_weight(2.5);
+    return shape;
+}
+
+void ExpectSameShape(const Shape& expected, const Shape& actual)
+{
+    EXPECT_EQ(expected.name(), actual.name());
+    EXPECT_EQ(expected.points(), actual.points());
+    EXPECT_EQ(expected.tags(), actual.tags());
+    ASSERT_EQ(expected.outline() != nullptr, actual.outline() != nullptr);
+    if (expected.outline()) {
+        EXPECT_EQ(expected.outline()->start, actual.outline()->start);
+        EXPECT_EQ(expected.outline()->end, actual.outline()->end);
+        EXPECT_EQ(expected.outline()->color, actual.outline()->color);
+    }
+
+    ASSERT_EQ(expected.weight().has_value(), actual.weight().has_value());
+    if (expected.weight().has_value()) {
+        EXPECT_EQ(*expected.weight(), *actual.weight());
+    }
+}
+
+class CountingAllocator : public kbase::PickleAllocator {
+public:
+    void* Reallocate(void* ptr, size_t old_size, size_t new_size) override
+    {
+        ++allocation_count;
+        return kbase::PickleAllocator::Default()->Reallocate(ptr, old_size, new_size);
+    }
+
+    void Free(void* ptr, size_t size) noexcept override
+    {
+        kbase::PickleAllocator::Default()->Free(ptr, size);
+    }
+
+    int allocation_count = 0;
+};
+
+}   // namespace
+
+namespace kbase {
+
+TEST(PickleFieldsTest, FixedSizeFields)
+{
+    // Sizes of classes whose fields are all of fixed sizes are known at compile-time.
+    static_assert(internal::FixedPickledSize<Point>::value ==
+                      internal::GetPickledFieldsSize({sizeof(int), sizeof(int64_t),
+                                                      sizeof(bool)}),
+                  "unexpected size of Point");
+    static_assert(internal::FixedPickledSize<Segment>::value ==
+                      internal::GetPickledFieldsSize({internal::FixedPickledSize<Point>::value,
+                                                      internal::FixedPickledSize<Point>::value,
+                                                      sizeof(uint8_t)}),
+                  "unexpected size of Segment");
+    static_assert(internal::FixedPickledSize<Shape>::value == 0, "Shape has variable size");
+
+    Segment segment {{1, -1, true}, {2, -(INT64_C(1) << 50), false}, 3};
+
+    // Identical to what writing fields one by one produces.
+    Pickle pickle;
+    pickle << segment;
+    Pickle one_by_one;
+    one_by_one << 1 << INT64_C(-1) << true << 2 << -(INT64_C(1) << 50) << false
+               << static_cast<uint8_t>(3);
+    ASSERT_EQ(one_by_one.size(), pickle.size());
+    EXPECT_EQ(0, memcmp(one_by_one.data(), pickle.data(), pickle.size()));
+    EXPECT_EQ(pickle.payload_size(), GetPickledSize(segment));
+
+    Segment read_segment {};
+    PickleReader reader(pickle);
+    reader >> read_segment;
+    EXPECT_FALSE(reader.has_error());
+    EXPECT_EQ(segment.start, read_segment.start);
+    EXPECT_EQ(segment.end, read_segment.end);
+    EXPECT_EQ(segment.color, read_segment.color);
+
+    // Truncated data.
+    Pickle truncated;
+    truncated << 1 << INT64_C(2);
+    PickleReader truncated_reader(truncated);
+    Point point {5, 6, true};
+    truncated_reader >> point;
+    EXPECT_TRUE(truncated_reader.has_error());
+    EXPECT_EQ((Point{0, 0, false}), point);
+}
+
+TEST(PickleFieldsTest, VariableSizeFields)
+{
+    auto shape = MakeShape();
+    for (auto encoding : {PickleEncoding::Aligned, PickleEncoding::Compact}) {
+        Pickle pickle(encoding);
+        pickle << shape << 42;
+        EXPECT_EQ(pickle.payload_size(), GetPickledSize(shape, encoding) +
+                                         (encoding == PickleEncoding::Compact ? 1 : 4));
+
+        Shape read_shape;
+        int tail = 0;
+        PickleReader reader(pickle);
+        reader >> read_shape >> tail;
+        EXPECT_FALSE(reader.has_error());
+        ExpectSameShape(shape, read_shape);
+        EXPECT_EQ(42, tail);
+    }
+
+    // Absent values.
+    Shape empty_shape("empty", {});
+    Pickle pickle;
+    pickle << empty_shape;
+    EXPECT_EQ(pickle.payload_size(), GetPickledSize(empty_shape));
+
+    // Values present in the destination are reset.
+    Shape read_shape;
+    read_shape.set_outline({});
+    read_shape.set_weight(1.0);
+    PickleReader reader(pickle);
+    reader >> read_shape;
+    EXPECT_FALSE(reader.has_error());
+    ExpectSameShape(empty_shape, read_shape);
+}
+
+TEST(PickleFieldsTest, MakePickle)
+{
+    auto shape = MakeShape();
+    for (auto encoding : {PickleEncoding::Aligned, PickleEncoding::Compact}) {
+        CountingAllocator allocator;
+        {
+            auto pickle = MakePickle(shape, encoding, &allocator);
+            EXPECT_EQ(encoding, pickle.encoding());
+            EXPECT_EQ(1, allocator.allocation_count);
+
+            Shape read_shape;
+            PickleReader reader(pickle);
+            reader >> read_shape;
+            EXPECT_FALSE(reader.has_error());
+            ExpectSameShape(shape, read_shape);
+        }
+
+        std::vector<Shape> shapes;
+        shapes.push_back(MakeShape());
+        shapes.push_back(Shape("empty", {}));
+        allocator.allocation_count = 0;
+        auto pickle = MakePickle(shapes, encoding, &allocator);
+        EXPECT_EQ(1, allocator.allocation_count);
+    }
+}
+
+}   // namespace kbase
@@ -2,7 +2,10 @@
  @ 0xCCCCCCCC
 */
 
+#include <array>
+#include <cstring>
 #include <functional>
+#include <limits>
 #include <list>
 #include <map>
 #include <tuple>
@@ -10,6 +13,7 @@
 
 #include "gtest/gtest.h"
 
+#include "kbase/error_exception_util.h"
 #include "kbase/pickle.h"
 #include "kbase/secure_c_runtime.h"
 
@@ -250,6 +254,196 @@ TEST(PickleTest, EmptyString)
     EXPECT_EQ(s, ss);
 }
 
+TEST(PickleTest, ReaderViews)
+{
+    const std::string str("hello world");
+    const std::wstring wstr(L"wide");
+    const char raw[] = "raw bytes";
+
+    Pickle pickle;
+    pickle << str << wstr << std::string();
+    pickle.Write(raw, sizeof(raw));
+
+    auto in_pickle = [&pickle](const void* ptr) {
+        auto p = static_cast<const kbase::byte*>(ptr);
+        return p >= pickle.payload() && p < pickle.payload() + pickle.payload_size();
+    };
+
+    {
+        PickleReader reader(pickle);
+        kbase::StringView sv, empty_sv;
+        kbase::WStringView wsv;
+        const kbase::byte* data = nullptr;
+        EXPECT_TRUE(reader.ReadStringView(sv));
+        EXPECT_TRUE(reader.ReadWStringView(wsv));
+        EXPECT_TRUE(reader.ReadStringView(empty_sv));
+        EXPECT_TRUE(reader.ReadRawView(data, sizeof(raw)));
+        EXPECT_EQ(str, sv.ToString());
+        EXPECT_EQ(wstr, wsv.ToString());
+        EXPECT_TRUE(empty_sv.empty());
+        EXPECT_EQ(0, memcmp(raw, data, sizeof(raw)));
+        EXPECT_TRUE(in_pickle(sv.data()));
+        EXPECT_TRUE(in_pickle(wsv.data()));
+        EXPECT_TRUE(in_pickle(data));
+        EXPECT_FALSE(!!reader);
+    }
+
+    // Out of bounds.
+    {
+        PickleReader reader(pickle);
+        const kbase::byte* data = nullptr;
+        EXPECT_FALSE(reader.ReadRawView(data, pickle.payload_size() + 1));
+        EXPECT_EQ(nullptr, data);
+        EXPECT_FALSE(!!reader);
+    }
+
+    {
+        Pickle bad_pickle;
+        bad_pickle << std::numeric_limits<size_t>::max();
+        PickleReader reader(bad_pickle);
+        kbase::WStringView wsv(L"untouched");
+        EXPECT_FALSE(reader.ReadWStringView(wsv));
+        EXPECT_TRUE(wsv.empty());
+        EXPECT_FALSE(!!reader);
+    }
+
+    {
+        Pickle empty_pickle;
+        PickleReader reader(empty_pickle);
+        kbase::StringView sv;
+        EXPECT_FALSE(reader.ReadStringView(sv));
+    }
+}
+
+TEST(PickleTest, ReaderUntrustedData)
+{
+    // Reading beyond the end, and the error is sticky.
+    {
+        Pickle pickle;
+        pickle << 1 << 2;
+        PickleReader reader(pickle);
+        int a = 0, b = 0;
+        int64_t c = -1;
+        reader >> a >> c;
+        EXPECT_EQ(1, a);
+        EXPECT_EQ(0, c);
+        EXPECT_TRUE(reader.has_error());
+        reader >> b;
+        EXPECT_EQ(0, b);
+        EXPECT_TRUE(reader.has_error());
+    }
+
+    // Truncated or malformed buffers.
+    {
+        Pickle pickle;
+        pickle << 1 << std::string("hello");
+        PickleReader reader(pickle.data(), pickle.size() - 1);
+        EXPECT_TRUE(reader.has_error());
+        EXPECT_FALSE(!!reader);
+
+        PickleReader no_header(pickle.data(), sizeof(uint32_t) - 1);
+        EXPECT_TRUE(no_header.has_error());
+
+        PickleReader intact(pickle.data(), pickle.size());
+        EXPECT_FALSE(intact.has_error());
+    }
+
+    // Forged sizes of containers and strings.
+    {
+        Pickle pickle;
+        pickle << std::numeric_limits<size_t>::max() / 2;
+        std::vector<int> vi;
+        std::map<int, int> mi;
+        std::string str("untouched");
+        PickleReader vector_reader(pickle);
+        PickleReader map_reader(pickle);
+        PickleReader string_reader(pickle);
+        vector_reader >> vi;
+        map_reader >> mi;
+        string_reader >> str;
+        EXPECT_TRUE(vi.empty());
+        EXPECT_TRUE(mi.empty());
+        EXPECT_TRUE(str.empty());
+        EXPECT_TRUE(vector_reader.has_error());
+        EXPECT_TRUE(map_reader.has_error());
+        EXPECT_TRUE(string_reader.has_error());
+    }
+
+    // Containers with fewer elements than claimed.
+    {
+        Pickle pickle;
+        pickle << size_t(3) << std::string("a") << std::string("b");
+        PickleReader reader(pickle);
+        std::vector<std::string> vs;
+        reader >> vs;
+        EXPECT_EQ(std::vector<std::string>({"a", "b"}), vs);
+        EXPECT_TRUE(reader.has_error());
+    }
+
+    // Elements in arithmetic types are read all or nothing.
+    {
+        Pickle pickle;
+        pickle << size_t(3) << 1 << 2;
+        PickleReader reader(pickle);
+        std::vector<int> vi {0};
+        reader >> vi;
+        EXPECT_EQ(std::vector<int>({0}), vi);
+        EXPECT_TRUE(reader.has_error());
+    }
+
+    {
+        Pickle pickle;
+        pickle << uint8_t(0x7F);
+        PickleReader reader(pickle);
+        bool value = false;
+        reader >> value;
+        EXPECT_TRUE(value);
+        reader.SkipData(1);
+        EXPECT_TRUE(reader.has_error());
+    }
+}
+
+TEST(PickleTest, ReaderReadFields)
+{
+    Pickle pickle;
+    pickle << true << 128 << int64_t(-1) << 3.14 << uint8_t(7);
+
+    {
+        PickleReader reader(pickle);
+        bool b = false;
+        int i = 0;
+        int64_t i64 = 0;
+        double d = 0;
+        uint8_t u8 = 0;
+        EXPECT_TRUE(reader.ReadFields(b, i, i64, d));
+        EXPECT_TRUE(reader.ReadFields(u8));
+        EXPECT_TRUE(b);
+        EXPECT_EQ(128, i);
+        EXPECT_EQ(-1, i64);
+        EXPECT_EQ(3.14, d);
+        EXPECT_EQ(7, u8);
+        EXPECT_FALSE(!!reader);
+        EXPECT_FALSE(reader.has_error());
+    }
+
+    {
+        PickleReader reader(pickle);
+        bool b = true;
+        int i = 1;
+        EXPECT_TRUE(reader.ReadFields(b, i));
+        int64_t i64 = 1;
+        double d = 1;
+        uint8_t u8 = 1;
+        int64_t extra = 1;
+        EXPECT_FALSE(reader.ReadFields(i64, d, u8, extra));
+        EXPECT_EQ(0, i64);
+        EXPECT_EQ(0, d);
+        EXPECT_EQ(0, u8);
+        EXPECT_EQ(0, extra);
+        EXPECT_TRUE(reader.has_error());
+    }
+}
+
 TEST(PickleTest, ContainerVector)
 {
     {
@@ -275,6 +469,91 @@ TEST(PickleTest, ContainerVector)
     }
 }
 
+TEST(PickleTest, ContainerBulkElements)
+{
+    // Identical to what writing elements one by one produces.
+    {
+        std::vector<uint8_t> vu8 {1, 2, 3};
+        std::vector<short> vs {-1, 2};
+        std::vector<int64_t> vi64 {INT64_C(1) << 40, -1};
+        std::array<float, 3> af {{1.5F, 2.5F, 3.5F}};
+
+        Pickle bulk;
+        bulk << true << vu8 << vs << vi64 << af;
+
+        Pickle one_by_one;
+        one_by_one << true << vu8.size();
+        for (auto ele : vu8) {
+            one_by_one << ele;
+        }
+
+        one_by_one << vs.size();
+        for (auto ele : vs) {
+            one_by_one << ele;
+        }
+
+        one_by_one << vi64.size();
+        for (auto ele : vi64) {
+            one_by_one << ele;
+        }
+
+        one_by_one << af.size();
+        for (auto ele : af) {
+            one_by_one << ele;
+        }
+
+        ASSERT_EQ(one_by_one.size(), bulk.size());
+        EXPECT_EQ(0, memcmp(one_by_one.data(), bulk.data(), bulk.size()));
+
+        PickleReader reader(bulk);
+        bool b = false;
+        std::vector<uint8_t> cvu8;
+        std::vector<short> cvs;
+        std::vector<int64_t> cvi64;
+        std::array<float, 3> caf {};
+        reader >> b >> cvu8 >> cvs >> cvi64 >> caf;
+        EXPECT_EQ(vu8, cvu8);
+        EXPECT_EQ(vs, cvs);
+        EXPECT_EQ(vi64, cvi64);
+        EXPECT_EQ(af, caf);
+        EXPECT_FALSE(!!reader);
+        EXPECT_FALSE(reader.has_error());
+    }
+
+    // Arrays of non-arithmetic types, and mismatched sizes.
+    {
+        std::array<std::string, 2> as {{"hello", "world"}};
+        Pickle pickle;
+        pickle << as;
+
+        std::array<std::string, 2> cas;
+        PickleReader reader(pickle);
+        reader >> cas;
+        EXPECT_EQ(as, cas);
+
+        std::array<std::string, 3> mismatched;
+        PickleReader mismatched_reader(pickle);
+        mismatched_reader >> mismatched;
+        EXPECT_TRUE(mismatched_reader.has_error());
+    }
+
+    {
+        std::vector<double> vd(1000);
+        for (size_t i = 0; i < vd.size(); ++i) {
+            vd[i] = i * 0.5;
+        }
+
+        Pickle pickle;
+        pickle << vd;
+        EXPECT_EQ(sizeof(size_t) + vd.size() * sizeof(double), pickle.payload_size());
+
+        std::vector<double> cvd;
+        PickleReader reader(pickle);
+        reader >> cvd;
+        EXPECT_EQ(vd, cvd);
+    }
+}
+
 TEST(PickleTest, ContainerList)
 {
     {
@@ -376,4 +655,389 @@ TEST(PickleTest, SerializeAndDeserialize)
     EXPECT_EQ(unmarshalled_data_list, data_list);
 }
 
+TEST(PickleTest, CompactEncoding)
+{
+    // The default encoding keeps the flag bit clear.
+    {
+        Pickle pickle;
+        pickle << 1;
+        EXPECT_EQ(kbase::PickleEncoding::Aligned, pickle.encoding());
+        PickleHeader header;
+        memcpy(&header, pickle.data(), sizeof(header));
+        EXPECT_EQ(sizeof(int), header.payload_size);
+    }
+
+    {
+        Pickle pickle(kbase::PickleEncoding::Compact);
+        MarshalDataToPickle(pickle);
+        EXPECT_EQ(kbase::PickleEncoding::Compact, pickle.encoding());
+        EXPECT_EQ(data_list, UnMarshalDataFromPickle(pickle));
+
+        Pickle aligned;
+        MarshalDataToPickle(aligned);
+        EXPECT_LT(pickle.size(), aligned.size());
+
+        // The encoding is carried in the serialized buffer.
+        Pickle copied(pickle.data(), pickle.size());
+        EXPECT_EQ(kbase::PickleEncoding::Compact, copied.encoding());
+        PickleReader reader(pickle.data(), pickle.size());
+        EXPECT_EQ(kbase::PickleEncoding::Compact, reader.encoding());
+        EXPECT_EQ(data_list, UnMarshalDataFromPickle(copied));
+    }
+
+    // Varints of boundary values, and no paddings.
+    {
+        Pickle pickle(kbase::PickleEncoding::Compact);
+        pickle << 0 << -1 << 63 << -64 << std::numeric_limits<int>::min()
+               << std::numeric_limits<int64_t>::min() << std::numeric_limits<uint64_t>::max()
+               << static_cast<uint8_t>(0xFF) << static_cast<unsigned short>(300);
+        EXPECT_EQ(1 + 1 + 1 + 1 + 5 + 10 + 10 + 1 + 2, pickle.payload_size());
+
+        int i0, i1, i2, i3, i4;
+        int64_t i64;
+        uint64_t u64;
+        uint8_t u8;
+        unsigned short us;
+        PickleReader reader(pickle);
+        reader >> i0 >> i1 >> i2 >> i3 >> i4 >> i64 >> u64 >> u8 >> us;
+        EXPECT_FALSE(reader.has_error());
+        EXPECT_EQ(0, i0);
+        EXPECT_EQ(-1, i1);
+        EXPECT_EQ(63, i2);
+        EXPECT_EQ(-64, i3);
+        EXPECT_EQ(std::numeric_limits<int>::min(), i4);
+        EXPECT_EQ(std::numeric_limits<int64_t>::min(), i64);
+        EXPECT_EQ(std::numeric_limits<uint64_t>::max(), u64);
+        EXPECT_EQ(0xFF, u8);
+        EXPECT_EQ(300, us);
+    }
+
+    // Containers and fields.
+    {
+        std::vector<int> vi {1, -300, 70000};
+        std::vector<double> vd {0.5, 1.5};
+        std::map<std::string, int> table {{"hello", 1}, {"world", -2}};
+        Pickle pickle(kbase::PickleEncoding::Compact);
+        pickle << vi << vd << table << 7 << true << 1.5F;
+
+        std::vector<int> cvi;
+        std::vector<double> cvd;
+        std::map<std::string, int> ctable;
+        int i = 0;
+        bool b = false;
+        float f = 0;
+        PickleReader reader(pickle);
+        reader >> cvi >> cvd >> ctable;
+        EXPECT_TRUE(reader.ReadFields(i, b, f));
+        EXPECT_EQ(vi, cvi);
+        EXPECT_EQ(vd, cvd);
+        EXPECT_EQ(table, ctable);
+        EXPECT_EQ(7, i);
+        EXPECT_TRUE(b);
+        EXPECT_EQ(1.5F, f);
+        EXPECT_FALSE(!!reader);
+        EXPECT_FALSE(reader.ReadFields(i, b));
+        EXPECT_EQ(0, i);
+    }
+
+    // Malformed varints.
+    {
+        // Truncated.
+        std::vector<kbase::byte> buf {1, 0, 0, 0x80, 0x80};
+        PickleReader truncated(buf.data(), buf.size());
+        int value = 1;
+        truncated >> value;
+        EXPECT_TRUE(truncated.has_error());
+        EXPECT_EQ(0, value);
+
+        // Out of range of the type.
+        Pickle pickle(kbase::PickleEncoding::Compact);
+        pickle << 70000;
+        PickleReader out_of_range(pickle);
+        unsigned short us = 1;
+        out_of_range >> us;
+        EXPECT_TRUE(out_of_range.has_error());
+        EXPECT_EQ(0, us);
+
+        // Overlong.
+        std::vector<kbase::byte> overlong(sizeof(PickleHeader), 0);
+        overlong.insert(overlong.end(), 10, 0xFF);
+        overlong.push_back(0x01);
+        PickleHeader header {static_cast<uint32_t>((overlong.size() - sizeof(header)) |
+                                                   (1U << 31))};
+        memcpy(overlong.data(), &header, sizeof(header));
+        PickleReader overlong_reader(overlong.data(), overlong.size());
+        uint64_t u64 = 1;
+        overlong_reader >> u64;
+        EXPECT_TRUE(overlong_reader.has_error());
+        EXPECT_EQ(0U, u64);
+    }
+}
+
+TEST(PickleTest, AllocatorAndReservation)
+{
+    // Exact reservation.
+    {
+        Pickle pickle(kbase::PickleAllocator::Default(), 3);
+        pickle.Reserve(1000);
+        pickle << 1 << std::string("hello");
+        PickleReader reader(pickle);
+        int i = 0;
+        std::string s;
+        reader >> i >> s;
+        EXPECT_EQ(1, i);
+        EXPECT_EQ("hello", s);
+    }
+
+    kbase::PickleArena arena(128);
+    {
+        std::vector<Pickle> pickles;
+        for (int i = 0; i < 20; ++i) {
+            Pickle pickle(&arena, 8);
+            MarshalDataToPickle(pickle);
+            pickles.push_back(pickle);
+            pickles.push_back(std::move(pickle));
+        }
+
+        Pickle compact(&arena, 0, kbase::PickleEncoding::Compact);
+        MarshalDataToPickle(compact);
+        EXPECT_EQ(kbase::PickleEncoding::Compact, compact.encoding());
+        EXPECT_EQ(data_list, UnMarshalDataFromPickle(compact));
+
+        for (const auto& pickle : pickles) {
+            EXPECT_EQ(data_list, UnMarshalDataFromPickle(pickle));
+        }
+    }
+
+    arena.Reset();
+    {
+        Pickle pickle(&arena, 8);
+        MarshalDataToPickle(pickle);
+        EXPECT_EQ(data_list, UnMarshalDataFromPickle(pickle));
+    }
+}
+
+TEST(PickleTest, ExternalBuffer)
+{
+    Pickle source;
+    MarshalDataToPickle(source);
+    std::vector<uint32_t> buf((source.size() + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+    memcpy(buf.data(), source.data(), source.size());
+    std::vector<uint32_t> original = buf;
+
+    auto pickle = Pickle::FromExternalBuffer(buf.data(), source.size());
+    EXPECT_EQ(buf.data(), pickle.data());
+    EXPECT_EQ(source.size(), pickle.size());
+    EXPECT_EQ(data_list, UnMarshalDataFromPickle(pickle));
+
+    // Copies are in their own buffers.
+    Pickle copied(pickle);
+    EXPECT_NE(pickle.data(), copied.data());
+    EXPECT_EQ(data_list, UnMarshalDataFromPickle(copied));
+
+    // The first write copies the buffer.
+    pickle << 42;
+    EXPECT_NE(buf.data(), pickle.data());
+    EXPECT_EQ(original, buf);
+    PickleReader reader(pickle);
+    decltype(data_list) unmarshalled;
+    reader >> std::get<0>(unmarshalled) >> std::get<1>(unmarshalled)
+           >> std::get<2>(unmarshalled) >> std::get<3>(unmarshalled)
+           >> std::get<4>(unmarshalled) >> std::get<5>(unmarshalled)
+           >> std::get<6>(unmarshalled) >> std::get<7>(unmarshalled)
+           >> std::get<8>(unmarshalled) >> std::get<9>(unmarshalled);
+    int appended = 0;
+    reader >> appended;
+    EXPECT_EQ(data_list, unmarshalled);
+    EXPECT_EQ(42, appended);
+
+    kbase::AlwaysCheckFirstInDebug(false);
+    EXPECT_ANY_THROW(Pickle::FromExternalBuffer(buf.data(), source.size() - 1));
+    EXPECT_ANY_THROW(Pickle::FromExternalBuffer(buf.data(), 2));
+}
+
+TEST(PickleTest, ScatterGather)
+{
+    const std::string large_text(1000, 'x');
+    const std::vector<kbase::byte> blob(301, 0xAB);
+
+    for (auto encoding : {kbase::PickleEncoding::Aligned, kbase::PickleEncoding::Compact}) {
+        auto write_message = [&](Pickle& pickle) {
+            pickle << 1 << std::string("small");
+            pickle.Write(blob.data(), blob.size());
+            pickle.Write(blob.data(), blob.size());
+            pickle << static_cast<uint8_t>(7) << large_text << 3.5;
+        };
+
+        Pickle contiguous(encoding);
+        write_message(contiguous);
+        EXPECT_FALSE(contiguous.has_external_segments());
+        ASSERT_EQ(1U, contiguous.GetSegments().size());
+
+        Pickle pickle(encoding);
+        pickle.set_external_write_threshold(256);
+        write_message(pickle);
+        EXPECT_TRUE(pickle.has_external_segments());
+        EXPECT_EQ(contiguous.payload_size(), pickle.payload_size());
+
+        // Only the internal buffer is covered, and the pickle can't be read as a whole.
+        EXPECT_EQ(contiguous.size() - blob.size() * 2 - large_text.size(), pickle.size());
+        PickleReader whole_reader(pickle);
+        int first = 0;
+        whole_reader >> first;
+        EXPECT_TRUE(whole_reader.has_error());
+
+        // Segments concatenated are identical to the contiguous one, and large data is not
+        // copied.
+        auto segments = pickle.GetSegments();
+        std::vector<kbase::byte> joined;
+        bool blob_referred = false;
+        bool text_referred = false;
+        for (const auto& segment : segments) {
+            auto data = static_cast<const kbase::byte*>(segment.data);
+            joined.insert(joined.end(), data, data + segment.size);
+            blob_referred |= segment.data == blob.data();
+            text_referred |= segment.data == large_text.data();
+        }
+
+        EXPECT_TRUE(blob_referred);
+        EXPECT_TRUE(text_referred);
+        ASSERT_EQ(contiguous.size(), joined.size());
+        EXPECT_EQ(0, memcmp(contiguous.data(), joined.data(), joined.size()));
+
+        auto read_message = [&](PickleReader& reader) {
+            int i = 0;
+            std::string small;
+            const kbase::byte* blob_view = nullptr;
+            const kbase::byte* another_blob_view = nullptr;
+            uint8_t u8 = 0;
+            kbase::StringView text;
+            double d = 0;
+            reader >> i >> small;
+            reader.ReadRawView(blob_view, blob.size());
+            reader.ReadRawView(another_blob_view, blob.size());
+            reader >> u8;
+            reader.ReadStringView(text);
+            reader >> d;
+            EXPECT_FALSE(reader.has_error());
+            EXPECT_FALSE(!!reader);
+            EXPECT_EQ(1, i);
+            EXPECT_EQ("small", small);
+            EXPECT_TRUE(blob_view && memcmp(blob.data(), blob_view, blob.size()) == 0);
+            EXPECT_TRUE(another_blob_view &&
+                        memcmp(blob.data(), another_blob_view, blob.size()) == 0);
+            EXPECT_EQ(7, u8);
+            EXPECT_EQ(large_text, text.ToString());
+            EXPECT_EQ(3.5, d);
+            return text.data();
+        };
+
+        PickleReader segmented_reader(segments.data(), segments.size());
+        EXPECT_EQ(large_text.data(), read_message(segmented_reader));
+
+        PickleReader joined_reader(joined.data(), joined.size());
+        read_message(joined_reader);
+
+        // Copies still refer to the external data.
+        Pickle copied(pickle);
+        auto copied_segments = copied.GetSegments();
+        ASSERT_EQ(segments.size(), copied_segments.size());
+        PickleReader copied_reader(copied_segments.data(), copied_segments.size());
+        read_message(copied_reader);
+    }
+
+    // Malformed segments.
+    {
+        Pickle pickle;
+        pickle << 1 << INT64_C(2) << std::string("hello");
+        auto data = static_cast<const kbase::byte*>(pickle.data());
+
+        // Incomplete.
+        kbase::PickleSegment incomplete[] {{data, pickle.size() - 1}};
+        PickleReader incomplete_reader(incomplete, 1);
+        EXPECT_TRUE(incomplete_reader.has_error());
+
+        // A field spans two segments.
+        kbase::PickleSegment split[] {{data, sizeof(PickleHeader) + 6},
+                                      {data + sizeof(PickleHeader) + 6,
+                                       pickle.size() - sizeof(PickleHeader) - 6}};
+        PickleReader split_reader(split, 2);
+        int i = 0;
+        int64_t i64 = 1;
+        split_reader >> i >> i64;
+        EXPECT_EQ(1, i);
+        EXPECT_EQ(0, i64);
+        EXPECT_TRUE(split_reader.has_error());
+
+        // Segments split on boundaries of fields can still be read.
+        kbase::PickleSegment on_boundaries[] {{data, sizeof(PickleHeader) + 4},
+                                              {data + sizeof(PickleHeader) + 4, 0},
+                                              {data + sizeof(PickleHeader) + 4,
+                                               pickle.size() - sizeof(PickleHeader) - 4}};
+        PickleReader boundary_reader(on_boundaries, 3);
+        std::string str;
+        boundary_reader >> i >> i64 >> str;
+        EXPECT_FALSE(boundary_reader.has_error());
+        EXPECT_EQ(2, i64);
+        EXPECT_EQ("hello", str);
+    }
+}
+
+TEST(PickleTest, RecordReader)
+{
+    // Messages of both encodings are packed back to back, and thus may be unaligned.
+    std::vector<kbase::byte> buffer;
+    for (int i = 0; i < 5; ++i) {
+        Pickle pickle(i % 2 == 0 ? kbase::PickleEncoding::Aligned :
+                                   kbase::PickleEncoding::Compact);
+        pickle << i << std::string(i, 'a');
+        if (i == 3) {
+            pickle << static_cast<uint8_t>(1);
+        }
+
+        auto data = static_cast<const kbase::byte*>(pickle.data());
+        buffer.insert(buffer.end(), data, data + pickle.size());
+    }
+
+    auto read_all = [](const kbase::byte* data, size_t size, int& count) {
+        kbase::PickleRecordReader records(data, size);
+        PickleReader reader;
+        count = 0;
+        while (records.Next(reader)) {
+            int i = -1;
+            kbase::StringView str;
+            reader >> i;
+            reader.ReadStringView(str);
+            EXPECT_FALSE(reader.has_error());
+            EXPECT_EQ(count, i);
+            EXPECT_EQ(std::string(count, 'a'), str.ToString());
+            ++count;
+        }
+
+        return records;
+    };
+
+    int count = 0;
+    auto records = read_all(buffer.data(), buffer.size(), count);
+    EXPECT_EQ(5, count);
+    EXPECT_FALSE(records.has_error());
+    EXPECT_EQ(buffer.size(), records.offset());
+
+    // Empty buffer.
+    records = read_all(nullptr, 0, count);
+    EXPECT_EQ(0, count);
+    EXPECT_FALSE(records.has_error());
+
+    // Truncated within the last payload, or within the last header.
+    records = read_all(buffer.data(), buffer.size() - 1, count);
+    EXPECT_EQ(4, count);
+    EXPECT_TRUE(records.has_error());
+
+    size_t last_offset = records.offset();
+    records = read_all(buffer.data(), last_offset + 2, count);
+    EXPECT_EQ(4, count);
+    EXPECT_TRUE(records.has_error());
+    EXPECT_EQ(last_offset, records.offset());
+}
+
 }   // namespace kbase
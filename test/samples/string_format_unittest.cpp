@@ -2,18 +2,38 @@
  @ 0xCCCCCCCC
 */
 
+#include <atomic>
+#include <clocale>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #if !defined(NDEBUG)
 #define NDEBUG
 #endif
 
+#include "kbase/scope_guard.h"
 #include "kbase/string_format.h"
 
 namespace {
 
 using namespace kbase::internal;
 
+struct Point {
+    int x;
+    int y;
+};
+
+std::ostream& operator<<(std::ostream& os, const Point& point)
+{
+    return os << "(" << point.x << ", " << point.y << ")";
+}
+
 template<typename CharT>
 bool ComparePlaceholder(const Placeholder<CharT>& p, unsigned i, unsigned pos, const CharT* spec)
 {
@@ -76,4 +96,242 @@ TEST(StringFormatTest, Format)
     EXPECT_THROW(StringFormat("{0: }", 123), FormatError);    // empty specifier
 }
 
+TEST(StringFormatTest, FormatFloatIgnoresLocale)
+{
+    const char* locale = nullptr;
+    const char* names[] {"de_DE.UTF-8", "de_DE.utf8", "de_DE", "German_Germany.1252"};
+    for (auto name : names) {
+        locale = setlocale(LC_NUMERIC, name);
+        if (locale) {
+            break;
+        }
+    }
+
+    // No locale with a non-dot decimal point is available.
+    if (!locale) {
+        return;
+    }
+
+    ON_SCOPE_EXIT { setlocale(LC_NUMERIC, "C"); };
+
+    EXPECT_EQ("3.5", StringFormat("{0}", 3.5));
+    EXPECT_EQ("0.1", StringFormat("{0}", 0.1));
+    EXPECT_EQ("-2.25", StringFormat("{0}", -2.25f));
+    EXPECT_EQ("+3.1400", StringFormat("{0:+.4}", 3.14));
+    EXPECT_EQ("1.500000e+00", StringFormat("{0:e}", 1.5L));
+    EXPECT_EQ("0.5" + std::string(69, '0'), StringFormat("{0:.70}", 0.5));
+}
+
+TEST(StringFormatTest, CompiledFormat)
+{
+    constexpr auto parsed = ParseFormat<char, 8>("a{0:*<+8.2}b{{{1}}}");
+    static_assert(parsed.segment_count == 5, "");
+    static_assert(parsed.placeholder_count == 2, "");
+    static_assert(parsed.literal_length == 4, "");
+    static_assert(parsed.required_arg_count == 2, "");
+    static_assert(parsed.segments[1].spec.fill == '*', "");
+    static_assert(parsed.segments[1].spec.align == FormatAlign::Left, "");
+    static_assert(parsed.segments[1].spec.show_pos, "");
+    static_assert(parsed.segments[1].spec.width == 8, "");
+    static_assert(parsed.segments[1].spec.precision == 2, "");
+    static_assert(parsed.segments[2].begin == 11 && parsed.segments[2].length == 2, "");
+
+    // Same results as the runtime-parsed.
+    EXPECT_EQ(StringFormat("abc {0:0>4X} {1} def {2:.4} {0:+}", 255, "test", 3.14),
+              StringFormat(KBASE_FORMAT("abc {0:0>4X} {1} def {2:.4} {0:+}"), 255, "test", 3.14));
+    EXPECT_EQ(StringFormat("{{{0:x}}} {1:#<6} {0:o}{{", 64, std::string("kbase")),
+              StringFormat(KBASE_FORMAT("{{{0:x}}} {1:#<6} {0:o}{{"), 64, std::string("kbase")));
+    EXPECT_EQ("no placeholders", StringFormat(KBASE_FORMAT("no placeholders")));
+    EXPECT_EQ("", StringFormat(KBASE_FORMAT("")));
+    EXPECT_EQ(L"1.50e+00|  -3", StringFormat(KBASE_FORMAT(L"{0:.2e}|{1:4}"), 1.5, -3));
+
+    // Invalid format strings are compile errors, and so is a mismatched argument count, e.g.
+    // StringFormat(KBASE_FORMAT("{0:>4}"), 1);
+    // StringFormat(KBASE_FORMAT("{0} {1}"), 1);
+    // StringFormat(KBASE_FORMAT("{1}"), 0, 1);
+    // Specifiers are parsed in the same way at runtime.
+    EXPECT_THROW(ParseFormatSpec<char>(".6+4", ".6+4" + 4), FormatError);
+    EXPECT_THROW((ParseFormat<char, 1>("{0")), FormatError);
+}
+
+TEST(StringFormatTest, FormatArguments)
+{
+    // Integers.
+    EXPECT_EQ("0 -1 18446744073709551615 -9223372036854775808",
+              StringFormat("{0} {1} {2} {3}", 0, -1, std::numeric_limits<uint64_t>::max(),
+                           std::numeric_limits<int64_t>::min()));
+    EXPECT_EQ("ff FF 377 11111111", StringFormat("{0:x} {0:X} {0:o} {0:b}", 255));
+    EXPECT_EQ("ffffffff ffff", StringFormat("{0:x} {1:x}", -1, static_cast<short>(-1)));
+    EXPECT_EQ("+42 -42 42 2a", StringFormat("{0:+} {1:+} {2:+} {0:+x}", 42, -42, 42U));
+    EXPECT_EQ("   42|42   |**-42|00042", StringFormat("{0:5}|{0: <5}|{1:*>5}|{0:0>5}", 42, -42));
+
+    // Booleans and characters.
+    EXPECT_EQ("1 0 true false", StringFormat("{0} {1} {0:b} {1:b}", true, false));
+    EXPECT_EQ("a|  b|c  ", StringFormat("{0}|{1:3}|{2: <3}", 'a', 'b', 'c'));
+
+    // Floating-point numbers are the shortest that read back as the same by default.
+    EXPECT_EQ("0.1 0.30000000000000004 3.141592653589793 1e+100 -0",
+              StringFormat("{0} {1} {2} {3} {4}", 0.1, 0.1 + 0.2, 3.141592653589793, 1e100,
+                           -0.0));
+    EXPECT_EQ("0.1 0.5", StringFormat("{0} {1}", 0.1F, 0.5L));
+    EXPECT_EQ("3.14 3 +2.50 1.500000e+00 1.50E+00", StringFormat("{0:.2} {0:.0} {1:+.2} {2:e} {2:.2E}",
+                                                               3.14159, 2.5, 1.5));
+    EXPECT_EQ("inf|  nan", StringFormat("{0}|{1:5}", std::numeric_limits<double>::infinity(),
+                                        std::numeric_limits<double>::quiet_NaN()));
+    auto huge = StringFormat("{0:.1}", 1e70);
+    EXPECT_EQ(73, huge.size());
+    EXPECT_EQ(".0", huge.substr(71));
+
+    // Strings.
+    const char* null_str = nullptr;
+    char buf[] = "buffer";
+    EXPECT_EQ("text|view|std  |buffer|", StringFormat("{0}|{1}|{2: <5}|{3}|{4}", "text",
+                                                      StringView("view"), std::string("std"),
+                                                      buf, null_str));
+
+    // Other types by operator<<, and the whole output is padded.
+    EXPECT_EQ("(1, 2)|  (1, 2)|(1, 2)--", StringFormat("{0}|{0:8}|{0:-<8}", Point{1, 2}));
+
+    // Wide strings.
+    EXPECT_EQ(L"ff|+1.5|wide|  x|0.25", StringFormat(L"{0:x}|{1:+}|{2}|{3: >3}|{4}", 255, 1.5,
+                                                     L"wide", L'x', 0.25));
+
+    // Compile-time parsed format strings share the same engine.
+    EXPECT_EQ("0x00ff 1.00 yes", StringFormat(KBASE_FORMAT("0x{0:0>4x} {1:.2} {2}"), 255, 1.0,
+                                               std::string("yes")));
+}
+
+TEST(StringFormatTest, FormatInPlace)
+{
+    // Appends to the existing content.
+    std::string str = "head ";
+    StringFormatTo(str, "{0}+{1}={2:x}", 7, 8, 15);
+    StringFormatTo(str, KBASE_FORMAT(" {0:*>4}"), "ok");
+    EXPECT_EQ("head 7+8=f **ok", str);
+
+    // A reused string doesn't grow once it is large enough.
+    str.clear();
+    str.reserve(64);
+    auto data = str.data();
+    for (int i = 0; i < 10; ++i) {
+        str.clear();
+        StringFormatTo(str, "{0:.3} {1}", 1.0 / (i + 1), i);
+    }
+
+    EXPECT_EQ("0.100 9", str);
+    EXPECT_EQ(data, str.data());
+
+    // The string is unchanged on errors.
+    str = "kept";
+    EXPECT_THROW(StringFormatTo(str, "abc {0} {1}", 1), FormatError);
+    EXPECT_EQ("kept", str);
+
+    std::wstring wstr = L"w:";
+    StringFormatTo(wstr, L"{0}|{1}", L"wide", 1.5);
+    EXPECT_EQ(L"w:wide|1.5", wstr);
+
+    // Buffers.
+    char buf[16];
+    auto result = FormatToBuffer(buf, sizeof(buf), "{0}-{1:0>4}", "id", 42);
+    EXPECT_EQ(7, result.size);
+    EXPECT_FALSE(result.truncated);
+    EXPECT_STREQ("id-0042", buf);
+
+    result = FormatToBuffer(buf, 8, KBASE_FORMAT("{0}-{1:0>4}"), "id", 42);
+    EXPECT_EQ(7, result.size);
+    EXPECT_FALSE(result.truncated);
+    EXPECT_STREQ("id-0042", buf);
+
+    result = FormatToBuffer(buf, 5, "{0}-{1:0>4}", "id", 42);
+    EXPECT_EQ(7, result.size);
+    EXPECT_TRUE(result.truncated);
+    EXPECT_STREQ("id-0", buf);
+
+    buf[0] = 'x';
+    result = FormatToBuffer(buf, 0, "{0}", 12345);
+    EXPECT_EQ(5, result.size);
+    EXPECT_TRUE(result.truncated);
+    EXPECT_EQ('x', buf[0]);
+
+    wchar_t wbuf[4];
+    result = FormatToBuffer(wbuf, 4, L"{0: <5}|", L'c');
+    EXPECT_EQ(6, result.size);
+    EXPECT_TRUE(result.truncated);
+    EXPECT_STREQ(L"c  ", wbuf);
+
+    // Sizes.
+    EXPECT_EQ(0, FormattedSize(""));
+    EXPECT_EQ(18, FormattedSize("{0:x} {1} {2: >8}", 255, Point{1, 2}, "x"));
+    EXPECT_EQ(StringFormat("{0:.3e}", 12345.678).size(),
+              FormattedSize(KBASE_FORMAT("{0:.3e}"), 12345.678));
+    EXPECT_EQ(3, FormattedSize(L"{0}", 100));
+    EXPECT_THROW(FormattedSize("{1}", 0), FormatError);
+}
+
+TEST(StringFormatTest, PreparedFormat)
+{
+    PreparedFormat fmt(std::string("abc {0:0>4X} {1} def {2:.4} {0:+}"));
+    EXPECT_EQ("abc {0:0>4X} {1} def {2:.4} {0:+}", fmt.format());
+    EXPECT_EQ(3, fmt.required_arg_count());
+    EXPECT_EQ("abc 00FF test def 3.1400 +255", fmt(255, "test", 3.14));
+    EXPECT_EQ("abc 0001 x def 0.5000 +1", StringFormat(fmt, 1, 'x', 0.5));
+
+    // Copies share the parsed result.
+    auto copy = fmt;
+    std::string str = "> ";
+    StringFormatTo(str, copy, 16, 2, 0.25);
+    EXPECT_EQ("> abc 0010 2 def 0.2500 +16", str);
+
+    char buf[8];
+    auto result = FormatToBuffer(buf, sizeof(buf), copy, 16, 2, 0.25);
+    EXPECT_EQ(25, result.size);
+    EXPECT_TRUE(result.truncated);
+    EXPECT_STREQ("abc 001", buf);
+    EXPECT_EQ(25, FormattedSize(copy, 16, 2, 0.25));
+
+    // Missing arguments are found before anything is written.
+    str = "kept";
+    EXPECT_THROW(StringFormatTo(str, fmt, 1, 2), FormatError);
+    EXPECT_EQ("kept", str);
+    EXPECT_THROW(PreparedFormat("{0:>4}"), FormatError);
+
+    WPreparedFormat wfmt(L"{1}{{{0}}}");
+    EXPECT_EQ(L"b{a}", wfmt(L"a", L'b'));
+}
+
+TEST(StringFormatTest, CachedFormat)
+{
+    auto fmt = GetCachedFormat("{0}-{1}");
+    EXPECT_EQ("1-2", fmt(1, 2));
+    EXPECT_EQ("x-y", GetCachedFormat("{0}-{1}")("x", "y"));
+
+    // Looked up by addresses, and content changes are noticed.
+    char text[] = "{0}+{1}";
+    EXPECT_EQ("1+2", GetCachedFormat(text)(1, 2));
+    text[3] = '*';
+    EXPECT_EQ("1*2", GetCachedFormat(text)(1, 2));
+
+    EXPECT_EQ(L"1.5", GetCachedFormat(L"{0}")(1.5));
+    EXPECT_THROW(GetCachedFormat("{0"), FormatError);
+
+    // Shared by threads.
+    std::vector<std::thread> threads;
+    std::atomic<int> failures(0);
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&failures, t] {
+            for (int i = 0; i < 1000; ++i) {
+                if (GetCachedFormat("{0}:{1}")(t, i) != StringFormat("{0}:{1}", t, i)) {
+                    ++failures;
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(0, failures);
+}
+
 }   // namespace kbase
@@ -2,6 +2,9 @@
  @ 0xCCCCCCCC
 */
 
+#include <random>
+#include <string>
+
 #include "gtest/gtest.h"
 
 #include "kbase/basic_macros.h"
@@ -338,4 +341,63 @@ TEST(StringViewTest, Hash)
     EXPECT_NE(std::hash<WStringView>()(w), std::hash<WStringView>()(wx));
 }
 
+TEST(StringViewTest, SearchLongStrings)
+{
+    // Searches are vectorized for narrow strings, and are checked against std::string with
+    // lengths around block sizes, and with bytes that have the highest bit set.
+    std::mt19937 engine(0xCC);
+    const char kAlphabet[] = "abcdefgh \x80\xF7\xFF";
+    const std::string sets[] {"a", "h\xFF", "bcd", " \x80g", "abcdefgh", "abcdefgh\xF7 ",
+                              std::string("\0a", 2)};
+    const std::string targets[] {"ab", "abc", "h \x80", "gggg", "\xFF\xF7" "a", "abcdefgha"};
+    for (size_t length : {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 257}) {
+        std::string str;
+        for (size_t i = 0; i < length; ++i) {
+            str += kAlphabet[engine() % (sizeof(kAlphabet) - 1)];
+        }
+
+        StringView view(str);
+        for (size_t pos : {size_t(0), size_t(1), length / 2, length, length + 1}) {
+            for (char ch : {'a', 'h', ' ', '\x80', '\xFF', 'z'}) {
+                EXPECT_EQ(str.find(ch, pos), view.find(ch, pos));
+                EXPECT_EQ(str.rfind(ch, pos), view.rfind(ch, pos));
+                EXPECT_EQ(str.find_first_of(ch, pos), view.find_first_of(ch, pos));
+                EXPECT_EQ(str.find_first_not_of(ch, pos), view.find_first_not_of(ch, pos));
+            }
+
+            for (const auto& set : sets) {
+                EXPECT_EQ(str.find_first_of(set, pos), view.find_first_of(set, pos));
+                EXPECT_EQ(str.find_first_not_of(set, pos), view.find_first_not_of(set, pos));
+            }
+
+            for (const auto& target : targets) {
+                EXPECT_EQ(str.find(target, pos), view.find(target, pos));
+            }
+
+            // Targets at the end.
+            if (pos <= length) {
+                auto tail = str.substr(pos);
+                EXPECT_EQ(str.find(tail, pos), view.find(tail, pos));
+                EXPECT_EQ(str.find(tail), view.find(tail));
+            }
+        }
+    }
+
+    std::string text(1000, 'x');
+    text[998] = 'y';
+    EXPECT_EQ(997, StringView(text).find("xy"));
+    EXPECT_EQ(999, StringView(text).find_first_not_of("y", 998));
+    EXPECT_EQ(997, StringView(text).rfind('x', 997));
+
+    // Wide strings are searched in the generic way.
+    WStringView wide = L"key = value; other = 1";
+    EXPECT_EQ(4, wide.find(L'='));
+    EXPECT_EQ(19, wide.rfind(L'='));
+    EXPECT_EQ(13, wide.find(L"other"));
+    EXPECT_EQ(11, wide.find_first_of(L";,", 5));
+    EXPECT_EQ(3, wide.find_first_not_of(L"key"));
+    EXPECT_EQ(6, wide.find_first_not_of(L' ', 5));
+    EXPECT_EQ(WStringView::npos, wide.find(L"none"));
+}
+
 }   // namespace kbase
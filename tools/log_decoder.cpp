@@ -0,0 +1,42 @@
+/*
+ @ 0xCCCCCCCC
+*/
+
+// Decodes a log file written in `BinaryLogFormat` into the text format.
+// Usage: log_decoder binary-log-file [output-file]
+
+#include <fstream>
+#include <iostream>
+
+#include "kbase/logging.h"
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " binary-log-file [output-file]\n";
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Failed to open " << argv[1] << "\n";
+        return 1;
+    }
+
+    std::ofstream out_file;
+    if (argc > 2) {
+        out_file.open(argv[2], std::ios::binary);
+        if (!out_file) {
+            std::cerr << "Failed to open " << argv[2] << "\n";
+            return 1;
+        }
+    }
+
+    std::ostream& out = argc > 2 ? out_file : std::cout;
+    if (!kbase::DecodeBinaryLog(in, out)) {
+        std::cerr << "Not a binary log file, or the file is truncated\n";
+        return 2;
+    }
+
+    return 0;
+}